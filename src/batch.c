@@ -0,0 +1,216 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+         ------------------------------------------------------------
+        / batch - packs many samples of single server into one mqtt  \
+        | message, so broker gets one message per read, and not one  |
+        \ per register                                               /
+         ------------------------------------------------------------
+   ==========================================================================
+          _               __            __         ____ _  __
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+
+   ========================================================================== */
+
+
+#include "batch.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "timing.h"
+#include "valid.h"
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ==========================================================================
+    Writes header of 'b' for its first record, taken at monotonic time
+    'at'. Base is kept in realtime, as that's what subscribers can make
+    sense of, monotonic base is only used to calculate offsets of records.
+   ========================================================================== */
+static void m2md_batch_header
+(
+	struct m2md_batch      *b,      /* batch to write header of */
+	const struct timespec  *at      /* time first record was taken */
+)
+{
+	struct timespec         now;    /* current monotonic time */
+	struct timespec         real;   /* current realtime */
+	uint16_t                magic;  /* magic number of batch */
+	uint64_t                base;   /* realtime of first record, us */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	clock_gettime(CLOCK_REALTIME, &real);
+
+	/* record was taken a moment ago, move realtime
+	 * back by that moment */
+	base = (uint64_t)real.tv_sec * 1000000 + real.tv_nsec / 1000;
+	base -= ((int64_t)(now.tv_sec - at->tv_sec) * 1000000000 +
+			(now.tv_nsec - at->tv_nsec)) / 1000;
+
+	magic = M2MD_BATCH_MAGIC;
+	memset(b->buf, 0x00, M2MD_BATCH_HDR_SIZE);
+	memcpy(b->buf, &magic, sizeof(magic));
+	b->buf[2] = M2MD_BATCH_VERSION;
+	memcpy(b->buf + 8, &base, sizeof(base));
+
+	b->base = *at;
+	b->len = M2MD_BATCH_HDR_SIZE;
+}
+
+
+/* ==========================================================================
+                       __     __ _          ____
+        ____   __  __ / /_   / /(_)_____   / __/__  __ ____   _____ _____
+       / __ \ / / / // __ \ / // // ___/  / /_ / / / // __ \ / ___// ___/
+      / /_/ // /_/ // /_/ // // // /__   / __// /_/ // / / // /__ (__  )
+     / .___/ \__,_//_.___//_//_/ \___/  /_/   \__,_//_/ /_/ \___//____/
+    /_/
+   ==========================================================================
+    Initializes batch 'b' that can hold message of up to 'size' bytes.
+
+    errno:
+            EINVAL      size cannot hold even header
+            ENOMEM      not enough memory for buffer
+   ========================================================================== */
+int m2md_batch_init
+(
+	struct m2md_batch  *b,    /* batch to initialize */
+	size_t              size  /* max size of message */
+)
+{
+	VALID(EINVAL, b);
+	VALID(EINVAL, size > M2MD_BATCH_HDR_SIZE + M2MD_BATCH_REC_SIZE);
+
+	if ((b->buf = malloc(size)) == NULL)
+		return -1;
+
+	b->size = size;
+	m2md_batch_reset(b);
+	return 0;
+}
+
+
+/* ==========================================================================
+    Frees resources of 'b'. Batch can be destroyed more than once, and
+    batch that has been destroyed takes no more records.
+   ========================================================================== */
+void m2md_batch_destroy
+(
+	struct m2md_batch  *b  /* batch to destroy */
+)
+{
+	free(b->buf);
+	b->buf = NULL;
+	b->size = 0;
+	m2md_batch_reset(b);
+}
+
+
+/* ==========================================================================
+    Drops all records of 'b', usually after batch has been sent.
+   ========================================================================== */
+void m2md_batch_reset
+(
+	struct m2md_batch  *b  /* batch to reset */
+)
+{
+	b->len = 0;
+	b->count = 0;
+}
+
+
+/* ==========================================================================
+    Adds record with 'value' of 'size' bytes of poll with topic 'id',
+    taken at monotonic time 'at', to batch 'b'. Message is kept valid
+    after each record, so it can be sent at any time as it is.
+
+    errno:
+            ENOSPC      record does not fit in batch, send it first
+            ERANGE      record is too far from first record of batch
+   ========================================================================== */
+int m2md_batch_add
+(
+	struct m2md_batch      *b,      /* batch to add record to */
+	uint32_t                id,     /* topic id of poll */
+	const struct timespec  *at,     /* time value was taken */
+	const void             *value,  /* value to add */
+	int                     size    /* size of value */
+)
+{
+	unsigned char          *rec;    /* new record */
+	int64_t                 dt;     /* time since first record, us */
+	uint32_t                dt32;   /* dt as it's stored in record */
+	uint16_t                size16; /* size as it's stored in record */
+	uint16_t                count;  /* count as it's stored in header */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	VALID(EINVAL, value);
+	VALID(EINVAL, size >= 0 && size <= UINT16_MAX);
+	VALID(ENOSPC, b->buf);
+	VALID(ENOSPC, b->count < UINT16_MAX);
+	VALID(ENOSPC, (b->len ? b->len : M2MD_BATCH_HDR_SIZE) +
+			M2MD_BATCH_REC_SIZE + size <= b->size);
+
+	if (b->count == 0)
+		m2md_batch_header(b, at);
+
+	dt = ((int64_t)(at->tv_sec - b->base.tv_sec) * 1000000000 +
+			(at->tv_nsec - b->base.tv_nsec)) / 1000;
+	VALID(ERANGE, dt >= 0 && dt <= UINT32_MAX);
+
+	dt32 = dt;
+	size16 = size;
+	rec = b->buf + b->len;
+	memcpy(rec, &id, sizeof(id));
+	memcpy(rec + 4, &dt32, sizeof(dt32));
+	memcpy(rec + 8, &size16, sizeof(size16));
+	memcpy(rec + M2MD_BATCH_REC_SIZE, value, size);
+
+	b->len += M2MD_BATCH_REC_SIZE + size;
+	count = ++b->count;
+	memcpy(b->buf + 4, &count, sizeof(count));
+	return 0;
+}
+
+
+/* ==========================================================================
+    Checks if batch 'b' should be published at 'now', when records are
+    gathered for 'window_ms' milliseconds since first one of the batch.
+    Without window, batch goes out as soon as it has anything in it.
+    When window is not over yet, its end is stored in 'end'.
+
+    Returns 1 when batch shall be published now, 0 when it waits until
+    'end', and -1 when batch is empty, and there is nothing to publish.
+   ========================================================================== */
+int m2md_batch_due
+(
+	const struct m2md_batch  *b,          /* batch to check */
+	int                       window_ms,  /* how long records are gathered */
+	struct timespec           now,        /* current monotonic time */
+	struct timespec          *end         /* end of window goes here */
+)
+{
+	if (b->count == 0)
+		return -1;
+
+	*end = m2md_timing_add(b->base,
+			m2md_timing_ts((int64_t)window_ms * 1000000));
+
+	return window_ms == 0 ||
+		m2md_timing_ns(m2md_timing_sub(*end, now)) <= 0;
+}
@@ -0,0 +1,57 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ========================================================================== */
+
+#ifndef M2MD_BATCH_H
+#define M2MD_BATCH_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Batch is a single mqtt message with many samples of one server. It
+ * starts with header, and records follow it one after another. All
+ * fields are in host byte order, just like single values are.
+ *
+ * header:
+ *      uint16_t  magic    M2MD_BATCH_MAGIC
+ *      uint8_t   version  M2MD_BATCH_VERSION
+ *      uint8_t   flags    reserved, 0 for now
+ *      uint16_t  count    number of records
+ *      uint16_t  pad      0
+ *      uint64_t  base     realtime of first record, us since epoch
+ *
+ * record:
+ *      uint32_t  id       topic id of poll
+ *      uint32_t  dt       time record was taken, us since base
+ *      uint16_t  size     size of value
+ *      uint8_t   value[size]  exactly what single message would carry
+ */
+#define M2MD_BATCH_MAGIC     0x424d  /* "MB" */
+#define M2MD_BATCH_VERSION   1
+#define M2MD_BATCH_HDR_SIZE  16
+#define M2MD_BATCH_REC_SIZE  10
+
+/* size of batch buffer, it's big enough to take few hundreds of values,
+ * and the biggest bitmap with room to spare */
+#define M2MD_BATCH_MAX       4096
+
+struct m2md_batch
+{
+	unsigned char    *buf;    /* encoded message, header and records */
+	size_t            size;   /* size of buf */
+	size_t            len;    /* bytes of buf in use */
+	int               count;  /* number of records in buf */
+	struct timespec   base;   /* monotonic time of first record */
+};
+
+int m2md_batch_init(struct m2md_batch *b, size_t size);
+void m2md_batch_destroy(struct m2md_batch *b);
+void m2md_batch_reset(struct m2md_batch *b);
+int m2md_batch_add(struct m2md_batch *b, uint32_t id,
+		const struct timespec *at, const void *value, int size);
+int m2md_batch_due(const struct m2md_batch *b, int window_ms,
+		struct timespec now, struct timespec *end);
+
+#endif
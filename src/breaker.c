@@ -0,0 +1,224 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+         ------------------------------------------------------------
+        / breaker - circuit breaker of modbus server, decides when   \
+        | server is dead, when to probe it, and keeps count of pool  |
+        \ connections that still work                                /
+         ------------------------------------------------------------
+   ==========================================================================
+          _               __            __         ____ _  __
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+
+   ========================================================================== */
+
+
+#include "breaker.h"
+
+#include "timing.h"
+
+
+/* ==========================================================================
+                       __     __ _          ____
+        ____   __  __ / /_   / /(_)_____   / __/__  __ ____   _____ _____
+       / __ \ / / / // __ \ / // // ___/  / /_ / / / // __ \ / ___// ___/
+      / /_/ // /_/ // /_/ // // // /__   / __// /_/ // / / // /__ (__  )
+     / .___/ \__,_//_.___//_//_/ \___/  /_/   \__,_//_/ /_/ \___//____/
+    /_/
+   ==========================================================================
+    Initializes 'breaker' of new server. Server starts with open breaker
+    that has already expired, so nothing is read until first probe shows
+    server is there.
+   ========================================================================== */
+void m2md_breaker_init
+(
+	struct m2md_breaker  *breaker,    /* breaker to initialize */
+	int                   wait_max,   /* longest wait between probes, s */
+	int                   fails_max   /* failed reads that break conn */
+)
+{
+	breaker->state = M2MD_BREAKER_OPEN;
+	breaker->wait = 1;
+	breaker->wait_max = wait_max;
+	breaker->fails_max = fails_max;
+	breaker->nhealthy = 0;
+	breaker->until.tv_sec = 0;
+	breaker->until.tv_nsec = 0;
+}
+
+
+/* ==========================================================================
+    Opens 'breaker', server is considered dead from now on. Nothing will
+    be sent to it until breaker timeout expires, and then only single
+    probe. Each next open makes server wait two times longer, up to
+    configured limit.
+   ========================================================================== */
+void m2md_breaker_open
+(
+	struct m2md_breaker  *breaker,    /* breaker to open */
+	struct timespec       now         /* current absolute time */
+)
+{
+	struct timespec       wait;       /* time to wait before probe */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	breaker->state = M2MD_BREAKER_OPEN;
+
+	wait.tv_sec = breaker->wait;
+	wait.tv_nsec = 0;
+	breaker->until = m2md_timing_add(now, wait);
+
+	/* next wait will be two times longer (if server is
+	 * still dead) but not longer than configured time */
+	breaker->wait *= 2;
+	if (breaker->wait > breaker->wait_max)
+		breaker->wait = breaker->wait_max;
+}
+
+
+/* ==========================================================================
+    Closes 'breaker', after probe has shown server is alive again. When
+    it dies next time, it will be probed quickly again.
+   ========================================================================== */
+void m2md_breaker_close
+(
+	struct m2md_breaker  *breaker     /* breaker to close */
+)
+{
+	breaker->state = M2MD_BREAKER_CLOSED;
+	breaker->wait = 1;
+}
+
+
+/* ==========================================================================
+    Checks if timeout of open 'breaker' is over at 'now'.
+
+    Returns 1 when it's time to probe the server, or 0 when it has to be
+    left alone for some more time.
+   ========================================================================== */
+int m2md_breaker_expired
+(
+	const struct m2md_breaker  *breaker,  /* breaker to check */
+	struct timespec             now       /* current absolute time */
+)
+{
+	return m2md_timing_ns(m2md_timing_sub(breaker->until, now)) <= 0;
+}
+
+
+/* ==========================================================================
+    Moves open 'breaker' which timeout has expired to half-open, so only
+    single probe is sent to the server. Whoever gets 1 here makes the
+    probe, and anyone else gets 0, until probe result comes back.
+
+    Probe that cannot be sent, must open breaker again with
+    m2md_breaker_open(), half-open breaker waits for probe result forever.
+   ========================================================================== */
+int m2md_breaker_probe
+(
+	struct m2md_breaker  *breaker,    /* breaker of server to probe */
+	struct timespec       now         /* current absolute time */
+)
+{
+	if (breaker->state != M2MD_BREAKER_OPEN ||
+			!m2md_breaker_expired(breaker, now))
+		return 0;
+
+	breaker->state = M2MD_BREAKER_HALF_OPEN;
+	return 1;
+}
+
+
+/* ==========================================================================
+    Feeds result of read over 'conn' to the 'breaker'. Enough failed reads
+    in a row mark connection as broken. As long as other connections of
+    the server work, they take over, and broken one is reconnected on its
+    own. When last working connection breaks, breaker must open. Result of
+    probe closes or opens it again. Modbus exception is a response, and
+    it means server is alive, even if it didn't like our request.
+
+    Health of the pool is updated here, but breaker state is not, caller
+    changes it with m2md_breaker_open() or m2md_breaker_close(), as
+    returned verdict says.
+
+    Returns enum m2md_breaker_verdict.
+   ========================================================================== */
+int m2md_breaker_result
+(
+	struct m2md_breaker       *breaker,  /* breaker of conn's server */
+	struct m2md_breaker_conn  *conn,     /* connection that has been read */
+	int                        alive     /* server responded */
+)
+{
+	/* read was queued before breaker opened, and now
+	 * it's up to the probe to decide, not to us */
+	if (breaker->state == M2MD_BREAKER_OPEN)
+		return M2MD_BREAKER_KEEP;
+
+	if (breaker->state == M2MD_BREAKER_HALF_OPEN)
+	{
+		if (!alive)
+			return M2MD_BREAKER_TRIP;
+
+		/* probe went over this connection,
+		 * so it surely works */
+		m2md_breaker_conn_up(breaker, conn);
+		return M2MD_BREAKER_RESET;
+	}
+
+	if (alive)
+	{
+		conn->fails = 0;
+		return M2MD_BREAKER_KEEP;
+	}
+
+	if (++conn->fails < breaker->fails_max)
+		return M2MD_BREAKER_KEEP;
+
+	/* connection is broken, it won't take
+	 * any more reads until it's reconnected */
+	m2md_breaker_conn_down(breaker, conn);
+	return breaker->nhealthy > 0 ? M2MD_BREAKER_BROKEN : M2MD_BREAKER_TRIP;
+}
+
+
+/* ==========================================================================
+    Marks 'conn' as working, after it has been (re)connected.
+   ========================================================================== */
+void m2md_breaker_conn_up
+(
+	struct m2md_breaker       *breaker,  /* breaker of conn's server */
+	struct m2md_breaker_conn  *conn      /* connection that works */
+)
+{
+	conn->fails = 0;
+	if (conn->healthy)
+		return;
+
+	conn->healthy = 1;
+	++breaker->nhealthy;
+}
+
+
+/* ==========================================================================
+    Marks 'conn' as broken, it won't take any reads until it's
+    reconnected.
+   ========================================================================== */
+void m2md_breaker_conn_down
+(
+	struct m2md_breaker       *breaker,  /* breaker of conn's server */
+	struct m2md_breaker_conn  *conn      /* connection that broke */
+)
+{
+	conn->fails = 0;
+	if (!conn->healthy)
+		return;
+
+	conn->healthy = 0;
+	--breaker->nhealthy;
+}
@@ -0,0 +1,76 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ========================================================================== */
+
+#ifndef M2MD_BREAKER_H
+#define M2MD_BREAKER_H 1
+
+#include <time.h>
+
+/* state of server's circuit breaker */
+enum m2md_breaker_state
+{
+	/* server works, reads are sent as scheduled */
+	M2MD_BREAKER_CLOSED,
+
+	/* server is considered dead, nothing is sent to it
+	 * until breaker timeout expires */
+	M2MD_BREAKER_OPEN,
+
+	/* single probe is on its way, its result decides
+	 * whether breaker gets closed or opened again */
+	M2MD_BREAKER_HALF_OPEN
+};
+
+/* what result of read means for the breaker */
+enum m2md_breaker_verdict
+{
+	/* breaker stays as it is */
+	M2MD_BREAKER_KEEP,
+
+	/* connection is broken, but other connections
+	 * of the pool still work and take over */
+	M2MD_BREAKER_BROKEN,
+
+	/* last working connection broke, or probe failed,
+	 * breaker must be opened */
+	M2MD_BREAKER_TRIP,
+
+	/* probe passed, breaker must be closed */
+	M2MD_BREAKER_RESET
+};
+
+/* health of single connection from the pool of server connections */
+struct m2md_breaker_conn
+{
+	int              healthy;   /* connection works, reads can use it */
+	int              fails;     /* failed reads in a row */
+};
+
+/* circuit breaker of single server, with health of its whole pool */
+struct m2md_breaker
+{
+	int              state;     /* enum m2md_breaker_state */
+	int              wait;      /* seconds to wait before next probe */
+	int              wait_max;  /* wait never grows longer than that */
+	int              fails_max; /* failed reads that break connection */
+	int              nhealthy;  /* connections that work */
+	struct timespec  until;     /* when open breaker allows probe */
+};
+
+void m2md_breaker_init(struct m2md_breaker *breaker, int wait_max,
+		int fails_max);
+void m2md_breaker_open(struct m2md_breaker *breaker, struct timespec now);
+void m2md_breaker_close(struct m2md_breaker *breaker);
+int m2md_breaker_expired(const struct m2md_breaker *breaker,
+		struct timespec now);
+int m2md_breaker_probe(struct m2md_breaker *breaker, struct timespec now);
+int m2md_breaker_result(struct m2md_breaker *breaker,
+		struct m2md_breaker_conn *conn, int alive);
+void m2md_breaker_conn_up(struct m2md_breaker *breaker,
+		struct m2md_breaker_conn *conn);
+void m2md_breaker_conn_down(struct m2md_breaker *breaker,
+		struct m2md_breaker_conn *conn);
+
+#endif
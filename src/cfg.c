@@ -182,6 +182,46 @@ static const char *g_m2md_log_ts_tm_fract_strings[] =
     "ns"
 };
 
+static const char *g_m2md_mqtt_encoding_strings[] =
+{
+    "raw",
+    "text",
+    "json",
+    "cbor",
+    "binary"
+};
+
+static const char *g_m2md_mqtt_backpressure_strings[] =
+{
+    "drop-oldest",
+    "drop-newest",
+    "block"
+};
+
+static const char *g_m2md_modbus_sched_strings[] =
+{
+    "central",
+    "server"
+};
+
+static const char *g_m2md_modbus_timing_strings[] =
+{
+    "relative",
+    "absolute"
+};
+
+static const char *g_m2md_modbus_catch_up_strings[] =
+{
+    "skip",
+    "burst"
+};
+
+static const char *g_m2md_modbus_engine_strings[] =
+{
+    "thread",
+    "epoll"
+};
+
 
 /* ==========================================================================
                   _                __           ____
@@ -297,9 +337,33 @@ static void m2md_cfg_print_help
 "\t-p, --mqtt-port=<port>                port on which broker listens\n"
 "\t-t, --mqtt-topic=<topic>              base topic name for all messages\n"
 "\t    --mqtt-id=<name>                  mqtt id to use when connecting to broker\n"
+"\t    --mqtt-batch=<0|1>                publish all samples of server in one message\n"
+"\t    --mqtt-batch-window=<ms>          how long samples are gathered in one batch\n"
+"\t    --mqtt-encoding=<enc>             payload encoding (raw, text, json, cbor, binary)\n"
+"\t    --mqtt-publishers=<n>             threads that publish samples, 0 publishes from server threads\n"
+"\t    --mqtt-queue=<samples>            size of queue between server and publisher threads\n"
+"\t    --mqtt-backpressure=<bp>          what to do when queue is full (drop-oldest, drop-newest, block)\n"
+"\t    --mqtt-spool=<path>               file where messages wait while broker is down, empty disables\n"
+"\t    --mqtt-spool-size=<MiB>           size of spool, oldest messages are dropped when it's full\n"
+"\t    --mqtt-spool-rate=<msg/s>         how fast spooled messages are replayed\n"
 "\t    --modbus-max-re-time=<seconds>    max time between reconnects in case connection to server fails\n"
 "\t    --modbus-poll-list=<path>         path to file with poll list\n"
 "\t    --modbus-map-list=<path>          path to file with mqtt->modbus map\n"
+"\t    --modbus-max-gap=<regs>           max unused registers read to merge two reads into one\n"
+"\t    --modbus-max-block=<regs>         max registers read with single request\n"
+"\t    --modbus-sched=<sched>            who schedules reads (central, server)\n"
+"\t    --modbus-timing=<timing>          next read timing (relative, absolute)\n"
+"\t    --modbus-catch-up=<policy>        missed reads policy (skip, burst)\n"
+"\t    --modbus-stagger=<0|1>            spread first reads across poll time\n"
+"\t    --modbus-engine=<engine>          how servers are talked to (thread, epoll)\n"
+"\t    --modbus-engine-threads=<num>     number of epoll engine threads\n"
+"\t    --modbus-window=<num>             max requests waiting for response per connection\n"
+"\t    --modbus-rto-min=<ms>             min response timeout\n"
+"\t    --modbus-rto-max=<ms>             max response timeout\n"
+"\t    --modbus-breaker-fails=<num>      failed reads that cut server off\n"
+"\t    --modbus-pool=<num>               connections to each modbus tcp server\n"
+"\t    --modbus-quarantine-min=<seconds> first quarantine of register that gets exceptions\n"
+"\t    --modbus-quarantine-max=<seconds> longest quarantine of register that gets exceptions\n"
 #endif /* M2MD_ENABLE_GETOPT_LONG */
 );
 
@@ -441,6 +505,24 @@ static int m2md_cfg_parse_ini
             PARSE_STR_INI(mqtt, topic)
         else if (strcmp(name, "id") == 0)
             PARSE_STR_INI(mqtt, id)
+        else if (strcmp(name, "batch") == 0)
+            PARSE_INT_INI(mqtt, batch, 0, 1)
+        else if (strcmp(name, "batch_window") == 0)
+            PARSE_INT_INI(mqtt, batch_window, 0, 60000)
+        else if (strcmp(name, "encoding") == 0)
+            PARSE_MAP_INI(mqtt, encoding, "raw:text:json:cbor:binary")
+        else if (strcmp(name, "publishers") == 0)
+            PARSE_INT_INI(mqtt, publishers, 0, 16)
+        else if (strcmp(name, "queue") == 0)
+            PARSE_INT_INI(mqtt, queue, 16, 1048576)
+        else if (strcmp(name, "backpressure") == 0)
+            PARSE_MAP_INI(mqtt, backpressure, "drop-oldest:drop-newest:block")
+        else if (strcmp(name, "spool") == 0)
+            PARSE_STR_INI(mqtt, spool)
+        else if (strcmp(name, "spool_size") == 0)
+            PARSE_INT_INI(mqtt, spool_size, 1, 65536)
+        else if (strcmp(name, "spool_rate") == 0)
+            PARSE_INT_INI(mqtt, spool_rate, 1, 1000000)
     }
 
     /* parsing section modbus
@@ -454,6 +536,36 @@ static int m2md_cfg_parse_ini
             PARSE_STR_INI(modbus, poll_list)
         else if (strcmp(name, "map_list") == 0)
             PARSE_STR_INI(modbus, map_list)
+        else if (strcmp(name, "max_gap") == 0)
+            PARSE_INT_INI(modbus, max_gap, 0, 124)
+        else if (strcmp(name, "max_block") == 0)
+            PARSE_INT_INI(modbus, max_block, 1, 125)
+        else if (strcmp(name, "sched") == 0)
+            PARSE_MAP_INI(modbus, sched, "central:server")
+        else if (strcmp(name, "timing") == 0)
+            PARSE_MAP_INI(modbus, timing, "relative:absolute")
+        else if (strcmp(name, "catch_up") == 0)
+            PARSE_MAP_INI(modbus, catch_up, "skip:burst")
+        else if (strcmp(name, "stagger") == 0)
+            PARSE_INT_INI(modbus, stagger, 0, 1)
+        else if (strcmp(name, "engine") == 0)
+            PARSE_MAP_INI(modbus, engine, "thread:epoll")
+        else if (strcmp(name, "engine_threads") == 0)
+            PARSE_INT_INI(modbus, engine_threads, 1, 64)
+        else if (strcmp(name, "window") == 0)
+            PARSE_INT_INI(modbus, window, 1, 64)
+        else if (strcmp(name, "rto_min") == 0)
+            PARSE_INT_INI(modbus, rto_min, 1, 600000)
+        else if (strcmp(name, "rto_max") == 0)
+            PARSE_INT_INI(modbus, rto_max, 1, 600000)
+        else if (strcmp(name, "breaker_fails") == 0)
+            PARSE_INT_INI(modbus, breaker_fails, 1, 1000)
+        else if (strcmp(name, "pool") == 0)
+            PARSE_INT_INI(modbus, pool, 1, 16)
+        else if (strcmp(name, "quarantine_min") == 0)
+            PARSE_INT_INI(modbus, quarantine_min, 0, 86400)
+        else if (strcmp(name, "quarantine_max") == 0)
+            PARSE_INT_INI(modbus, quarantine_max, 1, 86400)
     }
 
     /* as far as inih is concerned, 1 is OK, while 0 would be error
@@ -512,6 +624,30 @@ static int m2md_cfg_parse_args
         {"modbus-max-re-time", required_argument, NULL, 269},
         {"modbus-poll-list",   required_argument, NULL, 270},
         {"modbus-map-list",    required_argument, NULL, 271},
+        {"modbus-max-gap",     required_argument, NULL, 272},
+        {"modbus-max-block",   required_argument, NULL, 273},
+        {"modbus-sched",       required_argument, NULL, 274},
+        {"modbus-timing",      required_argument, NULL, 275},
+        {"modbus-catch-up",    required_argument, NULL, 276},
+        {"modbus-stagger",     required_argument, NULL, 277},
+        {"modbus-engine",      required_argument, NULL, 278},
+        {"modbus-engine-threads", required_argument, NULL, 279},
+        {"modbus-window",      required_argument, NULL, 280},
+        {"modbus-rto-min",     required_argument, NULL, 281},
+        {"modbus-rto-max",     required_argument, NULL, 282},
+        {"modbus-breaker-fails", required_argument, NULL, 283},
+        {"modbus-pool",        required_argument, NULL, 284},
+        {"modbus-quarantine-min", required_argument, NULL, 285},
+        {"modbus-quarantine-max", required_argument, NULL, 286},
+        {"mqtt-batch",         required_argument, NULL, 287},
+        {"mqtt-batch-window",  required_argument, NULL, 288},
+        {"mqtt-encoding",      required_argument, NULL, 289},
+        {"mqtt-publishers",    required_argument, NULL, 290},
+        {"mqtt-queue",         required_argument, NULL, 291},
+        {"mqtt-backpressure",  required_argument, NULL, 292},
+        {"mqtt-spool",         required_argument, NULL, 293},
+        {"mqtt-spool-size",    required_argument, NULL, 294},
+        {"mqtt-spool-rate",    required_argument, NULL, 295},
         {NULL, 0, NULL, 0}
     };
 
@@ -548,6 +684,30 @@ static int m2md_cfg_parse_args
         case 269: PARSE_INT(modbus_max_re_time, optarg, 1, INT_MAX); break;
         case 270: PARSE_STR(modbus_poll_list, optarg); break;
         case 271: PARSE_STR(modbus_map_list, optarg); break;
+        case 272: PARSE_INT(modbus_max_gap, optarg, 0, 124); break;
+        case 273: PARSE_INT(modbus_max_block, optarg, 1, 125); break;
+        case 274: PARSE_MAP(modbus_sched, optarg, "central:server"); break;
+        case 275: PARSE_MAP(modbus_timing, optarg, "relative:absolute"); break;
+        case 276: PARSE_MAP(modbus_catch_up, optarg, "skip:burst"); break;
+        case 277: PARSE_INT(modbus_stagger, optarg, 0, 1); break;
+        case 278: PARSE_MAP(modbus_engine, optarg, "thread:epoll"); break;
+        case 279: PARSE_INT(modbus_engine_threads, optarg, 1, 64); break;
+        case 280: PARSE_INT(modbus_window, optarg, 1, 64); break;
+        case 281: PARSE_INT(modbus_rto_min, optarg, 1, 600000); break;
+        case 282: PARSE_INT(modbus_rto_max, optarg, 1, 600000); break;
+        case 283: PARSE_INT(modbus_breaker_fails, optarg, 1, 1000); break;
+        case 284: PARSE_INT(modbus_pool, optarg, 1, 16); break;
+        case 285: PARSE_INT(modbus_quarantine_min, optarg, 0, 86400); break;
+        case 286: PARSE_INT(modbus_quarantine_max, optarg, 1, 86400); break;
+        case 287: PARSE_INT(mqtt_batch, optarg, 0, 1); break;
+        case 288: PARSE_INT(mqtt_batch_window, optarg, 0, 60000); break;
+        case 289: PARSE_MAP(mqtt_encoding, optarg, "raw:text:json:cbor:binary"); break;
+        case 290: PARSE_INT(mqtt_publishers, optarg, 0, 16); break;
+        case 291: PARSE_INT(mqtt_queue, optarg, 16, 1048576); break;
+        case 292: PARSE_MAP(mqtt_backpressure, optarg, "drop-oldest:drop-newest:block"); break;
+        case 293: PARSE_STR(mqtt_spool, optarg); break;
+        case 294: PARSE_INT(mqtt_spool_size, optarg, 1, 65536); break;
+        case 295: PARSE_INT(mqtt_spool_rate, optarg, 1, 1000000); break;
 
         case ':':
             fprintf(stderr, "option -%c, --%s requires an argument\n",
@@ -702,10 +862,34 @@ int m2md_cfg_init
     g_m2md_cfg.mqtt_port = 1883;
     strcpy(g_m2md_cfg.mqtt_topic, "/modbus");
     strcpy(g_m2md_cfg.mqtt_id, "m2md");
+    g_m2md_cfg.mqtt_batch = 0;
+    g_m2md_cfg.mqtt_batch_window = 0;
+    PARSE_MAP(mqtt_encoding, "raw", "raw:text:json:cbor:binary")
+    g_m2md_cfg.mqtt_publishers = 0;
+    g_m2md_cfg.mqtt_queue = 4096;
+    PARSE_MAP(mqtt_backpressure, "drop-oldest", "drop-oldest:drop-newest:block")
+    strcpy(g_m2md_cfg.mqtt_spool, "");
+    g_m2md_cfg.mqtt_spool_size = 64;
+    g_m2md_cfg.mqtt_spool_rate = 1000;
 
     g_m2md_cfg.modbus_max_re_time = 60;
     strcpy(g_m2md_cfg.modbus_poll_list, "/etc/m2md/poll-list.conf");
     strcpy(g_m2md_cfg.modbus_map_list, "/etc/m2md/map-list.conf");
+    g_m2md_cfg.modbus_max_gap = 0;
+    g_m2md_cfg.modbus_max_block = 125;
+    PARSE_MAP(modbus_sched, "central", "central:server")
+    PARSE_MAP(modbus_timing, "relative", "relative:absolute")
+    PARSE_MAP(modbus_catch_up, "skip", "skip:burst")
+    g_m2md_cfg.modbus_stagger = 1;
+    PARSE_MAP(modbus_engine, "thread", "thread:epoll")
+    g_m2md_cfg.modbus_engine_threads = 1;
+    g_m2md_cfg.modbus_window = 1;
+    g_m2md_cfg.modbus_rto_min = 20;
+    g_m2md_cfg.modbus_rto_max = 2000;
+    g_m2md_cfg.modbus_breaker_fails = 3;
+    g_m2md_cfg.modbus_pool = 1;
+    g_m2md_cfg.modbus_quarantine_min = 10;
+    g_m2md_cfg.modbus_quarantine_max = 3600;
 
     /* overwrite values with those define in compiletime
      */
@@ -782,6 +966,42 @@ int m2md_cfg_init
     strcpy(g_m2md_cfg.mqtt_id, M2MD_CFG_MQTT_ID);
 #endif
 
+#ifdef M2MD_CFG_MQTT_BATCH
+    g_m2md_cfg.mqtt_batch = M2MD_CFG_MQTT_BATCH;
+#endif
+
+#ifdef M2MD_CFG_MQTT_BATCH_WINDOW
+    g_m2md_cfg.mqtt_batch_window = M2MD_CFG_MQTT_BATCH_WINDOW;
+#endif
+
+#ifdef M2MD_CFG_MQTT_ENCODING
+    PARSE_MAP(mqtt_encoding, M2MD_CFG_MQTT_ENCODING, "raw:text:json:cbor:binary")
+#endif
+
+#ifdef M2MD_CFG_MQTT_PUBLISHERS
+    g_m2md_cfg.mqtt_publishers = M2MD_CFG_MQTT_PUBLISHERS;
+#endif
+
+#ifdef M2MD_CFG_MQTT_QUEUE
+    g_m2md_cfg.mqtt_queue = M2MD_CFG_MQTT_QUEUE;
+#endif
+
+#ifdef M2MD_CFG_MQTT_BACKPRESSURE
+    PARSE_MAP(mqtt_backpressure, M2MD_CFG_MQTT_BACKPRESSURE, "drop-oldest:drop-newest:block")
+#endif
+
+#ifdef M2MD_CFG_MQTT_SPOOL
+    strcpy(g_m2md_cfg.mqtt_spool, M2MD_CFG_MQTT_SPOOL);
+#endif
+
+#ifdef M2MD_CFG_MQTT_SPOOL_SIZE
+    g_m2md_cfg.mqtt_spool_size = M2MD_CFG_MQTT_SPOOL_SIZE;
+#endif
+
+#ifdef M2MD_CFG_MQTT_SPOOL_RATE
+    g_m2md_cfg.mqtt_spool_rate = M2MD_CFG_MQTT_SPOOL_RATE;
+#endif
+
 #ifdef M2MD_CFG_MODBUS_MAX_RE_TIME
     g_m2md_cfg.modbus_max_re_time = M2MD_CFG_MODBUS_MAX_RE_TIME;
 #endif
@@ -794,6 +1014,66 @@ int m2md_cfg_init
     strcpy(g_m2md_cfg.modbus_map_list, M2MD_CFG_MODBUS_MAP_LIST);
 #endif
 
+#ifdef M2MD_CFG_MODBUS_MAX_GAP
+    g_m2md_cfg.modbus_max_gap = M2MD_CFG_MODBUS_MAX_GAP;
+#endif
+
+#ifdef M2MD_CFG_MODBUS_MAX_BLOCK
+    g_m2md_cfg.modbus_max_block = M2MD_CFG_MODBUS_MAX_BLOCK;
+#endif
+
+#ifdef M2MD_CFG_MODBUS_SCHED
+    PARSE_MAP(modbus_sched, M2MD_CFG_MODBUS_SCHED, "central:server")
+#endif
+
+#ifdef M2MD_CFG_MODBUS_TIMING
+    PARSE_MAP(modbus_timing, M2MD_CFG_MODBUS_TIMING, "relative:absolute")
+#endif
+
+#ifdef M2MD_CFG_MODBUS_CATCH_UP
+    PARSE_MAP(modbus_catch_up, M2MD_CFG_MODBUS_CATCH_UP, "skip:burst")
+#endif
+
+#ifdef M2MD_CFG_MODBUS_STAGGER
+    g_m2md_cfg.modbus_stagger = M2MD_CFG_MODBUS_STAGGER;
+#endif
+
+#ifdef M2MD_CFG_MODBUS_ENGINE
+    PARSE_MAP(modbus_engine, M2MD_CFG_MODBUS_ENGINE, "thread:epoll")
+#endif
+
+#ifdef M2MD_CFG_MODBUS_ENGINE_THREADS
+    g_m2md_cfg.modbus_engine_threads = M2MD_CFG_MODBUS_ENGINE_THREADS;
+#endif
+
+#ifdef M2MD_CFG_MODBUS_WINDOW
+    g_m2md_cfg.modbus_window = M2MD_CFG_MODBUS_WINDOW;
+#endif
+
+#ifdef M2MD_CFG_MODBUS_RTO_MIN
+    g_m2md_cfg.modbus_rto_min = M2MD_CFG_MODBUS_RTO_MIN;
+#endif
+
+#ifdef M2MD_CFG_MODBUS_RTO_MAX
+    g_m2md_cfg.modbus_rto_max = M2MD_CFG_MODBUS_RTO_MAX;
+#endif
+
+#ifdef M2MD_CFG_MODBUS_BREAKER_FAILS
+    g_m2md_cfg.modbus_breaker_fails = M2MD_CFG_MODBUS_BREAKER_FAILS;
+#endif
+
+#ifdef M2MD_CFG_MODBUS_POOL
+    g_m2md_cfg.modbus_pool = M2MD_CFG_MODBUS_POOL;
+#endif
+
+#ifdef M2MD_CFG_MODBUS_QUARANTINE_MIN
+    g_m2md_cfg.modbus_quarantine_min = M2MD_CFG_MODBUS_QUARANTINE_MIN;
+#endif
+
+#ifdef M2MD_CFG_MODBUS_QUARANTINE_MAX
+    g_m2md_cfg.modbus_quarantine_max = M2MD_CFG_MODBUS_QUARANTINE_MAX;
+#endif
+
 
 #if M2MD_ENABLE_INI
 
@@ -909,7 +1189,7 @@ void m2md_cfg_dump
     el_print(ELN, "%s%s: %s", #FIELD, padder + strlen(#FIELD),                 \
         g_m2md_ ## FIELD ## _strings[g_m2md_cfg.FIELD])
 
-    const char *padder = "....................";
+    const char *padder = "................................";
     /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
     el_print(ELN, PACKAGE_STRING);
@@ -933,9 +1213,33 @@ void m2md_cfg_dump
     CONFIG_PRINT_FIELD(mqtt_port, "%d");
     CONFIG_PRINT_FIELD(mqtt_topic, "%s");
     CONFIG_PRINT_FIELD(mqtt_id, "%s");
+    CONFIG_PRINT_FIELD(mqtt_batch, "%d");
+    CONFIG_PRINT_FIELD(mqtt_batch_window, "%d");
+    CONFIG_PRINT_MAP(mqtt_encoding);
+    CONFIG_PRINT_FIELD(mqtt_publishers, "%d");
+    CONFIG_PRINT_FIELD(mqtt_queue, "%d");
+    CONFIG_PRINT_MAP(mqtt_backpressure);
+    CONFIG_PRINT_FIELD(mqtt_spool, "%s");
+    CONFIG_PRINT_FIELD(mqtt_spool_size, "%d");
+    CONFIG_PRINT_FIELD(mqtt_spool_rate, "%d");
     CONFIG_PRINT_FIELD(modbus_max_re_time, "%d");
     CONFIG_PRINT_FIELD(modbus_poll_list, "%s");
     CONFIG_PRINT_FIELD(modbus_map_list, "%s");
+    CONFIG_PRINT_FIELD(modbus_max_gap, "%d");
+    CONFIG_PRINT_FIELD(modbus_max_block, "%d");
+    CONFIG_PRINT_MAP(modbus_sched);
+    CONFIG_PRINT_MAP(modbus_timing);
+    CONFIG_PRINT_MAP(modbus_catch_up);
+    CONFIG_PRINT_FIELD(modbus_stagger, "%d");
+    CONFIG_PRINT_MAP(modbus_engine);
+    CONFIG_PRINT_FIELD(modbus_engine_threads, "%d");
+    CONFIG_PRINT_FIELD(modbus_window, "%d");
+    CONFIG_PRINT_FIELD(modbus_rto_min, "%d");
+    CONFIG_PRINT_FIELD(modbus_rto_max, "%d");
+    CONFIG_PRINT_FIELD(modbus_breaker_fails, "%d");
+    CONFIG_PRINT_FIELD(modbus_pool, "%d");
+    CONFIG_PRINT_FIELD(modbus_quarantine_min, "%d");
+    CONFIG_PRINT_FIELD(modbus_quarantine_max, "%d");
 
 #undef CONFIG_PRINT_FIELD
 #undef CONFIG_PRINT_VAR
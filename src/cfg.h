@@ -41,6 +41,15 @@ struct m2md_cfg
     int           mqtt_port;
     char          mqtt_topic[1024 + 1];
     char          mqtt_id[128 + 1];
+    int           mqtt_batch;
+    int           mqtt_batch_window;
+    int           mqtt_encoding;
+    int           mqtt_publishers;
+    int           mqtt_queue;
+    int           mqtt_backpressure;
+    char          mqtt_spool[PATH_MAX + 1];
+    int           mqtt_spool_size;
+    int           mqtt_spool_rate;
 
     /* modbus section options
      */
@@ -48,6 +57,21 @@ struct m2md_cfg
     int           modbus_max_re_time;
     char          modbus_poll_list[PATH_MAX + 1];
     char          modbus_map_list[PATH_MAX + 1];
+    int           modbus_max_gap;
+    int           modbus_max_block;
+    int           modbus_sched;
+    int           modbus_timing;
+    int           modbus_catch_up;
+    int           modbus_stagger;
+    int           modbus_engine;
+    int           modbus_engine_threads;
+    int           modbus_window;
+    int           modbus_rto_min;
+    int           modbus_rto_max;
+    int           modbus_breaker_fails;
+    int           modbus_pool;
+    int           modbus_quarantine_min;
+    int           modbus_quarantine_max;
 };
 
 extern const struct m2md_cfg  *m2md_cfg;
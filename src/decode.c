@@ -0,0 +1,427 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+         ------------------------------------------------------------
+        / decode - batch decoder, swaps bytes, sign extends and      \
+        | scales whole block of 16bit registers in one pass, with    |
+        | simd when cpu we are built for has it, and packs coils     |
+        \ and discrete inputs 16 in register                         /
+         ------------------------------------------------------------
+   ==========================================================================
+          _               __            __         ____ _  __
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+
+   ========================================================================== */
+
+
+#include "decode.h"
+
+#include <string.h>
+
+#if defined(__AVX2__)
+#   include <immintrin.h>
+#elif defined(__SSE2__)
+#   include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#   include <arm_neon.h>
+#endif
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ==========================================================================
+    Portable kernel, decodes registers from 'i' to 'n'. It's used on its
+    own when there is no simd, and for the tail that does not fill whole
+    vector otherwise.
+
+    Bytes are swapped only where swap mask is set, without branching.
+    Sign is extended with (r ^ 0x8000) - 0x8000, which is a no-op for
+    unsigned registers with mask of 0.
+   ========================================================================== */
+static void m2md_decode_scalar
+(
+	const struct m2md_decode16  *d,     /* decoder parameters */
+	const uint16_t              *regs,  /* registers to decode */
+	int                          i,     /* first register to decode */
+	int                          n,     /* number of registers in regs */
+	float                       *out    /* decoded values go here */
+)
+{
+	uint16_t                     r;     /* current register */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	for (; i < n; ++i)
+	{
+		r = regs[i];
+		r = (r & ~d->swap[i]) | ((uint16_t)(r >> 8 | r << 8) & d->swap[i]);
+		out[i] = ((int32_t)(uint16_t)(r ^ d->sign[i]) - d->sign[i]) *
+			d->scale[i];
+	}
+}
+
+
+#if defined(__AVX2__)
+
+/* ==========================================================================
+    AVX2 kernel, 8 registers at once. Swapping and sign flipping is done
+    on 16bit lanes, then lanes are widened to 32bit and converted to
+    floats in one 256bit register.
+
+    Returns number of registers decoded.
+   ========================================================================== */
+static int m2md_decode_simd
+(
+	const struct m2md_decode16  *d,     /* decoder parameters */
+	const uint16_t              *regs,  /* registers to decode */
+	int                          n,     /* number of registers in regs */
+	float                       *out    /* decoded values go here */
+)
+{
+	__m128i                      r;     /* registers */
+	__m128i                      sw;    /* swap mask */
+	__m128i                      sg;    /* sign mask */
+	__m256i                      v;     /* registers widened to 32bit */
+	__m256                       f;     /* decoded values */
+	int                          i;     /* iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	for (i = 0; i + 8 <= n; i += 8)
+	{
+		r = _mm_loadu_si128((const __m128i *)(regs + i));
+		sw = _mm_loadu_si128((const __m128i *)(d->swap + i));
+		sg = _mm_loadu_si128((const __m128i *)(d->sign + i));
+
+		r = _mm_or_si128(_mm_andnot_si128(sw, r), _mm_and_si128(sw,
+				_mm_or_si128(_mm_srli_epi16(r, 8), _mm_slli_epi16(r, 8))));
+		r = _mm_xor_si128(r, sg);
+
+		v = _mm256_sub_epi32(_mm256_cvtepu16_epi32(r),
+				_mm256_cvtepu16_epi32(sg));
+		f = _mm256_mul_ps(_mm256_cvtepi32_ps(v),
+				_mm256_loadu_ps(d->scale + i));
+		_mm256_storeu_ps(out + i, f);
+	}
+
+	return i;
+}
+
+static const char *g_kernel = "avx2";
+
+#elif defined(__SSE2__)
+
+/* ==========================================================================
+    SSE2 kernel, 8 registers at once, in two halves of 4 floats each, as
+    that's all 128bit register can hold.
+
+    Returns number of registers decoded.
+   ========================================================================== */
+static int m2md_decode_simd
+(
+	const struct m2md_decode16  *d,     /* decoder parameters */
+	const uint16_t              *regs,  /* registers to decode */
+	int                          n,     /* number of registers in regs */
+	float                       *out    /* decoded values go here */
+)
+{
+	__m128i                      r;     /* registers */
+	__m128i                      sw;    /* swap mask */
+	__m128i                      sg;    /* sign mask */
+	__m128i                      z;     /* zeroes, to widen lanes */
+	__m128i                      lo;    /* lower 4 registers, 32bit */
+	__m128i                      hi;    /* upper 4 registers, 32bit */
+	int                          i;     /* iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	z = _mm_setzero_si128();
+	for (i = 0; i + 8 <= n; i += 8)
+	{
+		r = _mm_loadu_si128((const __m128i *)(regs + i));
+		sw = _mm_loadu_si128((const __m128i *)(d->swap + i));
+		sg = _mm_loadu_si128((const __m128i *)(d->sign + i));
+
+		r = _mm_or_si128(_mm_andnot_si128(sw, r), _mm_and_si128(sw,
+				_mm_or_si128(_mm_srli_epi16(r, 8), _mm_slli_epi16(r, 8))));
+		r = _mm_xor_si128(r, sg);
+
+		lo = _mm_sub_epi32(_mm_unpacklo_epi16(r, z),
+				_mm_unpacklo_epi16(sg, z));
+		hi = _mm_sub_epi32(_mm_unpackhi_epi16(r, z),
+				_mm_unpackhi_epi16(sg, z));
+
+		_mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(lo),
+				_mm_loadu_ps(d->scale + i)));
+		_mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi),
+				_mm_loadu_ps(d->scale + i + 4)));
+	}
+
+	return i;
+}
+
+static const char *g_kernel = "sse2";
+
+#elif defined(__ARM_NEON)
+
+/* ==========================================================================
+    NEON kernel, 8 registers at once, in two halves of 4 floats each.
+
+    Returns number of registers decoded.
+   ========================================================================== */
+static int m2md_decode_simd
+(
+	const struct m2md_decode16  *d,     /* decoder parameters */
+	const uint16_t              *regs,  /* registers to decode */
+	int                          n,     /* number of registers in regs */
+	float                       *out    /* decoded values go here */
+)
+{
+	uint16x8_t                   r;     /* registers */
+	uint16x8_t                   sw;    /* swap mask */
+	uint16x8_t                   sg;    /* sign mask */
+	int32x4_t                    lo;    /* lower 4 registers, 32bit */
+	int32x4_t                    hi;    /* upper 4 registers, 32bit */
+	int                          i;     /* iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	for (i = 0; i + 8 <= n; i += 8)
+	{
+		r = vld1q_u16(regs + i);
+		sw = vld1q_u16(d->swap + i);
+		sg = vld1q_u16(d->sign + i);
+
+		r = vbslq_u16(sw, vreinterpretq_u16_u8(
+				vrev16q_u8(vreinterpretq_u8_u16(r))), r);
+		r = veorq_u16(r, sg);
+
+		lo = vsubq_s32(vreinterpretq_s32_u32(vmovl_u16(vget_low_u16(r))),
+				vreinterpretq_s32_u32(vmovl_u16(vget_low_u16(sg))));
+		hi = vsubq_s32(vreinterpretq_s32_u32(vmovl_u16(vget_high_u16(r))),
+				vreinterpretq_s32_u32(vmovl_u16(vget_high_u16(sg))));
+
+		vst1q_f32(out + i, vmulq_f32(vcvtq_f32_s32(lo),
+				vld1q_f32(d->scale + i)));
+		vst1q_f32(out + i + 4, vmulq_f32(vcvtq_f32_s32(hi),
+				vld1q_f32(d->scale + i + 4)));
+	}
+
+	return i;
+}
+
+static const char *g_kernel = "neon";
+
+#else
+
+/* ==========================================================================
+    No simd, portable kernel does all the work.
+   ========================================================================== */
+static int m2md_decode_simd
+(
+	const struct m2md_decode16  *d,     /* decoder parameters */
+	const uint16_t              *regs,  /* registers to decode */
+	int                          n,     /* number of registers in regs */
+	float                       *out    /* decoded values go here */
+)
+{
+	(void)d;
+	(void)regs;
+	(void)n;
+	(void)out;
+
+	return 0;
+}
+
+static const char *g_kernel = "scalar";
+
+#endif
+
+
+/* ==========================================================================
+                       __     __ _          ____
+        ____   __  __ / /_   / /(_)_____   / __/__  __ ____   _____ _____
+       / __ \ / / / // __ \ / // // ___/  / /_ / / / // __ \ / ___// ___/
+      / /_/ // /_/ // /_/ // // // /__   / __// /_/ // / / // /__ (__  )
+     / .___/ \__,_//_.___//_//_/ \___/  /_/   \__,_//_/ /_/ \___//____/
+    /_/
+   ==========================================================================
+    Returns 1 when 'poll' is single 16bit integer register, that can be
+    decoded by batch decoder. Order of words means nothing for value that
+    is only one word wide, so only swapped bytes are taken into account.
+   ========================================================================== */
+int m2md_decode_is16
+(
+	const struct m2md_pl_data  *poll  /* poll to check */
+)
+{
+	if (poll->type == M2MD_PL_TYPE_RAW)
+		return poll->field_width < 2;
+
+	return poll->type == M2MD_PL_TYPE_I16 || poll->type == M2MD_PL_TYPE_U16;
+}
+
+
+/* ==========================================================================
+    Sets parameters of register 'i' in 'd' to decode 16bit 'poll'.
+   ========================================================================== */
+void m2md_decode_set16
+(
+	struct m2md_decode16       *d,    /* decoder parameters */
+	int                         i,    /* register poll starts at */
+	const struct m2md_pl_data  *poll  /* poll to decode */
+)
+{
+	d->scale[i] = poll->scale;
+	d->sign[i] = poll->is_signed ? 0x8000 : 0;
+	d->swap[i] = poll->order & M2MD_PL_ORDER_BADC ? 0xffff : 0;
+}
+
+
+/* ==========================================================================
+    Decodes 'n' registers 'regs' with parameters 'd' into 'out'. Every
+    register of the block is decoded, no matter whether it's used or not,
+    so that it can be done in one go, values of registers that are not
+    16bit polls are simply 0.
+   ========================================================================== */
+void m2md_decode_block16
+(
+	const struct m2md_decode16  *d,     /* decoder parameters */
+	const uint16_t              *regs,  /* registers to decode */
+	int                          n,     /* number of registers in regs */
+	float                       *out    /* decoded values go here */
+)
+{
+	m2md_decode_scalar(d, regs, m2md_decode_simd(d, regs, n, out), n, out);
+}
+
+
+/* ==========================================================================
+    Returns name of kernel batch decoder was built with.
+   ========================================================================== */
+const char *m2md_decode_kernel
+(
+	void
+)
+{
+	return g_kernel;
+}
+
+
+/* ==========================================================================
+    Packs 'n' bits, that libmodbus returns one per byte, into 'words', 16
+    bits in each word, first bit in lowest bit of first word. That's how
+    bits are kept in registers buffer, no matter how they were read.
+   ========================================================================== */
+void m2md_decode_pack_bits
+(
+	const uint8_t  *bits,   /* bits to pack, one per byte */
+	int             n,      /* number of bits to pack */
+	uint16_t       *words   /* packed bits go here */
+)
+{
+	int             i;      /* iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	memset(words, 0x00, (n + 15) / 16 * sizeof(*words));
+	for (i = 0; i != n; ++i)
+		words[i >> 4] |= (uint16_t)(bits[i] != 0) << (i & 15);
+}
+
+
+/* ==========================================================================
+    Packs 'nbytes' bytes of bits, as modbus sends them, 8 in byte, first
+    bit in lowest bit of first byte, into 'words', the same way as
+    m2md_decode_pack_bits() does, so it's just a matter of putting two
+    bytes together. Last byte of odd number of bytes takes lower half of
+    its word, upper half is 0.
+   ========================================================================== */
+void m2md_decode_pack_bytes
+(
+	const uint8_t  *bytes,   /* bytes to pack */
+	int             nbytes,  /* number of bytes in bytes */
+	uint16_t       *words    /* packed bits go here */
+)
+{
+	int             i;       /* iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	for (i = 0; i + 1 < nbytes; i += 2)
+		words[i / 2] = bytes[i] | bytes[i + 1] << 8;
+
+	if (nbytes & 1)
+		words[i / 2] = bytes[i];
+}
+
+
+/* ==========================================================================
+    Reverse of m2md_decode_pack_bits(), unpacks 'n' bits from 'words'
+    into 'bits', one per byte, as libmodbus wants them for writing.
+   ========================================================================== */
+void m2md_decode_unpack_bits
+(
+	const uint16_t  *words,  /* packed bits */
+	int              n,      /* number of bits to unpack */
+	uint8_t         *bits    /* unpacked bits go here */
+)
+{
+	int              i;      /* iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	for (i = 0; i != n; ++i)
+		bits[i] = words[i >> 4] >> (i & 15) & 1;
+}
+
+
+/* ==========================================================================
+    Copies 'n' bits starting at bit 'off' of packed bits 'words' into
+    'map', 8 bits in each byte, first bit in lowest bit of first byte, just
+    like modbus sends them. Bits are taken 32 at a time, so each byte is
+    a single shift, no matter where in the word it starts. 'nwords' is
+    number of words in 'words', so we don't read past it.
+
+    Returns number of bytes stored in 'map'.
+   ========================================================================== */
+int m2md_decode_bitmap
+(
+	const uint16_t  *words,   /* packed bits */
+	int              nwords,  /* number of words in words */
+	int              off,     /* first bit to copy */
+	int              n,       /* number of bits to copy */
+	unsigned char   *map      /* copied bits go here */
+)
+{
+	uint32_t         v;       /* two words that hold current byte */
+	int              pos;     /* position of current byte in words */
+	int              i;       /* iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	for (i = 0; i * 8 < n; ++i)
+	{
+		pos = off + i * 8;
+		v = words[pos >> 4];
+		if ((pos >> 4) + 1 < nwords)
+			v |= (uint32_t)words[(pos >> 4) + 1] << 16;
+
+		map[i] = v >> (pos & 15);
+	}
+
+	/* clear bits past the end, they belong to other polls */
+	if (n & 7)
+		map[i - 1] &= (1 << (n & 7)) - 1;
+
+	return i;
+}
@@ -0,0 +1,37 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ========================================================================== */
+
+#ifndef M2MD_DECODE_H
+#define M2MD_DECODE_H 1
+
+#include <stdint.h>
+
+#include "poll-list.h"
+
+
+/* parameters of batch decoder for single block of registers, one entry
+ * for every register of the block. Entries of registers at which no
+ * 16bit poll starts have scale of 0, so they decode to 0 */
+struct m2md_decode16
+{
+	float     *scale;  /* scale of poll */
+	uint16_t  *sign;   /* 0x8000 - value is signed, 0 - it's not */
+	uint16_t  *swap;   /* 0xffff - swap bytes of register, 0 - don't */
+};
+
+int m2md_decode_is16(const struct m2md_pl_data *poll);
+void m2md_decode_set16(struct m2md_decode16 *d, int i,
+		const struct m2md_pl_data *poll);
+void m2md_decode_block16(const struct m2md_decode16 *d,
+		const uint16_t *regs, int n, float *out);
+const char *m2md_decode_kernel(void);
+void m2md_decode_pack_bits(const uint8_t *bits, int n, uint16_t *words);
+void m2md_decode_pack_bytes(const uint8_t *bytes, int nbytes,
+		uint16_t *words);
+void m2md_decode_unpack_bits(const uint16_t *words, int n, uint8_t *bits);
+int m2md_decode_bitmap(const uint16_t *words, int nwords, int off, int n,
+		unsigned char *map);
+
+#endif
@@ -0,0 +1,511 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+         ------------------------------------------------------------
+        / encode - turns sample into mqtt payload, in format that    \
+        | subscribers can read, into per thread buffer, so nothing   |
+        \ is allocated per sample                                    /
+         ------------------------------------------------------------
+   ==========================================================================
+          _               __            __         ____ _  __
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+
+   ========================================================================== */
+
+
+#include "encode.h"
+
+#include <errno.h>
+#include <float.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "valid.h"
+
+
+/* ==========================================================================
+          __             __                     __   _
+     ____/ /___   _____ / /____ _ _____ ____ _ / /_ (_)____   ____   _____
+    / __  // _ \ / ___// // __ `// ___// __ `// __// // __ \ / __ \ / ___/
+   / /_/ //  __// /__ / // /_/ // /   / /_/ // /_ / // /_/ // / / /(__  )
+   \__,_/ \___/ \___//_/ \__,_//_/    \__,_/ \__//_/ \____//_/ /_//____/
+
+   ========================================================================== */
+
+
+/* names of encodings, in order of enum m2md_enc */
+static const char *g_enc_names[] =
+{
+	"raw", "text", "json", "cbor", "binary"
+};
+
+/* every thread that publishes encodes into its own buffer, so
+ * encoding needs neither allocation nor locking */
+static __thread unsigned char g_enc_buf[M2MD_ENC_BUF_SIZE];
+
+/* digits that are always enough to read float and double back
+ * exactly, c99 doesn't have them yet */
+#ifndef FLT_DECIMAL_DIG
+#   define FLT_DECIMAL_DIG 9
+#endif
+
+#ifndef DBL_DECIMAL_DIG
+#   define DBL_DECIMAL_DIG 17
+#endif
+
+/* cbor major types */
+#define M2MD_ENC_CBOR_UINT   0
+#define M2MD_ENC_CBOR_NINT   1
+#define M2MD_ENC_CBOR_BYTES  2
+#define M2MD_ENC_CBOR_MAP    5
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ==========================================================================
+    Writes decimal 'v', with minus sign when 'neg' is set, into 'p'.
+    Digits are written from the end of small buffer, so there is no
+    need to reverse them afterwards.
+
+    Returns number of characters written.
+   ========================================================================== */
+static int m2md_enc_itoa
+(
+	char      *p,        /* text goes here */
+	uint64_t   v,        /* absolute value of number */
+	int        neg       /* number is negative */
+)
+{
+	char       tmp[20];  /* digits, from the end */
+	int        n;        /* number of digits */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	n = 0;
+	do
+		tmp[sizeof(tmp) - ++n] = '0' + v % 10;
+	while (v /= 10);
+
+	if (neg)
+		*p++ = '-';
+
+	memcpy(p, tmp + sizeof(tmp) - n, n);
+	return n + !!neg;
+}
+
+
+/* ==========================================================================
+    Writes floating point 'v' into 'p' as decimal text, with as few
+    digits as needed for it to be read back as exactly the same 'v'.
+    'single' tells that 'v' is a float, which needs less digits.
+
+    Whole numbers, which is what most registers hold, are written with
+    integer formatter, but only as long as every digit of them is needed
+    to read them back, that's up to 2^24 for float. Bigger float, like
+    164120395776, reads back from 1.64120396e+11 just as well. Any other
+    number that has shortest representation of N <= DIG digits, rounds
+    to it when printed with DIG digits, so printing starts with DIG, and
+    only numbers that don't read back go up, at most to DECIMAL_DIG,
+    which is always enough. That's at most 4 tries for float and 3 for
+    double. Subnormals don't have DIG digits of precision, so for them
+    printing starts with single digit.
+
+    Returns number of characters written, not nul terminated.
+   ========================================================================== */
+static int m2md_enc_real
+(
+	char    *p,       /* text goes here */
+	double   v,       /* value to write */
+	int      single,  /* v is a float */
+	int      json     /* write null for what json can't hold */
+)
+{
+	char     tmp[32]; /* number with nul terminator */
+	double   lim;     /* whole numbers below it are written as integers */
+	int      prec;    /* current precision */
+	int      n;       /* length of number */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (v != v || v - v != 0)
+	{
+		/* nan or infinity, json has no numbers for them */
+		if (json)
+			n = sprintf(tmp, "null");
+		else
+			n = sprintf(tmp, "%s", v != v ? "nan" : v < 0 ? "-inf" : "inf");
+
+		memcpy(p, tmp, n);
+		return n;
+	}
+
+	lim = single ? 16777216 : 1e15;
+	if (v > -lim && v < lim && v == (double)(int64_t)v && (v != 0 ||
+				!signbit(v)))
+		return m2md_enc_itoa(p, v < 0 ? -(int64_t)v : (int64_t)v, v < 0);
+
+	prec = single ? FLT_DIG : DBL_DIG;
+	if (fabs(v) < (single ? FLT_MIN : DBL_MIN))
+		prec = 1;
+
+	for (;; ++prec)
+	{
+		n = snprintf(tmp, sizeof(tmp), "%.*g", prec, v);
+
+		if (single && strtof(tmp, NULL) == (float)v)
+			break;
+
+		if (!single && strtod(tmp, NULL) == v)
+			break;
+
+		if (prec == (single ? FLT_DECIMAL_DIG : DBL_DECIMAL_DIG))
+			break; /* can't happen, but just in case */
+	}
+
+	memcpy(p, tmp, n);
+	return n;
+}
+
+
+/* ==========================================================================
+    Writes 'size' bytes of 'bits' into 'p' as hex text, first byte first.
+
+    Returns number of characters written.
+   ========================================================================== */
+static int m2md_enc_hex
+(
+	char                 *p,     /* text goes here */
+	const unsigned char  *bits,  /* bitmap to write */
+	int                   size   /* size of bitmap */
+)
+{
+	static const char    *hex = "0123456789abcdef";
+	int                   i;     /* iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	for (i = 0; i != size; ++i)
+	{
+		p[i * 2] = hex[bits[i] >> 4];
+		p[i * 2 + 1] = hex[bits[i] & 0x0f];
+	}
+
+	return size * 2;
+}
+
+
+/* ==========================================================================
+    Writes 'value' of 'kind' and 'size' into 'p' as text. With 'json',
+    bitmap is put in quotes, and nan and infinity are null.
+
+    Returns number of characters written.
+   ========================================================================== */
+static int m2md_enc_text
+(
+	char        *p,      /* text goes here */
+	int          kind,   /* kind of value */
+	const void  *value,  /* value to write */
+	int          size,   /* size of value */
+	int          json    /* text is part of json */
+)
+{
+	float        f;      /* value of float kind */
+	double       d;      /* value of double kind */
+	int64_t      i;      /* value of signed kind */
+	uint64_t     u;      /* value of unsigned kind */
+	int          n;      /* length of quoted bitmap */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	switch (kind)
+	{
+	case M2MD_ENC_KIND_F32:
+		memcpy(&f, value, sizeof(f));
+		return m2md_enc_real(p, f, 1, json);
+
+	case M2MD_ENC_KIND_F64:
+		memcpy(&d, value, sizeof(d));
+		return m2md_enc_real(p, d, 0, json);
+
+	case M2MD_ENC_KIND_I64:
+		memcpy(&i, value, sizeof(i));
+		return m2md_enc_itoa(p, i < 0 ? -(uint64_t)i : (uint64_t)i, i < 0);
+
+	case M2MD_ENC_KIND_U64:
+		memcpy(&u, value, sizeof(u));
+		return m2md_enc_itoa(p, u, 0);
+
+	default:
+		if (!json)
+			return m2md_enc_hex(p, value, size);
+
+		p[0] = '"';
+		n = m2md_enc_hex(p + 1, value, size);
+		p[n + 1] = '"';
+		return n + 2;
+	}
+}
+
+
+/* ==========================================================================
+    Writes 'n' lowest bytes of 'v' into 'p', most significant one first.
+
+    Returns pointer past written bytes.
+   ========================================================================== */
+static unsigned char *m2md_enc_be
+(
+	unsigned char  *p,  /* bytes go here */
+	uint64_t        v,  /* value to write */
+	int             n   /* number of bytes to write */
+)
+{
+	while (n--)
+		*p++ = v >> (n * 8);
+
+	return p;
+}
+
+
+/* ==========================================================================
+    Writes cbor head of 'major' type with argument 'n' into 'p', in the
+    shortest form, as cbor wants it.
+
+    Returns pointer past written head.
+   ========================================================================== */
+static unsigned char *m2md_enc_cbor_head
+(
+	unsigned char  *p,      /* head goes here */
+	int             major,  /* major type */
+	uint64_t        n       /* argument */
+)
+{
+	major <<= 5;
+
+	if (n < 24)
+	{
+		*p++ = major | n;
+		return p;
+	}
+
+	if (n <= 0xff)
+	{
+		*p++ = major | 24;
+		return m2md_enc_be(p, n, 1);
+	}
+
+	if (n <= 0xffff)
+	{
+		*p++ = major | 25;
+		return m2md_enc_be(p, n, 2);
+	}
+
+	if (n <= 0xffffffff)
+	{
+		*p++ = major | 26;
+		return m2md_enc_be(p, n, 4);
+	}
+
+	*p++ = major | 27;
+	return m2md_enc_be(p, n, 8);
+}
+
+
+/* ==========================================================================
+    Writes 'value' of 'kind' and 'size' into 'p' as cbor data item.
+    Double that is exactly the same as float is written as float.
+
+    Returns pointer past written item.
+   ========================================================================== */
+static unsigned char *m2md_enc_cbor_value
+(
+	unsigned char  *p,      /* item goes here */
+	int             kind,   /* kind of value */
+	const void     *value,  /* value to write */
+	int             size    /* size of value */
+)
+{
+	float           f;      /* value of float kind */
+	double          d;      /* value of double kind */
+	int64_t         i;      /* value of signed kind */
+	uint64_t        u;      /* bits of value */
+	uint32_t        u32;    /* bits of float */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	switch (kind)
+	{
+	case M2MD_ENC_KIND_F64:
+		memcpy(&d, value, sizeof(d));
+		f = d;
+		if (f != d && d == d)
+		{
+			memcpy(&u, &d, sizeof(u));
+			*p++ = 0xfb;
+			return m2md_enc_be(p, u, 8);
+		}
+
+		memcpy(&u32, &f, sizeof(u32));
+		*p++ = 0xfa;
+		return m2md_enc_be(p, u32, 4);
+
+	case M2MD_ENC_KIND_F32:
+		memcpy(&u32, value, sizeof(u32));
+		*p++ = 0xfa;
+		return m2md_enc_be(p, u32, 4);
+
+	case M2MD_ENC_KIND_I64:
+		memcpy(&i, value, sizeof(i));
+		if (i < 0)
+			return m2md_enc_cbor_head(p, M2MD_ENC_CBOR_NINT,
+					(uint64_t)-(i + 1));
+
+		return m2md_enc_cbor_head(p, M2MD_ENC_CBOR_UINT, i);
+
+	case M2MD_ENC_KIND_U64:
+		memcpy(&u, value, sizeof(u));
+		return m2md_enc_cbor_head(p, M2MD_ENC_CBOR_UINT, u);
+
+	default:
+		p = m2md_enc_cbor_head(p, M2MD_ENC_CBOR_BYTES, size);
+		memcpy(p, value, size);
+		return p + size;
+	}
+}
+
+
+/* ==========================================================================
+                       __     __ _          ____
+        ____   __  __ / /_   / /(_)_____   / __/__  __ ____   _____ _____
+       / __ \ / / / // __ \ / // // ___/  / /_ / / / // __ \ / ___// ___/
+      / /_/ // /_/ // /_/ // // // /__   / __// /_/ // / / // /__ (__  )
+     / .___/ \__,_//_.___//_//_/ \___/  /_/   \__,_//_/ /_/ \___//____/
+    /_/
+   ==========================================================================
+    Returns encoding with given 'name', or -1 when there is no such
+    encoding.
+   ========================================================================== */
+int m2md_enc_parse
+(
+	const char  *name  /* name of encoding */
+)
+{
+	int          i;    /* iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	for (i = 0; i != sizeof(g_enc_names) / sizeof(*g_enc_names); ++i)
+		if (strcmp(name, g_enc_names[i]) == 0)
+			return i;
+
+	return -1;
+}
+
+
+/* ==========================================================================
+    Encodes 'value' of 'kind' and 'size', taken at realtime 'ts', with
+    encoding 'enc'. Pointer to encoded payload is stored in 'out', it
+    points into buffer of calling thread, which is valid until next call
+    in the same thread. Raw encoding is 'value' itself, nothing is copied.
+
+    Returns size of encoded payload, or -1 on error.
+
+    errno:
+            EINVAL      unknown encoding or kind
+            ENOBUFS     bitmap is too big to be encoded
+   ========================================================================== */
+int m2md_enc_encode
+(
+	int                     enc,     /* encoding to use */
+	int                     kind,    /* kind of value */
+	const void             *value,   /* value to encode */
+	int                     size,    /* size of value */
+	const struct timespec  *ts,      /* time value was taken */
+	const void            **out      /* encoded payload goes here */
+)
+{
+	unsigned char          *p;       /* current position in buffer */
+	char                   *c;       /* the same, for text */
+	uint64_t                u;       /* bits of value */
+	uint32_t                u32;     /* bits of float */
+	uint64_t                ms;      /* ts, in ms since epoch */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	VALID(EINVAL, value);
+	VALID(EINVAL, out);
+	VALID(EINVAL, kind >= M2MD_ENC_KIND_F32 && kind <= M2MD_ENC_KIND_BITS);
+
+	/* twice the bitmap, in hex, and some room
+	 * for json keys and timestamp */
+	VALID(ENOBUFS, size >= 0 && size * 2 + 64 <= M2MD_ENC_BUF_SIZE);
+
+	p = g_enc_buf;
+	c = (char *)g_enc_buf;
+	*out = g_enc_buf;
+
+	switch (enc)
+	{
+	case M2MD_ENC_RAW:
+		*out = value;
+		return size;
+
+	case M2MD_ENC_TEXT:
+		return m2md_enc_text(c, kind, value, size, 0);
+
+	case M2MD_ENC_JSON:
+		ms = (uint64_t)ts->tv_sec * 1000 + ts->tv_nsec / 1000000;
+		memcpy(c, "{\"v\":", 5);
+		c += 5;
+		c += m2md_enc_text(c, kind, value, size, 1);
+		memcpy(c, ",\"ts\":", 6);
+		c += 6;
+		c += m2md_enc_itoa(c, ms, 0);
+		*c++ = '}';
+		return c - (char *)g_enc_buf;
+
+	case M2MD_ENC_CBOR:
+		ms = (uint64_t)ts->tv_sec * 1000 + ts->tv_nsec / 1000000;
+		p = m2md_enc_cbor_head(p, M2MD_ENC_CBOR_MAP, 2);
+		*p++ = 0x61;  /* text string of 1 byte */
+		*p++ = 'v';
+		p = m2md_enc_cbor_value(p, kind, value, size);
+		*p++ = 0x62;  /* text string of 2 bytes */
+		*p++ = 't';
+		*p++ = 's';
+		p = m2md_enc_cbor_head(p, M2MD_ENC_CBOR_UINT, ms);
+		return p - g_enc_buf;
+
+	case M2MD_ENC_BINARY:
+		if (kind == M2MD_ENC_KIND_BITS)
+		{
+			/* bitmap has no byte order */
+			*out = value;
+			return size;
+		}
+
+		if (kind == M2MD_ENC_KIND_F32)
+		{
+			memcpy(&u32, value, sizeof(u32));
+			return m2md_enc_be(p, u32, 4) - g_enc_buf;
+		}
+
+		memcpy(&u, value, sizeof(u));
+		return m2md_enc_be(p, u, 8) - g_enc_buf;
+
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+}
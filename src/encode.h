@@ -0,0 +1,44 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ========================================================================== */
+
+#ifndef M2MD_ENCODE_H
+#define M2MD_ENCODE_H 1
+
+#include <stddef.h>
+#include <time.h>
+
+
+/* how sample is encoded in mqtt payload, order must match order of
+ * names in mqtt_encoding config option */
+enum m2md_enc
+{
+	M2MD_ENC_RAW,      /* value as it is in memory, host byte order */
+	M2MD_ENC_TEXT,     /* decimal text, shortest that reads back exactly */
+	M2MD_ENC_JSON,     /* {"v":value,"ts":ms since epoch} */
+	M2MD_ENC_CBOR,     /* cbor map with the same keys as json */
+	M2MD_ENC_BINARY,   /* value in network byte order */
+
+	M2MD_ENC_DEFAULT   /* poll uses encoding from config */
+};
+
+/* what kind of value is encoded */
+enum m2md_enc_kind
+{
+	M2MD_ENC_KIND_F32,   /* float */
+	M2MD_ENC_KIND_F64,   /* double */
+	M2MD_ENC_KIND_I64,   /* int64_t */
+	M2MD_ENC_KIND_U64,   /* uint64_t */
+	M2MD_ENC_KIND_BITS   /* bitmap of any size */
+};
+
+/* size of per thread encoder buffer, enough for the biggest bitmap
+ * encoded as json */
+#define M2MD_ENC_BUF_SIZE 1024
+
+int m2md_enc_parse(const char *name);
+int m2md_enc_encode(int enc, int kind, const void *value, int size,
+		const struct timespec *ts, const void **out);
+
+#endif
@@ -24,8 +24,11 @@
 #include <string.h>
 #include <time.h>
 
+#include "encode.h"
 #include "modbus.h"
 #include "mqtt.h"
+#include "publisher.h"
+#include "spool.h"
 #include "macros.h"
 
 
@@ -126,6 +129,156 @@ static int m2md_get_float
 }
 
 
+/* ==========================================================================
+    Parses type 'name' of value and sets type, order, sign and width of
+    'poll' accordingly. Type is either sign followed by width, like "-2",
+    or named type, like "u32" or "f64:dcba", with optional byte and word
+    order after colon.
+
+    errno:
+            EINVAL      unknown type or order, or invalid width
+            ERANGE      width out of range
+   ========================================================================== */
+static int m2md_get_type
+(
+	const char           *name,  /* type to parse */
+	struct m2md_pl_data  *poll   /* type is stored here */
+)
+{
+	static const struct
+	{
+		const char       *name;  /* name of type */
+		int               type;  /* m2md_pl_type */
+		int               width; /* width in registers */
+		int               sign;  /* type is signed */
+	}
+	types[] =
+	{
+		{ "i16", M2MD_PL_TYPE_I16, 1, 1 },
+		{ "u16", M2MD_PL_TYPE_U16, 1, 0 },
+		{ "i32", M2MD_PL_TYPE_I32, 2, 1 },
+		{ "u32", M2MD_PL_TYPE_U32, 2, 0 },
+		{ "i64", M2MD_PL_TYPE_I64, 4, 1 },
+		{ "u64", M2MD_PL_TYPE_U64, 4, 0 },
+		{ "f32", M2MD_PL_TYPE_F32, 2, 1 },
+		{ "f64", M2MD_PL_TYPE_F64, 4, 1 }
+	};
+
+	static const char    *orders[M2MD_PL_ORDER_MAX] =
+	{
+		"abcd", "cdab", "badc", "dcba"
+	};
+
+	const char           *order; /* order part of name */
+	size_t                len;   /* length of type part of name */
+	size_t                i;     /* iterator */
+	long                  width; /* width of sign and width type */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	poll->order = M2MD_PL_ORDER_ABCD;
+
+	if (name[0] == '+' || name[0] == '-')
+	{
+		if (m2md_get_number(name + 1, &width) != 0)
+			return -1;
+
+		if (width < 0 || 2000 < width)
+			return_errno(ERANGE);
+
+		poll->type = M2MD_PL_TYPE_RAW;
+		poll->field_width = width;
+		poll->is_signed = name[0] == '-';
+		return 0;
+	}
+
+	order = strchr(name, ':');
+	len = order ? (size_t)(order - name) : strlen(name);
+
+	for (i = 0; i != sizeof(types) / sizeof(*types); ++i)
+		if (strlen(types[i].name) == len &&
+				strncmp(types[i].name, name, len) == 0)
+			break;
+
+	if (i == sizeof(types) / sizeof(*types))
+		return_errno(EINVAL);
+
+	poll->type = types[i].type;
+	poll->field_width = types[i].width;
+	poll->is_signed = types[i].sign;
+
+	/* no order, value is big endian, just as modbus wants */
+	if (order == NULL)
+		return 0;
+
+	for (i = 0; i != M2MD_PL_ORDER_MAX; ++i)
+		if (strcmp(orders[i], order + 1) == 0)
+			break;
+
+	if (i == M2MD_PL_ORDER_MAX)
+		return_errno(EINVAL);
+
+	poll->order = i;
+	return 0;
+}
+
+
+/* ==========================================================================
+    Parses deadband 'db' of poll and stores it in 'poll'. Deadband is
+    either "none", publish every sample, "any", publish on any change,
+    number, publish when value moves by that much, or number followed by
+    %, publish when value moves by that percent of last published value.
+
+    errno:
+            EINVAL      deadband is not valid or is negative
+   ========================================================================== */
+static int m2md_get_deadband
+(
+	const char           *db,       /* deadband to parse */
+	struct m2md_pl_data  *poll      /* deadband is stored here */
+)
+{
+	char                  num[32];  /* number part of deadband */
+	size_t                len;      /* length of db */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (strcmp(db, "none") == 0)
+	{
+		poll->deadband_mode = M2MD_PL_DEADBAND_NONE;
+		poll->deadband = 0;
+		return 0;
+	}
+
+	if (strcmp(db, "any") == 0)
+	{
+		poll->deadband_mode = M2MD_PL_DEADBAND_ANY;
+		poll->deadband = 0;
+		return 0;
+	}
+
+	len = strlen(db);
+	if (len == 0 || len >= sizeof(num))
+		return_errno(EINVAL);
+
+	strcpy(num, db);
+	poll->deadband_mode = M2MD_PL_DEADBAND_ABS;
+	if (num[len - 1] == '%')
+	{
+		num[len - 1] = '\0';
+		poll->deadband_mode = M2MD_PL_DEADBAND_PERCENT;
+	}
+
+	if (m2md_get_float(num, &poll->deadband) != 0)
+		return -1;
+
+	if (poll->deadband < 0)
+		return_errno(EINVAL);
+
+	return 0;
+}
+
+
 static int m2md_parse_poll_file
 (
 	void
@@ -135,7 +288,7 @@ static int m2md_parse_poll_file
 	FILE                *f;
 	char                 line[4096];
 	struct m2md_pl_data  poll;
-	char                 ip[INET_ADDRSTRLEN];
+	char                 ip[M2MD_MODBUS_ADDR_MAX];
 	int                  port;
 	char                *linetok;
 	int                  lineno;
@@ -203,7 +356,7 @@ static int m2md_parse_poll_file
 		if ((linetok = strtok(line, ",")) == NULL)
 			continue_print(ELW, "[%s:%d] no fields found", file, lineno);
 
-		if (strlen(linetok) > sizeof(ip))
+		if (strlen(linetok) >= sizeof(ip))
 			continue_print(ELW, "%s:%d, invalid ip address: %s",
 					file, lineno, linetok);
 
@@ -221,7 +374,12 @@ static int m2md_parse_poll_file
 		if (m2md_get_number(linetok, &value) != 0)
 			continue_print(ELW, "[%s:%d] invalid port %s", file, lineno, linetok);
 
-		if (value < 1 || 65535 < value)
+		/* for rtu device, port field holds baud rate */
+		if (ip[0] == '/' && (value < 50 || 4000000 < value))
+			continue_print(ELW, "[%s:%d] baud is out of range [50,4000000]",
+					file, lineno);
+
+		if (ip[0] != '/' && (value < 1 || 65535 < value))
 			continue_print(ELW, "[%s:%d] port is out of range [1,65535]",
 					file, lineno);
 
@@ -254,21 +412,13 @@ static int m2md_parse_poll_file
 	   ================================================================== */
 		NEXT_TOKEN("type");
 
-		if (linetok[0] != '+' && linetok[0] != '-')
-			continue_print(ELW, "[%s:%d] first character of type must be + or -",
-					file, lineno);
-
-		poll.is_signed = linetok[0] == '-' ? 1 : 0;
-
-		if (m2md_get_number(&linetok[1], &value) != 0)
-			continue_print(ELW, "[%s:%d], invalid field width %s",
-					file, lineno, &linetok[1]);
-
-		if (value < 0 || 2 < value)
-			continue_print(ELW, "[%s:%d] field width out of range [0,2]",
-					file, lineno);
-
-		poll.field_width = value;
+		/* for coils and discrete inputs width is in bits, and
+		 * it is checked once we know what function poll uses */
+		if (m2md_get_type(linetok, &poll) != 0)
+			continue_print(ELW, "[%s:%d] invalid type %s, it must be +width "
+					"or -width with width in range [0,2000], or one of i16, "
+					"u16, i32, u32, i64, u64, f32, f64 with optional :abcd, "
+					":cdab, :badc or :dcba order", file, lineno, linetok);
 
 
 	/* ==================================================================
@@ -307,6 +457,19 @@ static int m2md_parse_poll_file
 
 		poll.func = value;
 
+		/* coils can be written in bulk, just like they are read */
+		if (poll.type == M2MD_PL_TYPE_RAW && poll.func != 1 &&
+				poll.func != 2 && poll.func != 5 && poll.func != 15 &&
+				poll.field_width > 2)
+			continue_print(ELW, "[%s:%d] field width out of range [0,2]",
+					file, lineno);
+
+		/* bits have no type, they are bits */
+		if (poll.type != M2MD_PL_TYPE_RAW && (poll.func == 1 ||
+				poll.func == 2 || poll.func == 5 || poll.func == 15))
+			continue_print(ELW, "[%s:%d] coils and discrete inputs cannot "
+					"have named type", file, lineno);
+
 
 	/* ==================================================================
 	                         __       ___            __
@@ -378,7 +541,43 @@ static int m2md_parse_poll_file
 			continue_print(ELW, "[%s:%d] topic %s is not valid mqtt topic",
 					file, lineno, linetok);
 
-		poll.topic = strdup(linetok);
+		/* poll list keeps its own copy of topic */
+		poll.topic = linetok;
+
+		/* deadband, heartbeat and encoding are optional, poll
+		 * without them publishes every sample, just like it
+		 * always did */
+		poll.deadband_mode = M2MD_PL_DEADBAND_NONE;
+		poll.deadband = 0;
+		poll.heartbeat = 0;
+		poll.encoding = M2MD_ENC_DEFAULT;
+
+		if ((linetok = strtok(NULL, ",")) != NULL &&
+				m2md_get_deadband(linetok, &poll) != 0)
+			continue_print(ELW, "[%s:%d] invalid deadband %s, it must be "
+					"any, number or number followed by %%",
+					file, lineno, linetok);
+
+		if (linetok != NULL && (linetok = strtok(NULL, ",")) != NULL)
+		{
+			if (m2md_get_number(linetok, &value) != 0 ||
+					value < 0 || INT_MAX < value)
+				continue_print(ELW, "[%s:%d] invalid heartbeat %s, it must "
+						"be seconds in range [0,%d]", file, lineno, linetok,
+						INT_MAX);
+
+			poll.heartbeat = value;
+		}
+
+		if (linetok != NULL && (linetok = strtok(NULL, ",")) != NULL)
+		{
+			if ((value = m2md_enc_parse(linetok)) < 0)
+				continue_print(ELW, "[%s:%d] invalid encoding %s, it must "
+						"be one of raw, text, json, cbor, binary",
+						file, lineno, linetok);
+
+			poll.encoding = value;
+		}
 
 
 	/* ==================================================================
@@ -388,11 +587,24 @@ static int m2md_parse_poll_file
 	                                 /_/
 	   ================================================================== */
 
+		/* write function makes command out of topic, whatever
+		 * is published there is written to register, poll time
+		 * means nothing to such line */
+		if (poll.func == 5 || poll.func == 6 ||
+				poll.func == 15 || poll.func == 16)
+		{
+			if (m2md_modbus_add_write(&poll, ip, port) != 0 ||
+					m2md_mqtt_add_cmd(&poll, ip, port) != 0)
+				el_print(ELW, "[%s:%d] cannot add command %s",
+						file, lineno, poll.topic);
+
+			continue;
+		}
+
 		/* all fields parsed, add new poll */
 		if (m2md_modbus_add_poll(&poll, ip, port) != 0)
 		{
 			el_print(ELW, "m2md_modbus_add_poll(%s:%d)", ip, port);
-			free(poll.topic);
 			continue;
 		}
 
@@ -515,6 +727,16 @@ int main
 	m2md_cfg_dump();
 	g_main_thread_t = pthread_self();
 
+	/* queue must be there before first server is
+	 * started, servers queue samples right away */
+	if (m2md_pub_init() != 0)
+		goto_perror(m2md_pub_init_error, ELF, "m2md_pub_init()");
+
+	/* spool as well, server may publish before
+	 * we get to connect to broker */
+	if (m2md_spool_init() != 0)
+		goto_perror(m2md_spool_init_error, ELF, "m2md_spool_init()");
+
 	if (m2md_modbus_init() != 0)
 		goto_perror(m2md_modbus_init_error, ELF, "m2md_modbus_init()");
 
@@ -529,6 +751,15 @@ int main
 		/* or maybe not...  */
 		goto_perror(m2md_mqtt_loop_start_error, ELF, "mosquitto_start_loop()");
 
+	/* mqtt is up, samples that servers queued can be
+	 * published now */
+	if (m2md_pub_start() != 0)
+		goto_perror(m2md_pub_start_error, ELF, "m2md_pub_start()");
+
+	/* and what has been spooled, can be replayed */
+	if (m2md_spool_start() != 0)
+		goto_perror(m2md_spool_start_error, ELF, "m2md_spool_start()");
+
 	/* all resources initialized, now start main loop */
 	el_print(ELN, "all resources initialized, starting main loop");
 
@@ -542,11 +773,30 @@ int main
 		/* go and poll what is to be polled, and sleep until
 		 * it is time to do next polling */
 		req = m2md_modbus_loop();
+
+		/* when server threads schedule polls on their own, we
+		 * may have nothing to do for a very long time, but logs
+		 * still need to be flushed once in a while */
+		if (req.tv_sec >= 60)
+		{
+			req.tv_sec = 60;
+			req.tv_nsec = 0;
+		}
+
 		nanosleep(&req, NULL);
 
 		now = time(NULL);
 		if (now - prev_flush >= 60 || g_flush_now)
 		{
+			/* print stats before flush, so they hit the
+			 * disk together with everything else */
+			if (now - prev_flush >= 60)
+			{
+				m2md_modbus_print_stats();
+				m2md_pub_print_stats();
+				m2md_spool_print_stats();
+			}
+
 			if (g_flush_now)
 				el_print(ELN, "flushing due to flush_now flag");
 
@@ -566,6 +816,14 @@ int main
 	 * Set ret to 0 to caller of the app know about that */
 	ret = 0;
 
+	/* spool thread and publishers use mqtt, they
+	 * must be stopped before it */
+	m2md_spool_stop();
+
+m2md_spool_start_error:
+	m2md_pub_stop();
+
+m2md_pub_start_error:
 m2md_mqtt_loop_start_error:
 	m2md_mqtt_cleanup();
 
@@ -574,6 +832,12 @@ m2md_parse_poll_file_error:
 	m2md_modbus_cleanup();
 
 m2md_modbus_init_error:
+	m2md_spool_cleanup();
+
+m2md_spool_init_error:
+	m2md_pub_cleanup();
+
+m2md_pub_init_error:
 	el_print(ELN, "goodbye %s world!", ret ? "cruel" : "beautiful");
 	el_cleanup();
 	return ret;
@@ -0,0 +1,560 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+         ------------------------------------------------------------
+        / mbtcp - minimal non-blocking modbus tcp client, it only    \
+        | knows how to frame read and write requests and parse       |
+        \ responses, all waiting is done by the caller               /
+         ------------------------------------------------------------
+   ==========================================================================
+          _               __            __         ____ _  __
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+
+   ========================================================================== */
+
+
+#include "mbtcp.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <modbus/modbus.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "decode.h"
+#include "macros.h"
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ==========================================================================
+    Reads big endian 16bit value from 'p'
+   ========================================================================== */
+static uint16_t m2md_mbtcp_get16
+(
+	const unsigned char  *p  /* where to read value from */
+)
+{
+	return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+
+/* ==========================================================================
+    Writes 'v' as big endian 16bit value into 'p'
+   ========================================================================== */
+static void m2md_mbtcp_put16
+(
+	unsigned char  *p,  /* where to write value */
+	unsigned        v   /* value to write */
+)
+{
+	p[0] = v >> 8 & 0xff;
+	p[1] = v & 0xff;
+}
+
+
+/* ==========================================================================
+                       __     __ _          ____
+        ____   __  __ / /_   / /(_)_____   / __/__  __ ____   _____ _____
+       / __ \ / / / // __ \ / // // ___/  / /_ / / / // __ \ / ___// ___/
+      / /_/ // /_/ // /_/ // // // /__   / __// /_/ // / / // /__ (__  )
+     / .___/ \__,_//_.___//_//_/ \___/  /_/   \__,_//_/ /_/ \___//____/
+    /_/
+   ==========================================================================
+    Initializes closed connection 'c'
+   ========================================================================== */
+void m2md_mbtcp_init
+(
+	struct m2md_mbtcp  *c  /* connection to initialize */
+)
+{
+	memset(c, 0x00, sizeof(*c));
+	c->fd = -1;
+	c->state = M2MD_MBTCP_CLOSED;
+}
+
+
+/* ==========================================================================
+    Starts connecting 'c' to 'ip':'port'. Socket is non-blocking, so
+    connection usually is not established right away, caller should wait
+    for socket to become writable and then call m2md_mbtcp_finish_connect().
+
+    Returns 0 when connection has been established right away, 1 when
+    connection is in progress, and -1 on error.
+   ========================================================================== */
+int m2md_mbtcp_connect
+(
+	struct m2md_mbtcp   *c,     /* connection to connect */
+	const char          *ip,    /* ip of the server */
+	int                  port   /* port of the server */
+)
+{
+	struct sockaddr_in   addr;  /* address of the server */
+	int                  flags; /* socket flags */
+	int                  one;   /* value for setsockopt() */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	m2md_mbtcp_close(c);
+
+	memset(&addr, 0x00, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	if (inet_pton(AF_INET, ip, &addr.sin_addr) != 1)
+		return_errno(EINVAL);
+
+	if ((c->fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		return -1;
+
+	flags = fcntl(c->fd, F_GETFL, 0);
+	if (flags < 0 || fcntl(c->fd, F_SETFL, flags | O_NONBLOCK) != 0)
+		goto error;
+
+	/* requests are tiny and already batched by us,
+	 * nagle would only delay them */
+	one = 1;
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	if (connect(c->fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+	{
+		/* that was quick, probably server is on localhost */
+		c->state = M2MD_MBTCP_CONNECTED;
+		return 0;
+	}
+
+	if (errno != EINPROGRESS)
+		goto error;
+
+	c->state = M2MD_MBTCP_CONNECTING;
+	return 1;
+
+error:
+	m2md_mbtcp_close(c);
+	return -1;
+}
+
+
+/* ==========================================================================
+    Checks whether connection started with m2md_mbtcp_connect() has been
+    established. Should be called once socket is writable.
+   ========================================================================== */
+int m2md_mbtcp_finish_connect
+(
+	struct m2md_mbtcp  *c     /* connection to check */
+)
+{
+	int                 err;  /* result of connect() */
+	socklen_t           len;  /* size of err */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	len = sizeof(err);
+	if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0)
+		return -1;
+
+	if (err != 0)
+		return_errno(err);
+
+	c->state = M2MD_MBTCP_CONNECTED;
+	return 0;
+}
+
+
+/* ==========================================================================
+    Closes connection 'c', it's safe to call it on closed connection. All
+    requests that were waiting for response are forgotten.
+   ========================================================================== */
+void m2md_mbtcp_close
+(
+	struct m2md_mbtcp  *c  /* connection to close */
+)
+{
+	if (c->fd >= 0)
+		close(c->fd);
+
+	c->fd = -1;
+	c->rxlen = 0;
+	c->txlen = 0;
+	c->nreqs = 0;
+	memset(c->reqs, 0x00, sizeof(c->reqs));
+	c->state = M2MD_MBTCP_CLOSED;
+}
+
+
+/* ==========================================================================
+    Takes free slot for request to unit 'uid' with function 'func' for
+    'count' registers, and writes mbap header of request at the end of
+    transmit buffer. Header length field covers unit id and 'pdulen'
+    bytes of pdu, which caller puts right after the header.
+
+    Returns slot of the request, or -1 on error.
+
+    errno:
+            ENOTCONN    connection is not established
+            EBUSY       there are already M2MD_MBTCP_WINDOW_MAX requests
+                        waiting for response
+            ENOBUFS     there is no room for request in transmit buffer
+   ========================================================================== */
+static int m2md_mbtcp_new_req
+(
+	struct m2md_mbtcp      *c,      /* connection to send request over */
+	int                     uid,    /* unit id */
+	int                     func,   /* modbus function of request */
+	int                     count,  /* number of registers in request */
+	size_t                  pdulen  /* size of pdu of request */
+)
+{
+	struct m2md_mbtcp_req  *req;    /* slot for request */
+	unsigned char          *frame;  /* request frame */
+	int                     slot;   /* free slot for request */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (c->state != M2MD_MBTCP_CONNECTED)
+		return_errno(ENOTCONN);
+
+	if (c->nreqs == M2MD_MBTCP_WINDOW_MAX)
+		return_errno(EBUSY);
+
+	if (c->txlen + 7 + pdulen > sizeof(c->tx))
+		return_errno(ENOBUFS);
+
+	for (slot = 0; c->reqs[slot].used; ++slot)
+		;
+
+	req = &c->reqs[slot];
+	req->used = 1;
+	req->tid = ++c->tid;
+	req->uid = uid;
+	req->func = func;
+	req->count = count;
+	c->nreqs++;
+
+	/* mbap header: transaction id, protocol id (always 0),
+	 * length of what follows and unit id, then pdu */
+	frame = c->tx + c->txlen;
+	m2md_mbtcp_put16(frame + 0, req->tid);
+	m2md_mbtcp_put16(frame + 2, 0);
+	m2md_mbtcp_put16(frame + 4, 1 + pdulen);
+	frame[6] = uid;
+	c->txlen += 7 + pdulen;
+
+	return slot;
+}
+
+
+/* ==========================================================================
+    Queues request to read 'count' registers starting from 'reg' with
+    function 'func' from unit 'uid'. Request is not sent right away, so
+    many requests can be sent with single write, call m2md_mbtcp_flush()
+    once all requests are queued. Response is then received with
+    m2md_mbtcp_recv().
+
+    Returns slot of the request, which will be reported back by
+    m2md_mbtcp_recv() once response arrives, or -1 on error.
+
+    errno:
+            ENOTCONN    connection is not established
+            EBUSY       there are already M2MD_MBTCP_WINDOW_MAX requests
+                        waiting for response
+   ========================================================================== */
+int m2md_mbtcp_send_read
+(
+	struct m2md_mbtcp      *c,      /* connection to send request over */
+	int                     uid,    /* unit id */
+	int                     func,   /* modbus function to read with */
+	int                     reg,    /* first register to read */
+	int                     count   /* number of registers to read */
+)
+{
+	unsigned char          *pdu;    /* pdu of request frame */
+	int                     slot;   /* slot of request */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	/* there is always space in tx for read
+	 * request of every slot in window */
+	if ((slot = m2md_mbtcp_new_req(c, uid, func, count, 5)) < 0)
+		return -1;
+
+	pdu = c->tx + c->txlen - 5;
+	pdu[0] = func;
+	m2md_mbtcp_put16(pdu + 1, reg);
+	m2md_mbtcp_put16(pdu + 3, count);
+
+	return slot;
+}
+
+
+/* ==========================================================================
+    Queues request to write 'count' registers starting from 'reg' with
+    function 'func' to unit 'uid'. Registers are taken from 'values', for
+    coils they are packed 16 in each word, first coil in lowest bit of
+    first word, same as m2md_mbtcp_recv() stores read bits. Single write
+    functions (5 and 6) take 'count' of 1.
+
+    Write request can be much bigger than read request, and transmit
+    buffer has room for only one such request on top of read requests,
+    so it may not fit when another write is still waiting to be sent.
+
+    Returns slot of the request, or -1 on error, just like
+    m2md_mbtcp_send_read() does.
+
+    errno:
+            ENOTCONN    connection is not established
+            EBUSY       there are already M2MD_MBTCP_WINDOW_MAX requests
+                        waiting for response
+            ENOBUFS     there is no room for request in transmit buffer
+            EINVAL      'func' is not write function
+   ========================================================================== */
+int m2md_mbtcp_send_write
+(
+	struct m2md_mbtcp  *c,       /* connection to send request over */
+	int                 uid,     /* unit id */
+	int                 func,    /* modbus function to write with */
+	int                 reg,     /* first register to write */
+	int                 count,   /* number of registers to write */
+	const uint16_t     *values   /* values to write */
+)
+{
+	unsigned char      *pdu;     /* pdu of request frame */
+	size_t              nbytes;  /* size of values in frame */
+	int                 slot;    /* slot of request */
+	int                 i;       /* iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	switch (func)
+	{
+	case 5:
+	case 6:
+		/* single write is register and value, same
+		 * size as read request */
+		if ((slot = m2md_mbtcp_new_req(c, uid, func, 1, 5)) < 0)
+			return -1;
+
+		pdu = c->tx + c->txlen - 5;
+		pdu[0] = func;
+		m2md_mbtcp_put16(pdu + 1, reg);
+
+		/* coil is switched on with 0xff00, anything else
+		 * is not 0 but invalid value */
+		if (func == 5)
+			m2md_mbtcp_put16(pdu + 3, values[0] & 1 ? 0xff00 : 0x0000);
+		else
+			m2md_mbtcp_put16(pdu + 3, values[0]);
+
+		return slot;
+
+	case 15:
+	case 16:
+		nbytes = func == 15 ? (count + 7) / 8 : count * 2;
+		if ((slot = m2md_mbtcp_new_req(c, uid, func, count,
+						6 + nbytes)) < 0)
+			return -1;
+
+		pdu = c->tx + c->txlen - 6 - nbytes;
+		pdu[0] = func;
+		m2md_mbtcp_put16(pdu + 1, reg);
+		m2md_mbtcp_put16(pdu + 3, count);
+		pdu[5] = nbytes;
+
+		/* bits go 8 in byte, first bit in lowest bit, so
+		 * each word is simply split into two bytes */
+		if (func == 15)
+			for (i = 0; i != (int)nbytes; ++i)
+				pdu[6 + i] = values[i / 2] >> (i & 1) * 8 & 0xff;
+		else
+			for (i = 0; i != count; ++i)
+				m2md_mbtcp_put16(pdu + 6 + i * 2, values[i]);
+
+		return slot;
+
+	default:
+		return_errno(EINVAL);
+	}
+}
+
+
+/* ==========================================================================
+    Sends all requests queued with m2md_mbtcp_send_read() with single
+    write. When socket cannot take them all, rest is kept and caller
+    should call this again, once socket is writable.
+
+    Returns 0 when everything has been sent, 1 when some data is still
+    waiting to be sent and -1 on error.
+   ========================================================================== */
+int m2md_mbtcp_flush
+(
+	struct m2md_mbtcp  *c  /* connection to flush */
+)
+{
+	ssize_t             w;  /* bytes written */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (c->txlen == 0)
+		return 0;
+
+	w = send(c->fd, c->tx, c->txlen, MSG_NOSIGNAL);
+	if (w < 0)
+		return errno == EAGAIN || errno == EWOULDBLOCK ? 1 : -1;
+
+	memmove(c->tx, c->tx + w, c->txlen - w);
+	c->txlen -= w;
+	return c->txlen != 0;
+}
+
+
+/* ==========================================================================
+    Takes first frame out of receive buffer of 'c', if whole frame is
+    already there. Return values are same as for m2md_mbtcp_recv().
+   ========================================================================== */
+static int m2md_mbtcp_parse
+(
+	struct m2md_mbtcp      *c,      /* connection to parse frame from */
+	uint16_t               *regs,   /* received registers will go here */
+	int                    *slot    /* slot of request response is for */
+)
+{
+	struct m2md_mbtcp_req  *req;    /* request response is for */
+	unsigned char          *pdu;    /* pdu part of the frame */
+	size_t                  total;  /* size of whole frame */
+	uint16_t                tid;    /* transaction id of response */
+	int                     ret;    /* return code */
+	int                     i;      /* iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (c->rxlen < 7)
+		return 1; /* don't know size of frame without header */
+
+	/* length field in mbap header covers unit id and pdu,
+	 * and pdu is at least function code and one byte */
+	total = 6 + m2md_mbtcp_get16(c->rx + 4);
+	if (total < 9 || total > M2MD_MBTCP_ADU_MAX)
+		return_errno(EPROTO);
+
+	if (c->rxlen < total)
+		return 1; /* frame is not complete yet */
+
+	/* window is small, simply look through it */
+	tid = m2md_mbtcp_get16(c->rx + 0);
+	for (i = 0; i != M2MD_MBTCP_WINDOW_MAX; ++i)
+		if (c->reqs[i].used && c->reqs[i].tid == tid)
+			break;
+
+	if (i == M2MD_MBTCP_WINDOW_MAX || m2md_mbtcp_get16(c->rx + 2) != 0 ||
+			c->rx[6] != c->reqs[i].uid)
+		/* response to something we didn't ask for */
+		return_errno(EPROTO);
+
+	req = &c->reqs[i];
+	req->used = 0;
+	c->nreqs--;
+	*slot = i;
+	pdu = c->rx + 7;
+	ret = 0;
+
+	if (pdu[0] == (req->func | 0x80))
+	{
+		/* server did not like our request */
+		errno = MODBUS_ENOBASE + pdu[1];
+		ret = -1;
+	}
+	else if (req->func == 5 || req->func == 6 ||
+			req->func == 15 || req->func == 16)
+	{
+		/* write is confirmed with echo of register and value,
+		 * or register and count, nothing to store */
+		if (pdu[0] != req->func || total != 12)
+			return_errno(EPROTO);
+	}
+	else if (req->func == 1 || req->func == 2)
+	{
+		/* bits are packed 8 in byte, first bit in lowest bit of
+		 * first byte. We pack them further 16 in word */
+		if (pdu[0] != req->func || pdu[1] != (req->count + 7) / 8 ||
+				total != 9 + (size_t)pdu[1])
+			return_errno(EPROTO);
+
+		m2md_decode_pack_bytes(pdu + 2, pdu[1], regs);
+	}
+	else
+	{
+		if (pdu[0] != req->func || pdu[1] != req->count * 2 ||
+				total != 9 + (size_t)req->count * 2)
+			return_errno(EPROTO);
+
+		for (i = 0; i != req->count; ++i)
+			regs[i] = m2md_mbtcp_get16(pdu + 2 + i * 2);
+	}
+
+	/* frame is consumed, next one may be already there */
+	c->rxlen -= total;
+	memmove(c->rx, c->rx + total, c->rxlen);
+	return ret;
+}
+
+
+/* ==========================================================================
+    Receives whatever has arrived on connection 'c', and once whole
+    response to any of requests sent with m2md_mbtcp_send_read() is
+    received, registers are stored in 'regs' in host endianess, and slot
+    of request is stored in 'slot'. Response to request sent with
+    m2md_mbtcp_send_write() only sets 'slot'. Coils and discrete inputs are stored
+    packed, 16 in each word, first bit in lowest bit of first word.
+
+    Single read from socket can bring many responses, so caller should
+    call this function until it returns 1, or it could miss responses
+    that are already received.
+
+    Returns 0 when response has been received, 1 when more data is
+    needed and -1 on error. When server responded with exception, errno
+    is set to MODBUS_ENOBASE + exception code, just like libmodbus does,
+    'slot' is set and connection is still usable in that case.
+
+    errno:
+            ECONNRESET  server closed connection
+            EPROTO      received frame is invalid
+            EMBX*       server responded with exception
+   ========================================================================== */
+int m2md_mbtcp_recv
+(
+	struct m2md_mbtcp  *c,      /* connection to receive from */
+	uint16_t           *regs,   /* received registers will go here */
+	int                *slot    /* slot of request response is for */
+)
+{
+	ssize_t             r;      /* bytes read */
+	int                 ret;    /* return code */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	/* first take care of what we already have */
+	if ((ret = m2md_mbtcp_parse(c, regs, slot)) != 1)
+		return ret;
+
+	r = recv(c->fd, c->rx + c->rxlen, sizeof(c->rx) - c->rxlen, 0);
+	if (r == 0)
+		return_errno(ECONNRESET);
+
+	if (r < 0)
+		return errno == EAGAIN || errno == EWOULDBLOCK ? 1 : -1;
+
+	c->rxlen += r;
+	return m2md_mbtcp_parse(c, regs, slot);
+}
@@ -0,0 +1,71 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ========================================================================== */
+
+#ifndef M2MD_MBTCP_H
+#define M2MD_MBTCP_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/* max size of modbus tcp frame, 7 bytes of mbap header and 253 of pdu */
+#define M2MD_MBTCP_ADU_MAX 260
+
+/* size of read request frame */
+#define M2MD_MBTCP_REQ_SIZE 12
+
+/* max number of requests that can wait for response at once */
+#define M2MD_MBTCP_WINDOW_MAX 64
+
+/* size of transmit buffer, it holds read request for every slot in
+ * window, and one write request of the biggest size on top of that */
+#define M2MD_MBTCP_TX_SIZE \
+	(M2MD_MBTCP_WINDOW_MAX * M2MD_MBTCP_REQ_SIZE + M2MD_MBTCP_ADU_MAX)
+
+enum m2md_mbtcp_state
+{
+	M2MD_MBTCP_CLOSED,      /* there is no connection */
+	M2MD_MBTCP_CONNECTING,  /* connect() in progress */
+	M2MD_MBTCP_CONNECTED    /* connection established */
+};
+
+/* request that waits for response */
+struct m2md_mbtcp_req
+{
+	int            used;     /* slot holds request waiting for response */
+	uint16_t       tid;      /* transaction id of request */
+	int            uid;      /* unit id of request */
+	int            func;     /* function of request */
+	int            count;    /* number of registers requested */
+};
+
+/* single non-blocking modbus tcp connection. Many requests can be sent
+ * without waiting for responses, responses are matched with requests
+ * by transaction id, so they may come in any order */
+struct m2md_mbtcp
+{
+	int            fd;       /* connection socket, -1 when closed */
+	int            state;    /* one of m2md_mbtcp_state */
+	uint16_t       tid;      /* transaction id of last request */
+	struct m2md_mbtcp_req  reqs[M2MD_MBTCP_WINDOW_MAX];  /* sent requests */
+	int            nreqs;    /* requests waiting for response */
+	unsigned char  rx[2 * M2MD_MBTCP_ADU_MAX];  /* received frames */
+	size_t         rxlen;    /* bytes received so far */
+	unsigned char  tx[M2MD_MBTCP_TX_SIZE];  /* requests to send */
+	size_t         txlen;    /* bytes queued, but not yet sent */
+};
+
+void m2md_mbtcp_init(struct m2md_mbtcp *c);
+int m2md_mbtcp_connect(struct m2md_mbtcp *c, const char *ip, int port);
+int m2md_mbtcp_finish_connect(struct m2md_mbtcp *c);
+void m2md_mbtcp_close(struct m2md_mbtcp *c);
+int m2md_mbtcp_send_read(struct m2md_mbtcp *c, int uid, int func,
+		int reg, int count);
+int m2md_mbtcp_send_write(struct m2md_mbtcp *c, int uid, int func,
+		int reg, int count, const uint16_t *values);
+int m2md_mbtcp_flush(struct m2md_mbtcp *c);
+int m2md_mbtcp_recv(struct m2md_mbtcp *c, uint16_t *regs, int *slot);
+
+#endif
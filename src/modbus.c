@@ -20,12 +20,26 @@
 #include <modbus/modbus.h>
 #include <unistd.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
+#include "breaker.h"
 #include "cfg.h"
+#include "decode.h"
+#include "encode.h"
+#include "mbtcp.h"
 #include "reg2topic-map.h"
+#include "rtu.h"
 #include "poll-list.h"
+#include "publisher.h"
+#include "scheduler.h"
 #include "mqtt.h"
 #include "macros.h"
 
@@ -40,9 +54,78 @@
    ========================================================================== */
 
 
-static struct m2md_server servers[M2MD_SERVERS_MAX];
+/* table with all servers ever created. Servers are allocated one by
+ * one, so they never move in memory when table grows - threads and
+ * schedulers keep pointers to them. Hash index maps ip and port into
+ * position of server in table. Servers are never removed from table,
+ * server which thread has finished is reused when poll for the same
+ * ip and port is added again */
+static struct m2md_servers
+{
+	struct m2md_server  **servers;  /* all servers ever created */
+	size_t                n;        /* number of servers in table */
+	size_t                size;     /* number of servers table can hold */
+	size_t               *index;    /* hash of servers, 0 - empty slot */
+	unsigned              bits;     /* index has 1 << bits slots */
+}
+g_servers;
+
+/* protects g_servers table, it is never held together with any
+ * other lock */
+static pthread_mutex_t g_servers_lock = PTHREAD_MUTEX_INITIALIZER;
 extern pthread_t g_main_thread_t;
 
+/* all servers that have any poll, ordered by time of their earliest
+ * poll. Thanks to that, main loop does not need to look at servers
+ * (and polls) that are not yet due. Lock order is: first
+ * g_servers_sched_lock, then server->lock */
+static struct m2md_sched g_servers_sched;
+static pthread_mutex_t g_servers_sched_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* servers with batch waiting to be published, ordered by time when
+ * batch window ends. Main loop publishes batches that nobody else
+ * has published in time. Lock order is: server->lock, then
+ * g_batch_lock, and g_batch_lock is never held when server->lock is
+ * taken */
+static struct m2md_sched g_batch_sched;
+static pthread_mutex_t g_batch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* fractional part of golden ratio, used to spread reads in time */
+#define M2MD_MODBUS_GOLDEN_RATIO 0.6180339887498949
+
+/* starting point of stagger sequence for next new server */
+static double g_servers_phase;
+
+/* time when stats were last printed */
+static struct timespec g_stats_last;
+
+/* how long to wait for connection to be established, in seconds,
+ * response timeout is calculated for each server from its rtt */
+#define M2MD_MODBUS_CONNECT_TIMEOUT 2
+
+/* epoll engine, single thread that talks with many servers over
+ * non-blocking sockets. Servers are ordered in engine's scheduler by
+ * time of their next event, which is either earliest block, or timeout
+ * of what server is doing right now. Scheduler is only ever touched by
+ * engine thread, so other threads that change polls of the server only
+ * put that server on pending list and wake engine up via eventfd. Lock
+ * order is: server->lock, then engine->lock */
+struct m2md_engine
+{
+	int                  epfd;     /* epoll instance */
+	int                  evfd;     /* eventfd to wake engine up */
+	struct m2md_sched    sched;    /* servers ordered by next event */
+	struct m2md_server  *pending;  /* servers which polls changed */
+	pthread_mutex_t      lock;     /* protects pending list */
+	pthread_t            thandle;  /* engine thread handle */
+};
+
+static struct m2md_engine  *g_engines;
+static int                  g_engines_n;
+
+/* engine that will get next new server */
+static int                  g_engines_next;
+
 
 /* ==========================================================================
                   _                __           ____
@@ -52,78 +135,261 @@ extern pthread_t g_main_thread_t;
  / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
 /_/
    ==========================================================================
-    Calculates diff between t1 - t2
+    Opens circuit breaker of the 'server', which is considered dead from
+    now on. Nothing will be sent to it until breaker timeout expires, and
+    then only single probe. Each next open makes server wait two times
+    longer, up to configured limit.
+
+    server->lock must be held.
+   ========================================================================== */
+static void m2md_modbus_breaker_open
+(
+	struct m2md_server  *server,  /* server to cut off */
+	struct timespec      now      /* current absolute time */
+)
+{
+	el_print(ELW, "modbus server %s:%d is down, next probe in %d seconds",
+			server->ip, server->port, server->breaker.wait);
+
+	m2md_breaker_open(&server->breaker, now);
+}
+
+
+/* ==========================================================================
+    Closes circuit breaker of the 'server', after probe has shown server
+    is alive again.
+
+    Reads that were due while server was down have not been missed
+    because we were late, there simply was no one to read from, so we
+    don't try to make up for them. Each block is moved to its latest
+    deadline, so it's read once right away, instead of bursting all
+    missed reads at freshly recovered server.
+
+    server->lock must be held.
    ========================================================================== */
-static struct timespec m2md_modbus_subtract_timespec
+static void m2md_modbus_breaker_close
 (
-	struct timespec   t1,   /* time to subtract from */
-	struct timespec   t2    /* time to subtract */
+	struct m2md_server    *server,  /* server that is alive again */
+	struct timespec        now      /* current absolute time */
 )
 {
-	struct timespec   res;  /* subtract result */
+	struct m2md_rp_block  *block;   /* current block */
+	size_t                 i;       /* iterator */
 	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
 
-	res.tv_sec = t1.tv_sec - t2.tv_sec;
-	res.tv_nsec = t1.tv_nsec - t2.tv_nsec;
+	el_print(ELN, "modbus server %s:%d is up", server->ip, server->port);
+
+	m2md_breaker_close(&server->breaker);
 
-	if (res.tv_nsec < 0)
+	for (i = 0; i != server->plan.nblocks; ++i)
 	{
-		res.tv_sec -= 1;
-		res.tv_nsec += 1000000000l;
+		block = &server->plan.blocks[i];
+
+		if (m2md_timing_resume(&block->sched.deadline, block->poll_time,
+					now, &server->stats.timing) &&
+				block->sched.idx != M2MD_SCHED_NOT_QUEUED)
+			m2md_sched_update(&server->sched, &block->sched);
 	}
+}
+
+
+/* ==========================================================================
+    Moves timer of 'block' that has just expired to the time of its next
+    read, according to configured timing, and records how late 'now' the
+    block is read, compared to its deadline.
 
-	return res;
+    server->lock must be held.
+   ========================================================================== */
+static void m2md_modbus_server_next_read
+(
+	struct m2md_server    *server,    /* server block belongs to */
+	struct m2md_rp_block  *block,     /* block that has expired */
+	struct timespec        now        /* current absolute time */
+)
+{
+	m2md_timing_next(&block->sched.deadline, block->poll_time, now,
+			m2md_cfg->modbus_timing, m2md_cfg->modbus_catch_up,
+			&server->stats.timing);
 }
 
 
 /* ==========================================================================
-    Finds server in 'servers' object with specified 'ip' and 'port'. Returns
-    index to found server or -1 when modbus server doesn't exist with given
-    'ip' and/or 'port'.
+    Returns slot in servers index where server with 'ip' and 'port' should
+    be looked for first. fnv-1a hash is used.
    ========================================================================== */
-static int m2md_modbus_server_find
+static size_t m2md_modbus_server_hash
 (
-	const char  *ip,   /* ip address of server */
-	int          port  /* port server listens on */
+	const char     *ip,    /* ip address of server */
+	int             port   /* port server listens on */
 )
 {
-	int          i;
+	unsigned long   hash;  /* calculated hash */
 	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
 
-	for (i = 0; i != M2MD_SERVERS_MAX; ++i)
-	{
-		if (servers[i].modbus == NULL)
-			continue; /* empty slot, nothing to look for here */
+	hash = 2166136261UL;
+	for (; *ip != '\0'; ++ip)
+		hash = ((hash ^ (unsigned char)*ip) * 16777619UL) & 0xffffffffUL;
 
-		if (strcmp(servers[i].ip, ip) == 0 && servers[i].port == port)
+	hash = ((hash ^ (port & 0xff)) * 16777619UL) & 0xffffffffUL;
+	hash = ((hash ^ (port >> 8 & 0xff)) * 16777619UL) & 0xffffffffUL;
+
+	return (size_t)(hash & (((size_t)1 << g_servers.bits) - 1));
+}
+
+
+/* ==========================================================================
+    Finds slot in servers index that holds server with 'ip' and 'port'. If
+    there is no such server, empty slot, where server should be put, is
+    returned.
+
+    g_servers_lock must be held.
+   ========================================================================== */
+static size_t m2md_modbus_server_slot
+(
+	const char           *ip,      /* ip address of server */
+	int                   port     /* port server listens on */
+)
+{
+	struct m2md_server   *server;  /* server in current slot */
+	size_t                mask;    /* mask to wrap slot around index */
+	size_t                i;       /* current slot */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	mask = ((size_t)1 << g_servers.bits) - 1;
+	for (i = m2md_modbus_server_hash(ip, port); g_servers.index[i] != 0;
+			i = (i + 1) & mask)
+	{
+		server = g_servers.servers[g_servers.index[i] - 1];
+		if (server->port == port && strcmp(server->ip, ip) == 0)
 			return i; /* that's the one!  */
 	}
 
-	/* no servers with given ip and port in the array */
-	return -1;
+	return i;
 }
 
 
 /* ==========================================================================
-    Finds free slot in server array.
+    Finds server with specified 'ip' and 'port' in servers table. Returns
+    found server, even when its thread is not running anymore, or NULL
+    when there was never server with given 'ip' and/or 'port'.
+
+    g_servers_lock must be held.
    ========================================================================== */
-static int m2md_modbus_server_find_free
+static struct m2md_server *m2md_modbus_server_lookup
 (
-	void
+	const char  *ip,   /* ip address of server */
+	int          port  /* port server listens on */
 )
 {
-	int   i;      /* iterator */
+	size_t       i;    /* position of server in table */
 	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
 
-	for (i = 0; i != M2MD_SERVERS_MAX; ++i)
-		if (servers[i].modbus == NULL)
-			return i; /* this slot is empty */
+	if (g_servers.index == NULL)
+		return NULL; /* no servers at all yet */
 
-	/* we iterated through all servers and none of them are free */
-	return -1;
+	if ((i = g_servers.index[m2md_modbus_server_slot(ip, port)]) == 0)
+		return NULL; /* no servers with given ip and port in table */
+
+	return g_servers.servers[i - 1];
+}
+
+
+/* ==========================================================================
+    Finds running server with specified 'ip' and 'port'. Returns NULL when
+    there is no such server.
+   ========================================================================== */
+static struct m2md_server *m2md_modbus_server_find
+(
+	const char          *ip,      /* ip address of server */
+	int                  port     /* port server listens on */
+)
+{
+	struct m2md_server  *server;  /* found server */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	pthread_mutex_lock(&g_servers_lock);
+	server = m2md_modbus_server_lookup(ip, port);
+	pthread_mutex_unlock(&g_servers_lock);
+
+	if (server == NULL || !server->running)
+		return NULL; /* server does not exist or is not running */
+
+	return server;
+}
+
+
+/* ==========================================================================
+    Returns server object for new server with 'ip' and 'port'. If server
+    existed before and its thread has finished, old object is returned,
+    otherwise new one is allocated and added to servers table. Table and
+    its index grow two times each time they are full.
+
+    errno:
+            ENOMEM      not enough memory for new server
+   ========================================================================== */
+static struct m2md_server *m2md_modbus_server_new
+(
+	const char           *ip,       /* ip address of server */
+	int                   port      /* port server listens on */
+)
+{
+	struct m2md_server   *server;   /* new server */
+	struct m2md_server  **servers;  /* reallocated servers table */
+	size_t               *index;    /* new servers index */
+	size_t                i;        /* iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	pthread_mutex_lock(&g_servers_lock);
+
+	if ((server = m2md_modbus_server_lookup(ip, port)) != NULL)
+		goto end; /* server already has its object */
+
+	if (g_servers.n == g_servers.size)
+	{
+		servers = realloc(g_servers.servers,
+				(g_servers.size ? g_servers.size * 2 : 16) * sizeof(*servers));
+		if (servers == NULL)
+			goto end;
+
+		g_servers.servers = servers;
+		g_servers.size = g_servers.size ? g_servers.size * 2 : 16;
+	}
+
+	if ((g_servers.n + 1) * 2 > (size_t)1 << g_servers.bits)
+	{
+		/* index is getting too crowded, make it bigger, and
+		 * put all servers in their new slots */
+		if ((index = calloc((size_t)1 << (g_servers.bits + 1),
+						sizeof(*index))) == NULL)
+			goto end;
+
+		free(g_servers.index);
+		g_servers.index = index;
+		g_servers.bits++;
+
+		for (i = 0; i != g_servers.n; ++i)
+			g_servers.index[m2md_modbus_server_slot(g_servers.servers[i]->ip,
+					g_servers.servers[i]->port)] = i + 1;
+	}
+
+	if ((server = calloc(1, sizeof(*server))) == NULL)
+		goto end;
+
+	strcpy(server->ip, ip);
+	server->port = port;
+
+	g_servers.servers[g_servers.n++] = server;
+	g_servers.index[m2md_modbus_server_slot(ip, port)] = g_servers.n;
+
+end:
+	pthread_mutex_unlock(&g_servers_lock);
+	return server;
 }
 
 
@@ -162,188 +428,3257 @@ static int m2md_modbus_server_reconnect
 		 * this will ever happen */
 		el_print(ELF, "interesting, look me up in the code!");
 	}
-}
+}
+
+
+/* ==========================================================================
+    Updates position of 'server' in servers scheduler, so it's in line
+    with server's earliest block. If server has no polls, it is removed
+    from the scheduler, so main loop does not waste time on it. Server
+    with changed polls is scheduled immediately, so main loop can rebuild
+    its read plan.
+
+    Server with open circuit breaker is scheduled on breaker timeout, no
+    matter what its blocks say, so main loop does not look at it until it
+    is time to probe it. That's also true for server without polls, that
+    has something to write. Server with probe on its way is not scheduled
+    at all, its thread will reschedule it once probe is done.
+
+    When servers schedule reads on their own, servers scheduler is not
+    used at all, server threads are only woken up so they can take a look
+    at new polls. Same goes for epoll engine, server is put on engine's
+    pending list and engine takes it from there.
+
+    Both g_servers_sched_lock and server->lock must be held.
+   ========================================================================== */
+static int m2md_modbus_server_reschedule
+(
+	struct m2md_server      *server  /* server to reschedule */
+)
+{
+	struct m2md_sched_node  *first;  /* server's earliest block */
+	struct m2md_engine      *engine; /* engine handling the server */
+	uint64_t                 one;    /* value to write to eventfd */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (server->engine != NULL)
+	{
+		engine = server->engine;
+		pthread_mutex_lock(&engine->lock);
+		if (!server->pending)
+		{
+			server->pending = 1;
+			server->pending_next = engine->pending;
+			engine->pending = server;
+		}
+		pthread_mutex_unlock(&engine->lock);
+
+		/* eventfd only fails when counter overflows, and
+		 * then engine has plenty of wake ups waiting */
+		one = 1;
+		if (write(engine->evfd, &one, sizeof(one)) != sizeof(one) &&
+				errno != EAGAIN)
+			return -1;
+
+		return 0;
+	}
+
+	if (m2md_cfg->modbus_sched == M2MD_MODBUS_SCHED_SERVER)
+	{
+		/* threads may be sleeping for a long time waiting
+		 * for earliest block, and new poll may need to be
+		 * read much sooner than that */
+		pthread_cond_broadcast(&server->wake);
+		return 0;
+	}
+
+	first = m2md_sched_peek(&server->sched);
+	if (server->breaker.state == M2MD_BREAKER_HALF_OPEN ||
+			(first == NULL && !server->plan_dirty &&
+			 (server->writes.nwrites == 0 ||
+			  server->breaker.state == M2MD_BREAKER_CLOSED)))
+	{
+		/* no more polls for this server, or we are waiting
+		 * for result of probe, nothing to schedule. Writes
+		 * of working server are taken by its threads, main
+		 * loop has nothing to do with them */
+		if (server->next_poll.idx != M2MD_SCHED_NOT_QUEUED)
+			m2md_sched_delete(&g_servers_sched, &server->next_poll);
+
+		return 0;
+	}
+
+	if (server->breaker.state == M2MD_BREAKER_OPEN)
+		server->next_poll.deadline = server->breaker.until;
+	else if (server->plan_dirty)
+	{
+		server->next_poll.deadline.tv_sec = 0;
+		server->next_poll.deadline.tv_nsec = 0;
+	}
+	else
+		server->next_poll.deadline = first->deadline;
+
+	if (server->next_poll.idx == M2MD_SCHED_NOT_QUEUED)
+		return m2md_sched_add(&g_servers_sched, &server->next_poll);
+
+	return m2md_sched_update(&g_servers_sched, &server->next_poll);
+}
+
+
+/* ==========================================================================
+    Places first read of 'block' somewhere within its poll time, instead
+    of reading it right away. If all blocks with same poll time were read
+    at once, they would be read at once forever, flooding queues and
+    network with bursts of requests, and doing nothing in between.
+
+    Offsets come from golden ratio sequence - each next offset lands in
+    the biggest gap left by the previous ones, so no matter how many
+    blocks are placed, they are always spread evenly across the period.
+    Each server starts its sequence at different point, so blocks of
+    different servers don't land at the same offsets.
+
+    server->lock must be held.
+   ========================================================================== */
+static void m2md_modbus_server_stagger
+(
+	struct m2md_server    *server,  /* server block belongs to */
+	struct m2md_rp_block  *block,   /* block to place */
+	struct timespec        now      /* current absolute time */
+)
+{
+	int64_t                offset;  /* offset of first read */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	server->phase += M2MD_MODBUS_GOLDEN_RATIO;
+	if (server->phase >= 1.0)
+		server->phase -= 1.0;
+
+	offset = server->phase * m2md_timing_ns(block->poll_time);
+	block->sched.deadline = m2md_timing_add(now,
+			m2md_timing_ts(offset));
+}
+
+
+/* ==========================================================================
+    Rebuilds read plan of the 'server' after its polls have changed, and
+    schedules new blocks in place of old ones. Building plan is not cheap,
+    so it's done only once per loop, no matter how many polls have been
+    added or removed in the meantime.
+
+    server->lock must be held.
+   ========================================================================== */
+static void m2md_modbus_server_replan
+(
+	struct m2md_server    *server  /* server to rebuild plan for */
+)
+{
+	struct m2md_rp_block  *block;  /* current block */
+	struct timespec        now;    /* current absolute time */
+	size_t                 i;      /* iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	server->plan_dirty = 0;
+
+	/* old blocks will be gone in a moment, scheduler
+	 * must not have any reference to them */
+	m2md_sched_clear(&server->sched);
+
+	if (m2md_rp_build(&server->plan, &server->polls,
+				m2md_cfg->modbus_max_gap, m2md_cfg->modbus_max_block) != 0)
+		/* old plan is left intact, so we will still be reading
+		 * old polls, new ones will be picked up when polls change
+		 * again and we have enough memory for new plan */
+		el_perror(ELE, "m2md_rp_build(%s:%d)", server->ip, server->port);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (i = 0; i != server->plan.nblocks; ++i)
+	{
+		block = &server->plan.blocks[i];
+
+		/* blocks with new polls have never been read, and
+		 * it's time to decide when they should be */
+		if (m2md_cfg->modbus_stagger && block->sched.deadline.tv_sec == 0 &&
+				block->sched.deadline.tv_nsec == 0)
+			m2md_modbus_server_stagger(server, block, now);
+
+		if (m2md_sched_add(&server->sched, &block->sched))
+			el_perror(ELE, "m2md_sched_add(%s:%d)", server->ip, server->port);
+	}
+
+	el_print(ELI, "read plan for %s:%d: %lu reads", server->ip, server->port,
+			(unsigned long)server->plan.nblocks);
+}
+
+
+/* ==========================================================================
+    Adds 'poll' to list of 'server' polls. Server will be scheduled for
+    immediate rebuild of its read plan, which will pick up new poll. Poll
+    list keeps full 'topic', exactly as poll is published on broker,
+    instead of poll's own one.
+   ========================================================================== */
+static int m2md_modbus_server_add_poll
+(
+	struct m2md_server         *server,  /* server to add poll to */
+	const struct m2md_pl_data  *poll,    /* poll to add */
+	const char                 *topic    /* full topic of poll */
+)
+{
+	struct m2md_pl_data         data;    /* poll with full topic */
+	size_t                      pi;      /* position of added poll */
+	size_t                      nnodes;  /* polls on list before add */
+	int                         ret;     /* return code from function */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	/* list copies topic into its arena, so it's
+	 * fine to point to caller's buffer here */
+	data = *poll;
+	data.topic = (char *)topic;
+
+	pthread_mutex_lock(&g_servers_sched_lock);
+	pthread_mutex_lock(&server->lock);
+
+	/* poll that is already on the list is only updated,
+	 * this is the only way to tell which one happened */
+	nnodes = server->polls.nnodes;
+	if ((ret = m2md_pl_add(&server->polls, &data)) == 0)
+	{
+		/* every new poll gets new topic id, so subscribers of
+		 * batches never mistake it for the old one. Poll that
+		 * was already there keeps its id */
+		pi = m2md_pl_find(&server->polls, poll);
+		if (server->polls.data[pi].id == 0)
+		{
+			server->polls.data[pi].id = ++server->ids;
+			server->index_dirty = 1;
+
+			/* queued samples outlive poll list's copy of topic,
+			 * so publisher gets its own. Poll without it is
+			 * simply published directly */
+			server->polls.data[pi].tid = M2MD_PUB_NO_TOPIC;
+			if (m2md_cfg->mqtt_publishers &&
+					(server->polls.data[pi].tid = m2md_pub_topic(topic)) ==
+					M2MD_PUB_NO_TOPIC)
+				el_perror(ELW, "m2md_pub_topic(%s)", topic);
+		}
+
+		server->plan_dirty = 1;
+		if ((ret = m2md_modbus_server_reschedule(server)) != 0 &&
+				server->polls.nnodes != nnodes)
+			/* server could not be scheduled, so poll would
+			 * never be read, no point to keep it on the list.
+			 * Poll that was there before this call stays, it's
+			 * been read until now, and will be again, once plan
+			 * gets rebuilt */
+			m2md_pl_delete(&server->polls, poll);
+	}
+
+	pthread_mutex_unlock(&server->lock);
+	pthread_mutex_unlock(&g_servers_sched_lock);
+	return ret;
+}
+
+
+/* ==========================================================================
+    Fills read request 'rd' with information needed to read 'block'.
+
+    server->lock must be held.
+   ========================================================================== */
+static void m2md_modbus_server_read_request
+(
+	struct m2md_server       *server,  /* server block belongs to */
+	struct m2md_rp_block     *block,   /* block to read */
+	struct m2md_server_read  *rd       /* request to fill */
+)
+{
+	rd->block = block;
+	rd->gen = server->plan.gen;
+	rd->func = block->func;
+	rd->uid = block->uid;
+	rd->reg = block->reg;
+	rd->count = block->count;
+}
+
+
+/* ==========================================================================
+    Sends request to 'server' thread to read 'block'.
+   ========================================================================== */
+static void m2md_modbus_server_send_block
+(
+	struct m2md_server     *server,        /* server to send block to */
+	struct m2md_rp_block   *block          /* block to send */
+)
+{
+	struct m2md_server_msg  msg;           /* msg to send to server */
+	static int              rb_send_fails; /* number of rb_send() fails */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	msg.cmd = M2MD_SERVER_MSG_POLL;
+	m2md_modbus_server_read_request(server, block, &msg.data.read);
+
+	if (rb_send(server->msgq, &msg, 1, MSG_DONTWAIT) != 1)
+	{
+		/* sending poll request failed, could be that
+		 * server dies and message queue is full, can't do
+		 * anything about that, and surely we won't be
+		 * waiting for situation to resolve itself, log
+		 * situation and move on like nothing had happened */
+
+		if (errno != EAGAIN || ++rb_send_fails < 3)
+			/* log error only if it is not EAGAIN or number
+			 * of consecutive fails is less than 3 - there
+			 * is no need to logs with same error over and
+			 * over again.  */
+			el_perror(ELW, "rb_send(), fail no: %d", rb_send_fails);
+
+		return;
+	}
+
+	/* if rb_send() was successful,
+	 * decrement rb_send_fails */
+
+	--rb_send_fails;
+	if (rb_send_fails == -1)
+		/* -1 means, we are very good and there were no
+		 * errors for long time, set rb_send_fails to 0,
+		 * so next successfull rb_send() will result in
+		 * rb_send_fails to become -1 once again.  */
+		rb_send_fails = 0;
+	else if (rb_send_fails == 0)
+		/* previous rb_send_fails was 1, so it means
+		 * there were errors and now we recovered from
+		 * them, log good information */
+		el_print(ELN, "rb_send() recovered");
+
+	/* rb_send_fails is bigger than 0, so there we
+	 * multiple rb_send() errors before, and now
+	 * rb_sed() seems to work again, but still, it
+	 * didn't make enough consecutive successfull calls
+	 * to consider it stable. Nothing to do in this
+	 * case, just wait for fix */
+}
+
+
+/* ==========================================================================
+    Takes writes from the front of 'server' write queue, that can be done
+    with single request, and fills 'rd' and 'values' with them, see
+    m2md_wq_take(). Single register or coil is written with single write
+    function, more of them with multiple write function, no matter which
+    function command was configured with.
+
+    Returns 1 when request has been filled, or 0 when queue is empty.
+
+    server->lock must be held.
+   ========================================================================== */
+static int m2md_modbus_server_take_write
+(
+	struct m2md_server       *server,  /* server to take writes of */
+	struct m2md_server_read  *rd,      /* request to fill */
+	uint16_t                 *values   /* values to write go here */
+)
+{
+	struct m2md_wq_write      w;       /* first write taken */
+	int                       n;       /* number of writes taken */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if ((n = m2md_wq_take(&server->writes, &w, values)) == 0)
+		return 0;
+
+	rd->block = NULL;
+	rd->gen = 0;
+	rd->uid = w.uid;
+	rd->reg = w.reg;
+	rd->count = n;
+
+	if (w.bits)
+		rd->func = n == 1 ? M2MD_MODBUS_FUNC_WRITE_COIL :
+			M2MD_MODBUS_FUNC_WRITE_MULTI_COIL;
+	else
+		rd->func = n == 1 ? M2MD_MODBUS_FUNC_WRITE_SINGLE_HOLD_REG :
+			M2MD_MODBUS_FUNC_WRITE_MULTI_HOLD_REG;
+
+	server->stats.writes++;
+	server->stats.written += n;
+	return 1;
+}
+
+
+/* ==========================================================================
+    Wakes up one of 'server' connection threads, so it takes whatever
+    waits in write queue. When message queue is full, there is no need
+    to, threads are busy with reads, and each takes writes before read.
+   ========================================================================== */
+static void m2md_modbus_server_kick_write
+(
+	struct m2md_server     *server  /* server to wake up */
+)
+{
+	struct m2md_server_msg  msg;    /* msg to send to server */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	msg.cmd = M2MD_SERVER_MSG_WRITE;
+	if (rb_send(server->msgq, &msg, 1, MSG_DONTWAIT) != 1 && errno != EAGAIN)
+		el_perror(ELW, "rb_send(%s:%d, write)", server->ip, server->port);
+}
+
+
+/* ==========================================================================
+    Connects 'conn' to its server. When connection fails, it's up to the
+    caller to decide when to try again.
+   ========================================================================== */
+static int m2md_modbus_conn_connect
+(
+	struct m2md_server_conn  *conn     /* connection to connect */
+)
+{
+	struct m2md_server       *server;  /* server to connect to */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	server = conn->server;
+
+	/* in case someone wants to reconnect
+	 * while still being connected */
+	modbus_close(conn->modbus);
+
+	el_print(ELN, "connecting to modbus %s:%d, conn %d",
+			server->ip, server->port, conn->id);
+
+	/* libmodbus waits for connection as long as it waits
+	 * for response, and rto may be way too short for that */
+	modbus_set_response_timeout(conn->modbus,
+			M2MD_MODBUS_CONNECT_TIMEOUT, 0);
+
+	if (modbus_connect(conn->modbus) == 0)
+	{
+		/* connection was a success, open the champagne!  */
+		el_print(ELN, "connected to modbus server %s:%d, conn %d",
+				server->ip, server->port, conn->id);
+		return 0;
+	}
+
+	el_print(ELW, "modbus_connect(%s:%d, conn %d) failed: %s", server->ip,
+			server->port, conn->id, modbus_strerror(errno));
+	return -1;
+}
+
+
+/* ==========================================================================
+    Returns 1 when 'func' reads bits (coils or discrete inputs) and not
+    registers.
+   ========================================================================== */
+static int m2md_modbus_func_bits
+(
+	int  func  /* modbus function to check */
+)
+{
+	return func == M2MD_MODBUS_FUNC_READ_COIL ||
+		func == M2MD_MODBUS_FUNC_READ_DISCRETE_INPUT;
+}
+
+
+/* ==========================================================================
+    Returns 1 when 'func' writes registers or coils.
+   ========================================================================== */
+static int m2md_modbus_func_write
+(
+	int  func  /* modbus function to check */
+)
+{
+	return func == M2MD_MODBUS_FUNC_WRITE_COIL ||
+		func == M2MD_MODBUS_FUNC_WRITE_MULTI_COIL ||
+		func == M2MD_MODBUS_FUNC_WRITE_SINGLE_HOLD_REG ||
+		func == M2MD_MODBUS_FUNC_WRITE_MULTI_HOLD_REG;
+}
+
+
+/* ==========================================================================
+    Returns 1 when 'err' tells that server responded with modbus
+    exception. libmodbus puts its own protocol errors (bad crc, bad
+    data, invalid slave and such) above MODBUS_ENOBASE too, but these
+    come after exceptions and say nothing good about the server, so
+    they are not exceptions here.
+   ========================================================================== */
+static int m2md_modbus_is_exception
+(
+	int  err  /* errno to check */
+)
+{
+	return err > MODBUS_ENOBASE &&
+		err < MODBUS_ENOBASE + MODBUS_EXCEPTION_MAX;
+}
+
+
+/* ==========================================================================
+    Reads registers requested by 'rd' over 'conn' into 'regs' with
+    libmodbus. Bits are stored packed, see m2md_decode_pack_bits(). When
+    'rd' is write request, registers (or packed bits) are written from
+    'regs' instead.
+   ========================================================================== */
+static int m2md_modbus_conn_read_regs
+(
+	struct m2md_server_conn        *conn,    /* connection to read over */
+	const struct m2md_server_read  *rd,      /* what to read */
+	uint16_t                       *regs     /* read registers go here */
+)
+{
+	int                             ret;     /* return code */
+	int                             max;     /* max items in single read */
+	uint8_t                         bits[MODBUS_MAX_READ_BITS];
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	max = m2md_modbus_func_bits(rd->func) ?
+		MODBUS_MAX_READ_BITS : MODBUS_MAX_READ_REGISTERS;
+	if (rd->count > max)
+		return_print(-1, EINVAL, ELW, "poll: too many registers to read %d",
+				rd->count);
+
+	/* set unit id */
+	if (modbus_set_slave(conn->modbus, rd->uid) != 0)
+		return_print(-1, EINVAL, ELW, "poll: invalid unit id set: %d",
+				rd->uid);
+
+	/* what function should we use to read bits?  */
+	switch (rd->func)
+	{
+	case M2MD_MODBUS_FUNC_READ_INPUT_REG:
+		ret = modbus_read_input_registers(conn->modbus,
+				rd->reg, rd->count, regs) != rd->count;
+		break;
+
+	case M2MD_MODBUS_FUNC_READ_MULTI_HOLD_REG:
+		ret = modbus_read_registers(conn->modbus,
+				rd->reg, rd->count, regs) != rd->count;
+		break;
+
+	case M2MD_MODBUS_FUNC_READ_COIL:
+		/* bits are packed only when they were read, or
+		 * they would take garbage from the stack */
+		if ((ret = modbus_read_bits(conn->modbus,
+				rd->reg, rd->count, bits) != rd->count) == 0)
+			m2md_decode_pack_bits(bits, rd->count, regs);
+		break;
+
+	case M2MD_MODBUS_FUNC_READ_DISCRETE_INPUT:
+		if ((ret = modbus_read_input_bits(conn->modbus,
+				rd->reg, rd->count, bits) != rd->count) == 0)
+			m2md_decode_pack_bits(bits, rd->count, regs);
+		break;
+
+	case M2MD_MODBUS_FUNC_WRITE_SINGLE_HOLD_REG:
+		ret = modbus_write_register(conn->modbus, rd->reg, regs[0]) != 1;
+		break;
+
+	case M2MD_MODBUS_FUNC_WRITE_MULTI_HOLD_REG:
+		ret = modbus_write_registers(conn->modbus,
+				rd->reg, rd->count, regs) != rd->count;
+		break;
+
+	case M2MD_MODBUS_FUNC_WRITE_COIL:
+		ret = modbus_write_bit(conn->modbus, rd->reg, regs[0] & 1) != 1;
+		break;
+
+	case M2MD_MODBUS_FUNC_WRITE_MULTI_COIL:
+		m2md_decode_unpack_bits(regs, rd->count, bits);
+		ret = modbus_write_bits(conn->modbus,
+				rd->reg, rd->count, bits) != rd->count;
+		break;
+
+	default:
+		return_print(-1, EINVAL, ELW, "poll: invalid modbus function passed %d",
+				rd->func);
+	}
+
+	/* server is fine, it just didn't like our request, it's up
+	 * to quarantine to decide whether that is worth logging */
+	if (ret != 0 && m2md_modbus_is_exception(errno))
+		return_print(-1, errno, ELD, "poll: modbus_%s_%d(%d, %d, %d): %s ",
+				m2md_modbus_func_write(rd->func) ? "write" : "read",
+				rd->func, rd->reg, rd->count, rd->uid,
+				modbus_strerror(errno));
+
+	/* message sent, but was it successfull?  */
+	if (ret != 0)
+		/* sadly not, problems with sending and receiving
+		 * data over modbustcp is usually due to connection
+		 * problem.  It may not be, but meh, who care
+		 * really. We don't reconnect here manually,
+		 * libmodbus shall do it for us since we have error
+		 * handling enabled.  */
+		return_print(-1, errno, ELE, "poll: modbus_%s_%d(%d, %d, %d): %s ",
+				m2md_modbus_func_write(rd->func) ? "write" : "read",
+				rd->func, rd->reg, rd->count, rd->uid,
+				modbus_strerror(errno));
+
+	return 0;
+}
+
+
+/* ==========================================================================
+    Reads registers requested by 'rd' over 'conn' into 'regs', or writes
+    them, when 'rd' is write request. On rtu bus, it also keeps line
+    silent between frames, and accounts for time line was busy.
+   ========================================================================== */
+static int m2md_modbus_conn_read
+(
+	struct m2md_server_conn        *conn,    /* connection to read over */
+	const struct m2md_server_read  *rd,      /* what to read */
+	uint16_t                       *regs     /* read registers go here */
+)
+{
+	struct m2md_server             *server;  /* server to read from */
+	struct timespec                 start;   /* when request was sent */
+	struct timespec                 end;     /* when response came */
+	struct timespec                 gap;     /* silence before frame */
+	int64_t                         wait;    /* silence left, ns */
+	int64_t                         took;    /* how long read took, ns */
+	int                             ret;     /* return code */
+	int                             err;     /* errno of read */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	server = conn->server;
+
+	if (server->rtu)
+	{
+		/* all units on rtu line are read by this thread, one by
+		 * one, back to back, but line must stay silent for a
+		 * moment between frames, or devices will take two frames
+		 * as one. Silence is counted as busy line, since nothing
+		 * else can use it in that time */
+		gap = m2md_timing_ts((int64_t)server->gap_us * 1000);
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		wait = m2md_timing_ns(m2md_timing_sub(
+					m2md_timing_add(server->rtu_last, gap), start));
+		if (wait > 0)
+		{
+			gap = m2md_timing_ts(wait);
+			nanosleep(&gap, NULL);
+		}
+	}
+
+	/* rto is shared by all connections of the server */
+	pthread_mutex_lock(&server->lock);
+	gap = m2md_timing_ts(server->rtt.rto);
+	pthread_mutex_unlock(&server->lock);
+	modbus_set_response_timeout(conn->modbus, gap.tv_sec,
+			gap.tv_nsec / 1000);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ret = m2md_modbus_conn_read_regs(conn, rd, regs);
+	err = errno;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	took = m2md_timing_ns(m2md_timing_sub(end, start));
+
+	pthread_mutex_lock(&server->lock);
+
+	/* exception is also a response, and tells
+	 * us as much about rtt as any other */
+	if (ret == 0 || m2md_modbus_is_exception(err))
+		m2md_timing_rtt_sample(&server->rtt, took);
+	else if (err == ETIMEDOUT)
+		m2md_timing_rtt_backoff(&server->rtt);
+
+	if (server->rtu)
+	{
+		server->rtu_last = end;
+		server->stats.busy_ns += took + (int64_t)server->gap_us * 1000;
+	}
+
+	pthread_mutex_unlock(&server->lock);
+
+	errno = err;
+	return ret;
+}
+
+
+/* ==========================================================================
+    Glues 'n' registers 'rval' into single raw value, most significant
+    byte first, putting bytes and words in place as 'order' says. Order
+    is always a constant in decoders below, so compiler drops the swaps
+    that are not needed and unrolls the loop.
+   ========================================================================== */
+static inline uint64_t m2md_modbus_gather
+(
+	const uint16_t  *rval,   /* registers to glue */
+	int              n,      /* number of registers in rval */
+	int              order   /* byte and word order, m2md_pl_order */
+)
+{
+	uint64_t         raw;    /* glued value */
+	uint16_t         w;      /* current word */
+	int              i;      /* iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	raw = 0;
+	for (i = 0; i != n; ++i)
+	{
+		w = rval[order & M2MD_PL_ORDER_CDAB ? n - 1 - i : i];
+		if (order & M2MD_PL_ORDER_BADC)
+			w = (uint16_t)(w >> 8 | w << 8);
+
+		raw = raw << 16 | w;
+	}
+
+	return raw;
+}
+
+
+/* ==========================================================================
+    Reinterprets raw bits 'raw' as ieee754 single and double precision
+    floats. memcpy() is the only way to do it that compiler won't break
+    with strict aliasing, it's optimized out anyway.
+   ========================================================================== */
+static inline double m2md_modbus_f32
+(
+	uint64_t  raw  /* bits of float in lower 32 bits */
+)
+{
+	uint32_t  r;   /* bits of float */
+	float     f;   /* float made of r */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	r = (uint32_t)raw;
+	memcpy(&f, &r, sizeof(f));
+	return f;
+}
+
+static inline double m2md_modbus_f64
+(
+	uint64_t  raw  /* bits of double */
+)
+{
+	double    f;   /* double made of raw */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	memcpy(&f, &raw, sizeof(f));
+	return f;
+}
+
+
+/* ==========================================================================
+    Decoders of every type in every byte and word order. Each one is a
+    separate function with type, width and order known at compile time,
+    so there is no branching on type of poll when value is decoded, it's
+    all decided once, when poll is added.
+
+    M2MD_MODBUS_DECODER(type, n, k, field, conv) generates decoders of
+    'type' that is 'n' registers wide, 'conv' turns glued 'raw' value
+    into 'field' of value of kind 'k'.
+   ========================================================================== */
+#define M2MD_MODBUS_DECODER_ORDER(type, order, n, k, field, conv) \
+	static void m2md_modbus_decode_##type##_##order \
+	( \
+		const uint16_t        *rval, \
+		struct m2md_pl_value  *v \
+	) \
+	{ \
+		uint64_t               raw; \
+		\
+		raw = m2md_modbus_gather(rval, n, M2MD_PL_ORDER_##order); \
+		v->kind = M2MD_PL_VALUE_##k; \
+		v->v.field = conv; \
+	}
+
+#define M2MD_MODBUS_DECODER(type, n, k, field, conv) \
+	M2MD_MODBUS_DECODER_ORDER(type, ABCD, n, k, field, conv) \
+	M2MD_MODBUS_DECODER_ORDER(type, CDAB, n, k, field, conv) \
+	M2MD_MODBUS_DECODER_ORDER(type, BADC, n, k, field, conv) \
+	M2MD_MODBUS_DECODER_ORDER(type, DCBA, n, k, field, conv)
+
+#define M2MD_MODBUS_DECODERS(type) \
+	{ \
+		m2md_modbus_decode_##type##_ABCD, \
+		m2md_modbus_decode_##type##_CDAB, \
+		m2md_modbus_decode_##type##_BADC, \
+		m2md_modbus_decode_##type##_DCBA \
+	}
+
+M2MD_MODBUS_DECODER(i16, 1, INT,   i, (int16_t)raw)
+M2MD_MODBUS_DECODER(u16, 1, UINT,  u, (uint16_t)raw)
+M2MD_MODBUS_DECODER(i32, 2, INT,   i, (int32_t)raw)
+M2MD_MODBUS_DECODER(u32, 2, UINT,  u, (uint32_t)raw)
+M2MD_MODBUS_DECODER(i64, 4, INT,   i, (int64_t)raw)
+M2MD_MODBUS_DECODER(u64, 4, UINT,  u, raw)
+M2MD_MODBUS_DECODER(f32, 2, FLOAT, f, m2md_modbus_f32(raw))
+M2MD_MODBUS_DECODER(f64, 4, FLOAT, f, m2md_modbus_f64(raw))
+
+static const m2md_pl_decode g_decoders[M2MD_PL_TYPE_MAX][M2MD_PL_ORDER_MAX] =
+{
+	[M2MD_PL_TYPE_I16] = M2MD_MODBUS_DECODERS(i16),
+	[M2MD_PL_TYPE_U16] = M2MD_MODBUS_DECODERS(u16),
+	[M2MD_PL_TYPE_I32] = M2MD_MODBUS_DECODERS(i32),
+	[M2MD_PL_TYPE_U32] = M2MD_MODBUS_DECODERS(u32),
+	[M2MD_PL_TYPE_I64] = M2MD_MODBUS_DECODERS(i64),
+	[M2MD_PL_TYPE_U64] = M2MD_MODBUS_DECODERS(u64),
+	[M2MD_PL_TYPE_F32] = M2MD_MODBUS_DECODERS(f32),
+	[M2MD_PL_TYPE_F64] = M2MD_MODBUS_DECODERS(f64)
+};
+
+
+/* ==========================================================================
+    Picks decoder for 'poll'. Poll with sign and width type is just an
+    integer 1 or 2 registers wide, big endian.
+
+    Returns NULL when type or order of poll is not known.
+   ========================================================================== */
+static m2md_pl_decode m2md_modbus_decoder
+(
+	const struct m2md_pl_data  *poll  /* poll to pick decoder for */
+)
+{
+	int                         type; /* type of poll's value */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	type = poll->type;
+	if (type == M2MD_PL_TYPE_RAW && poll->field_width < 2)
+		type = poll->is_signed ? M2MD_PL_TYPE_I16 : M2MD_PL_TYPE_U16;
+	else if (type == M2MD_PL_TYPE_RAW)
+		type = poll->is_signed ? M2MD_PL_TYPE_I32 : M2MD_PL_TYPE_U32;
+
+	if (type >= M2MD_PL_TYPE_MAX || poll->order >= M2MD_PL_ORDER_MAX)
+		return NULL;
+
+	return g_decoders[type][poll->order];
+}
+
+
+/* ==========================================================================
+    Converts raw registers 'rval' of 'poll' into real value, and stores
+    it in 'buf' ready to be published, and in 'v' for deadband check.
+
+    Poll with sign and width type is published as single precision float,
+    as it always was. Named type is published at full precision, integer
+    that has no scale (scale is 1) goes as 64bit integer, everything else
+    is scaled and goes as double.
+
+    Returns number of bytes stored in 'buf'.
+   ========================================================================== */
+static int m2md_modbus_poll_value
+(
+	const struct m2md_pl_data  *poll,  /* poll to convert value for */
+	const uint16_t             *rval,  /* poll's registers */
+	void                       *buf,   /* converted value goes here */
+	double                     *v      /* and here */
+)
+{
+	struct m2md_pl_value        val;   /* decoded value */
+	float                       f;     /* value of sign and width poll */
+	double                      d;     /* scaled value */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	poll->decode(rval, &val);
+
+	if (val.kind == M2MD_PL_VALUE_INT)
+		d = (double)val.v.i;
+	else if (val.kind == M2MD_PL_VALUE_UINT)
+		d = (double)val.v.u;
+	else
+		d = val.v.f;
+
+	/* received data is just imaginary value without unit, we
+	 * apply scale factor to convert value to known unit. Integer
+	 * that has no scale is left alone, so it does not lose any
+	 * bits on the way to double */
+	if (poll->scale == 1 && poll->type != M2MD_PL_TYPE_RAW &&
+			val.kind != M2MD_PL_VALUE_FLOAT)
+	{
+		*v = d;
+		memcpy(buf, &val.v, sizeof(val.v));
+		return sizeof(val.v);
+	}
+
+	d *= poll->scale;
+
+	if (poll->type == M2MD_PL_TYPE_RAW)
+	{
+		f = d;
+		*v = f;
+		memcpy(buf, &f, sizeof(f));
+		return sizeof(f);
+	}
+
+	*v = d;
+	memcpy(buf, &d, sizeof(d));
+	return sizeof(d);
+}
+
+
+/* ==========================================================================
+    Returns 1 when value of 16bit 'poll' decoded by batch decoder is
+    exactly what m2md_modbus_poll_value() would give. Raw poll is
+    published as single precision float anyway, and product of 16bit
+    integer and float scale is rounded only once either way. Integer
+    with no scale fits in float as it is. But typed poll that is scaled
+    goes as double, and float product of batch decoder would cut its
+    precision down, so such poll must be decoded on its own.
+   ========================================================================== */
+static int m2md_modbus_poll_batch16
+(
+	const struct m2md_pl_data  *poll  /* poll to check */
+)
+{
+	return m2md_decode_is16(poll) &&
+		(poll->type == M2MD_PL_TYPE_RAW || poll->scale == 1);
+}
+
+
+/* ==========================================================================
+    Stores value 'v' of 16bit 'poll', already decoded and scaled by batch
+    decoder, in 'buf', in the same format m2md_modbus_poll_value() would.
+    Only polls accepted by m2md_modbus_poll_batch16() can go here.
+
+    Returns number of bytes stored in 'buf'.
+   ========================================================================== */
+static int m2md_modbus_poll_value16
+(
+	const struct m2md_pl_data  *poll,  /* poll to store value for */
+	float                       v,     /* decoded value */
+	void                       *buf    /* value goes here */
+)
+{
+	int64_t                     i;     /* value of unscaled poll */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (poll->type == M2MD_PL_TYPE_RAW)
+	{
+		memcpy(buf, &v, sizeof(v));
+		return sizeof(v);
+	}
+
+	/* uint64_t of the same value has the same bits */
+	i = (int64_t)v;
+	memcpy(buf, &i, sizeof(i));
+	return sizeof(i);
+}
+
+
+/* ==========================================================================
+    Decides whether sample of poll at position 'pi' of 'server', with
+    payload 'buf' of 'size' bytes and value 'v', should be published, as
+    poll's deadband and heartbeat say, and counts it in server's stats.
+
+    Returns 1 when sample shall be published, 0 when it's suppressed.
+   ========================================================================== */
+static int m2md_modbus_poll_report
+(
+	struct m2md_server     *server,  /* server poll belongs to */
+	size_t                  pi,      /* position of poll in list */
+	const void             *buf,     /* payload to publish */
+	int                     size,    /* size of buf */
+	double                  v,       /* value of sample */
+	const struct timespec  *now      /* time sample was taken */
+)
+{
+	if (m2md_pl_report(&server->polls, pi, buf, size, v, now))
+	{
+		server->stats.published++;
+		return 1;
+	}
+
+	server->stats.suppressed++;
+	return 0;
+}
+
+
+/* ==========================================================================
+    Publishes 'payload' of 'len' bytes on full 'topic'. With publisher
+    threads, payload is only queued, by topic's interned id 'tid', and
+    server thread goes on with its work right away. Topic that could not
+    be interned goes straight to broker.
+   ========================================================================== */
+static int m2md_modbus_publish
+(
+	uint32_t     tid,      /* interned topic, or M2MD_PUB_NO_TOPIC */
+	const char  *topic,    /* full topic to publish on */
+	const void  *payload,  /* payload to publish */
+	int          len       /* length of payload */
+)
+{
+	if (m2md_cfg->mqtt_publishers && tid != M2MD_PUB_NO_TOPIC)
+		return m2md_pub_push(tid, payload, len);
+
+	return m2md_mqtt_publish_full(topic, payload, len, 0);
+}
+
+
+/* ==========================================================================
+    Builds full topic on which batches of 'server' are published, that is
+    batch/<ip>:<port> under base topic.
+
+    errno:
+            ENOBUFS     topic is too long
+            ENOMEM      not enough memory for topic
+   ========================================================================== */
+static int m2md_modbus_batch_topic
+(
+	struct m2md_server  *server  /* server to build batch topic for */
+)
+{
+	char                 batch[M2MD_MODBUS_ADDR_MAX + 16]; /* own topic */
+	char                 topic[M2MD_TOPIC_MAX];  /* full topic */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	snprintf(batch, sizeof(batch), "batch/%s:%d", server->ip, server->port);
+	if (m2md_mqtt_topic(topic, sizeof(topic), batch) < 0)
+		return -1;
+
+	if ((server->batch_topic = strdup(topic)) == NULL)
+		return -1;
+
+	return 0;
+}
+
+
+/* ==========================================================================
+    Publishes index of topic ids of 'server' polls, so subscribers of
+    batches know which poll each record belongs to. Index is plain text,
+    "<id> <topic>" in each line, with full topics, and broker retains it,
+    so subscriber that comes late gets it too.
+
+    server->lock must be held.
+   ========================================================================== */
+static int m2md_modbus_batch_index
+(
+	struct m2md_server  *server   /* server to publish index of */
+)
+{
+	char                 topic[M2MD_TOPIC_MAX + 8]; /* index topic */
+	char                *index;   /* index to publish */
+	size_t               size;    /* size of index buffer */
+	size_t               len;     /* length of index */
+	size_t               i;       /* iterator */
+	int                  ret;     /* return code from publish */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	/* 10 digits of id, space and newline */
+	size = 1;
+	for (i = 0; i != server->polls.nnodes; ++i)
+		size += strlen(server->polls.data[i].topic) + 12;
+
+	if ((index = malloc(size)) == NULL)
+		return_perror(ELE, "batch: malloc(index, %zu)", size);
+
+	len = 0;
+	index[0] = '\0';
+	for (i = 0; i != server->polls.nnodes; ++i)
+		len += sprintf(index + len, "%"PRIu32" %s\n",
+				server->polls.data[i].id, server->polls.data[i].topic);
+
+	/* index is retained and rarely sent, it goes straight to
+	 * broker, never through publisher queue, so it is there
+	 * before any queued batch that uses its ids */
+	snprintf(topic, sizeof(topic), "%s/index", server->batch_topic);
+	ret = m2md_mqtt_publish_full(topic, index, len, 1);
+	free(index);
+	return ret;
+}
+
+
+/* ==========================================================================
+    Publishes batch of 'server' samples, if there is anything in it. Index
+    of topic ids goes first, when polls have changed since it was last
+    published, so subscriber knows new ids before it sees them.
+
+    server->lock must be held.
+   ========================================================================== */
+static void m2md_modbus_batch_flush
+(
+	struct m2md_server  *server  /* server to publish batch of */
+)
+{
+	const char          *topic;  /* topic of server batches */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (server->batch.count == 0)
+		return;
+
+	topic = server->batch_topic;
+	if (server->index_dirty && m2md_modbus_batch_index(server) == 0)
+		server->index_dirty = 0;
+
+	el_print(ELD, "batch publish: %s: %d samples, %zu bytes", topic,
+			server->batch.count, server->batch.len);
+	if (m2md_modbus_publish(server->batch_tid, topic, server->batch.buf,
+				server->batch.len) != 0)
+		el_perror(ELE, "batch: mqtt_publish(%s, %zu) failed",
+				topic, server->batch.len);
+	else
+		server->stats.batches++;
+
+	m2md_batch_reset(&server->batch);
+}
+
+
+/* ==========================================================================
+    Decides when batch of 'server' is published, once samples of single
+    read are in it. Without window it goes out right away. Otherwise main
+    loop is told when window of batch ends, unless it already knows, and
+    it's main loop that publishes batch then.
+
+    server->lock must be held.
+   ========================================================================== */
+static void m2md_modbus_batch_done
+(
+	struct m2md_server  *server  /* server which read has finished */
+)
+{
+	struct timespec      end;    /* when batch window ends */
+	struct timespec      now;    /* current time */
+	int                  kick;   /* main needs to know about window */
+	int                  due;    /* batch must go out now */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	due = m2md_batch_due(&server->batch, m2md_cfg->mqtt_batch_window,
+			now, &end);
+
+	if (due < 0)
+		return; /* everything was suppressed */
+
+	if (due)
+	{
+		m2md_modbus_batch_flush(server);
+		return;
+	}
+
+	/* node that is already queued ends no later than
+	 * this window, and that's good enough */
+	kick = 0;
+	pthread_mutex_lock(&g_batch_lock);
+	if (server->batch_flush.idx == M2MD_SCHED_NOT_QUEUED)
+	{
+		server->batch_flush.deadline = end;
+		if (m2md_sched_add(&g_batch_sched, &server->batch_flush) == 0)
+			kick = 1;
+		else
+			/* batch will be published with one of next
+			 * reads, once its window is over */
+			el_perror(ELW, "batch: m2md_sched_add(%s:%d)",
+					server->ip, server->port);
+	}
+	pthread_mutex_unlock(&g_batch_lock);
+
+	/* main may be sleeping for much longer than
+	 * window, wake it up so it knows */
+	if (kick)
+		pthread_kill(g_main_thread_t, SIGUSR2);
+}
+
+
+/* ==========================================================================
+    Publishes batches which windows have ended by 'now'. Time when next
+    window ends is stored in 'next'.
+
+    Returns 0 when there is any batch still waiting, -1 when there is none.
+   ========================================================================== */
+static int m2md_modbus_batch_expire
+(
+	const struct timespec   *now,     /* current time */
+	struct timespec         *next     /* end of next window goes here */
+)
+{
+	struct m2md_sched_node  *node;    /* expired batch node */
+	struct m2md_server      *server;  /* server node belongs to */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	pthread_mutex_lock(&g_batch_lock);
+	while ((node = m2md_sched_peek(&g_batch_sched)) != NULL &&
+			m2md_sched_expired(node, now))
+	{
+		server = m2md_sched_entry(node, struct m2md_server, batch_flush);
+		m2md_sched_delete(&g_batch_sched, node);
+
+		/* server lock can't be taken with batch lock held.
+		 * Batch may go out with server's next read in the
+		 * meantime, then there is nothing left to do here */
+		pthread_mutex_unlock(&g_batch_lock);
+		pthread_mutex_lock(&server->lock);
+		m2md_modbus_batch_flush(server);
+		pthread_mutex_unlock(&server->lock);
+		pthread_mutex_lock(&g_batch_lock);
+	}
+
+	if (node != NULL)
+		*next = node->deadline;
+	pthread_mutex_unlock(&g_batch_lock);
+
+	return node == NULL ? -1 : 0;
+}
+
+
+/* ==========================================================================
+    Returns kind of value, m2md_enc_kind, 'poll' publishes, so encoder
+    knows what is in the payload. It follows what m2md_modbus_poll_value()
+    and m2md_decode_bitmap() store.
+   ========================================================================== */
+static int m2md_modbus_poll_kind
+(
+	const struct m2md_pl_data  *poll  /* poll to check */
+)
+{
+	if (m2md_modbus_func_bits(poll->func))
+		return poll->field_width > 1 ?
+			M2MD_ENC_KIND_BITS : M2MD_ENC_KIND_F32;
+
+	if (poll->type == M2MD_PL_TYPE_RAW)
+		return M2MD_ENC_KIND_F32;
+
+	if (poll->scale != 1 || poll->type == M2MD_PL_TYPE_F32 ||
+			poll->type == M2MD_PL_TYPE_F64)
+		return M2MD_ENC_KIND_F64;
+
+	if (poll->type == M2MD_PL_TYPE_I16 || poll->type == M2MD_PL_TYPE_I32 ||
+			poll->type == M2MD_PL_TYPE_I64)
+		return M2MD_ENC_KIND_I64;
+
+	return M2MD_ENC_KIND_U64;
+}
+
+
+/* ==========================================================================
+    Publishes sample 'buf' of 'size' bytes of 'poll', taken at 'now',
+    which is 'real' in realtime. Sample is encoded as poll wants it, and
+    goes on poll's own topic, or into server's batch when batching is
+    enabled. Batch that is full is published right away, to make room
+    for the sample.
+
+    server->lock must be held.
+   ========================================================================== */
+static void m2md_modbus_poll_publish
+(
+	struct m2md_server         *server,  /* server poll belongs to */
+	const struct m2md_pl_data  *poll,    /* poll sample belongs to */
+	const void                 *buf,     /* sample to publish */
+	int                         size,    /* size of buf */
+	const struct timespec      *now,     /* time sample was taken */
+	const struct timespec      *real     /* now, in realtime */
+)
+{
+	int                         enc;     /* encoding of sample */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	enc = poll->encoding;
+	if (enc == M2MD_ENC_DEFAULT)
+		enc = m2md_cfg->mqtt_encoding;
+
+	/* encoded sample lives in buffer of this thread, until
+	 * next sample is encoded, and it's published before that */
+	size = m2md_enc_encode(enc, m2md_modbus_poll_kind(poll), buf, size,
+			real, &buf);
+	if (size < 0)
+	{
+		el_perror(ELE, "poll: m2md_enc_encode(%s, %d) failed",
+				poll->topic, enc);
+		return;
+	}
+
+	if (!m2md_cfg->mqtt_batch)
+	{
+		/* we are ready to publish message, so what are you
+		 * waiting for? hit em with it!  */
+		el_print(ELD, "poll publish: %s: %d bytes", poll->topic, size);
+		if (m2md_modbus_publish(poll->tid, poll->topic, buf, size) != 0)
+			el_perror(ELE, "poll: mqtt_publish(%s, %d) failed",
+					poll->topic, size);
+		return;
+	}
+
+	if (m2md_batch_add(&server->batch, poll->id, now, buf, size) == 0)
+		return;
+
+	/* no room left in batch, send what's
+	 * there and start new one */
+	m2md_modbus_batch_flush(server);
+	if (m2md_batch_add(&server->batch, poll->id, now, buf, size) != 0)
+		el_perror(ELE, "poll: batch_add(%s, %d) failed", poll->topic, size);
+}
+
+
+/* ==========================================================================
+    Slices registers 'regs' read for 'rd' request back into polls of the
+    block and publishes them on mqtt. If read plan has changed while we
+    were reading, block may be long gone, in such case we simply drop
+    what we've read, new plan will read it again soon enough.
+
+    Bit poll that is one bit wide is published as value, just like
+    register poll, wider one is published as bitmap.
+
+    Block of registers is first decoded in one go by batch decoder, which
+    takes care of all 16bit polls, wider polls are decoded one by one.
+
+    When batching is enabled, samples are not published on their own,
+    they go into server's batch, which is published as single message.
+   ========================================================================== */
+static void m2md_modbus_server_publish_block
+(
+	struct m2md_server             *server,  /* server registers came from */
+	const struct m2md_server_read  *rd,      /* read request */
+	const uint16_t                 *regs     /* registers read */
+)
+{
+	const struct m2md_pl_data      *poll;    /* current poll to publish */
+	size_t                          pi;      /* position of poll in list */
+	struct timespec                 now;     /* time samples were taken */
+	struct timespec                 real;    /* now, in realtime */
+	double                          v;       /* value for deadband check */
+	float                           data;    /* bit data to send over mqtt */
+	unsigned char                   value[sizeof(double)];  /* decoded */
+	int                             off;     /* offset of poll in block */
+	int                             size;    /* size of bitmap */
+	int                             batch;   /* block went through batch */
+	int                             i;       /* iterator */
+	unsigned char                   map[M2MD_RP_MAX_BITS / 8];
+	float                           values[MODBUS_MAX_READ_REGISTERS];
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	pthread_mutex_lock(&server->lock);
+
+	if (rd->gen != server->plan.gen)
+	{
+		/* plan changed, block is no longer valid */
+		pthread_mutex_unlock(&server->lock);
+		el_print(ELD, "poll: read plan changed, dropping %d:%d",
+				rd->reg, rd->count);
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	clock_gettime(CLOCK_REALTIME, &real);
+	batch = rd->block->decode.scale != NULL &&
+		rd->count <= MODBUS_MAX_READ_REGISTERS;
+	if (batch)
+		m2md_decode_block16(&rd->block->decode, regs, rd->count, values);
+
+	for (i = 0; i != rd->block->npolls; ++i)
+	{
+		if ((pi = rd->block->polls[i]) == M2MD_PL_NONE)
+			continue; /* poll was deleted in the meantime */
+
+		poll = &server->polls.data[pi];
+		off = poll->reg - rd->reg;
+
+		if (server->polls.exc[pi].strikes)
+		{
+			/* quarantined poll has been read just fine,
+			 * it's back to normal */
+			el_print(ELN, "poll %s is out of quarantine after %d "
+					"exceptions", poll->topic,
+					server->polls.exc[pi].strikes);
+			server->polls.exc[pi].strikes = 0;
+		}
+
+		if (m2md_modbus_func_bits(rd->func) && poll->field_width > 1)
+		{
+			size = m2md_decode_bitmap(regs, (rd->count + 15) / 16,
+					off, poll->field_width, map);
+			if (m2md_modbus_poll_report(server, pi, map, size, NAN, &now))
+				m2md_modbus_poll_publish(server, poll, map, size,
+						&now, &real);
+			continue;
+		}
+
+		if (m2md_modbus_func_bits(rd->func))
+		{
+			data = (regs[off >> 4] >> (off & 15) & 1) * poll->scale;
+			memcpy(value, &data, sizeof(data));
+			size = sizeof(data);
+			v = data;
+		}
+		else if (batch && m2md_modbus_poll_batch16(poll))
+		{
+			size = m2md_modbus_poll_value16(poll, values[off], value);
+			v = values[off];
+		}
+		else
+			size = m2md_modbus_poll_value(poll, regs + off, value, &v);
+
+		/* unchanged sample goes no further, it's cheaper
+		 * to drop it here than anywhere down the line */
+		if (m2md_modbus_poll_report(server, pi, value, size, v, &now))
+			m2md_modbus_poll_publish(server, poll, value, size,
+					&now, &real);
+	}
+
+	if (m2md_cfg->mqtt_batch)
+		m2md_modbus_batch_done(server);
+
+	pthread_mutex_unlock(&server->lock);
+}
+
+
+/* ==========================================================================
+    Handles modbus exception 'err' that server answered 'rd' read with.
+    Exception means something is wrong with registers we've asked for,
+    and asking again won't change that. Block of many polls is split in
+    halves, and halves are read separately from now on, so bad poll is
+    found in a few reads, while good polls around it are still read as
+    usual. Poll that gets exception while it's read alone is quarantined,
+    its block is read again only after quarantine time, which doubles
+    with each next exception, up to configured max. First good read ends
+    quarantine.
+
+    Called without any lock held.
+   ========================================================================== */
+static void m2md_modbus_server_exception
+(
+	struct m2md_server             *server,  /* server that sent exception */
+	const struct m2md_server_read  *rd,      /* request that got it */
+	int                             err      /* exception errno */
+)
+{
+	struct m2md_rp_block           *block;   /* block that got exception */
+	struct m2md_pl_data            *poll;    /* poll that got exception */
+	struct timespec                 now;     /* current absolute time */
+	struct timespec                 until;   /* end of quarantine */
+	int64_t                         wait;    /* quarantine time, s */
+	size_t                          pi;      /* position of poll in list */
+	int                             npolls;  /* polls still in block */
+	int                             i;       /* iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	pthread_mutex_lock(&g_servers_sched_lock);
+	pthread_mutex_lock(&server->lock);
+
+	server->stats.exceptions++;
+
+	if (m2md_cfg->modbus_quarantine_min == 0)
+	{
+		/* we are told to just keep on reading */
+		el_print(ELE, "poll: modbus_read_%d(%d, %d, %d): %s", rd->func,
+				rd->reg, rd->count, rd->uid, modbus_strerror(err));
+		goto out;
+	}
+
+	if (rd->gen != server->plan.gen)
+		goto out; /* plan changed, block is long gone */
+
+	block = rd->block;
+	npolls = m2md_rp_split(block, &server->polls, &server->splits);
+
+	if (npolls == 0)
+		goto out; /* all polls have been deleted in the meantime */
+
+	if (npolls > 1)
+	{
+		/* halves got their own splits, so they
+		 * will be read separately from now on */
+		el_print(ELW, "poll %s:%d: modbus_read_%d(%d, %d, %d): %s, "
+				"splitting %d polls", server->ip, server->port, rd->func,
+				rd->reg, rd->count, rd->uid, modbus_strerror(err), npolls);
+
+		server->stats.splits++;
+		server->plan_dirty = 1;
+		m2md_modbus_server_reschedule(server);
+		goto out;
+	}
+
+	/* poll is read alone and still gets exception, so
+	 * it's this poll that is bad, quarantine it */
+	for (i = 0; block->polls[i] == M2MD_PL_NONE; ++i)
+		;
+
+	pi = block->polls[i];
+	poll = &server->polls.data[pi];
+	wait = m2md_pl_strike(&server->polls, pi,
+			m2md_cfg->modbus_quarantine_min, m2md_cfg->modbus_quarantine_max);
+
+	if (server->polls.exc[pi].strikes == 1)
+		el_print(ELW, "poll %s: modbus_read_%d(%d, %d, %d): %s, "
+				"quarantined for %lds", poll->topic, rd->func, rd->reg,
+				rd->count, rd->uid, modbus_strerror(err), (long)wait);
+	else
+		el_print(ELI, "poll %s: exception no %d, quarantined for %lds",
+				poll->topic, server->polls.exc[pi].strikes, (long)wait);
+
+	/* block was moved to its next read when it was sent,
+	 * now it's moved further, to the end of quarantine */
+	until = now;
+	until.tv_sec += wait;
+	if (m2md_timing_ns(m2md_timing_sub(until, block->sched.deadline)) > 0)
+	{
+		block->sched.deadline = until;
+		if (block->sched.idx != M2MD_SCHED_NOT_QUEUED)
+			m2md_sched_update(&server->sched, &block->sched);
+
+		m2md_modbus_server_reschedule(server);
+	}
+
+out:
+	pthread_mutex_unlock(&server->lock);
+	pthread_mutex_unlock(&g_servers_sched_lock);
+}
+
+
+/* ==========================================================================
+    Feeds result of read over 'conn' to the circuit breaker of its server,
+    and moves server in servers scheduler when breaker opens or closes.
+    Modbus exception is a response, and it means server is alive, even
+    if it didn't like our request.
+
+    Called by connection thread, without any lock held.
+   ========================================================================== */
+static void m2md_modbus_conn_breaker
+(
+	struct m2md_server_conn  *conn,    /* connection that has been read */
+	int                       alive    /* server responded */
+)
+{
+	struct m2md_server       *server;  /* server of the connection */
+	struct timespec           now;     /* current absolute time */
+	int                       verdict; /* what read means for breaker */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	server = conn->server;
+
+	/* most of the time breaker stays as it is, and there
+	 * is no need to bother servers scheduler at all */
+	pthread_mutex_lock(&server->lock);
+	verdict = m2md_breaker_result(&server->breaker, &conn->health, alive);
+	if (verdict == M2MD_BREAKER_BROKEN)
+		el_print(ELW, "modbus server %s:%d, conn %d is broken, "
+				"%d connections left", server->ip, server->port,
+				conn->id, server->breaker.nhealthy);
+	pthread_mutex_unlock(&server->lock);
+
+	if (verdict == M2MD_BREAKER_KEEP || verdict == M2MD_BREAKER_BROKEN)
+		return;
+
+	/* breaker changes state, server must be moved in servers
+	 * scheduler. Only thread that made probe, or broke last
+	 * working connection changes breaker from closed or
+	 * half-open, so it's still what we've seen above */
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	pthread_mutex_lock(&g_servers_sched_lock);
+	pthread_mutex_lock(&server->lock);
+
+	if (verdict == M2MD_BREAKER_RESET)
+		m2md_modbus_breaker_close(server, now);
+	else
+		m2md_modbus_breaker_open(server, now);
+
+	m2md_modbus_server_reschedule(server);
+	pthread_mutex_unlock(&server->lock);
+	pthread_mutex_unlock(&g_servers_sched_lock);
+
+	/* reads that have been queued before breaker opened
+	 * would only time out one by one, drop them */
+	if (verdict == M2MD_BREAKER_TRIP)
+		rb_clear(server->msgq, 0);
+}
+
+
+/* ==========================================================================
+    Writes everything that waits in write queue of the server over 'conn'.
+    It's done before each read, so setpoints never wait behind reads, not
+    even behind those that were queued long before them. Write that fails
+    is dropped and logged, and it counts for breaker just like failed read
+    does. Server that is down keeps its writes until it's back up.
+
+    Called by connection thread, without any lock held.
+   ========================================================================== */
+static void m2md_modbus_conn_write
+(
+	struct m2md_server_conn  *conn,    /* connection to write over */
+	uint16_t                 *regs     /* buffer for values to write */
+)
+{
+	struct m2md_server       *server;  /* server of the connection */
+	struct m2md_server_read   rd;      /* write request */
+	int                       ret;     /* write has been taken */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	server = conn->server;
+
+	for (;;)
+	{
+		pthread_mutex_lock(&server->lock);
+		ret = server->breaker.state == M2MD_BREAKER_CLOSED &&
+			conn->health.healthy &&
+			m2md_modbus_server_take_write(server, &rd, regs);
+		pthread_mutex_unlock(&server->lock);
+
+		if (!ret)
+			return;
+
+		el_print(ELD, "write: %s:%d: func: %d, reg: %d, count: %d, uid: %d",
+				server->ip, server->port, rd.func, rd.reg, rd.count, rd.uid);
+
+		if (m2md_modbus_conn_read(conn, &rd, regs) == 0)
+			m2md_modbus_conn_breaker(conn, 1);
+		else
+			m2md_modbus_conn_breaker(conn,
+					m2md_modbus_is_exception(errno));
+	}
+}
+
+
+/* ==========================================================================
+    Reconnects 'conn' that has broken, or has not been connected yet,
+    while its server works. When connection fails, function sleeps for
+    some time before returning, so caller can simply try again.
+
+    Called by connection thread, without any lock held.
+   ========================================================================== */
+static int m2md_modbus_conn_reconnect
+(
+	struct m2md_server_conn  *conn     /* connection to reconnect */
+)
+{
+	struct m2md_server       *server;  /* server of the connection */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	server = conn->server;
+
+	if (m2md_modbus_conn_connect(conn) == 0)
+	{
+		pthread_mutex_lock(&server->lock);
+		m2md_breaker_conn_up(&server->breaker, &conn->health);
+		conn->conn_to = 1;
+		pthread_mutex_unlock(&server->lock);
+		return 0;
+	}
+
+	/* server works, so it's probably something with this
+	 * connection only, sleep for some time before trying
+	 * again, other connections handle reads meanwhile */
+	el_print(ELW, "reconnecting %s:%d, conn %d in %d seconds",
+			server->ip, server->port, conn->id, conn->conn_to);
+
+	sleep(conn->conn_to);
+
+	/* next sleep will be two times longer (if we still
+	 * cannot connect) but don't sleep longer than
+	 * configured time, like ever.  */
+	conn->conn_to *= 2;
+	if (conn->conn_to > m2md_cfg->modbus_max_re_time)
+		conn->conn_to = m2md_cfg->modbus_max_re_time;
+
+	return -1;
+}
+
+
+/* ==========================================================================
+    Sends single probe over 'conn' to its server, which breaker is
+    half-open. Probe is a fresh connection and read of server's earliest
+    block, so we know
+    not only that there is something listening, but that it also answers
+    our requests. Result of probe closes or opens breaker again.
+
+    Called by connection thread, without any lock held.
+   ========================================================================== */
+static void m2md_modbus_conn_probe
+(
+	struct m2md_server_conn  *conn,    /* connection to probe with */
+	uint16_t                 *regs     /* buffer for read registers */
+)
+{
+	struct m2md_server       *server;  /* server to probe */
+	struct m2md_sched_node   *bnode;   /* earliest block of server */
+	struct m2md_rp_block     *block;   /* block to probe with */
+	struct m2md_server_read   rd;      /* probe read request */
+	struct timespec           now;     /* current absolute time */
+	int                       alive;   /* server responded to probe */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	server = conn->server;
+	alive = 0;
+	bnode = NULL;
+
+	if (m2md_modbus_conn_connect(conn) == 0)
+	{
+		/* probe is an ordinary read, so block's timer
+		 * is moved, just like main loop would do it */
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		pthread_mutex_lock(&server->lock);
+		if ((bnode = m2md_sched_peek(&server->sched)) != NULL)
+		{
+			block = m2md_sched_entry(bnode, struct m2md_rp_block, sched);
+			m2md_modbus_server_read_request(server, block, &rd);
+			m2md_modbus_server_next_read(server, block, now);
+			m2md_sched_update(&server->sched, bnode);
+		}
+		pthread_mutex_unlock(&server->lock);
+
+		/* with nothing to read yet, connection is all
+		 * the proof we can get */
+		alive = 1;
+		if (bnode != NULL)
+		{
+			if (m2md_modbus_conn_read(conn, &rd, regs) == 0)
+				m2md_modbus_server_publish_block(server, &rd, regs);
+			else
+				alive = m2md_modbus_is_exception(errno);
+		}
+	}
+
+	m2md_modbus_conn_breaker(conn, alive);
+}
+
+
+/* ==========================================================================
+    Thread handling single connection to the server. All connections of
+    the server take read requests from the same queue, so each request
+    goes to whichever connection is free first, which is always the one
+    with least requests waiting for response.
+   ========================================================================== */
+static void *m2md_modbus_server_thread
+(
+	void                     *arg
+)
+{
+	struct m2md_server_conn  *conn = arg;
+	struct m2md_server       *server;  /* server of the connection */
+	struct m2md_server_msg    msg;
+	int                       breaker; /* copy of breaker state */
+	int                       healthy; /* copy of connection health */
+	uint16_t                  regs[MODBUS_MAX_READ_REGISTERS];
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	server = conn->server;
+	el_print(ELN, "starting thread for server %s:%d, conn %d",
+			server->ip, server->port, conn->id);
+	for (;;)
+	{
+		pthread_mutex_lock(&server->lock);
+		breaker = server->breaker.state;
+		healthy = conn->health.healthy;
+		pthread_mutex_unlock(&server->lock);
+
+		/* server works, but this connection does not, don't
+		 * take any reads until it's fixed. When whole server
+		 * is down, probe will take care of it */
+		if (!healthy && breaker == M2MD_BREAKER_CLOSED &&
+				m2md_modbus_conn_reconnect(conn) != 0)
+			continue;
+
+		/* wait for command to arrive */
+		if (rb_read(server->msgq, &msg, 1) != 1)
+		{
+			if (errno == ECANCELED)
+				/* someone called rb_stop() on us, we should
+				 * stop using msgq at once!  */
+				goto end_of_the_road;
+
+			/* should not happen, but world is a strange place */
+			el_perror(ELW, "rb_read()");
+			continue;
+		}
+
+		/* message received, what does it say?  */
+		switch (msg.cmd)
+		{
+		/* hmm, connection initialization, huh? Right on that */
+
+		/* main thread wants to know if server is alive, it
+		 * sends us this when breaker is half-open. When
+		 * probe fails, main thread will send another one
+		 * once breaker timeout expires. Until then we just
+		 * sleep on queue and cost nothing.  */
+		case M2MD_SERVER_MSG_CONNECT:
+			m2md_modbus_conn_probe(conn, regs);
+
+			/* probe passed, and writes that waited for
+			 * server to come back can go now */
+			m2md_modbus_conn_write(conn, regs);
+			break;
+
+
+			/* we are suppose to poll for data and
+			 * publish it on mqtt bus, or just to write,
+			 * when someone published on command topic */
+		case M2MD_SERVER_MSG_POLL:
+		case M2MD_SERVER_MSG_WRITE:
+			pthread_mutex_lock(&server->lock);
+			healthy = conn->health.healthy;
+			pthread_mutex_unlock(&server->lock);
+
+			/* we were waiting on queue while server was down,
+			 * and someone else brought it back up, this
+			 * connection needs to be reconnected first */
+			if (!healthy && m2md_modbus_conn_reconnect(conn) != 0)
+			{
+				/* writes would wait for next message,
+				 * pass them to some other connection */
+				if (msg.cmd == M2MD_SERVER_MSG_WRITE)
+					m2md_modbus_server_kick_write(server);
+				break;
+			}
+
+			/* writes go first, no matter how many
+			 * reads were queued before them */
+			m2md_modbus_conn_write(conn, regs);
+			if (msg.cmd == M2MD_SERVER_MSG_WRITE)
+				break;
+
+			if (m2md_modbus_conn_read(conn, &msg.data.read, regs) != 0)
+			{
+				if (!m2md_modbus_is_exception(errno))
+				{
+					m2md_modbus_conn_breaker(conn, 0);
+					break;
+				}
+
+				/* exception, server is alive, but
+				 * something is wrong with the block */
+				m2md_modbus_server_exception(server, &msg.data.read,
+						errno);
+				m2md_modbus_conn_breaker(conn, 1);
+				break;
+			}
+
+			m2md_modbus_conn_breaker(conn, 1);
+
+			/* message received, now slice it back
+			 * into polls and publish on mqtt */
+			m2md_modbus_server_publish_block(server, &msg.data.read, regs);
+			break;
+		}
+	}
+
+end_of_the_road:
+	modbus_close(conn->modbus);
+	modbus_free(conn->modbus);
+	conn->modbus = NULL;
+
+	/* last connection going down takes server with it */
+	pthread_mutex_lock(&server->lock);
+	if (--server->nthreads)
+	{
+		pthread_mutex_unlock(&server->lock);
+		return NULL;
+	}
+	pthread_mutex_unlock(&server->lock);
+
+	/* server is going down, make sure main
+	 * loop won't try to poll it anymore */
+	pthread_mutex_lock(&g_servers_sched_lock);
+	if (server->next_poll.idx != M2MD_SCHED_NOT_QUEUED)
+		m2md_sched_delete(&g_servers_sched, &server->next_poll);
+	pthread_mutex_unlock(&g_servers_sched_lock);
+
+	/* whatever is left in batch goes out now, main loop
+	 * must not look at it anymore */
+	pthread_mutex_lock(&server->lock);
+	m2md_modbus_batch_flush(server);
+	m2md_batch_destroy(&server->batch);
+	free(server->batch_topic);
+	server->batch_topic = NULL;
+	pthread_mutex_unlock(&server->lock);
+
+	pthread_mutex_lock(&g_batch_lock);
+	if (server->batch_flush.idx != M2MD_SCHED_NOT_QUEUED)
+		m2md_sched_delete(&g_batch_sched, &server->batch_flush);
+	pthread_mutex_unlock(&g_batch_lock);
+
+	m2md_pl_destroy(&server->polls);
+	m2md_rp_destroy(&server->plan);
+	m2md_sched_destroy(&server->sched);
+	rb_destroy(server->msgq);
+	free(server->pool);
+	m2md_wq_destroy(&server->writes);
+
+	/* server cannot be used anymore, next poll
+	 * for it will start it anew */
+	server->pool = NULL;
+	server->running = 0;
+	return NULL;
+}
+
+
+/* ==========================================================================
+    Thread handling single connection to the server, that also decides on
+    its own when blocks are read. Used when modbus_sched is set to server.
+    Main thread does not take part in reading at all, connection threads
+    simply sleep until server's earliest block is due, or until its polls
+    change, or there is something to write. Each free connection takes
+    next expired block, so reads are spread across connections of the
+    server.
+   ========================================================================== */
+static void *m2md_modbus_server_sched_thread
+(
+	void                     *arg
+)
+{
+	struct m2md_server_conn  *conn = arg;
+	struct m2md_server       *server; /* server of the connection */
+	struct m2md_sched_node   *bnode;  /* block's scheduler node */
+	struct m2md_rp_block     *block;  /* current block to read */
+	struct m2md_server_read   rd;     /* block read request */
+	struct timespec           now;    /* current absolute time */
+	struct timespec           wake;   /* time of earliest block */
+	uint16_t                  regs[MODBUS_MAX_READ_REGISTERS];
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	server = conn->server;
+	el_print(ELN, "starting scheduling thread for server %s:%d, conn %d",
+			server->ip, server->port, conn->id);
+
+	/* server starts with open breaker that has already
+	 * expired, so nothing is read until first probe
+	 * connects to it */
+	pthread_mutex_lock(&server->lock);
+	for (;;)
+	{
+		/* polls have changed since last time, read plan
+		 * is outdated and needs to be rebuilt */
+		if (server->plan_dirty)
+			m2md_modbus_server_replan(server);
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		if (server->breaker.state == M2MD_BREAKER_OPEN &&
+				!m2md_breaker_expired(&server->breaker, now))
+		{
+			/* server is dead, leave it alone until it's
+			 * time to probe it, polls don't matter now */
+			wake = server->breaker.until;
+			pthread_cond_timedwait(&server->wake, &server->lock, &wake);
+			continue;
+		}
+
+		if (m2md_breaker_probe(&server->breaker, now))
+		{
+			/* first connection to see expired breaker
+			 * makes the probe, others wait for result */
+			pthread_mutex_unlock(&server->lock);
+			m2md_modbus_conn_probe(conn, regs);
+			pthread_mutex_lock(&server->lock);
+			continue;
+		}
+
+		if (server->breaker.state == M2MD_BREAKER_HALF_OPEN)
+		{
+			pthread_cond_wait(&server->wake, &server->lock);
+			continue;
+		}
+
+		if (!conn->health.healthy)
+		{
+			/* server works, but this connection does not,
+			 * fix it before it takes any reads */
+			pthread_mutex_unlock(&server->lock);
+			m2md_modbus_conn_reconnect(conn);
+			pthread_mutex_lock(&server->lock);
+			continue;
+		}
+
+		if (server->writes.nwrites != 0)
+		{
+			/* writes go first, no matter how late blocks are */
+			pthread_mutex_unlock(&server->lock);
+			m2md_modbus_conn_write(conn, regs);
+			pthread_mutex_lock(&server->lock);
+			continue;
+		}
+
+		bnode = m2md_sched_peek(&server->sched);
+
+		if (bnode == NULL)
+		{
+			/* nothing to read, sleep until someone adds poll */
+			pthread_cond_wait(&server->wake, &server->lock);
+			continue;
+		}
+
+		if (!m2md_sched_expired(bnode, &now))
+		{
+			/* earliest block is not due yet, sleep until it is,
+			 * or until polls change. Deadline is copied, as
+			 * block can be gone after replan, while we wait */
+			wake = bnode->deadline;
+			pthread_cond_timedwait(&server->wake, &server->lock, &wake);
+			continue;
+		}
+
+		/* block has expired, move its timer for next read,
+		 * before we release lock */
+		block = m2md_sched_entry(bnode, struct m2md_rp_block, sched);
+		m2md_modbus_server_read_request(server, block, &rd);
+		m2md_modbus_server_next_read(server, block, now);
+		m2md_sched_update(&server->sched, bnode);
+
+		/* reading may take a while, don't keep polls locked
+		 * while waiting for the device, publish will lock
+		 * and check if block is still valid by itself */
+		pthread_mutex_unlock(&server->lock);
+		if (m2md_modbus_conn_read(conn, &rd, regs) == 0)
+		{
+			m2md_modbus_conn_breaker(conn, 1);
+			m2md_modbus_server_publish_block(server, &rd, regs);
+		}
+		else if (m2md_modbus_is_exception(errno))
+		{
+			m2md_modbus_server_exception(server, &rd, errno);
+			m2md_modbus_conn_breaker(conn, 1);
+		}
+		else
+			m2md_modbus_conn_breaker(conn, 0);
+		pthread_mutex_lock(&server->lock);
+	}
+
+	/* never reached, server threads are not stopped yet */
+	return NULL;
+}
+
+
+/* ==========================================================================
+    Returns 1 when 'deadline' has passed 'now'.
+   ========================================================================== */
+static int m2md_modbus_expired
+(
+	struct timespec  deadline,  /* deadline to check */
+	struct timespec  now        /* current absolute time */
+)
+{
+	return m2md_timing_ns(m2md_timing_sub(now, deadline)) >= 0;
+}
+
+
+/* ==========================================================================
+    Closes 'conn' socket, whatever it was doing.
+
+    server->lock must be held.
+   ========================================================================== */
+static void m2md_modbus_engine_close
+(
+	struct m2md_engine       *engine,  /* engine handling the server */
+	struct m2md_server_conn  *conn     /* connection to close */
+)
+{
+	/* closing socket would remove it from epoll anyway,
+	 * but this way we are sure no stale event will come */
+	if (conn->tcp.fd >= 0)
+		epoll_ctl(engine->epfd, EPOLL_CTL_DEL, conn->tcp.fd, NULL);
+
+	m2md_mbtcp_close(&conn->tcp);
+	conn->tx_blocked = 0;
+
+	m2md_breaker_conn_down(&conn->server->breaker, &conn->health);
+}
+
+
+/* ==========================================================================
+    Drops 'conn' to the server. As long as other connections of the server
+    work, only this one is reconnected, after some time. Each next failure
+    makes it wait two times longer, up to configured limit, just like with
+    threads.
+
+    When it was the last working connection, whole server is considered
+    dead and its circuit breaker opens. All connections are closed, and
+    only the first one will try to connect again, as a probe, once breaker
+    timeout expires.
+
+    server->lock must be held.
+   ========================================================================== */
+static void m2md_modbus_engine_disconnect
+(
+	struct m2md_engine       *engine,  /* engine handling the server */
+	struct m2md_server_conn  *conn,    /* connection to drop */
+	struct timespec           now      /* current absolute time */
+)
+{
+	struct m2md_server       *server;  /* server of the connection */
+	struct timespec           wait;    /* time to wait before reconnect */
+	int                       i;       /* iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	server = conn->server;
+	m2md_modbus_engine_close(engine, conn);
+
+	if (server->breaker.nhealthy > 0)
+	{
+		el_print(ELW, "modbus server %s:%d, conn %d disconnected, "
+				"reconnecting in %d seconds", server->ip, server->port,
+				conn->id, conn->conn_to);
+
+		wait.tv_sec = conn->conn_to;
+		wait.tv_nsec = 0;
+		conn->io_deadline = m2md_timing_add(now, wait);
+
+		conn->conn_to *= 2;
+		if (conn->conn_to > m2md_cfg->modbus_max_re_time)
+			conn->conn_to = m2md_cfg->modbus_max_re_time;
+
+		return;
+	}
+
+	/* connections that are still connecting, or have not
+	 * been answered yet, are probes, and there must be
+	 * only one probe at a time */
+	for (i = 0; i != server->npool; ++i)
+		m2md_modbus_engine_close(engine, &server->pool[i]);
+
+	m2md_modbus_breaker_open(server, now);
+	server->pool[0].io_deadline = server->breaker.until;
+}
+
+
+/* ==========================================================================
+    Returns how many requests can wait for response on 'conn' at once.
+    Until connection gets its first response, first request is a probe,
+    and nothing else is sent until it's answered. Window is the same for
+    every server, just like timeouts and pool size are, poll list has no
+    place for per server options.
+
+    server->lock must be held.
+   ========================================================================== */
+static int m2md_modbus_engine_window
+(
+	struct m2md_server_conn  *conn  /* connection to check window of */
+)
+{
+	if (!conn->health.healthy)
+		return 1;
+
+	return m2md_cfg->modbus_window;
+}
+
+
+/* ==========================================================================
+    Returns 1 when server of 'conn' has something to write, and 'conn'
+    could send it right away. Write frame can be much bigger than read,
+    so there must be room in transmit buffer for the biggest one.
+
+    server->lock must be held.
+   ========================================================================== */
+static int m2md_modbus_engine_can_write
+(
+	struct m2md_server_conn  *conn  /* connection to check */
+)
+{
+	return conn->server->writes.nwrites != 0 &&
+		sizeof(conn->tcp.tx) - conn->tcp.txlen >= M2MD_MBTCP_ADU_MAX;
+}
+
+
+/* ==========================================================================
+    Finds next event of 'conn' and stores it in 'next'. Connection waits
+    for its earliest block, if there is still room in window to send it,
+    or for timeout of what it waits for - connection, responses or
+    reconnect - whichever comes first. 'first' is server's earliest block.
+    Pending writes don't wait for anything, they are sent as soon as
+    there is room for them.
+
+    Returns 1 when 'next' is set, or 0 when connection has nothing to do.
+
+    server->lock must be held.
+   ========================================================================== */
+static int m2md_modbus_engine_conn_next
+(
+	struct m2md_server_conn  *conn,   /* connection to check */
+	struct m2md_sched_node   *first,  /* server's earliest block */
+	struct timespec          *next    /* next event of connection */
+)
+{
+	int                       write;  /* connection can send write */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (conn->tcp.state == M2MD_MBTCP_CONNECTING)
+	{
+		*next = conn->io_deadline;
+		return 1;
+	}
+
+	write = m2md_modbus_engine_can_write(conn);
+
+	if ((first == NULL && !write) ||
+			conn->tcp.nreqs >= m2md_modbus_engine_window(conn))
+	{
+		if (conn->tcp.nreqs == 0)
+			return 0; /* nothing to read, nothing to wait for */
+
+		/* can't send anything now, wait for responses */
+		*next = conn->io_deadline;
+		return 1;
+	}
+
+	if (conn->tcp.state == M2MD_MBTCP_CLOSED)
+	{
+		/* while server is down, only first connection
+		 * probes it, others wait for breaker to close */
+		if (conn->server->breaker.state != M2MD_BREAKER_CLOSED &&
+				conn->id != 0)
+			return 0;
+
+		/* there is something to read or write, but we need to
+		 * connect first, and not sooner than backoff allows */
+		*next = conn->io_deadline;
+		return 1;
+	}
+
+	if (write)
+	{
+		/* write can go right now */
+		next->tv_sec = 0;
+		next->tv_nsec = 0;
+		return 1;
+	}
+
+	if (conn->tcp.nreqs == 0 || m2md_timing_ns(
+				m2md_timing_sub(first->deadline,
+					conn->io_deadline)) < 0)
+		*next = first->deadline;
+	else
+		*next = conn->io_deadline;
+
+	return 1;
+}
+
+
+/* ==========================================================================
+    Updates position of 'server' in 'engine' scheduler. Server is scheduled
+    on the earliest event of all its connections. Server that has nothing
+    to read and nothing to wait for is removed from scheduler, engine will
+    be told when server gets new polls.
+
+    server->lock must be held.
+   ========================================================================== */
+static void m2md_modbus_engine_schedule
+(
+	struct m2md_engine      *engine,  /* engine handling the server */
+	struct m2md_server      *server   /* server to reschedule */
+)
+{
+	struct m2md_sched_node  *first;   /* server's earliest block */
+	struct timespec         *next;    /* next event of the server */
+	struct timespec          cnext;   /* next event of connection */
+	int                      found;   /* any connection has event */
+	int                      ret;     /* return code from function */
+	int                      i;       /* iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	first = m2md_sched_peek(&server->sched);
+	next = &server->next_poll.deadline;
+	found = 0;
+
+	for (i = 0; i != server->npool; ++i)
+	{
+		if (m2md_modbus_engine_conn_next(&server->pool[i], first, &cnext) == 0)
+			continue;
+
+		if (!found || m2md_timing_ns(m2md_timing_sub(cnext, *next)) < 0)
+			*next = cnext;
+
+		found = 1;
+	}
+
+	if (!found)
+	{
+		/* nothing to read, nothing to wait for */
+		if (server->next_poll.idx != M2MD_SCHED_NOT_QUEUED)
+			m2md_sched_delete(&engine->sched, &server->next_poll);
+
+		return;
+	}
+
+	if (server->next_poll.idx == M2MD_SCHED_NOT_QUEUED)
+		ret = m2md_sched_add(&engine->sched, &server->next_poll);
+	else
+		ret = m2md_sched_update(&engine->sched, &server->next_poll);
+
+	if (ret != 0)
+		el_perror(ELE, "m2md_sched_add(%s:%d)", server->ip, server->port);
+}
+
+
+/* ==========================================================================
+    Starts connecting 'conn' to its server. Connection is established in
+    the background, engine will be notified by epoll once it's done.
+
+    server->lock must be held.
+   ========================================================================== */
+static void m2md_modbus_engine_connect
+(
+	struct m2md_engine       *engine,  /* engine handling the server */
+	struct m2md_server_conn  *conn,    /* connection to connect */
+	struct timespec           now      /* current absolute time */
+)
+{
+	struct m2md_server       *server;  /* server to connect to */
+	struct epoll_event        ev;      /* epoll event for socket */
+	struct timespec           wait;    /* time to wait for connection */
+	int                       ret;     /* return code from function */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	server = conn->server;
+	el_print(ELN, "connecting to modbus %s:%d, conn %d",
+			server->ip, server->port, conn->id);
+
+	/* when server is down, connection and first response
+	 * that comes over it are the probe of the server */
+	if (server->breaker.state == M2MD_BREAKER_OPEN)
+		server->breaker.state = M2MD_BREAKER_HALF_OPEN;
+
+	if ((ret = m2md_mbtcp_connect(&conn->tcp, server->ip, server->port)) < 0)
+	{
+		el_perror(ELW, "m2md_mbtcp_connect(%s:%d, conn %d)",
+				server->ip, server->port, conn->id);
+		m2md_modbus_engine_disconnect(engine, conn, now);
+		return;
+	}
+
+	/* connection in progress is reported as writable socket,
+	 * established connection only cares about responses */
+	ev.events = ret == 0 ? EPOLLIN : EPOLLOUT;
+	ev.data.ptr = conn;
+	if (epoll_ctl(engine->epfd, EPOLL_CTL_ADD, conn->tcp.fd, &ev) != 0)
+	{
+		el_perror(ELE, "epoll_ctl(%s:%d)", server->ip, server->port);
+		m2md_modbus_engine_disconnect(engine, conn, now);
+		return;
+	}
+
+	if (ret == 0)
+	{
+		el_print(ELN, "connected to modbus server %s:%d, conn %d",
+				server->ip, server->port, conn->id);
+		return;
+	}
+
+	wait.tv_sec = M2MD_MODBUS_CONNECT_TIMEOUT;
+	wait.tv_nsec = 0;
+	conn->io_deadline = m2md_timing_add(now, wait);
+}
+
+
+/* ==========================================================================
+    Sends whatever requests are queued on 'conn'. If socket cannot take
+    them all, engine will wait for socket to become writable and try
+    again.
+
+    server->lock must be held.
+   ========================================================================== */
+static void m2md_modbus_engine_flush
+(
+	struct m2md_engine       *engine,  /* engine handling the server */
+	struct m2md_server_conn  *conn,    /* connection to flush */
+	struct timespec           now      /* current absolute time */
+)
+{
+	struct m2md_server       *server;  /* server of the connection */
+	struct epoll_event        ev;      /* epoll event for socket */
+	int                       ret;     /* return code from function */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	server = conn->server;
+
+	if ((ret = m2md_mbtcp_flush(&conn->tcp)) < 0)
+	{
+		el_perror(ELE, "m2md_mbtcp_flush(%s:%d, conn %d)",
+				server->ip, server->port, conn->id);
+		m2md_modbus_engine_disconnect(engine, conn, now);
+		return;
+	}
+
+	if (ret == conn->tx_blocked)
+		return; /* epoll already waits for what it should */
+
+	conn->tx_blocked = ret;
+	ev.events = ret ? EPOLLIN | EPOLLOUT : EPOLLIN;
+	ev.data.ptr = conn;
+	if (epoll_ctl(engine->epfd, EPOLL_CTL_MOD, conn->tcp.fd, &ev) != 0)
+	{
+		el_perror(ELE, "epoll_ctl(%s:%d)", server->ip, server->port);
+		m2md_modbus_engine_disconnect(engine, conn, now);
+	}
+}
+
+
+/* ==========================================================================
+    Returns connection of 'server' with least requests waiting for
+    response, that still has room for another one, or NULL when all
+    windows are full. When 'write' is set, connection must also have
+    room for write request in its transmit buffer.
+
+    server->lock must be held.
+   ========================================================================== */
+static struct m2md_server_conn *m2md_modbus_engine_pick
+(
+	struct m2md_server       *server,  /* server to pick connection of */
+	int                       write    /* request is write */
+)
+{
+	struct m2md_server_conn  *conn;    /* picked connection */
+	struct m2md_server_conn  *c;       /* current connection */
+	int                       i;       /* iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	conn = NULL;
+	for (i = 0; i != server->npool; ++i)
+	{
+		c = &server->pool[i];
+		if (c->tcp.state != M2MD_MBTCP_CONNECTED ||
+				c->tcp.nreqs >= m2md_modbus_engine_window(c) ||
+				(write && !m2md_modbus_engine_can_write(c)))
+			continue;
+
+		if (conn == NULL || c->tcp.nreqs < conn->tcp.nreqs)
+			conn = c;
+	}
+
+	return conn;
+}
+
+
+/* ==========================================================================
+    Sends pending writes and then requests for all expired blocks of the
+    'server'. Writes go first, so they never wait behind reads. Each request
+    goes to connection with least requests waiting for response, so
+    reads are spread evenly, and connection that is slow to respond, gets
+    less of them. When all windows are full, the rest waits for responses.
+    If socket cannot take all requests, engine will wait for socket to
+    become writable and try again.
+
+    server->lock must be held.
+   ========================================================================== */
+static void m2md_modbus_engine_send
+(
+	struct m2md_engine       *engine,  /* engine handling the server */
+	struct m2md_server       *server,  /* server to send requests to */
+	struct timespec           now      /* current absolute time */
+)
+{
+	struct m2md_sched_node   *bnode;   /* block's scheduler node */
+	struct m2md_rp_block     *block;   /* block to read */
+	struct m2md_server_conn  *conn;    /* connection to send request on */
+	struct m2md_server_conn  *c;       /* current connection */
+	struct m2md_server_read   rd;      /* read request */
+	struct timespec           wait;    /* time to wait for response */
+	int                       slot;    /* slot of sent request */
+	int                       i;       /* iterator */
+	uint16_t                  values[MODBUS_MAX_WRITE_REGISTERS];
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	wait = m2md_timing_ts(server->rtt.rto);
+
+	while (server->writes.nwrites != 0 &&
+			(conn = m2md_modbus_engine_pick(server, 1)) != NULL)
+	{
+		m2md_modbus_server_take_write(server, &rd, values);
+
+		if (conn->tcp.nreqs == 0)
+			conn->io_deadline = m2md_timing_add(now, wait);
+
+		if ((slot = m2md_mbtcp_send_write(&conn->tcp, rd.uid, rd.func,
+						rd.reg, rd.count, values)) < 0)
+		{
+			el_perror(ELE, "write: m2md_mbtcp_send_write(%d, %d, %d, %d)",
+					rd.func, rd.reg, rd.count, rd.uid);
+			m2md_modbus_engine_disconnect(engine, conn, now);
+			continue;
+		}
+
+		conn->inflight[slot] = rd;
+		conn->sent[slot] = now;
+	}
+
+	while ((bnode = m2md_sched_peek(&server->sched)) != NULL &&
+			m2md_sched_expired(bnode, &now))
+	{
+		if ((conn = m2md_modbus_engine_pick(server, 0)) == NULL)
+			break; /* no room on any connection */
+
+		block = m2md_sched_entry(bnode, struct m2md_rp_block, sched);
+		m2md_modbus_server_read_request(server, block, &rd);
+		m2md_modbus_server_next_read(server, block, now);
+		m2md_sched_update(&server->sched, bnode);
+
+		if (rd.func != M2MD_MODBUS_FUNC_READ_INPUT_REG &&
+				rd.func != M2MD_MODBUS_FUNC_READ_MULTI_HOLD_REG &&
+				!m2md_modbus_func_bits(rd.func))
+			continue_print(ELW, "poll: invalid modbus function passed %d",
+					rd.func);
+
+		if (conn->tcp.nreqs == 0)
+			/* window was empty, start counting
+			 * time server has to respond */
+			conn->io_deadline = m2md_timing_add(now, wait);
+
+		if ((slot = m2md_mbtcp_send_read(&conn->tcp, rd.uid, rd.func,
+						rd.reg, rd.count)) < 0)
+		{
+			el_perror(ELE, "poll: m2md_mbtcp_send_read(%d, %d, %d, %d)",
+					rd.func, rd.reg, rd.count, rd.uid);
+			m2md_modbus_engine_disconnect(engine, conn, now);
+			continue;
+		}
+
+		conn->inflight[slot] = rd;
+		conn->sent[slot] = now;
+	}
+
+	/* requests are only queued above, push them
+	 * all at once, one write per connection */
+	for (i = 0; i != server->npool; ++i)
+	{
+		c = &server->pool[i];
+		if (c->tcp.state == M2MD_MBTCP_CONNECTED && c->tcp.txlen &&
+				!c->tx_blocked)
+			m2md_modbus_engine_flush(engine, c, now);
+	}
+}
+
+
+/* ==========================================================================
+    Handles expired timer of the 'server'. What it means depends on what
+    each connection is doing, we either have to connect, give up on
+    connection or responses that didn't come in time. Then, requests for
+    expired blocks are sent over connections that have room for them.
+
+    server->lock must be held.
+   ========================================================================== */
+static void m2md_modbus_engine_timeout
+(
+	struct m2md_engine       *engine,  /* engine handling the server */
+	struct m2md_server       *server,  /* server which timer has expired */
+	struct timespec           now      /* current absolute time */
+)
+{
+	struct m2md_server_conn  *conn;    /* current connection */
+	int                       i;       /* iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	for (i = 0; i != server->npool; ++i)
+	{
+		conn = &server->pool[i];
+
+		switch (conn->tcp.state)
+		{
+		case M2MD_MBTCP_CLOSED:
+			/* nothing to read nor write, or server is down and
+			 * this is not the connection that probes it */
+			if ((m2md_sched_peek(&server->sched) == NULL &&
+					server->writes.nwrites == 0) ||
+					(server->breaker.state != M2MD_BREAKER_CLOSED &&
+					 conn->id != 0))
+				break;
+
+			if (m2md_modbus_expired(conn->io_deadline, now))
+				m2md_modbus_engine_connect(engine, conn, now);
+			break;
+
+		case M2MD_MBTCP_CONNECTING:
+			if (!m2md_modbus_expired(conn->io_deadline, now))
+				break;
+
+			el_print(ELW, "modbus_connect(%s:%d, conn %d) failed: timed out",
+					server->ip, server->port, conn->id);
+			m2md_modbus_engine_disconnect(engine, conn, now);
+			break;
+
+		case M2MD_MBTCP_CONNECTED:
+			if (conn->tcp.nreqs == 0 ||
+					!m2md_modbus_expired(conn->io_deadline, now))
+				break;
+
+			/* server did not respond to anything for too long,
+			 * we don't know if responses are lost or just late,
+			 * so start over with fresh connection */
+			el_print(ELE, "poll: %s:%d, conn %d: %d requests timed out",
+					server->ip, server->port, conn->id, conn->tcp.nreqs);
+			m2md_timing_rtt_backoff(&server->rtt);
+			m2md_modbus_engine_disconnect(engine, conn, now);
+			break;
+		}
+	}
+
+	m2md_modbus_engine_send(engine, server, now);
+}
+
+
+/* ==========================================================================
+    Handles epoll 'events' on 'conn' socket. It's either end of
+    connecting, room for more requests, or responses to our requests.
+    Each response is published on mqtt, just like thread would do.
+
+    First response on connection makes it healthy, and when server was
+    down, it means probe passed and its breaker closes, so the rest of
+    connections can connect again.
+
+    server->lock must be held, it's released for the time of publishing.
+   ========================================================================== */
+static void m2md_modbus_engine_io
+(
+	struct m2md_engine       *engine,  /* engine handling the server */
+	struct m2md_server_conn  *conn,    /* connection with socket event */
+	uint32_t                  events,  /* what happened on socket */
+	struct timespec           now      /* current absolute time */
+)
+{
+	struct m2md_server       *server;  /* server of the connection */
+	struct epoll_event        ev;      /* epoll event for socket */
+	struct m2md_server_read   rd;      /* request that got response */
+	struct timespec           wait;    /* time to wait for response */
+	int                       slot;    /* slot of request */
+	int                       ret;     /* return code */
+	int                       err;     /* errno of response */
+	int                       i;       /* iterator */
+	uint16_t                  regs[MODBUS_MAX_READ_REGISTERS];
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	server = conn->server;
+
+	if (conn->tcp.state == M2MD_MBTCP_CONNECTING)
+	{
+		if (m2md_mbtcp_finish_connect(&conn->tcp) != 0)
+		{
+			el_print(ELW, "modbus_connect(%s:%d, conn %d) failed: %s",
+					server->ip, server->port, conn->id, strerror(errno));
+			m2md_modbus_engine_disconnect(engine, conn, now);
+			return;
+		}
+
+		ev.events = EPOLLIN;
+		ev.data.ptr = conn;
+		if (epoll_ctl(engine->epfd, EPOLL_CTL_MOD, conn->tcp.fd, &ev) != 0)
+		{
+			el_perror(ELE, "epoll_ctl(%s:%d)", server->ip, server->port);
+			m2md_modbus_engine_disconnect(engine, conn, now);
+			return;
+		}
+
+		el_print(ELN, "connected to modbus server %s:%d, conn %d",
+				server->ip, server->port, conn->id);
+		return;
+	}
+
+	if (conn->tcp.state != M2MD_MBTCP_CONNECTED)
+		return;
+
+	if (events & EPOLLOUT)
+	{
+		/* there is room for requests that didn't fit before */
+		m2md_modbus_engine_flush(engine, conn, now);
+		if (conn->tcp.state != M2MD_MBTCP_CONNECTED)
+			return;
+	}
+
+	if ((events & (EPOLLIN | EPOLLERR | EPOLLHUP)) == 0)
+		return;
+
+	/* single read may bring many responses, take them all */
+	for (;;)
+	{
+		ret = m2md_mbtcp_recv(&conn->tcp, regs, &slot);
+		err = errno;
+		if (ret == 1)
+			return; /* nothing more for now */
+
+		if (ret != 0 && !m2md_modbus_is_exception(errno))
+		{
+			el_print(ELE, "poll: modbus %s:%d, conn %d: %s", server->ip,
+					server->port, conn->id, modbus_strerror(errno));
+			m2md_modbus_engine_disconnect(engine, conn, now);
+			return;
+		}
+
+		if (ret != 0)
+			/* server didn't like our request, but connection
+			 * is fine, so just move on to next response */
+			el_print(ELD, "poll: modbus_%s_%d(%d, %d, %d): %s ",
+					m2md_modbus_func_write(conn->inflight[slot].func) ?
+					"write" : "read",
+					conn->inflight[slot].func, conn->inflight[slot].reg,
+					conn->inflight[slot].count, conn->inflight[slot].uid,
+					modbus_strerror(errno));
+
+		/* server is alive and responds, learn how fast
+		 * it was and give it some more time for the rest */
+		m2md_timing_rtt_sample(&server->rtt, m2md_timing_ns(
+					m2md_timing_sub(now, conn->sent[slot])));
+		wait = m2md_timing_ts(server->rtt.rto);
+		conn->io_deadline = m2md_timing_add(now, wait);
+
+		if (!conn->health.healthy)
+		{
+			/* that was the probe of connection, and it
+			 * passed, rest of the window is open again */
+			m2md_breaker_conn_up(&server->breaker, &conn->health);
+			conn->conn_to = 1;
+		}
+
+		if (server->breaker.state != M2MD_BREAKER_CLOSED)
+		{
+			/* and it was the probe of the whole server too,
+			 * other connections may connect right away */
+			m2md_modbus_breaker_close(server, now);
+			for (i = 0; i != server->npool; ++i)
+				if (&server->pool[i] != conn)
+					server->pool[i].io_deadline = now;
+		}
+
+		if (m2md_modbus_func_write(conn->inflight[slot].func))
+			continue; /* nothing to publish */
+
+		/* copy request, as publishing is done without
+		 * lock, and slot may be reused in the meantime */
+		rd = conn->inflight[slot];
+		pthread_mutex_unlock(&server->lock);
+		if (ret != 0)
+			m2md_modbus_server_exception(server, &rd, err);
+		else
+			m2md_modbus_server_publish_block(server, &rd, regs);
+		pthread_mutex_lock(&server->lock);
+	}
+}
+
+
+/* ==========================================================================
+    Takes servers, which polls have changed, from 'engine' pending list,
+    rebuilds their read plans and puts them in proper place in engine's
+    scheduler.
+   ========================================================================== */
+static void m2md_modbus_engine_pending
+(
+	struct m2md_engine  *engine  /* engine to process pending list of */
+)
+{
+	struct m2md_server  *server; /* server taken from pending list */
+	uint64_t             cnt;    /* eventfd counter, not used */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	/* counter is reset before list is taken, so any server
+	 * put on list after that will wake us up again */
+	if (read(engine->evfd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+		el_perror(ELW, "read(eventfd)");
+
+	for (;;)
+	{
+		/* servers are taken one by one, as server that
+		 * is put back on list overwrites its next pointer */
+		pthread_mutex_lock(&engine->lock);
+		if ((server = engine->pending) != NULL)
+		{
+			engine->pending = server->pending_next;
+			server->pending = 0;
+		}
+		pthread_mutex_unlock(&engine->lock);
+
+		if (server == NULL)
+			return;
+
+		pthread_mutex_lock(&server->lock);
+		if (server->plan_dirty)
+			m2md_modbus_server_replan(server);
+
+		m2md_modbus_engine_schedule(engine, server);
+		pthread_mutex_unlock(&server->lock);
+	}
+}
+
+
+/* ==========================================================================
+    Thread of epoll engine. It sleeps until some socket has something to
+    say, or until earliest timer of its servers expires, and then does
+    whatever needs to be done without ever blocking, so single thread can
+    keep thousands of servers busy.
+   ========================================================================== */
+static void *m2md_modbus_engine_thread
+(
+	void                    *arg
+)
+{
+	struct m2md_engine      *engine = arg;
+	struct m2md_server      *server;  /* current server */
+	struct m2md_server_conn *conn;    /* connection with event */
+	struct m2md_sched_node  *snode;   /* server's scheduler node */
+	struct epoll_event       events[64];  /* events returned by epoll */
+	struct timespec          now;     /* current absolute time */
+	int64_t                  ms;      /* time to earliest timer */
+	int                      timeout; /* epoll_wait() timeout */
+	int                      n;       /* number of events */
+	int                      i;       /* iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	el_print(ELN, "starting epoll engine thread");
+
+	for (;;)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		timeout = -1;
+
+		if ((snode = m2md_sched_peek(&engine->sched)) != NULL)
+		{
+			/* round up, or we would wake up just before timer
+			 * expires, and spin until it finally does */
+			ms = m2md_timing_ns(m2md_timing_sub(snode->deadline, now));
+			ms = (ms + 999999) / 1000000;
+			timeout = ms < 0 ? 0 : ms > INT_MAX ? INT_MAX : ms;
+		}
+
+		n = epoll_wait(engine->epfd, events, 64, timeout);
+		if (n < 0)
+		{
+			if (errno != EINTR)
+				el_perror(ELE, "epoll_wait()");
+
+			n = 0;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		for (i = 0; i != n; ++i)
+		{
+			if ((conn = events[i].data.ptr) == NULL)
+			{
+				/* eventfd, someone changed polls */
+				m2md_modbus_engine_pending(engine);
+				continue;
+			}
+
+			server = conn->server;
+			pthread_mutex_lock(&server->lock);
+			m2md_modbus_engine_io(engine, conn, events[i].events, now);
+			m2md_modbus_engine_schedule(engine, server);
+			pthread_mutex_unlock(&server->lock);
+		}
+
+		/* for each server which timer has expired */
+		while ((snode = m2md_sched_peek(&engine->sched)) != NULL &&
+				m2md_sched_expired(snode, &now))
+		{
+			server = m2md_sched_entry(snode, struct m2md_server, next_poll);
+
+			pthread_mutex_lock(&server->lock);
+			m2md_modbus_engine_timeout(engine, server, now);
+			m2md_modbus_engine_schedule(engine, server);
+			pthread_mutex_unlock(&server->lock);
+		}
+	}
+
+	/* never reached, engines are not stopped yet */
+	return NULL;
+}
+
+
+/* ==========================================================================
+    Creates everything 'engine' needs and starts its thread.
+   ========================================================================== */
+static int m2md_modbus_engine_start
+(
+	struct m2md_engine  *engine  /* engine to start */
+)
+{
+	struct epoll_event   ev;     /* epoll event for eventfd */
+	int                  ret;    /* return code from function */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	engine->pending = NULL;
+
+	if ((engine->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		return_perror(ELE, "epoll_create1()");
+
+	if ((engine->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+		goto_perror(eventfd_error, ELE, "eventfd()");
+
+	/* eventfd is the only fd without connection */
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(engine->epfd, EPOLL_CTL_ADD, engine->evfd, &ev) != 0)
+		goto_perror(epoll_ctl_error, ELE, "epoll_ctl(eventfd)");
+
+	if (m2md_sched_init(&engine->sched) != 0)
+		goto_perror(epoll_ctl_error, ELE, "m2md_sched_init()");
+
+	ret = pthread_mutex_init(&engine->lock, NULL);
+	if (ret)
+		goto_perror(pthread_mutex_init_error, ELE, "pthread_mutex_init()");
+
+	ret = pthread_create(&engine->thandle, NULL,
+			m2md_modbus_engine_thread, engine);
+	if (ret)
+		goto_perror(pthread_create_error, ELE, "pthread_create()");
+
+	return 0;
+
+pthread_create_error:
+	pthread_mutex_destroy(&engine->lock);
+
+pthread_mutex_init_error:
+	m2md_sched_destroy(&engine->sched);
+
+epoll_ctl_error:
+	close(engine->evfd);
+
+eventfd_error:
+	close(engine->epfd);
+	return -1;
+}
+
+
+/* ==========================================================================
+    Creates server with 'ip' and 'port' and starts talking to it. Server
+    gets its connection threads, or is handed over to one of epoll
+    engines, and connects in the background, as soon as it has something
+    to read or write. Server starts without any polls.
+
+    Returns started server, or NULL on error.
+   ========================================================================== */
+static struct m2md_server *m2md_modbus_server_start
+(
+	const char               *ip,      /* ip of server to start */
+	int                       port     /* modbus port on the server */
+)
+{
+	struct m2md_server_msg    msg;     /* message to send to server thread */
+	struct m2md_server       *server;  /* modbus server description */
+	struct m2md_server_conn  *conn;    /* connection to the server */
+	pthread_condattr_t        cattr;   /* server's wake condition attrs */
+	int                       ret;     /* return code for some functions */
+	int                       i;       /* iterator */
+	int                       rtu;     /* ip is rtu device */
+	char                      dev[M2MD_MODBUS_ADDR_MAX];  /* rtu device */
+	char                      parity;  /* rtu line parity */
+	int                       data_bit; /* rtu line data bits */
+	int                       stop_bit; /* rtu line stop bits */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (strlen(ip) >= M2MD_MODBUS_ADDR_MAX)
+		return_print(NULL, EINVAL, ELW,
+				"server/start: server address too long");
+
+	/* absolute path means rtu device, anything else
+	 * should be ip address of modbus tcp server */
+	rtu = ip[0] == '/';
+
+	if (rtu && m2md_rtu_parse(ip, dev, &parity,
+				&data_bit, &stop_bit) != 0)
+		return_print(NULL, EINVAL, ELW,
+				"server/start: wrong rtu line settings %s", ip);
+
+	/* use ntohl function to parse and check if
+	 * passed ip address is actually ip address */
+	if (!rtu && ntohl(inet_addr(ip)) == INADDR_ANY)
+		return_print(NULL, EINVAL, ELW,
+				"server/start: wrong server address %s", ip);
+
+	if ((server = m2md_modbus_server_new(ip, port)) == NULL)
+	{
+		el_perror(ELE, "server/start: %s:%d, no memory for new server",
+				ip, port);
+		return NULL;
+	}
+
+	/* initialize modbus context, we only have to do this once */
+	el_print(ELN, "initializing modbus client for %s:%d", ip, port);
+
+	/* nothing is read from new server until first probe,
+	 * which is its first connection, says it's alive. Open
+	 * breaker has already expired, so probe is sent as soon
+	 * as server has something to read or write */
+	m2md_breaker_init(&server->breaker, m2md_cfg->modbus_max_re_time,
+			m2md_cfg->modbus_breaker_fails);
+	m2md_pl_init(&server->polls);
+	server->plan_dirty = 0;
+	server->next_poll.idx = M2MD_SCHED_NOT_QUEUED;
+	memset(&server->stats, 0x00, sizeof(server->stats));
+	m2md_timing_rtt_init(&server->rtt, m2md_cfg->modbus_rto_min * 1000000ll,
+			m2md_cfg->modbus_rto_max * 1000000ll);
+
+	/* each server starts its stagger sequence from
+	 * different point of the same golden sequence */
+	g_servers_phase += M2MD_MODBUS_GOLDEN_RATIO;
+	if (g_servers_phase >= 1.0)
+		g_servers_phase -= 1.0;
+	server->phase = g_servers_phase;
+	server->splits = 0;
+	server->ids = 0;
+	server->index_dirty = 0;
+	server->batch_flush.idx = M2MD_SCHED_NOT_QUEUED;
+	m2md_rp_init(&server->plan);
+	m2md_wq_init(&server->writes);
+	server->msgq = NULL;
+	server->engine = NULL;
+	server->rtu = rtu;
+
+	/* all units on rtu line are read by single connection,
+	 * so they never talk over each other */
+	server->npool = rtu ? 1 : m2md_cfg->modbus_pool;
+	server->nthreads = 0;
+
+	/* batch buffer is needed only when samples are batched,
+	 * destroyed batch simply takes no samples */
+	server->batch.buf = NULL;
+	m2md_batch_destroy(&server->batch);
+	if (m2md_cfg->mqtt_batch &&
+			m2md_batch_init(&server->batch, M2MD_BATCH_MAX) != 0)
+		goto_perror(batch_error, ELE, "server/start: m2md_batch_init()");
+
+	/* full topic of batches is built once, just like
+	 * topics of polls are */
+	server->batch_topic = NULL;
+	if (m2md_cfg->mqtt_batch &&
+			m2md_modbus_batch_topic(server) != 0)
+		goto_perror(batch_topic_error, ELE,
+				"server/start: m2md_modbus_batch_topic()");
+
+	server->batch_tid = M2MD_PUB_NO_TOPIC;
+	if (m2md_cfg->mqtt_batch && m2md_cfg->mqtt_publishers &&
+			(server->batch_tid = m2md_pub_topic(server->batch_topic)) ==
+			M2MD_PUB_NO_TOPIC)
+		el_perror(ELW, "server/start: m2md_pub_topic(%s)",
+				server->batch_topic);
+
+	if ((server->pool = calloc(server->npool, sizeof(*conn))) == NULL)
+		goto_perror(pool_error, ELE, "server/start: calloc(pool)");
+
+	for (i = 0; i != server->npool; ++i)
+	{
+		/* no connection is healthy until it connects */
+		conn = &server->pool[i];
+		conn->server = server;
+		conn->id = i;
+		conn->conn_to = 1;
+		m2md_mbtcp_init(&conn->tcp);
+	}
+
+	/* epoll engine knows only modbus tcp, rtu
+	 * bus always gets its own thread */
+	if (m2md_cfg->modbus_engine == M2MD_MODBUS_ENGINE_EPOLL && !rtu)
+	{
+		/* engine talks to server over its own non-blocking
+		 * sockets, there is no libmodbus context, queue nor
+		 * thread. Engine will connect once it sees server
+		 * has something to read */
+		server->pending = 0;
+		server->engine = &g_engines[g_engines_next];
+		g_engines_next = (g_engines_next + 1) % g_engines_n;
+	}
+	else
+	{
+		if (rtu)
+		{
+			server->gap_us = m2md_rtu_gap_us(port);
+			server->rtu_last.tv_sec = 0;
+			server->rtu_last.tv_nsec = 0;
+		}
+
+		/* each connection has its own libmodbus
+		 * context, and thread that uses it */
+		for (i = 0; i != server->npool; ++i)
+		{
+			conn = &server->pool[i];
+
+			if (rtu)
+				conn->modbus = modbus_new_rtu(dev, port, parity,
+						data_bit, stop_bit);
+			else
+				conn->modbus = modbus_new_tcp(ip, port);
+
+			if (conn->modbus == NULL)
+				goto_perror(modbus_new_error, ELE,
+						"server/start: modbus_new(%s, %d)", ip, port);
+
+			modbus_set_error_recovery(conn->modbus,
+					MODBUS_ERROR_RECOVERY_LINK |
+					MODBUS_ERROR_RECOVERY_PROTOCOL);
+			modbus_set_response_timeout(conn->modbus,
+					M2MD_MODBUS_CONNECT_TIMEOUT, 0);
+		}
+
+		/* Create queue on which server will receive
+		 * commands from main thread. All connection
+		 * threads read from it. */
+
+		if ((server->msgq = rb_new(16, sizeof(msg), O_MULTITHREAD)) == NULL)
+			goto_perror(modbus_new_error, ELE, "server/start: rb_new()");
+	}
 
+	if (m2md_sched_init(&server->sched) != 0)
+		goto_perror(m2md_sched_init_error, ELE, "server/start: m2md_sched_init()");
 
-/* ==========================================================================
-    Thread handling single server connection.
-   ========================================================================== */
-static void *m2md_modbus_server_thread
-(
-	void                   *arg
-)
-{
-	struct m2md_server     *server = arg;
-	struct m2md_server_msg  msg;
-	int                     ret;
-	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+	ret = pthread_mutex_init(&server->lock, NULL);
 
+	if (ret)
+		goto_perror(pthread_mutex_init_error, ELE,
+				"server/start: pthread_mutex_init()");
 
-	el_print(ELN, "starting thread for server %s:%d",
-			server->ip, server->port);
-	for (;;)
+	/* thread waits on condition with absolute time of next
+	 * block, and these are taken from monotonic clock */
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+	ret = pthread_cond_init(&server->wake, &cattr);
+	pthread_condattr_destroy(&cattr);
+
+	if (ret)
+		goto_perror(pthread_cond_init_error, ELE,
+				"server/start: pthread_cond_init()");
+
+	/* mark server as running before thread starts, thread
+	 * clears it when it exits */
+	server->running = 1;
+
+	/* epoll engine is already running, only threads
+	 * of thread engine need to be started, one for each
+	 * connection */
+	for (i = 0; server->engine == NULL && i != server->npool; ++i)
 	{
-		/* wait for command to arrive */
-		if (rb_read(server->msgq, &msg, 1) != 1)
-		{
-			if (errno == ECANCELED)
-				/* someone called rb_stop() on us, we should
-				 * stop using msgq at once!  */
-				goto end_of_the_road;
+		conn = &server->pool[i];
 
-			/* should not happen, but world is a strange place */
-			el_perror(ELW, "rb_read()");
+		/* counted before thread starts, as
+		 * thread decrements it when it exits */
+		pthread_mutex_lock(&server->lock);
+		++server->nthreads;
+		pthread_mutex_unlock(&server->lock);
+
+		if (m2md_cfg->modbus_sched == M2MD_MODBUS_SCHED_SERVER)
+			ret = pthread_create(&conn->thandle, NULL,
+					m2md_modbus_server_sched_thread, conn);
+		else
+			ret = pthread_create(&conn->thandle, NULL,
+					m2md_modbus_server_thread, conn);
+
+		if (ret == 0)
 			continue;
-		}
 
-		/* message received, what does it say?  */
-		switch (msg.cmd)
-		{
-		/* hmm, connection initialization, huh? Right on that */
+		pthread_mutex_lock(&server->lock);
+		--server->nthreads;
+		pthread_mutex_unlock(&server->lock);
 
-		case M2MD_SERVER_MSG_CONNECT:
-			/* in case someone wants to reconnect
-			 * while still being connected */
-			modbus_close(server->modbus);
+		if (i == 0)
+			goto_perror(pthread_create_error, ELE,
+					"server/start: pthread_create()");
 
-			el_print(ELN, "connecting to modbus %s:%d",
-					server->ip, server->port);
+		/* some connections are already running, server
+		 * will have to make do with smaller pool */
+		el_perror(ELW, "server/start: pthread_create(%s:%d, conn %d)",
+				ip, port, i);
 
-			if (modbus_connect(server->modbus) == 0)
-				/* connection was a success, open the champagne!  */
-				break_print(ELN, "connected to modbus server %s:%d",
-						server->ip, server->port);
+		pthread_mutex_lock(&server->lock);
+		for (; i != server->npool; ++i)
+			modbus_free(server->pool[i].modbus);
+		server->npool = server->nthreads;
+		pthread_mutex_unlock(&server->lock);
+		break;
+	}
 
-			/* we failed to connect, client could be dead, sleep
-			 * for some time before reconnecting */
-			el_print(ELW, "modbus_connect(%s:%d) failed: %s, "
-					"reconnecting in %d seconds", server->ip,
-					server->port, modbus_strerror(errno), server->conn_to);
-
-			sleep(server->conn_to);
-
-			/* next sleep will be two times longer (if we still
-			 * cannot connect) but don't sleep longer than
-			 * configured time, like ever.  */
-			server->conn_to *= 2;
-			if (server->conn_to > m2md_cfg->modbus_max_re_time)
-				server->conn_to = m2md_cfg->modbus_max_re_time;
-
-			/* send connect command back to ourselfs, so we try to
-			 * reconnect to the server. Before sending message
-			 * clear communication buffer, it's not like any of
-			 * them will succeed without active connection.  */
-			if (m2md_modbus_server_reconnect(server->msgq) != 0)
-				goto end_of_the_road;
+	return server;
 
-			break;
+pthread_create_error:
+	server->running = 0;
+	pthread_cond_destroy(&server->wake);
 
+pthread_cond_init_error:
+	pthread_mutex_destroy(&server->lock);
 
-			/* we are suppose to poll for data and
-			 * publish it on mqtt bus */
-		case M2MD_SERVER_MSG_POLL:
-		{
-			uint16_t  rval[2];    /* read value from modbus */
-			float     data;       /* data to send over mqtt */
-			int       ret;        /* return code from functions */
-			int       tl;         /* topic length - from snprintf */
-			int       i;          /* iterator */
-			int       regind;     /* register position in reg2topic map */
-			char      topic[M2MD_TOPIC_MAX + 1];  /* topic to publish */
-			/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+pthread_mutex_init_error:
+	m2md_sched_destroy(&server->sched);
 
+m2md_sched_init_error:
+	if (server->msgq)
+		rb_destroy(server->msgq);
 
-			/* set unit id */
-			if (modbus_set_slave(server->modbus, msg.data.poll.uid) != 0)
-				continue_print(ELW, "poll: invalid unit id set: %d",
-						msg.data.poll.uid);
+modbus_new_error:
+	for (i = 0; i != server->npool; ++i)
+		modbus_free(server->pool[i].modbus);
 
-			/* what function should we use to read bits?  */
-			switch (msg.data.poll.func)
-			{
-			case M2MD_MODBUS_FUNC_READ_INPUT_REG:
-				ret = modbus_read_input_registers(server->modbus,
-						msg.data.poll.reg, msg.data.poll.field_width,
-						rval) != msg.data.poll.field_width;
-				break;
+	free(server->pool);
 
-			case M2MD_MODBUS_FUNC_READ_MULTI_HOLD_REG:
-				ret = modbus_read_registers(server->modbus,
-						msg.data.poll.reg, msg.data.poll.field_width,
-						rval) != msg.data.poll.field_width;
-				break;
+pool_error:
+	server->pool = NULL;
+	free(server->batch_topic);
+	server->batch_topic = NULL;
 
-			default:
-				continue_print(ELW, "poll: invalid modbus function passed %d",
-						msg.data.poll.func);
-			}
+batch_topic_error:
+	m2md_batch_destroy(&server->batch);
 
-			/* message sent, but was it successfull?  */
-			if (ret != 0)
-				/* sadly not, problems with sending and receiving
-				 * data over modbustcp is usually due to connection
-				 * problem.  It may not be, but meh, who care
-				 * really. We don't reconnect here manually,
-				 * libmodbus shall do it for us since we have error
-				 * handling enabled.  */
-				continue_print(ELE, "poll: modbus_read_%d(%d, %d): %s ",
-						msg.data.poll.func, msg.data.poll.reg,
-						msg.data.poll.uid, modbus_strerror(errno));
-
-			/* message received, now transform it into mqtt */
-
-			/* prepare data to send, received data is just imaginary value
-			 * without unit, we apply scale factor to convert value to
-			 * known unit.  */
-
-			if (msg.data.poll.field_width == 1)
-			{
-				/* data is signed, we need to treat data in rval as
-				 * signed so compiler can generate proper assembly
-				 * instruction for signed multiplication */
-				if (msg.data.poll.is_signed)
-					data = (int16_t)rval[0];
-				else
-					data = rval[0];
-			}
-			else
-			{
-				uint32_t  val;
-				/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+batch_error:
+	return NULL;
+}
 
 
-				val = rval[1] | ((uint32_t)rval[0] << 16);
 
-				if (msg.data.poll.is_signed)
-					data = (int32_t)val;
-				else
-					data = val;
-			}
 
-			data *= msg.data.poll.scale;
+/* ==========================================================================
+    Converts 'data' received on command topic of 'cmd' into raw registers
+    'rval', that's reverse of what m2md_modbus_poll_value() does. Value
+    that does not fit into registers is not clamped, writing something
+    else than what was asked for, is worse than not writing at all.
+   ========================================================================== */
+static int m2md_modbus_cmd_value
+(
+	const struct m2md_pl_data  *cmd,   /* command to convert value for */
+	float                       data,  /* value in real units */
+	uint16_t                   *rval   /* raw registers go here */
+)
+{
+	double                      raw;   /* value in register units */
+	double                      min;   /* min value registers can hold */
+	double                      max;   /* max value registers can hold */
+	int64_t                     val;   /* raw value, rounded */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
-			/* we are ready to publish message, so what are you
-			 * waiting for? hit em with it!  */
-			el_print(ELD, "poll publish: %s: %f", msg.data.poll.topic, data);
-			if (m2md_mqtt_publish(msg.data.poll.topic, &data, sizeof(data)) != 0)
-				el_perror(ELE, "poll: mqtt_publish(%s, %ld) failed",
-						topic, (long)sizeof(data));
-		}
-		}
+
+	raw = data / cmd->scale;
+
+	if (cmd->field_width < 2)
+	{
+		min = cmd->is_signed ? INT16_MIN : 0;
+		max = cmd->is_signed ? INT16_MAX : UINT16_MAX;
+	}
+	else
+	{
+		min = cmd->is_signed ? INT32_MIN : 0;
+		max = cmd->is_signed ? INT32_MAX : UINT32_MAX;
 	}
 
-end_of_the_road:
-	modbus_close(server->modbus);
-	modbus_free(server->modbus);
+	/* nan fails both comparisons, so it goes out too */
+	if (!(raw >= min - 0.5 && raw < max + 0.5))
+		return_errno(ERANGE);
 
-modbus_tcp_new_error:
-	m2md_pl_destroy(server->polls);
-	rb_destroy(server->msgq);
+	val = raw < 0 ? (int64_t)(raw - 0.5) : (int64_t)(raw + 0.5);
 
-	/* this will use as flag to indicate if thread
-	 * is still running or not */
-	server->modbus = NULL;
-	return NULL;
+	if (cmd->field_width < 2)
+	{
+		rval[0] = (uint16_t)val;
+		return 0;
+	}
+
+	rval[0] = (uint32_t)val >> 16;
+	rval[1] = (uint32_t)val & 0xffff;
+	return 0;
 }
 
 
@@ -362,14 +3697,35 @@ int m2md_modbus_init
 	void
 )
 {
-	int   i;  /* teh iterator */
+	int  i;  /* teh iterator */
 	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
 
-	/* just nullify 'modbus' field, to indicate
-	 * all slots are free after initialization */
-	for (i = 0; i != M2MD_SERVERS_MAX; ++i)
-		servers[i].modbus = NULL;
+	/* servers table is empty and grows as servers
+	 * are added, so there is nothing to do for it */
+	memset(&g_servers, 0x00, sizeof(g_servers));
+	clock_gettime(CLOCK_MONOTONIC, &g_stats_last);
+	if (m2md_sched_init(&g_servers_sched) != 0)
+		return -1;
+
+	if (m2md_sched_init(&g_batch_sched) != 0)
+		return -1;
+
+	el_print(ELI, "batch decoder kernel: %s", m2md_decode_kernel());
+
+	if (m2md_cfg->modbus_engine != M2MD_MODBUS_ENGINE_EPOLL)
+		return 0;
+
+	/* engines are started up front, and servers are
+	 * spread across them as they are created */
+	g_engines_n = m2md_cfg->modbus_engine_threads;
+	g_engines_next = 0;
+	if ((g_engines = calloc(g_engines_n, sizeof(*g_engines))) == NULL)
+		return_perror(ELF, "calloc(engines)");
+
+	for (i = 0; i != g_engines_n; ++i)
+		if (m2md_modbus_engine_start(&g_engines[i]) != 0)
+			return -1;
 
 	return 0;
 }
@@ -381,120 +3737,42 @@ int m2md_modbus_init
    ========================================================================== */
 int m2md_modbus_add_poll
 (
-	struct m2md_pl_data      *poll,    /* register to poll */
-	const char               *ip,      /* ip of server to poll */
-	int                       port     /* modbus port on the server */
+	struct m2md_pl_data  *poll,    /* register to poll */
+	const char           *ip,      /* ip of server to poll */
+	int                   port     /* modbus port on the server */
 )
 {
-	struct m2md_server_msg    msg;     /* message to send to server thread */
-	struct m2md_server       *server;  /* modbus server description */
-	int                       sid;     /* existing server index */
-	int                       ret;     /* return code for some functions */
+	struct m2md_server   *server;  /* modbus server description */
+	char                  topic[M2MD_TOPIC_MAX];  /* full topic of poll */
 	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
 
-	/* use ntohl function to parse and check if
-	 * passed ip address is actually ip address */
-	if (ntohl(inet_addr(ip)) == INADDR_ANY)
-		return_print(-1, EINVAL, ELW, "poll/add: wrong server address %s", ip);
-
-	if ((sid = m2md_modbus_server_find(ip, port)) >= 0)
-	{
-		/* Server already exists, just push add request to server. */
-		server = servers + sid;
-		poll->next_read.tv_sec = 0;
-		poll->next_read.tv_nsec = 0;
-		pthread_mutex_lock(&server->lock);
-		if (m2md_pl_add(&server->polls, poll) != 0)
-		{
-			/* "Noooo i w pizdu... i cały misterny plan też w pizdu"
-			 *      ~Siara
-			 *
-			 *  This will happen when memory is exhausted in the
-			 *  system, we don't remove client, memory may be freed and
-			 *  we will continue then */
-			pthread_mutex_unlock(&server->lock);
-			el_perror(ELE, "poll/add: m2md_pl_add(%s:%d, %s)",
-					ip, port, poll->topic);
-			return -1;
-		}
-
-		pthread_mutex_unlock(&server->lock);
+	/* poll is published on full topic, with base topic from
+	 * config, that is built only once, here, so publishing
+	 * sample doesn't have to format anything */
+	if (m2md_mqtt_topic(topic, sizeof(topic), poll->topic) < 0)
+		return_print(-1, ENOBUFS, ELW, "poll/add: %s: topic too long",
+				poll->topic);
 
-		/* new poll has been added, send signal to main thread so
-		 * it exits sleep and process new signal. It is crucial as
-		 * main might be sleeping for... let's say 10 minuts, and
-		 * new poll requires polling once every 1 second. Without
-		 * the signal it would take 10 minutes to start sending new
-		 * poll once a second. Not an ideal situation, is it? */
-		pthread_kill(g_main_thread_t, SIGUSR2);
-		el_print(ELN, "poll/add finished: host: %s:%d, topic: %s, scale: %f, "
-				"type: %c%d, reg: %d, uid: %d, func: %d, "
-				"poll_s: %ld, poll_ms: %d",
-				ip, port, poll->topic, poll->scale,
-				poll->is_signed ? '-' : '+', poll->field_width,
-				poll->reg, poll->uid, poll->func, poll->poll_time.tv_sec,
-				poll->poll_time.tv_nsec / 1000000);
+	/* topic id is given by server, once poll is on its list */
+	poll->id = 0;
 
-#if 0
-		/* publish ack on mqtt bus, maybe someone is listening */
-		m2md_mqtt_publish_add_ack(poll, ip, port);
-#endif
-		return 0;
-	}
+	/* decoder is picked here, once, so reads don't have
+	 * to look at poll type every time they publish */
+	if ((poll->decode = m2md_modbus_decoder(poll)) == NULL)
+		return_print(-1, EINVAL, ELW, "poll/add: %s: unknown type %d "
+				"or order %d", poll->topic, poll->type, poll->order);
 
 	/* First request for that server, create new thread with
 	 * server connection and let that thread take it from here. */
-	if ((sid = m2md_modbus_server_find_free()) < 0)
-		return_print(-1, ENOSPC, ELW,
-				"poll/add: %s, no free slots", poll->topic);
-
-	/* initialize modbus context, we only have to do this once */
-	el_print(ELN, "initializing modbus client for %s:%d", ip, port);
-	server = servers + sid;
-	strcpy(server->ip, ip);
-
-	server->conn_to = 1;
-	server->port = port;
-	server->modbus = modbus_new_tcp(ip, port);
-	if (server->modbus == NULL)
-		goto_perror(modbus_tcp_new_error, ELE,
-				"poll/add: modbus_tcp_new(%s, %d)", ip, port);
-
-	modbus_set_error_recovery(server->modbus,
-			MODBUS_ERROR_RECOVERY_LINK | MODBUS_ERROR_RECOVERY_PROTOCOL);
-	modbus_set_response_timeout(server->modbus, 2, 0);
-
-	/* Create queue on which server will receive
-	 * commands from main thread. */
-
-	if ((server->msgq = rb_new(16, sizeof(msg), O_MULTITHREAD)) == NULL)
-		goto_perror(rb_new_error, ELE, "poll/add: rb_new()");
-
-	ret = pthread_mutex_init(&server->lock, NULL);
-
-	if (ret)
-		goto_perror(pthread_mutex_init_error, ELE,
-				"poll/add: pthread_mutex_init()");
-
-	ret = pthread_create(&server->thandle, NULL,
-			m2md_modbus_server_thread, server);
-
-	if (ret)
-		goto_perror(pthread_create_error, ELE, "poll/add: pthread_create()");
-
-	/* New thread started, send connect command so thread starts
-	 * connecting to modbus server. All data needed to make connection
-	 * is already in modbus variable.  */
-	msg.cmd = M2MD_SERVER_MSG_CONNECT;
-	rb_write(server->msgq, &msg, 1);
+	if ((server = m2md_modbus_server_find(ip, port)) == NULL &&
+			(server = m2md_modbus_server_start(ip, port)) == NULL)
+		return -1;
 
-	/* Server will be connecting in background, and we can add
-	 * poll to the list of polls for that server */
-	poll->next_read.tv_sec = 0;
-	poll->next_read.tv_nsec = 0;
-	pthread_mutex_lock(&server->lock);
-	if (m2md_pl_add(&server->polls, poll) != 0)
+	/* Server will be connecting in background, as soon as
+	 * it is scheduled, and we can add poll to the list of
+	 * polls for that server */
+	if (m2md_modbus_server_add_poll(server, poll, topic) != 0)
 	{
 		/* "Noooo i w pizdu... i cały misterny plan też w pizdu"
 		 *      ~Siara
@@ -502,38 +3780,206 @@ int m2md_modbus_add_poll
 		 *  This will happen when memory is exhausted in the
 		 *  system, we don't remove client, memory may be freed and
 		 *  we will continue then */
-		pthread_mutex_unlock(&server->lock);
-		el_perror(ELE, "poll/add: m2md_pl_add()");
+		el_perror(ELE, "poll/add: m2md_pl_add(%s:%d, %s)",
+				ip, port, poll->topic);
 		return -1;
 	}
 
-	pthread_mutex_unlock(&server->lock);
-	pthread_kill(g_main_thread_t, SIGUSR2);
+	/* new poll has been added, send signal to main thread so
+	 * it exits sleep and process new signal. It is crucial as
+	 * main might be sleeping for... let's say 10 minuts, and
+	 * new poll requires polling once every 1 second. Without
+	 * the signal it would take 10 minutes to start sending new
+	 * poll once a second. Not an ideal situation, is it?
+	 * Server threads that schedule on their own and epoll
+	 * engines are woken up when poll is added, so main can
+	 * keep sleeping */
+	if (server->engine == NULL &&
+			m2md_cfg->modbus_sched == M2MD_MODBUS_SCHED_CENTRAL)
+		pthread_kill(g_main_thread_t, SIGUSR2);
+
 	el_print(ELN, "poll/add finished: host: %s:%d, topic: %s, scale: %f, "
-			"type: %c%d, reg: %d, uid: %d, func: %d, "
+			"type: %c%d (%d:%d), reg: %d, uid: %d, func: %d, "
 			"poll_s: %ld, poll_ms: %d",
 			ip, port, poll->topic, poll->scale,
 			poll->is_signed ? '-' : '+', poll->field_width,
-			poll->reg, poll->uid, poll->func, poll->poll_time.tv_sec,
-			poll->poll_time.tv_nsec / 1000000);
+			poll->type, poll->order, poll->reg, poll->uid, poll->func,
+			poll->poll_time.tv_sec, poll->poll_time.tv_nsec / 1000000);
 
 #if 0
+	/* publish ack on mqtt bus, maybe someone is listening */
 	m2md_mqtt_publish_add_ack(poll, ip, port);
 #endif
 	return 0;
+}
 
-pthread_create_error:
-	pthread_mutex_destroy(&server->lock);
 
-pthread_mutex_init_error:
-	rb_destroy(server->msgq);
+/* ==========================================================================
+    Prepares 'ip':'port' server for writes of command 'cmd', which
+    registers are written with whatever is published on its topic. Server
+    is started if it's not running yet, server that has only commands and
+    no polls simply waits until there is something to write.
+   ========================================================================== */
+int m2md_modbus_add_write
+(
+	const struct m2md_pl_data  *cmd,     /* command to add */
+	const char                 *ip,      /* ip of server to write to */
+	int                         port     /* modbus port on the server */
+)
+{
+	struct m2md_server         *server;  /* modbus server description */
+	int                         max;     /* max width of command */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
-rb_new_error:
-	modbus_free(server->modbus);
 
-modbus_tcp_new_error:
-	server->modbus = NULL;
-	return -1;
+	if (!m2md_modbus_func_write(cmd->func))
+		return_print(-1, EINVAL, ELW, "write/add: %d is not write function",
+				cmd->func);
+
+	/* commands take float, as they always did, named
+	 * types are for reading only */
+	if (cmd->type != M2MD_PL_TYPE_RAW)
+		return_print(-1, EINVAL, ELW, "write/add: %s: named type cannot "
+				"be written, use sign and width", cmd->topic);
+
+	max = cmd->func == M2MD_MODBUS_FUNC_WRITE_COIL ||
+		cmd->func == M2MD_MODBUS_FUNC_WRITE_MULTI_COIL ?
+		MODBUS_MAX_WRITE_BITS : 2;
+	if (cmd->field_width > max || cmd->reg + cmd->field_width > 65536)
+		return_print(-1, EINVAL, ELW, "write/add: %s: invalid width %d",
+				cmd->topic, cmd->field_width);
+
+	if (cmd->scale == 0)
+		return_print(-1, EINVAL, ELW, "write/add: %s: scale cannot be 0",
+				cmd->topic);
+
+	if ((server = m2md_modbus_server_find(ip, port)) == NULL &&
+			(server = m2md_modbus_server_start(ip, port)) == NULL)
+		return -1;
+
+	el_print(ELN, "write/add finished: host: %s:%d, topic: %s, scale: %f, "
+			"type: %c%d, reg: %d, uid: %d, func: %d",
+			ip, port, cmd->topic, cmd->scale,
+			cmd->is_signed ? '-' : '+', cmd->field_width,
+			cmd->reg, cmd->uid, cmd->func);
+
+	return 0;
+}
+
+
+/* ==========================================================================
+    Writes value received in 'payload' on command topic of 'cmd' to its
+    registers on 'ip':'port' server. Payload has the same format as value
+    that poll with the same settings publishes - float that is divided
+    by scale and stored in one or two registers, or bitmap for coils,
+    when command is wider than one bit.
+
+    Value is only put in server's write queue, connection threads (or
+    engine) take writes ahead of any read. Newer write to a register
+    replaces older one, that still waits in queue, and writes to
+    registers next to each other are merged into single request. Writes
+    to different registers are not guaranteed to be done in the order
+    they came in.
+
+    Called by mosquitto thread.
+   ========================================================================== */
+int m2md_modbus_write
+(
+	const struct m2md_pl_data  *cmd,      /* command to write */
+	const char                 *ip,       /* ip of server to write to */
+	int                         port,     /* modbus port on the server */
+	const void                 *payload,  /* value to write */
+	int                         paylen    /* length of payload */
+)
+{
+	struct m2md_server         *server;   /* server to write to */
+	const unsigned char        *map;      /* bitmap payload */
+	float                       data;     /* value to write */
+	int                         bits;     /* command writes coils */
+	int                         width;    /* registers or coils to write */
+	int                         breaker;  /* copy of breaker state */
+	int                         ret;      /* return code */
+	int                         i;        /* iterator */
+	uint16_t                    rval[2];  /* raw registers to write */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if ((server = m2md_modbus_server_find(ip, port)) == NULL)
+		return_print(-1, ENODEV, ELW, "write: server %s:%d does not exist",
+				ip, port);
+
+	bits = cmd->func == M2MD_MODBUS_FUNC_WRITE_COIL ||
+		cmd->func == M2MD_MODBUS_FUNC_WRITE_MULTI_COIL;
+	width = cmd->field_width < 2 ? 1 : cmd->field_width;
+	map = payload;
+
+	if (bits && width > 1)
+	{
+		if (paylen != (width + 7) / 8)
+			return_print(-1, EINVAL, ELW, "write: %s: expected %d bits, "
+					"got %d bytes", cmd->topic, width, paylen);
+	}
+	else
+	{
+		if (paylen != sizeof(data))
+			return_print(-1, EINVAL, ELW, "write: %s: expected float, "
+					"got %d bytes", cmd->topic, paylen);
+
+		memcpy(&data, payload, sizeof(data));
+
+		if (bits)
+			rval[0] = data != 0;
+		else if (m2md_modbus_cmd_value(cmd, data, rval) != 0)
+			return_print(-1, ERANGE, ELW, "write: %s: value %f out of range",
+					cmd->topic, data);
+	}
+
+	pthread_mutex_lock(&g_servers_sched_lock);
+	pthread_mutex_lock(&server->lock);
+
+	/* whole value goes in, or nothing does, half of
+	 * 32bit register is worse than none at all. Registers
+	 * that are already queued only get new value, they
+	 * take no more room */
+	ret = 0;
+	if (server->writes.nwrites + m2md_wq_missing(&server->writes, cmd->uid,
+				bits, cmd->reg, width) > M2MD_WQ_MAX)
+	{
+		errno = ENOBUFS;
+		ret = -1;
+	}
+
+	for (i = 0; i != width && ret >= 0; ++i)
+		if ((ret = m2md_wq_add(&server->writes, cmd->uid, bits,
+				cmd->reg + i, bits && width > 1 ?
+				map[i >> 3] >> (i & 7) & 1 : rval[i])) == 1)
+			server->stats.superseded++;
+
+	/* server that is down is scheduled for probe, and
+	 * the rest is woken up to take writes */
+	if (ret >= 0)
+		m2md_modbus_server_reschedule(server);
+
+	breaker = server->breaker.state;
+	pthread_mutex_unlock(&server->lock);
+	pthread_mutex_unlock(&g_servers_sched_lock);
+
+	if (ret < 0)
+		return_perror(ELW, "write: %s: queue write to %s:%d",
+				cmd->topic, ip, port);
+
+	if (server->engine == NULL &&
+			m2md_cfg->modbus_sched == M2MD_MODBUS_SCHED_CENTRAL)
+	{
+		if (breaker == M2MD_BREAKER_CLOSED)
+			m2md_modbus_server_kick_write(server);
+		else if (breaker == M2MD_BREAKER_OPEN)
+			pthread_kill(g_main_thread_t, SIGUSR2);
+	}
+
+	el_print(ELD, "write: %s: queued %d registers to %s:%d",
+			cmd->topic, width, ip, port);
+	return 0;
 }
 
 
@@ -547,35 +3993,46 @@ int m2md_modbus_delete_poll
 	int                   port     /* modbus port on the server */
 )
 {
-	int                   sid;     /* server index */
+	struct m2md_server   *server;  /* server to delete poll from */
 	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
 
 	/* use ntohl function to parse and check if
 	 * passed ip address is actually ip address */
 
-	if (ntohl(inet_addr(ip)) == INADDR_ANY)
+	if (ip[0] != '/' && ntohl(inet_addr(ip)) == INADDR_ANY)
 		return_print(-1, EINVAL, ELW,
 				"poll/delete: wrong server address %s", ip);
 
-	if ((sid = m2md_modbus_server_find(ip, port)) < 0)
+	if ((server = m2md_modbus_server_find(ip, port)) == NULL)
 		/* ip:port server doesn't exist, so nothing to delete */
 		return_print(-1, ENODEV, ELW,
 				"poll/delete: specified server %s:%d does not exist",
 				ip, port);
 
-	pthread_mutex_lock(&servers[sid].lock);
-	if (m2md_pl_delete(&servers[sid].polls, poll) != 0)
+	pthread_mutex_lock(&g_servers_sched_lock);
+	pthread_mutex_lock(&server->lock);
+	if (m2md_pl_find(&server->polls, poll) == M2MD_PL_NONE)
 	{
 		/* failed to delete, specified poll doesn't exist
 		 * can't delete what doesn't exist */
-		pthread_mutex_unlock(&servers[sid].lock);
+		pthread_mutex_unlock(&server->lock);
+		pthread_mutex_unlock(&g_servers_sched_lock);
 		el_print(ELW, "poll/delete: func: %d, reg: %d, uid: %d doesn't exist "
 				"in server %s:%d", poll->func, poll->reg, poll->uid, ip, port);
 		return -1;
 	}
 
-	pthread_mutex_unlock(&servers[sid].lock);
+	/* deleting poll also removes it from its read plan block, so
+	 * it's safe to delete it now, but plan should be rebuilt, so
+	 * we don't read registers that noone is interested in */
+	m2md_pl_delete(&server->polls, poll);
+	server->plan_dirty = 1;
+	server->index_dirty = 1;
+	m2md_modbus_server_reschedule(server);
+
+	pthread_mutex_unlock(&server->lock);
+	pthread_mutex_unlock(&g_servers_sched_lock);
 	el_print(ELN, "poll/delete finished: host: %s:%d, func: %d, reg: %d, "
 			"uid: %d", ip, port, poll->func, poll->reg, poll->uid);
 #if 0
@@ -586,10 +4043,14 @@ int m2md_modbus_delete_poll
 
 
 /* ==========================================================================
-    Loops through all servers and poll lists and checks if any poll timeout
-    has occured, if so it trigger read for that register from that server.
-
-    Function will return time when nearest poll should occur.
+    Triggers read for every block which timer has expired. Only servers
+    and blocks that are due are looked at, thanks to schedulers, so cost of
+    single call is proportional to number of expired blocks, and not to
+    number of all polls. Batches which window has ended are published
+    here as well.
+
+    Function will return time when nearest poll, or end of batch window,
+    should occur.
    ========================================================================== */
 struct timespec m2md_modbus_loop
 (
@@ -597,143 +4058,98 @@ struct timespec m2md_modbus_loop
 )
 {
 	struct m2md_server       *server;        /* current server being probed */
+	struct m2md_sched_node   *snode;         /* server's scheduler node */
+	struct m2md_sched_node   *bnode;         /* block's scheduler node */
+	struct m2md_rp_block     *block;         /* current block to read */
 	struct timespec           next_poll;     /* time left to next poll */
-	struct timespec           parse_finish;  /* time taken parsing all polls */
+	struct timespec           next_batch;    /* end of next batch window */
 	struct timespec           now;           /* current absolute time */
-	struct m2md_pl           *poll;          /* current poll information */
-	int                       i;             /* iterator */
-	static int                rb_send_fails; /* number of fails of rb_send() */
+	int                       batch;         /* batch is waiting */
 	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
 
 	clock_gettime(CLOCK_MONOTONIC, &now);
 
-	/* set next_poll to invalid value, as an indicator that
-	 * next_poll was modified or not.  */
-	next_poll.tv_nsec = LONG_MAX;
+	/* batches which window is over, and that noone else
+	 * has published yet, are sent here */
+	batch = m2md_cfg->mqtt_batch &&
+		m2md_modbus_batch_expire(&now, &next_batch) == 0;
 
-	/* for each active server */
-	for (i = 0; i != M2MD_SERVERS_MAX; ++i)
+	pthread_mutex_lock(&g_servers_sched_lock);
+
+	/* for each server that has at least one expired poll */
+	while ((snode = m2md_sched_peek(&g_servers_sched)) != NULL &&
+			m2md_sched_expired(snode, &now))
 	{
-		server = servers + i;
-		if (server->modbus == NULL)
-			continue; /* that slot is not active */
+		server = m2md_sched_entry(snode, struct m2md_server, next_poll);
 
 		/* lock mutex - noone messes with our poll
 		 * list while we are messing with them! */
 		pthread_mutex_lock(&server->lock);
 
-		for (poll = server->polls; poll != NULL; poll = poll->next)
-		{
-			int                     expired;  /* did poll expire or not */
-			struct m2md_server_msg  msg;      /* msg to send to serv thread */
-			/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
-
-
-			/* did timer for that poll expire?  */
-			expired = 0;
-			if ((now.tv_sec > poll->data.next_read.tv_sec) ||
-					(now.tv_sec == poll->data.next_read.tv_sec &&
-					 now.tv_nsec >= poll->data.next_read.tv_nsec))
-				expired = 1;
-
-			if (expired == 0)
-			{
-				/* no, it's not yet time to make a poll, just update
-				 * next_poll timer if it is smaller than current
-				 * next_poll */
-				if (next_poll.tv_nsec == LONG_MAX ||
-						poll->data.next_read.tv_sec < next_poll.tv_sec ||
-						(poll->data.next_read.tv_sec == next_poll.tv_sec &&
-						 poll->data.next_read.tv_nsec < next_poll.tv_nsec))
-				{
-					next_poll.tv_sec = poll->data.next_read.tv_sec;
-					next_poll.tv_nsec = poll->data.next_read.tv_nsec;
-				}
-
-				continue;
-			}
-
-			/* yes, that poll has expired, send request to server's
-			 * thread to read register */
+		/* polls have changed since last time, read plan
+		 * is outdated and needs to be rebuilt */
+		if (server->plan_dirty)
+			m2md_modbus_server_replan(server);
 
-			msg.cmd = M2MD_SERVER_MSG_POLL;
-			msg.data.poll = poll->data;
-
-			if (rb_send(server->msgq, &msg, 1, MSG_DONTWAIT) != 1)
-			{
-				/* sending poll request failed, could be that
-				 * server dies and message queue is full, can't do
-				 * anything about that, and surely we won't be
-				 * waiting for situation to resolve itself, log
-				 * situation and move on like nothing had happened */
-
-				if (errno != EAGAIN || ++rb_send_fails < 3)
-					/* log error only if it is not EAGAIN or number
-					 * of consecutive fails is less than 3 - there
-					 * is no need to logs with same error over and
-					 * over again.  */
-					el_perror(ELW, "rb_send(), fail no: %d", rb_send_fails);
-			}
-			else
+		if (m2md_breaker_probe(&server->breaker, now))
+		{
+			/* dead server has been left alone long enough,
+			 * its thread will probe it, and reschedule it
+			 * once it knows how probe went */
+			if (m2md_modbus_server_reconnect(server->msgq) != 0)
 			{
-				/* if rb_send() was successful,
-				 * decrement rb_send_fails */
-
-				--rb_send_fails;
-				if (rb_send_fails == -1)
-					/* -1 means, we are very good and there were no
-					 * errors for long time, set rb_send_fails to 0,
-					 * so next successfull rb_send() will result in
-					 * rb_send_fails to become -1 once again.  */
-					rb_send_fails = 0;
-				else if (rb_send_fails == 0)
-					/* previous rb_send_fails was 1, so it means
-					 * there were errors and now we recovered from
-					 * them, log good information */
-					el_print(ELN, "rb_send() recovered");
-
-				/* rb_send_fails is bigger than 0, so there we
-				 * multiple rb_send() errors before, and now
-				 * rb_sed() seems to work again, but still, it
-				 * didn't make enough consecutive successfull calls
-				 * to consider it stable. Nothing to do in this
-				 * case, just wait for fix */
+				/* probe could not be queued, thread is going
+				 * down. Half open server is never rescheduled,
+				 * so breaker is opened again, that keeps server
+				 * in scheduler until thread removes it, and
+				 * probes it again later if it doesn't */
+				el_print(ELW, "probe(%s:%d): server is stopping",
+						server->ip, server->port);
+				m2md_modbus_breaker_open(server, now);
 			}
+		}
 
-			/* update poll's timer for next poll */
-			poll->data.next_read.tv_sec = now.tv_sec +
-				poll->data.poll_time.tv_sec;
-			poll->data.next_read.tv_nsec = now.tv_nsec +
-				poll->data.poll_time.tv_nsec;
-
-			/* it is still possible that this poll has smallest
-			 * time, so we need to update next poll timer if
-			 * that is the case */
-
-			if (next_poll.tv_nsec == LONG_MAX ||
-					poll->data.next_read.tv_sec < next_poll.tv_sec ||
-					(poll->data.next_read.tv_sec == next_poll.tv_sec &&
-					 poll->data.next_read.tv_nsec < next_poll.tv_nsec))
-			{
-				/* see? told you it could be smaller!  */
-				next_poll.tv_sec = poll->data.next_read.tv_sec;
-				next_poll.tv_nsec = poll->data.next_read.tv_nsec;
-			}
+		while (server->breaker.state == M2MD_BREAKER_CLOSED &&
+				(bnode = m2md_sched_peek(&server->sched)) != NULL &&
+				m2md_sched_expired(bnode, &now))
+		{
+			/* yes, that block has expired, send request to
+			 * server's thread to read registers */
+			block = m2md_sched_entry(bnode, struct m2md_rp_block, sched);
+			m2md_modbus_server_send_block(server, block);
+
+			/* update block's timer for next read, it will
+			 * sink to the position where it belongs */
+			m2md_modbus_server_next_read(server, block, now);
+			m2md_sched_update(&server->sched, bnode);
 		}
 
-		/* all polls in that server are served,
-		 * unlock mutex and move to next server */
+		/* all expired blocks in that server are served, server
+		 * now has new earliest block, put it in proper place */
+		m2md_modbus_server_reschedule(server);
 		pthread_mutex_unlock(&server->lock);
 	}
 
-	if (next_poll.tv_nsec == LONG_MAX)
+	snode = m2md_sched_peek(&g_servers_sched);
+	if (snode != NULL)
+		next_poll = snode->deadline;
+
+	pthread_mutex_unlock(&g_servers_sched_lock);
+
+	/* batch window that ends before next poll
+	 * wakes us up earlier */
+	if (batch && (snode == NULL || m2md_timing_ns(
+					m2md_timing_sub(next_batch, next_poll)) < 0))
+		next_poll = next_batch;
+
+	if (snode == NULL && !batch)
 	{
-		/* next_poll was not modified, either there are no server
-		 * and/or poll, sleep for as long as we can, since when
-		 * request for new poll comes in, sleep will be interrupted
-		 * and this function triggered again - no need to call
-		 * this function when no polls are installed yet.
+		/* there are no server and/or poll, sleep for as long as
+		 * we can, since when request for new poll comes in,
+		 * sleep will be interrupted and this function triggered
+		 * again - no need to call this function when no polls
+		 * are installed yet.
 		 *
 		 * time_t will never be smaller than int, no really, it's
 		 * no use. So it's the safest bigest value to sleep for,
@@ -743,24 +4159,11 @@ struct timespec m2md_modbus_loop
 		return next_poll;
 	}
 
-	/* processsing all have taken some time, so we need to update
-	 * next_poll with the time we spent here processing data, it is
-	 * possible that next time will have to be done immediately */
-	clock_gettime(CLOCK_MONOTONIC, &parse_finish);
-
-	/* subtract parse_finish from now (now as in time of entering
-	 * function) to get time spent on parsing */
-	parse_finish = m2md_modbus_subtract_timespec(parse_finish, now);
-
-	/* now subtract time spending on parsing from next poll time
-	 * this will give us time when next poll shall be made */
-	next_poll = m2md_modbus_subtract_timespec(next_poll, parse_finish);
-
-	/* now we just need to calculate how many seconds there are
-	 * until poll shall be made - now we only have info when poll
-	 * shall be made */
+	/* processsing all have taken some time, so now we just need
+	 * to calculate how much time there is left until poll shall
+	 * be made - now we only have info when poll shall be made */
 	clock_gettime(CLOCK_MONOTONIC, &now);
-	next_poll = m2md_modbus_subtract_timespec(next_poll, now);
+	next_poll = m2md_timing_sub(next_poll, now);
 
 	if (next_poll.tv_sec < 0)
 	{
@@ -775,6 +4178,108 @@ struct timespec m2md_modbus_loop
 }
 
 
+/* ==========================================================================
+    Prints how far behind schedule each server runs, since last call. It's
+    meant to be called periodically, so stats are reset after print. Rtt
+    estimate, response timeout currently in use and state of circuit
+    breaker, if it's not closed, are printed as well, so are writes,
+    batches, samples suppressed by deadband, modbus exceptions and
+    quarantined polls, if there were any. For rtu buses, it also prints
+    how much of that time line was busy.
+   ========================================================================== */
+void m2md_modbus_print_stats
+(
+	void
+)
+{
+	struct m2md_server_stats  stats;   /* copy of server stats */
+	struct m2md_timing_rtt    rtt;     /* copy of server rtt */
+	int                       breaker; /* copy of server breaker state */
+	int                       nhealthy; /* copy of working connections */
+	int                       nquarantined; /* quarantined polls */
+	struct m2md_server       *server;  /* current server */
+	struct timespec           now;     /* current absolute time */
+	double                    period;  /* time since previous call, ns */
+	size_t                    i;       /* teh iterator */
+	size_t                    j;       /* another iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	period = m2md_timing_ns(m2md_timing_sub(now, g_stats_last));
+	g_stats_last = now;
+
+	pthread_mutex_lock(&g_servers_lock);
+	for (i = 0; i != g_servers.n; ++i)
+	{
+		server = g_servers.servers[i];
+		if (!server->running)
+			continue;
+
+		pthread_mutex_lock(&server->lock);
+		stats = server->stats;
+		rtt = server->rtt;
+		breaker = server->breaker.state;
+		nhealthy = server->breaker.nhealthy;
+		memset(&server->stats, 0x00, sizeof(server->stats));
+		nquarantined = 0;
+		for (j = 0; j != server->polls.nnodes; ++j)
+			nquarantined += server->polls.exc[j].strikes != 0;
+		pthread_mutex_unlock(&server->lock);
+
+		if (breaker != M2MD_BREAKER_CLOSED)
+			el_print(ELI, "stats %s:%d: circuit breaker: %s", server->ip,
+					server->port, breaker == M2MD_BREAKER_OPEN ?
+					"open" : "half-open");
+
+		if (server->npool > 1)
+			el_print(ELI, "stats %s:%d: connections: %d/%d healthy",
+					server->ip, server->port, nhealthy, server->npool);
+
+		if (stats.writes)
+			el_print(ELI, "stats %s:%d: writes: %lu, registers written: %lu, "
+					"superseded: %lu", server->ip, server->port, stats.writes,
+					stats.written, stats.superseded);
+
+		if (stats.batches)
+			el_print(ELI, "stats %s:%d: batches: %lu, samples per batch: %.1f",
+					server->ip, server->port, stats.batches,
+					(double)stats.published / stats.batches);
+
+		if (stats.suppressed)
+			el_print(ELI, "stats %s:%d: published: %lu, suppressed: %lu "
+					"(%.1f%%)", server->ip, server->port, stats.published,
+					stats.suppressed, 100.0 * stats.suppressed /
+					(stats.published + stats.suppressed));
+
+		if (stats.exceptions || nquarantined)
+			el_print(ELI, "stats %s:%d: exceptions: %lu, blocks split: %lu, "
+					"quarantined polls: %d", server->ip, server->port,
+					stats.exceptions, stats.splits, nquarantined);
+
+		if (stats.timing.reads == 0)
+			continue;
+
+		el_print(ELI, "stats %s:%d: reads: %lu, skipped: %lu, "
+				"late avg: %.3fms, late max: %.3fms",
+				server->ip, server->port, stats.timing.reads,
+				stats.timing.skipped, stats.timing.late_sum /
+				(double)stats.timing.reads / 1000000.0,
+				stats.timing.late_max / 1000000.0);
+
+		el_print(ELI, "stats %s:%d: rtt: %.3fms, rttvar: %.3fms, rto: %.3fms",
+				server->ip, server->port, rtt.srtt / 1000000.0,
+				rtt.rttvar / 1000000.0, rtt.rto / 1000000.0);
+
+		if (server->rtu)
+			el_print(ELI, "stats %s:%d: bus occupancy: %.1f%%",
+					server->ip, server->port,
+					100.0 * stats.busy_ns / period);
+	}
+	pthread_mutex_unlock(&g_servers_lock);
+}
+
+
 /* ==========================================================================
     Stop all thrads and free resources allocated by adding polls operations
    ========================================================================== */
@@ -12,9 +12,24 @@
 
 #include <arpa/inet.h>
 #include <modbus/modbus.h>
+#include <stdint.h>
 #include <time.h>
 
+#include "batch.h"
+#include "breaker.h"
+#include "mbtcp.h"
 #include "poll-list.h"
+#include "read-plan.h"
+#include "scheduler.h"
+#include "timing.h"
+#include "write-queue.h"
+
+/* max length of server address, which is ip for modbus tcp, or
+ * serial device with its line settings for modbus rtu */
+#define M2MD_MODBUS_ADDR_MAX 128
+
+/* max number of connections opened to single server */
+#define M2MD_MODBUS_POOL_MAX 16
 
 enum m2md_modbus_functions
 {
@@ -31,10 +46,46 @@ enum m2md_modbus_functions
 	M2MD_MODBUS_FUNC_WRITE_MULTI_HOLD_REG   = 16
 };
 
+/* who decides when blocks are read */
+enum m2md_modbus_sched
+{
+	/* main thread schedules reads of all servers and sends
+	 * read requests to server threads via queue */
+	M2MD_MODBUS_SCHED_CENTRAL,
+
+	/* each server thread schedules its own reads */
+	M2MD_MODBUS_SCHED_SERVER
+};
+
+/* how servers are talked to */
+enum m2md_modbus_engine
+{
+	/* each server has its own thread, with blocking
+	 * libmodbus connection */
+	M2MD_MODBUS_ENGINE_THREAD,
+
+	/* few engine threads multiplex all servers over
+	 * non-blocking sockets with epoll */
+	M2MD_MODBUS_ENGINE_EPOLL
+};
+
 enum m2md_server_msg_cmd
 {
 	M2MD_SERVER_MSG_CONNECT,
-	M2MD_SERVER_MSG_POLL
+	M2MD_SERVER_MSG_POLL,
+	M2MD_SERVER_MSG_WRITE
+};
+
+/* request to read single block from read plan, or to write registers
+ * taken from server's write queue, then block is NULL */
+struct m2md_server_read
+{
+	struct m2md_rp_block  *block;  /* block to read, valid only in gen */
+	unsigned               gen;    /* read plan generation of block */
+	int                    func;   /* modbus function to use */
+	int                    uid;    /* unit id */
+	int                    reg;    /* first register of request */
+	int                    count;  /* number of registers in request */
 };
 
 /* single com message for server thread */
@@ -43,22 +94,91 @@ struct m2md_server_msg
 	int  cmd;
 	union
 	{
-		struct m2md_pl_data poll;
+		struct m2md_server_read read;
 	}
 	data;
 };
 
+/* how far behind schedule server runs */
+struct m2md_server_stats
+{
+	struct m2md_timing_stats  timing;   /* lateness of reads */
+	int64_t                 busy_ns;    /* time line was busy, ns, rtu only */
+	unsigned long           writes;     /* write requests sent */
+	unsigned long           written;    /* registers and coils written */
+	unsigned long           superseded; /* writes replaced by newer ones */
+	unsigned long           published;  /* samples published */
+	unsigned long           suppressed; /* samples within deadband */
+	unsigned long           exceptions; /* reads answered with exception */
+	unsigned long           splits;     /* blocks split to find bad poll */
+	unsigned long           batches;    /* batched messages published */
+};
+
+struct m2md_server;
+
+/* single connection from the pool of server connections. With thread
+ * engine each connection has its own thread and libmodbus context,
+ * epoll engine talks over non-blocking socket. Connection that fails
+ * is reconnected on its own, while the rest keep working */
+struct m2md_server_conn
+{
+	struct m2md_server     *server;     /* server connection belongs to */
+	int                     id;         /* position in server's pool */
+	struct m2md_breaker_conn  health;   /* connection works, reads can use it */
+	int                     conn_to;    /* time to wait between reconnections */
+
+	/* fields used only by thread engine */
+	modbus_t               *modbus;     /* libmodbus object */
+	pthread_t               thandle;    /* thread handle */
+
+	/* fields used only by epoll engine */
+	struct m2md_mbtcp       tcp;        /* non-blocking connection */
+	struct m2md_server_read inflight[M2MD_MBTCP_WINDOW_MAX]; /* by slot */
+	struct timespec         sent[M2MD_MBTCP_WINDOW_MAX]; /* send time by slot */
+	int                     tx_blocked; /* socket didn't take all requests */
+	struct timespec         io_deadline; /* connect/response/reconnect timeout */
+};
+
 /* struct describing connection to single server */
 struct m2md_server
 {
-	modbus_t         *modbus;  /* libmodbus object */
-	struct m2md_pl   *polls;   /* list of register to poll */
-	pthread_mutex_t   lock;    /* server access mutex */
-	pthread_t         thandle; /* thread handle */
-	struct rb        *msgq;    /* one way comm bus with thread */
-	int               conn_to; /* time to wait between reconnections */
-	int               port;    /* porn on which modbus server listens */
-	char              ip[INET_ADDRSTRLEN];  /* ip of the server */
+	struct m2md_server_conn  *pool;     /* connections to the server */
+	int                     npool;      /* number of connections in pool */
+	int                     nthreads;   /* threads of thread engine running */
+	struct m2md_pl_list     polls;      /* list of register to poll */
+	struct m2md_rp          plan;       /* how to read polls in few reads */
+	int                     plan_dirty; /* polls changed, rebuild plan */
+	struct m2md_sched       sched;      /* blocks ordered by next read */
+	struct m2md_sched_node  next_poll;  /* earliest poll in servers sched */
+	struct m2md_server_stats  stats;    /* schedule lateness stats */
+	struct m2md_timing_rtt  rtt;        /* rtt estimate and timeout */
+	double                  phase;      /* offset of last staggered block */
+	unsigned                splits;     /* last split given to polls */
+	struct m2md_batch       batch;      /* samples waiting to be published */
+	char                   *batch_topic; /* full topic of batches */
+	uint32_t                batch_tid;  /* batch_topic interned for queue */
+	struct m2md_sched_node  batch_flush; /* when batch must be published */
+	uint32_t                ids;        /* last topic id given to poll */
+	int                     index_dirty; /* polls changed, publish index */
+	struct m2md_wq          writes;     /* registers waiting to be written */
+	pthread_mutex_t         lock;       /* server access mutex */
+	pthread_cond_t          wake;       /* polls changed, in server sched */
+	struct rb              *msgq;       /* one way comm bus with threads */
+	int                     running;    /* server is alive and can be used */
+	struct m2md_breaker     breaker;    /* circuit breaker, health of pool */
+	int                     port;       /* porn on which modbus server listens */
+	char                    ip[M2MD_MODBUS_ADDR_MAX];  /* ip of the server */
+
+	/* fields used only by rtu bus, for which ip is serial
+	 * device and port is baud rate */
+	int                     rtu;        /* server is rtu bus */
+	int                     gap_us;     /* silence required between frames */
+	struct timespec         rtu_last;   /* end of last frame on the line */
+
+	/* fields used only by epoll engine */
+	struct m2md_engine     *engine;     /* engine handling the server */
+	int                     pending;    /* server is on engine pending list */
+	struct m2md_server     *pending_next; /* next server on pending list */
 };
 
 int m2md_modbus_init(void);
@@ -74,5 +194,10 @@ int m2md_modbus_add_poll(struct m2md_pl_data *poll,
 		const char *ip, int port);
 int m2md_modbus_delete_poll(struct m2md_pl_data *poll,
 		const char *ip, int port);
+int m2md_modbus_add_write(const struct m2md_pl_data *cmd,
+		const char *ip, int port);
+int m2md_modbus_write(const struct m2md_pl_data *cmd, const char *ip,
+		int port, const void *payload, int paylen);
+void m2md_modbus_print_stats(void);
 
 #endif
@@ -19,6 +19,8 @@
 #include <embedlog.h>
 #include <errno.h>
 #include <mosquitto.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
@@ -26,6 +28,8 @@
 #include "cfg.h"
 #include "modbus.h"
 #include "poll-list.h"
+#include "spool.h"
+#include "topic.h"
 #include "valid.h"
 #include "macros.h"
 
@@ -53,6 +57,10 @@ extern volatile int g_m2md_run;
 #endif
 static struct mosquitto *mqtt;
 
+/* set while we are connected to broker, messages that are published
+ * when it's not set go straight to spool, if there is one */
+static int g_m2md_mqtt_connected;
+
 struct m2md_mqtt_sub
 {
 	const char  *topic;
@@ -67,6 +75,23 @@ g_m2md_mqtt_subs[] =
 #endif
 };
 
+/* command topic, whatever is published on it, is written to registers
+ * of the command */
+struct m2md_mqtt_cmd
+{
+	char                 *topic;  /* topic, without base and first slash */
+	struct m2md_pl_data   cmd;    /* registers to write */
+	char                  ip[M2MD_MODBUS_ADDR_MAX];  /* server to write to */
+	int                   port;   /* port of the server */
+};
+
+/* command topics, sorted by topic, so command for received message is
+ * found with binary search. Commands are only added at startup, before
+ * mosquitto thread is started, so they never change while messages
+ * are coming in */
+static struct m2md_mqtt_cmd  *g_m2md_mqtt_cmds;
+static size_t                 g_m2md_mqtt_ncmds;
+
 /* check m2md_mqtt_create_ack_msg() for frame details */
 #define M2MD_ACK_FRAME_SIZE (28)
 #define m2md_array_size(a) (sizeof(a)/sizeof(*(a)))
@@ -251,13 +276,12 @@ static void m2md_mqtt_poll_add
 	pdata.topic = topic;
 	pdata.poll_time.tv_sec = poll_s;
 	pdata.poll_time.tv_nsec = poll_ms * 1000000l;
-	pdata.next_read.tv_sec = 0;
-	pdata.next_read.tv_nsec = 0;
 
 	/* ship it! don't care for errors, they will
 	 * be handled in modbus module. */
 
 	m2md_modbus_add_poll(&pdata, ip, port);
+	free(topic);
 	return;
 
 incorect_data:
@@ -353,6 +377,19 @@ incorect_data:
 
 #endif
 
+/* ==========================================================================
+    Compares 'topic' with topic of command 'elem', for bsearch().
+   ========================================================================== */
+static int m2md_mqtt_cmd_cmp
+(
+	const void  *topic,  /* topic to look for */
+	const void  *elem    /* command to compare topic with */
+)
+{
+	return strcmp(topic, ((const struct m2md_mqtt_cmd *)elem)->topic);
+}
+
+
 /* ==========================================================================
     Called by mosquitto on connection response.
    ========================================================================== */
@@ -385,6 +422,7 @@ static void m2md_mqtt_on_connect
 	}
 
 	el_print(ELN, "connected to the broker");
+	__atomic_store_n(&g_m2md_mqtt_connected, 1, __ATOMIC_RELEASE);
 
 	for (i = 0; i != m2md_array_size(g_m2md_mqtt_subs); ++i)
 	{
@@ -404,6 +442,26 @@ static void m2md_mqtt_on_connect
 
 		el_print(ELN, "sent subscribe request for %s, mid: %d", topic, mid);
 	}
+
+	/* command topics are subscribed with qos 1, so setpoint
+	 * is not lost on the way, and when it comes twice, it is
+	 * simply written twice, or even merged into one write */
+	for (i = 0; i != g_m2md_mqtt_ncmds; ++i)
+	{
+		char  topic[M2MD_TOPIC_MAX + 1];
+		int   mid;
+		/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+		if (snprintf(topic, sizeof(topic), "%s/%s", m2md_cfg->mqtt_topic,
+					g_m2md_mqtt_cmds[i].topic) >= sizeof(topic))
+			continue_print(ELE, "cannot subscribe to %s, topic too long",
+					g_m2md_mqtt_cmds[i].topic);
+
+		if (mosquitto_subscribe(mqtt, &mid, topic, 1) != 0)
+			continue_perror(ELE, "mosquitto_subscribe(%s)", topic);
+
+		el_print(ELN, "sent subscribe request for %s, mid: %d", topic, mid);
+	}
 }
 
 
@@ -437,6 +495,8 @@ static void m2md_mqtt_on_disconnect
 	int                rc         /* disconnect reason */
 )
 {
+	__atomic_store_n(&g_m2md_mqtt_connected, 0, __ATOMIC_RELEASE);
+
 	if (rc == 0)
 	{
 		/* called by us, it's fine */
@@ -461,21 +521,27 @@ static void m2md_mqtt_on_message
 	const struct mosquitto_message  *msg       /* received message */
 )
 {
+	struct m2md_mqtt_cmd            *cmd;      /* command for topic */
+	const char                      *topic;    /* topic without base */
 	int                              i;        /* the i iterator */
 	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
 
-	for (i = 0; i != m2md_array_size(g_m2md_mqtt_subs); ++i)
-	{
-		const char  *topic;
-		/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
-
-		/* strip first part of topic for conveniance */
-		topic = msg->topic + strlen(m2md_cfg->mqtt_topic);
+	/* strip first part of topic for conveniance */
+	topic = msg->topic + strlen(m2md_cfg->mqtt_topic);
 
+	for (i = 0; i != m2md_array_size(g_m2md_mqtt_subs); ++i)
 		if (strcmp(topic, g_m2md_mqtt_subs[i].topic) == 0)
 			g_m2md_mqtt_subs[i].on_message(mqtt, userdata, msg);
-	}
+
+	if (topic[0] != '/' || (cmd = bsearch(topic + 1, g_m2md_mqtt_cmds,
+					g_m2md_mqtt_ncmds, sizeof(*cmd), m2md_mqtt_cmd_cmp)) == NULL)
+		return;
+
+	/* someone wants to change setpoint, errors are
+	 * already logged, nothing more we can do here */
+	m2md_modbus_write(&cmd->cmd, cmd->ip, cmd->port,
+			msg->payload, msg->payloadlen);
 }
 
 
@@ -554,6 +620,118 @@ int m2md_mqtt_init
 }
 
 
+/* ==========================================================================
+    Builds full topic, exactly as it is published on broker, out of
+    'topic' into 'dst' of 'size' bytes. Base topic from config is put in
+    front of it, and first slash of 'topic' is stripped. Topic that is
+    published often should be built once with this, and then published
+    with m2md_mqtt_publish_full(), so nothing is formatted per message.
+
+    Returns length of full topic.
+
+    errno:
+            ENOBUFS     full topic does not fit in dst
+   ========================================================================== */
+int m2md_mqtt_topic
+(
+	char        *dst,      /* full topic goes here */
+	size_t       size,     /* size of dst buffer */
+	const char  *topic     /* topic to build full topic of */
+)
+{
+	int          toplen;   /* length of full topic */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	toplen = m2md_topic_build(dst, size, m2md_cfg->mqtt_topic, topic);
+	if (toplen < 0 && errno == ENOBUFS)
+		el_print(ELE, "topic turned to be too large, made this: %s", dst);
+
+	return toplen;
+}
+
+
+/* ==========================================================================
+    Publishes 'payload' of size 'paylen' on full 'topic', built earlier
+    with m2md_mqtt_topic(), it's passed to mosquitto as it is. Message is
+    kept by broker, and handed to everyone who subscribes later on, when
+    'retain' is set.
+
+    When broker cannot be reached, message goes to spool, if it's enabled,
+    to be published once broker is back. Retained messages are not spooled,
+    they are sent again anyway, once they change.
+   ========================================================================== */
+int m2md_mqtt_publish_full
+(
+	const char  *topic,    /* full topic on which to publish message */
+	const void  *payload,  /* data to publish */
+	int          paylen,   /* length of payload buffer */
+	int          retain    /* broker shall keep message */
+)
+{
+	int          spool;    /* message can be spooled */
+	int          ret;      /* return code from mosquitto */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	VALID(EINVAL, topic);
+	VALID(EINVAL, payload);
+
+	spool = !retain && m2md_cfg->mqtt_spool[0] != '\0';
+	if (spool && !__atomic_load_n(&g_m2md_mqtt_connected, __ATOMIC_ACQUIRE))
+		/* no point asking mosquitto, we know
+		 * it has nowhere to send it */
+		return m2md_spool_add(topic, payload, paylen);
+
+	ret = mosquitto_publish(mqtt, NULL, topic, paylen, payload, 0, retain);
+
+	/* connection is gone, but we haven't been
+	 * told about it yet */
+	if (ret == MOSQ_ERR_NO_CONN && spool)
+		return m2md_spool_add(topic, payload, paylen);
+
+	if (ret != 0)
+		return_perror(ELE, "mosquitto_publish(%s)", topic);
+
+	return 0;
+}
+
+
+/* ==========================================================================
+    Publishes 'payload' of size 'paylen', taken from spool, on full
+    'topic'. Unlike m2md_mqtt_publish_full(), message never goes back to
+    spool, so replay can stop when broker is gone again, and carry on
+    from the same message later.
+   ========================================================================== */
+int m2md_mqtt_publish_spooled
+(
+	const char  *topic,    /* full topic on which to publish message */
+	const void  *payload,  /* data to publish */
+	int          paylen    /* length of payload buffer */
+)
+{
+	VALID(EINVAL, topic);
+	VALID(EINVAL, payload);
+
+	if (mosquitto_publish(mqtt, NULL, topic, paylen, payload, 0, 0) != 0)
+		return -1;
+
+	return 0;
+}
+
+
+/* ==========================================================================
+    Returns 1 when we are connected to broker, 0 otherwise.
+   ========================================================================== */
+int m2md_mqtt_connected
+(
+	void
+)
+{
+	return __atomic_load_n(&g_m2md_mqtt_connected, __ATOMIC_ACQUIRE);
+}
+
+
 /* ==========================================================================
     Publishes message on specified 'broker' on given 'topic' with 'payload'
     of size 'paylen'. Function will construct topic with prefix from config,
@@ -567,7 +745,6 @@ int m2md_mqtt_publish
 )
 {
 	char         top[M2MD_TOPIC_MAX];
-	int          toplen;
 	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
 
@@ -575,21 +752,74 @@ int m2md_mqtt_publish
 	VALID(EINVAL, payload);
 
 	/* construct topic with base from config file and passed topic */
+	if (m2md_mqtt_topic(top, sizeof(top), topic) < 0)
+		return -1;
+
+	return m2md_mqtt_publish_full(top, payload, paylen, 0);
+}
+
+
+/* ==========================================================================
+    Adds command topic of 'cmd', whatever is published on it will be
+    written to registers of 'cmd' on 'ip':'port' server. Topic is
+    constructed with prefix from config, just like when publishing.
+    Commands must be added before mosquitto thread is started.
+
+    errno:
+            EEXIST      there already is command with the same topic
+            ENOMEM      not enough memory for command
+   ========================================================================== */
+int m2md_mqtt_add_cmd
+(
+	const struct m2md_pl_data  *cmd,     /* command to add */
+	const char                 *ip,      /* server to write to */
+	int                         port     /* port of the server */
+)
+{
+	struct m2md_mqtt_cmd       *cmds;    /* reallocated commands */
+	const char                 *topic;   /* topic of command */
+	size_t                      i;       /* position of new command */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	VALID(EINVAL, cmd);
+	VALID(EINVAL, cmd->topic);
+	VALID(EINVAL, ip);
+	VALID(EINVAL, strlen(ip) < M2MD_MODBUS_ADDR_MAX);
 
 	/* strip first slash */
+	topic = cmd->topic;
 	if (topic[0] == '/')
 		topic += 1;
 
-	toplen = snprintf(top, sizeof(top), "%s/%s", m2md_cfg->mqtt_topic, topic);
+	/* commands are added once, at startup, so it's fine
+	 * to grow table by one and keep it sorted on the go */
+	for (i = 0; i != g_m2md_mqtt_ncmds; ++i)
+		if (strcmp(topic, g_m2md_mqtt_cmds[i].topic) <= 0)
+			break;
+
+	if (i != g_m2md_mqtt_ncmds && strcmp(topic, g_m2md_mqtt_cmds[i].topic) == 0)
+		return_print(-1, EEXIST, ELW, "command topic %s already exists", topic);
+
+	cmds = realloc(g_m2md_mqtt_cmds, (g_m2md_mqtt_ncmds + 1) * sizeof(*cmds));
+	if (cmds == NULL)
+		return_perror(ELE, "realloc(cmds)");
 
-	if (toplen > sizeof(top))
-		return_print(-1, ENOBUFS, ELE,
-				"topic turned to be too large: %d, made this: %s",
-				toplen, top);
+	g_m2md_mqtt_cmds = cmds;
+	memmove(&cmds[i + 1], &cmds[i], (g_m2md_mqtt_ncmds - i) * sizeof(*cmds));
 
-	if (mosquitto_publish(mqtt, NULL, top, paylen, payload, 0, 0) != 0)
-		return_perror(ELE, "mosquitto_publish(%s)", top);
+	if ((cmds[i].topic = strdup(topic)) == NULL)
+	{
+		memmove(&cmds[i], &cmds[i + 1],
+				(g_m2md_mqtt_ncmds - i) * sizeof(*cmds));
+		return_perror(ELE, "strdup(%s)", topic);
+	}
 
+	cmds[i].cmd = *cmd;
+	cmds[i].cmd.topic = cmds[i].topic;
+	strcpy(cmds[i].ip, ip);
+	cmds[i].port = port;
+	g_m2md_mqtt_ncmds++;
 	return 0;
 }
 
@@ -664,8 +894,22 @@ int m2md_mqtt_cleanup
 	void
 )
 {
+	size_t  i;  /* iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	/* whatever is still published, goes to spool
+	 * from now on, and not to mosquitto that's gone */
+	__atomic_store_n(&g_m2md_mqtt_connected, 0, __ATOMIC_RELEASE);
 	mosquitto_disconnect(mqtt);
 	mosquitto_destroy(mqtt);
 	mosquitto_lib_cleanup();
+
+	for (i = 0; i != g_m2md_mqtt_ncmds; ++i)
+		free(g_m2md_mqtt_cmds[i].topic);
+
+	free(g_m2md_mqtt_cmds);
+	g_m2md_mqtt_cmds = NULL;
+	g_m2md_mqtt_ncmds = 0;
 	return 0;
 }
@@ -6,9 +6,19 @@
 #ifndef M2MD_MQTT_H
 #define M2MD_MQTT_H 1
 
+#include <stddef.h>
+
 int m2md_mqtt_init(const char *ip, int port);
 int m2md_mqtt_cleanup(void);
 int m2md_mqtt_publish(const char *topic, const void *payload, int paylen);
+int m2md_mqtt_topic(char *dst, size_t size, const char *topic);
+int m2md_mqtt_publish_full(const char *topic, const void *payload,
+		int paylen, int retain);
+int m2md_mqtt_publish_spooled(const char *topic, const void *payload,
+		int paylen);
+int m2md_mqtt_connected(void);
+int m2md_mqtt_add_cmd(const struct m2md_pl_data *cmd,
+		const char *ip, int port);
 int m2md_mqtt_loop_start(void);
 int m2md_mqtt_publish_add_ack(struct m2md_pl_data *pdata,
 		const char *ip, int port);
@@ -3,7 +3,7 @@
     Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
    ==========================================================================
          ------------------------------------------------------------
-        / pl - poll list, a very minimal linked list implementation  \
+        / pl - poll list, a very minimal container implementation    \
         \ that holds list of poll for the server                     /
          ------------------------------------------------------------
           \
@@ -29,6 +29,7 @@
 #include "poll-list.h"
 
 #include <errno.h>
+#include <math.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -44,76 +45,366 @@
  / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
 /_/
    ==========================================================================
-    Finds a node that contains 'data'
+    Returns 1 when 'a' and 'b' describe same poll - only func, reg and uid
+    fields are taken into consideration.
+   ========================================================================== */
+static int m2md_pl_equal
+(
+	const struct m2md_pl_data  *a,  /* first poll to compare */
+	const struct m2md_pl_data  *b   /* second poll to compare */
+)
+{
+	return a->func == b->func && a->reg == b->reg && a->uid == b->uid;
+}
+
+
+/* ==========================================================================
+    Returns slot in index of 'pl' where 'data' should be looked for first.
+
+    func, uid and reg are packed into single 32bit key, and key is mixed
+    with fibonacci hashing - multiplication moves entropy of key into upper
+    bits of the product, so slot is taken from there.
+   ========================================================================== */
+static size_t m2md_pl_hash
+(
+	const struct m2md_pl_list  *pl,    /* list to compute slot for */
+	const struct m2md_pl_data  *data   /* data to compute slot of */
+)
+{
+	unsigned long               key;   /* func, uid and reg packed */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	key = (unsigned long)(data->func & 0xff) << 24 |
+		(unsigned long)(data->uid & 0xff) << 16 |
+		(unsigned long)(data->reg & 0xffff);
+
+	key = (key * 2654435769UL) & 0xffffffffUL;
+	return (size_t)(key >> (32 - pl->bits));
+}
+
+
+/* ==========================================================================
+    Finds slot in index of 'pl' that holds poll with 'data'. If there is
+    no such poll, slot where poll should be put is returned - such slot
+    is always empty. Index must not be full, or this will never return.
+
+    Index keeps position of poll in arrays increased by one, so that 0 can
+    mark empty slot.
+   ========================================================================== */
+static size_t m2md_pl_index_slot
+(
+	const struct m2md_pl_list  *pl,    /* list to search */
+	const struct m2md_pl_data  *data   /* data to look for */
+)
+{
+	size_t                      mask;  /* mask to wrap slot around index */
+	size_t                      i;     /* current slot */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
-    Returns pointer to found node or null.
 
-    If 'prev' is not null, function will also return previous node that
-    'next' field points to returned node. This is usefull when deleting
-    nodes and saves searching for previous node to rearange list after
-    delete. If function returns valid pointer, and prev is NULL, this
-    means first element from the list was returned.
+	mask = ((size_t)1 << pl->bits) - 1;
+
+	/* linear probing, polls that collide are stored in
+	 * next free slots, so just walk until we find our
+	 * poll or empty slot which means there is no poll */
+	for (i = m2md_pl_hash(pl, data); pl->index[i] != 0; i = (i + 1) & mask)
+		if (m2md_pl_equal(&pl->data[pl->index[i] - 1], data))
+			return i;
+
+	return i;
+}
+
+
+/* ==========================================================================
+    Makes sure index of 'pl' can hold 'nnodes' polls. Index is never more
+    than half full, so probing sequences stay short.
+
+    errno:
+            ENOMEM      not enough memory to grow index
+   ========================================================================== */
+static int m2md_pl_index_grow
+(
+	struct m2md_pl_list  *pl,     /* list to grow index for */
+	size_t                nnodes  /* number of polls index must hold */
+)
+{
+	uint32_t             *index;  /* new index */
+	unsigned              bits;   /* bits of new index */
+	size_t                i;      /* iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (pl->index != NULL && nnodes * 2 <= (size_t)1 << pl->bits)
+		return 0; /* there is still plenty of room in index */
+
+	bits = pl->index ? pl->bits + 1 : 4;
+	if (bits > 31)
+		return_errno(ENOMEM);
+
+	index = calloc((size_t)1 << bits, sizeof(*index));
+	if (index == NULL)
+		return -1;
+
+	/* polls will land in different slots in bigger index,
+	 * so all of them need to be put there once again */
+	free(pl->index);
+	pl->index = index;
+	pl->bits = bits;
+
+	for (i = 0; i != pl->nnodes; ++i)
+		pl->index[m2md_pl_index_slot(pl, &pl->data[i])] = i + 1;
+
+	return 0;
+}
+
+
+/* ==========================================================================
+    Removes poll in 'slot' from index of 'pl'. Polls that follow removed
+    poll are shifted back, so that probing sequence is never broken with
+    empty slot - this way we don't need tombstones.
    ========================================================================== */
-static struct m2md_pl *m2md_pl_find_node
+static void m2md_pl_index_remove
 (
-	struct m2md_pl             *head,  /* head of the list to search */
-	const struct m2md_pl_data  *data,  /* data to look for */
-	struct m2md_pl            **prev   /* previous node to returned node */
+	struct m2md_pl_list  *pl,    /* list to remove poll from */
+	size_t                slot   /* slot with poll to remove */
 )
 {
-	struct m2md_pl             *node;  /* current node */
+	size_t                mask;  /* mask to wrap slot around index */
+	size_t                home;  /* slot where poll wants to be */
+	size_t                i;     /* current slot */
 	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
-	if (prev != NULL)
-		*prev = NULL;
 
-	for (node = head; node != NULL; node = node->next)
+	mask = ((size_t)1 << pl->bits) - 1;
+	pl->index[slot] = 0;
+
+	for (i = (slot + 1) & mask; pl->index[i] != 0; i = (i + 1) & mask)
+	{
+		home = m2md_pl_hash(pl, &pl->data[pl->index[i] - 1]);
+
+		/* poll can be moved into the hole only if its home slot
+		 * is not between hole and poll itself, otherwise poll
+		 * would be put before its home and never found again */
+		if (slot < i ? (home > slot && home <= i) :
+				(home > slot || home <= i))
+			continue;
+
+		pl->index[slot] = pl->index[i];
+		pl->index[i] = 0;
+		slot = i;
+	}
+}
+
+
+/* ==========================================================================
+    Makes sure arrays of 'pl' can hold one more poll. Arrays grow by one
+    eighth each time they are full, so adding is still amortized constant
+    time, but no more than eighth of arrays is ever wasted, where doubling
+    could waste half of them. Arrays that big are moved by remapping pages
+    and not by copying, so growing them often costs next to nothing.
+
+    errno:
+            ENOMEM      not enough memory to grow arrays
+   ========================================================================== */
+static int m2md_pl_grow
+(
+	struct m2md_pl_list     *pl,         /* list to grow */
+	size_t                   nnodes      /* number of polls list must hold */
+)
+{
+	struct m2md_pl_data     *data;       /* reallocated data array */
+	struct timespec         *next_read;  /* reallocated timers array */
+	struct m2md_pl_exc      *exc;        /* reallocated exceptions array */
+	struct m2md_pl_last     *last;       /* reallocated last values array */
+	uint32_t                *rp_slot;    /* reallocated rp slots array */
+	size_t                   size;       /* new size of arrays */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (nnodes <= pl->size)
+		return 0;
+
+	size = pl->size < 16 ? 16 : pl->size + pl->size / 8;
+
+	/* when any of realloc fails, arrays that already have
+	 * been reallocated are simply bigger than they have to
+	 * be, and size is not changed - list stays consistent */
+	if ((data = realloc(pl->data, size * sizeof(*data))) == NULL)
+		return -1;
+	pl->data = data;
+
+	if ((next_read = realloc(pl->next_read, size * sizeof(*next_read))) == NULL)
+		return -1;
+	pl->next_read = next_read;
+
+	if ((exc = realloc(pl->exc, size * sizeof(*exc))) == NULL)
+		return -1;
+	pl->exc = exc;
+
+	if ((rp_slot = realloc(pl->rp_slot, size * sizeof(*rp_slot))) == NULL)
+		return -1;
+	pl->rp_slot = rp_slot;
+
+	/* last values exist only when there is
+	 * poll with deadband that needs them */
+	if (pl->last)
 	{
-		/* check if nodes are equal - take only func, reg and uid
-		 * fields into consideration */
-		if (node->data.func == data->func &&
-				node->data.reg == data->reg &&
-				node->data.uid == data->uid)
-			return node; /* this is the node you are looking for */
-
-		if (prev != NULL)
-			*prev = node;
+		if ((last = realloc(pl->last, size * sizeof(*last))) == NULL)
+			return -1;
+		pl->last = last;
 	}
 
-	/* node of that data does not exist */
-	return NULL;
+	pl->size = size;
+	return 0;
 }
 
 
 /* ==========================================================================
-    Creates new node with copy of 'data'
+    Makes sure list 'pl' has array of last published values, which is
+    needed only by polls with deadband.
+
+    errno:
+            ENOMEM      not enough memory for array
+   ========================================================================== */
+static int m2md_pl_last_alloc
+(
+	struct m2md_pl_list  *pl  /* list that needs last values */
+)
+{
+	if (pl->last != NULL)
+		return 0;
+
+	/* nothing has been published by any of polls
+	 * already in list, as noone had deadband */
+	if ((pl->last = calloc(pl->size, sizeof(*pl->last))) == NULL)
+		return -1;
+
+	return 0;
+}
+
 
-    Returns NULL on error or address on success
+/* ==========================================================================
+    Copies 'topic' into arena of 'pl', and returns pointer to the copy.
+    Chunks are never moved in memory, so returned pointer is valid until
+    arena is compacted or destroyed.
 
     errno:
-            ENOMEM      not enough memory for new node
+            ENOMEM      not enough memory for new chunk
+   ========================================================================== */
+static char *m2md_pl_arena_add
+(
+	struct m2md_pl_list   *pl,     /* list with arena to add topic to */
+	const char            *topic   /* topic to copy into arena */
+)
+{
+	struct m2md_pl_chunk  *chunk;  /* chunk topic is copied into */
+	char                  *dst;    /* where topic is copied */
+	size_t                 len;    /* length of topic with null */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	len = strlen(topic) + 1;
+	chunk = pl->chunks;
+
+	if (chunk == NULL || chunk->size - chunk->used < len)
+	{
+		/* current chunk is full, space left in it is not
+		 * worth tracking, just allocate new one. Topics
+		 * bigger than chunk get chunk of their own size */
+		chunk = malloc(sizeof(*chunk) + (len > 4096 ? len : 4096));
+		if (chunk == NULL)
+			return NULL;
+
+		chunk->size = len > 4096 ? len : 4096;
+		chunk->used = 0;
+		chunk->next = pl->chunks;
+		pl->chunks = chunk;
+	}
+
+	dst = (char *)(chunk + 1) + chunk->used;
+	memcpy(dst, topic, len);
+	chunk->used += len;
+	pl->live += len;
+
+	return dst;
+}
+
+
+/* ==========================================================================
+    Frees all chunks in 'chunks' arena.
    ========================================================================== */
-static struct m2md_pl *m2md_pl_new_node
+static void m2md_pl_arena_free
 (
-	const struct m2md_pl_data  *data   /* data to create new node with */
+	struct m2md_pl_chunk  *chunks  /* chunks to free */
 )
 {
-	struct m2md_pl             *node;  /* pointer to new node */
+	struct m2md_pl_chunk  *next;   /* next chunk to free */
 	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
 
-	/* allocate enough memory for data and node in one malloc(), */
-	node = malloc(sizeof(struct m2md_pl));
-	if (node == NULL)
-		return NULL;
+	for (; chunks != NULL; chunks = next)
+	{
+		next = chunks->next;
+		free(chunks);
+	}
+}
 
-	/* make a copy of data */
-	memcpy(&node->data, data, sizeof(*data));
 
-	/* since this is new node, it doesn't point to anything */
-	node->next = NULL;
+/* ==========================================================================
+    Space of deleted topics is not reused, instead once there is more of
+    deleted topics than existing ones, all existing topics are copied to
+    fresh arena and old one is dropped. This way cost of compacting is
+    spread over all deletes that made it necessary.
+   ========================================================================== */
+static void m2md_pl_arena_compact
+(
+	struct m2md_pl_list   *pl      /* list with arena to compact */
+)
+{
+	struct m2md_pl_chunk  *old;    /* arena before compacting */
+	struct m2md_pl_chunk  *chunk;  /* last chunk of new arena */
+	char                  *topic;  /* topic copied to new arena */
+	size_t                 i;      /* iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (pl->dead < 4096 || pl->dead < pl->live)
+		return; /* not worth it yet */
+
+	old = pl->chunks;
+	pl->chunks = NULL;
+	pl->live = 0;
 
-	return node;
+	for (i = 0; i != pl->nnodes; ++i)
+	{
+		if ((topic = m2md_pl_arena_add(pl, pl->data[i].topic)) == NULL)
+			break;
+
+		pl->data[i].topic = topic;
+	}
+
+	if (i != pl->nnodes)
+	{
+		/* no memory for new arena, some topics are still in
+		 * old one, so keep both of them, we will try again on
+		 * next delete */
+		for (chunk = pl->chunks; chunk && chunk->next; chunk = chunk->next)
+			;
+
+		if (chunk == NULL)
+			pl->chunks = old;
+		else
+			chunk->next = old;
+
+		for (; i != pl->nnodes; ++i)
+			pl->live += strlen(pl->data[i].topic) + 1;
+
+		return;
+	}
+
+	pl->dead = 0;
+	m2md_pl_arena_free(old);
 }
 
 
@@ -125,230 +416,372 @@ static struct m2md_pl *m2md_pl_new_node
      / .___/ \__,_//_.___//_//_/ \___/  /_/   \__,_//_/ /_/ \___//____/
     /_/
    ==========================================================================
-    Adds new node with 'data' to list pointed by 'head'
+    Initializes empty poll list 'pl'. Memory is allocated on first add.
+   ========================================================================== */
+int m2md_pl_init
+(
+	struct m2md_pl_list  *pl  /* list to initialize */
+)
+{
+	VALID(EINVAL, pl);
 
-    Function will add node just after head, not at the end of list - this is
-    so we can gain some speed by not searching for last node. So when 'head'
-    list is
+	memset(pl, 0x00, sizeof(*pl));
+	return 0;
+}
 
-        +---+     +---+
-        | 1 | --> | 2 |
-        +---+     +---+
 
-    And node '3' is added, list will be
+/* ==========================================================================
+    Adds copy of 'data' to list 'pl'. Topic is copied into list's arena,
+    so caller still owns 'data->topic' and may free it after this call.
+
+    New poll is always appended at the end of arrays, so when list is
+
+        +---+---+
+        | 1 | 2 |
+        +---+---+
 
-        +---+     +---+     +---+
-        | 1 | --> | 3 | --> | 2 |
-        +---+     +---+     +---+
+    And poll '3' is added, list will be
 
-    If 'head' is NULL (meaning list is empty), function will create new list
-    and add 'data' node to 'head'
+        +---+---+---+
+        | 1 | 2 | 3 |
+        +---+---+---+
 
-    Function will first check if same node exists - if not just add new node
-    if yes, it will check if poll time is smaller and if it's indeed smaller
-    poll time will be updated to smaller value.
+    Function will first check if same poll exists - if not just add new
+    poll if yes, it will check if poll time is smaller and if it's indeed
+    smaller poll time will be updated to smaller value. Existing poll is
+    found with hash index, so it takes the same time no matter how long
+    list is.
+
+    errno:
+            EINVAL      pl, data or data->topic is NULL
+            ENOMEM      not enough memory for new poll
    ========================================================================== */
 int m2md_pl_add
 (
-	struct m2md_pl            **head,  /* head of list where to add new node */
-	const struct m2md_pl_data  *data   /* data for new node */
+	struct m2md_pl_list        *pl,     /* list where to add new poll */
+	const struct m2md_pl_data  *data    /* data for new poll */
 )
 {
-	struct m2md_pl             *node;  /* newly created node */
+	char                       *topic;  /* topic copied into arena */
+	size_t                      slot;   /* slot of poll in index */
+	size_t                      i;      /* position of poll in arrays */
 	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
 
-	VALID(EINVAL, head);
+	VALID(EINVAL, pl);
 	VALID(EINVAL, data);
+	VALID(EINVAL, data->topic);
+
+	/* make room for new poll up front, so we don't have
+	 * to clean up after new poll when it fails later */
+	if (m2md_pl_index_grow(pl, pl->nnodes + 1) != 0)
+		return -1;
+
+	if (m2md_pl_grow(pl, pl->nnodes + 1) != 0)
+		return -1;
 
-	/* let's check if such node already exist */
-	if ((node = m2md_pl_find_node(*head, data, NULL)) != NULL)
+	if (data->deadband_mode != M2MD_PL_DEADBAND_NONE &&
+			m2md_pl_last_alloc(pl) != 0)
+		return -1;
+
+	/* let's check if such poll already exist */
+	slot = m2md_pl_index_slot(pl, data);
+	if (pl->index[slot] != 0)
 	{
-		/* oh look, such node already exist! Check
+		i = pl->index[slot] - 1;
+
+		/* oh look, such poll already exist! Check
 		 * if next poll time is smaller or not */
-		if (data->poll_time.tv_sec < node->data.poll_time.tv_sec ||
-				(data->poll_time.tv_sec == node->data.poll_time.tv_sec &&
-				 data->poll_time.tv_nsec < node->data.poll_time.tv_nsec))
+		if (data->poll_time.tv_sec < pl->data[i].poll_time.tv_sec ||
+				(data->poll_time.tv_sec == pl->data[i].poll_time.tv_sec &&
+				 data->poll_time.tv_nsec < pl->data[i].poll_time.tv_nsec))
 		{
 			/* it's less! update new - smaller -
 			 * poll time and exit with success */
-			node->data.poll_time = data->poll_time;
-
-			/* we also need to reset next read timer, so that new
-			 * poll data is handled immediately, without that next
-			 * read could be like 10 minutes in the future, and
-			 * changing poll time would be in effect only after
-			 * poll expires (after 10 minutes). */
-			node->data.next_read.tv_sec = 0;
-			node->data.next_read.tv_nsec = 0;
+			pl->data[i].poll_time = data->poll_time;
+
+			/* we also need to reset next read timer, without that
+			 * poll would carry deadline of the block it leaves, which
+			 * could be like 10 minutes in the future, or long gone.
+			 * Unscheduled poll simply takes schedule of the block it
+			 * joins when plan is rebuilt, without moving it, so polls
+			 * that are already there keep their timing. When there
+			 * is no such block, new one is placed like any other */
+			pl->next_read[i].tv_sec = 0;
+			pl->next_read[i].tv_nsec = 0;
+
+			/* poll no longer belongs to the block it is in,
+			 * as block has different poll time now. Read plan
+			 * needs to be rebuilt by the caller anyway */
+			if (pl->rp_slot[i] != M2MD_PL_NO_SLOT)
+				pl->rp_polls[pl->rp_slot[i]] = M2MD_PL_NONE;
+			pl->rp_slot[i] = M2MD_PL_NO_SLOT;
 		}
 
 		/* current poll_time is smaller from new one, don't change
 		 * anything, and just ignore the whole situation - don't
-		 * even add new node */
+		 * even add new poll */
 		return 0;
 	}
 
-	/* new poll data are not in the list yet so
-	 * create new node, let's call it 3
-	 *
-	 *           +---+
-	 *           | 3 |
-	 *           +---+
-	 *
-	 *      +---+     +---+
-	 *      | 1 | --> | 2 |
-	 *      +---+     +---+ */
-
-	node = m2md_pl_new_node(data);
-	if (node == NULL)
+	/* new poll data are not in the list yet so copy
+	 * its topic into arena and append it to arrays */
+	if ((topic = m2md_pl_arena_add(pl, data->topic)) == NULL)
 		return -1;
 
-	if (*head == NULL)
-	{
-		/* head is null, so list is empty and we are creating
-		 * new list here. In that case, simply set *head with
-		 * newly created node and exit */
-		*head = node;
-		return 0;
-	}
+	i = pl->nnodes++;
+	memcpy(&pl->data[i], data, sizeof(*data));
+	pl->data[i].topic = topic;
+
+	/* new poll is not in any read plan yet, and it
+	 * should be read as soon as it gets there */
+	pl->next_read[i].tv_sec = 0;
+	pl->next_read[i].tv_nsec = 0;
+	pl->rp_slot[i] = M2MD_PL_NO_SLOT;
 
-	/* set new node's next field, to second item in the list,
-	 * if there is no second item, it will point to NULL
-	 *
-	 *           +---+
-	 *           | 3 |
-	 *           +---+
-	 *                 \
-	 *                 |
-	 *                 V
-	 *      +---+     +---+
-	 *      | 1 | --> | 2 |
-	 *      +---+     +---+ */
-	node->next = (*head)->next;
-
-	/* set head's next to point to newly created node so our
-	 * list is complete once again.
-	 *
-	 *           +---+
-	 *           | 3 |
-	 *           +---+
-	 *           ^    \
-	 *           |     |
-	 *          /      V
-	 *      +---+     +---+
-	 *      | 1 |     | 2 |
-	 *      +---+     +---+ */
-	(*head)->next = node;
+	/* new poll has never been read, so it's not
+	 * known to cause any trouble yet */
+	pl->exc[i].split = 0;
+	pl->exc[i].strikes = 0;
+
+	/* nothing published yet, so first sample
+	 * goes out no matter what deadband says */
+	if (pl->last)
+		pl->last[i].valid = 0;
+
+	/* slot is still empty and valid, nothing changed index */
+	pl->index[slot] = i + 1;
 
 	return 0;
 }
 
 
 /* ==========================================================================
-    Removes 'data' from list 'head'.
+    Finds poll in list 'pl' that has same func, reg and uid as 'data'.
 
-    - if 'data' is in 'head' node, function will modify 'head' pointer
-      so 'head' points to proper node
+    Returns position of found poll in list arrays, or M2MD_PL_NONE when
+    there is no such poll. Position is valid until next delete.
+   ========================================================================== */
+size_t m2md_pl_find
+(
+	struct m2md_pl_list        *pl,    /* list to search */
+	const struct m2md_pl_data  *data   /* data to look for */
+)
+{
+	uint32_t                    i;     /* poll in index, 0 - none */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (pl == NULL || data == NULL || pl->index == NULL)
+		return M2MD_PL_NONE;
+
+	if ((i = pl->index[m2md_pl_index_slot(pl, data)]) == 0)
+		return M2MD_PL_NONE;
+
+	return i - 1;
+}
+
+
+/* ==========================================================================
+    Removes 'data' from list 'pl'.
+
+    To keep arrays dense, last poll is moved into the place of deleted
+    one, so when '2' is deleted from list
 
-    - if 'data' is in 'head' node and 'head' turns out to be last element
-      int the list, 'head' will become NULL
+        +---+---+---+---+
+        | 1 | 2 | 3 | 4 |
+        +---+---+---+---+
+
+    List will be
+
+        +---+---+---+
+        | 1 | 4 | 3 |
+        +---+---+---+
+
+    Index and read plan slot of moved poll are updated, so that they point
+    to its new position.
    ========================================================================== */
 int m2md_pl_delete
 (
-	struct m2md_pl            **head,       /* pointer to head of the list */
-	const struct m2md_pl_data  *data        /* node with data to telete */
+	struct m2md_pl_list        *pl,    /* list to delete from */
+	const struct m2md_pl_data  *data   /* poll with data to telete */
 )
 {
-	struct m2md_pl             *node;       /* found node for with 'data' */
-	struct m2md_pl             *prev_node;  /* previous node of found 'node' */
+	size_t                      slot;  /* slot of poll in index */
+	size_t                      last;  /* position of last poll */
+	size_t                      i;     /* position of deleted poll */
 	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
 
-	VALID(EINVAL, head);
-	VALID(ENOENT, *head);
+	VALID(EINVAL, pl);
+	VALID(ENOENT, pl->nnodes);
 	VALID(EINVAL, data);
 
-	node = m2md_pl_find_node(*head, data, &prev_node);
-	if (node == NULL)
-		/* cannot delete node with name 'data'
-		 * because such node does not exist */
+	slot = m2md_pl_index_slot(pl, data);
+	if (pl->index[slot] == 0)
+		/* cannot delete poll with name 'data'
+		 * because such poll does not exist */
 		return_errno(ENOENT);
 
-	/* initial state of the list
-	 *
-	 *            +---+     +---+     +---+
-	 *   head --> | 1 | --> | 3 | --> | 2 |
-	 *            +---+     +---+     +---+ */
+	i = pl->index[slot] - 1;
+	m2md_pl_index_remove(pl, slot);
+
+	/* remove poll from read plan block it's in, so noone
+	 * will try to read it after it's gone */
+	if (pl->rp_slot[i] != M2MD_PL_NO_SLOT)
+		pl->rp_polls[pl->rp_slot[i]] = M2MD_PL_NONE;
 
-	if (node == *head)
+	/* topic stays in arena until it's compacted */
+	pl->live -= strlen(pl->data[i].topic) + 1;
+	pl->dead += strlen(pl->data[i].topic) + 1;
+
+	last = --pl->nnodes;
+	if (i != last)
 	{
-		/* caller wants to delete node that is currently head node,
-		 * so we need to remove head, and them make head->next new
-		 * head of the list
-		 *
-		 *            +---+          +---+     +---+
-		 *   node --> | 1 | head --> | 3 | --> | 2 |
-		 *            +---+          +---+     +---+ */
-		*head = node->next;
-
-		/* now '1' is detached from anything and can be safely freed */
-		free(node->data.topic);
-		free(node);
-		return 0;
+		/* move last poll into the hole */
+		pl->data[i] = pl->data[last];
+		pl->next_read[i] = pl->next_read[last];
+		pl->exc[i] = pl->exc[last];
+		pl->rp_slot[i] = pl->rp_slot[last];
+		if (pl->last)
+			pl->last[i] = pl->last[last];
+
+		if (pl->rp_slot[i] != M2MD_PL_NO_SLOT)
+			pl->rp_polls[pl->rp_slot[i]] = i;
+
+		pl->index[m2md_pl_index_slot(pl, &pl->data[i])] = i + 1;
 	}
 
-	/* node points to something else than 'head'
-	 *
-	 *            +---+     +---+     +---+     +---+
-	 *   head --> | 1 | --> | 3 | --> | 2 | --> | 4 |
-	 *            +---+     +---+     +---+     +---+
-	 *                                 ^
-	 *                                 |
-	 *                                node
-	 *
-	 * before deleting, we need to make sure '3' (prev node) points
-	 * to '4'. If node points to last element '4', then we will set
-	 * next member of '2' element to null.
-	 *
-	 *            +---+     +---+     +---+
-	 *   head --> | 1 | --> | 3 | --> | 4 |
-	 *            +---+     +---+     +---+
-	 *                                 ^
-	 *                                 |
-	 *                      +---+     /
-	 *             node --> | 2 | ---`
-	 *                      +---+ */
-	prev_node->next = node->next;
-
-	/* now that list is consistent again, we can
-	 * remove node (2) without destroying list */
-	free(node->data.topic);
-	free(node);
+	m2md_pl_arena_compact(pl);
 	return 0;
 }
 
 
 /* ==========================================================================
-    Removes all elements in the list pointed by 'head'. After this function
-    is called 'head' should no longer be used without calling m2md_pl_new()
-    on it again
+    Records modbus exception of poll at position 'i' of 'pl', that was
+    read alone, so it's known it's this poll that is bad. Each exception
+    in a row is a strike, and poll is quarantined for 'min' seconds on
+    first strike, and two times longer on each next one, but never longer
+    than 'max' seconds.
+
+    Returns time in seconds, for which poll is quarantined.
    ========================================================================== */
-int m2md_pl_destroy
+int m2md_pl_strike
 (
-	struct m2md_pl *head  /* list to destroy */
+	struct m2md_pl_list  *pl,    /* list with poll */
+	size_t                i,     /* position of poll that got exception */
+	int                   min,   /* quarantine after first strike */
+	int                   max    /* longest quarantine */
 )
 {
-	struct m2md_pl *next; /* next node to free() */
+	int                   wait;  /* quarantine time */
+	int                   s;     /* strike iterator */
 	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
-	VALID(EINVAL, head);
 
-	for (;head != NULL; head = next)
-	{
-		next = head->next;
-		free(head);
-	}
+	pl->exc[i].strikes++;
+	wait = min;
+	for (s = 1; s < pl->exc[i].strikes && wait < max; ++s)
+		wait = wait > max / 2 ? max : wait * 2;
+
+	return wait > max ? max : wait;
+}
+
 
+/* ==========================================================================
+    Decides whether sample of poll at position 'i' of 'pl', with payload
+    'buf' of 'size' bytes and value 'v', should be published, and if so,
+    remembers it as last published. Sample is suppressed when it didn't
+    move past poll's deadband since last published one, unless poll has
+    been silent for heartbeat seconds, then it goes out anyway, so
+    subscribers know poll is still alive.
+
+    Bitmaps have no value ('v' is NAN), so any deadband means any change
+    for them. Payloads up to 8 bytes are compared exactly, bigger ones by
+    their hash.
+
+    Returns 1 when sample shall be published, 0 when it's suppressed.
+   ========================================================================== */
+int m2md_pl_report
+(
+	struct m2md_pl_list        *pl,    /* list with poll */
+	size_t                      i,     /* position of poll in list */
+	const void                 *buf,   /* payload to publish */
+	int                         size,  /* size of buf */
+	double                      v,     /* value of sample */
+	const struct timespec      *now    /* time sample was taken */
+)
+{
+	const struct m2md_pl_data  *poll;  /* poll sample belongs to */
+	struct m2md_pl_last        *last;  /* last published sample */
+	const unsigned char        *p;     /* byte of payload to hash */
+	uint64_t                    key;   /* payload or its hash */
+	double                      band;  /* how much value must move */
+	int                         b;     /* byte iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	poll = &pl->data[i];
+	if (poll->deadband_mode == M2MD_PL_DEADBAND_NONE)
+		return 1;
+
+	key = 0;
+	if (size <= (int)sizeof(key))
+		memcpy(&key, buf, size);
+	else
+		/* fnv-1a, good enough to tell bitmaps apart */
+		for (key = 14695981039346656037ull, p = buf, b = 0; b != size; ++b)
+			key = (key ^ p[b]) * 1099511628211ull;
+
+	last = &pl->last[i];
+	if (!last->valid)
+		goto publish;
+
+	if (poll->heartbeat && now->tv_sec - last->at.tv_sec >= poll->heartbeat)
+		goto publish;
+
+	if (key == last->key && size == last->size)
+		return 0; /* nothing changed at all */
+
+	if (poll->deadband_mode == M2MD_PL_DEADBAND_ANY || v != v)
+		goto publish;
+
+	band = poll->deadband;
+	if (poll->deadband_mode == M2MD_PL_DEADBAND_PERCENT)
+		band = fabs(last->value) * poll->deadband / 100;
+
+	if (fabs(v - last->value) < band)
+		return 0;
+
+publish:
+	last->valid = 1;
+	last->size = size;
+	last->key = key;
+	last->value = v;
+	last->at = *now;
+	return 1;
+}
+
+
+/* ==========================================================================
+    Removes all polls in the list 'pl'. After this function is called
+    'pl' should no longer be used without calling m2md_pl_init() on it
+    again
+   ========================================================================== */
+int m2md_pl_destroy
+(
+	struct m2md_pl_list  *pl  /* list to destroy */
+)
+{
+	VALID(EINVAL, pl);
+
+	m2md_pl_arena_free(pl->chunks);
+	free(pl->data);
+	free(pl->next_read);
+	free(pl->exc);
+	free(pl->last);
+	free(pl->rp_slot);
+	free(pl->index);
+	memset(pl, 0x00, sizeof(*pl));
 	return 0;
 }
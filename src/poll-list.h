@@ -6,10 +6,81 @@
 #ifndef M2MD_POLL_LIST_H
 #define M2MD_POLL_LIST_H 1
 
+#include <stddef.h>
+#include <stdint.h>
 #include <time.h>
 
 
-/* struct describes what register and how often to pool it */
+/* type of value stored in poll's registers */
+enum m2md_pl_type
+{
+	/* type given as sign and width in registers, value is
+	 * converted and published as single precision float */
+	M2MD_PL_TYPE_RAW,
+
+	M2MD_PL_TYPE_I16,
+	M2MD_PL_TYPE_U16,
+	M2MD_PL_TYPE_I32,
+	M2MD_PL_TYPE_U32,
+	M2MD_PL_TYPE_I64,
+	M2MD_PL_TYPE_U64,
+	M2MD_PL_TYPE_F32,
+	M2MD_PL_TYPE_F64,
+
+	M2MD_PL_TYPE_MAX
+};
+
+/* order of bytes and words of value, letters are bytes of value from
+ * the most significant one, in order in which they come over the wire.
+ * It's a bitmask, first bit swaps words, second swaps bytes in words */
+enum m2md_pl_order
+{
+	M2MD_PL_ORDER_ABCD = 0,  /* big endian, what modbus says */
+	M2MD_PL_ORDER_CDAB = 1,  /* words swapped */
+	M2MD_PL_ORDER_BADC = 2,  /* bytes in words swapped */
+	M2MD_PL_ORDER_DCBA = 3,  /* little endian */
+
+	M2MD_PL_ORDER_MAX
+};
+
+/* when sampled value is published */
+enum m2md_pl_deadband
+{
+	M2MD_PL_DEADBAND_NONE,     /* every sample is published */
+	M2MD_PL_DEADBAND_ANY,      /* only when value changes at all */
+	M2MD_PL_DEADBAND_ABS,      /* when value moves by deadband or more */
+	M2MD_PL_DEADBAND_PERCENT   /* when value moves by deadband % or more */
+};
+
+/* kind of value that came out of decoder */
+enum m2md_pl_value_kind
+{
+	M2MD_PL_VALUE_INT,
+	M2MD_PL_VALUE_UINT,
+	M2MD_PL_VALUE_FLOAT
+};
+
+/* value decoded from registers, at full precision */
+struct m2md_pl_value
+{
+	int           kind;  /* which field of v holds value */
+	union
+	{
+		int64_t   i;     /* signed integer */
+		uint64_t  u;     /* unsigned integer */
+		double    f;     /* floating point */
+	}
+	v;
+};
+
+/* converts registers 'rval' into value 'v', picked once for each poll
+ * depending on its type and order */
+typedef void (*m2md_pl_decode)(const uint16_t *rval, struct m2md_pl_value *v);
+
+
+/* struct describes what register and how often to pool it. There is
+ * one of these for every poll, so fields are ordered by size, to not
+ * waste any space on padding */
 struct m2md_pl_data
 {
 	/* fields used to determin uniqueness of poll */
@@ -18,23 +89,92 @@ struct m2md_pl_data
 	int     uid;                   /* unit id */
 	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
 
-	char            *topic;        /* topic to publish register on */
-	float            scale;        /* scale factor for the field */
+	unsigned short   field_width;  /* field withd in registers or bits */
 	unsigned char    is_signed;    /* 1 - field is signed; 0 - unsigned */
-	unsigned char    field_width;  /* field withd in bytes */
+	unsigned char    type;         /* type of value, m2md_pl_type */
+	char            *topic;        /* topic to publish register on */
 	struct timespec  poll_time;    /* poll register every this time */
-	struct timespec  next_read;    /* absolute time of next poll */
+	m2md_pl_decode   decode;       /* decoder of registers, set by modbus */
+	float            scale;        /* scale factor for the field */
+	float            deadband;     /* how much value must move to publish */
+	int              heartbeat;    /* publish at least every this s, 0 - off */
+	uint32_t         id;           /* topic id in batched messages */
+	uint32_t         tid;          /* topic interned for publisher queue */
+	unsigned char    order;        /* byte and word order, m2md_pl_order */
+	unsigned char    deadband_mode; /* m2md_pl_deadband */
+	unsigned char    encoding;     /* m2md_enc, how sample is published */
+};
+
+/* how poll deals with modbus exceptions, it changes as poll is read,
+ * so it's kept next to timers, and not with descriptors */
+struct m2md_pl_exc
+{
+	unsigned         split;        /* split poll is read only with polls of
+	                                  the same split, 0 - not split */
+	int              strikes;      /* exceptions in a row while read alone,
+	                                  poll is quarantined when not 0 */
+};
+
+/* last value published by poll with deadband */
+struct m2md_pl_last
+{
+	int              valid;        /* anything has been published yet */
+	int              size;         /* size of published payload */
+	uint64_t         key;          /* payload, or its hash when bigger */
+	double           value;        /* published value */
+	struct timespec  at;           /* when it was published */
 };
 
-/* struct describing single node in the list */
-struct m2md_pl
+/* index of poll that does not exist */
+#define M2MD_PL_NONE ((size_t)-1)
+
+/* read plan slot of poll that is in no read plan block */
+#define M2MD_PL_NO_SLOT ((uint32_t)-1)
+
+/* chunk of memory in which topics of polls are stored */
+struct m2md_pl_chunk
 {
-	struct m2md_pl_data  data;
-	struct m2md_pl      *next;
+	struct m2md_pl_chunk  *next;       /* next chunk in arena */
+	size_t                 used;       /* bytes used in chunk */
+	size_t                 size;       /* bytes available in chunk */
+};
+
+/* list of polls. Polls are kept in contiguous arrays, so walking polls
+ * does not jump all over the memory, and are split so that timers,
+ * which change all the time, don't share cache with poll descriptors,
+ * which barely change at all. Last published values, which change as
+ * often as timers, get their own array for the same reason, but only
+ * once some poll has deadband, most lists never need it. Read plan slot
+ * is kept as position in read plan storage, which takes half of what
+ * pointer would. Topics are kept in chunked arena, instead of separate
+ * allocation for each topic. Hash index maps func, reg and uid into
+ * position in arrays, so polls can be found without walking whole list */
+struct m2md_pl_list
+{
+	struct m2md_pl_data   *data;       /* descriptors of polls */
+	struct timespec       *next_read;  /* absolute time of next poll */
+	struct m2md_pl_exc    *exc;        /* exception state of polls */
+	struct m2md_pl_last   *last;       /* last published values, or NULL */
+	uint32_t              *rp_slot;    /* slot in rp_polls, or NO_SLOT */
+	size_t                *rp_polls;   /* storage of read plan slots */
+	size_t                 nnodes;     /* number of polls in list */
+	size_t                 size;       /* number of polls arrays can hold */
+
+	uint32_t              *index;      /* hash of polls, 0 - empty slot */
+	unsigned               bits;       /* index has 1 << bits slots */
+
+	struct m2md_pl_chunk  *chunks;     /* arena with topics */
+	size_t                 live;       /* bytes used by existing topics */
+	size_t                 dead;       /* bytes used by deleted topics */
 };
 
-int m2md_pl_add(struct m2md_pl **head, const struct m2md_pl_data *data);
-int m2md_pl_delete(struct m2md_pl **head, const struct m2md_pl_data *data);
-int m2md_pl_destroy(struct m2md_pl *head);
+int m2md_pl_init(struct m2md_pl_list *pl);
+int m2md_pl_add(struct m2md_pl_list *pl, const struct m2md_pl_data *data);
+size_t m2md_pl_find(struct m2md_pl_list *pl, const struct m2md_pl_data *data);
+int m2md_pl_delete(struct m2md_pl_list *pl, const struct m2md_pl_data *data);
+int m2md_pl_strike(struct m2md_pl_list *pl, size_t i, int min, int max);
+int m2md_pl_report(struct m2md_pl_list *pl, size_t i, const void *buf,
+		int size, double v, const struct timespec *now);
+int m2md_pl_destroy(struct m2md_pl_list *pl);
 
 #endif
@@ -0,0 +1,817 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+         ------------------------------------------------------------
+        / publisher - takes samples from server threads through lock \
+        | free queue, and publishes them on mqtt from its own        |
+        \ threads, so slow broker never stalls modbus                /
+         ------------------------------------------------------------
+   ==========================================================================
+          _               __            __         ____ _  __
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+
+   ========================================================================== */
+
+
+#include "publisher.h"
+
+#include <embedlog.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cfg.h"
+#include "poll-list.h"
+#include "mqtt.h"
+#include "valid.h"
+#include "macros.h"
+
+
+/* ==========================================================================
+          __             __                     __   _
+     ____/ /___   _____ / /____ _ _____ ____ _ / /_ (_)____   ____   _____
+    / __  // _ \ / ___// // __ `// ___// __ `// __// // __ \ / __ \ / ___/
+   / /_/ //  __// /__ / // /_/ // /   / /_/ // /_ / // /_/ // / / /(__  )
+   \__,_/ \___/ \___//_/ \__,_//_/    \__,_/ \__//_/ \____//_/ /_//____/
+
+   ========================================================================== */
+
+
+/* sample waiting in queue to be published */
+struct m2md_pub_rec
+{
+	uint32_t          tid;    /* interned topic of sample */
+	int               len;    /* length of payload */
+	struct timespec   at;     /* monotonic time sample was queued */
+	unsigned char    *ext;    /* payload that didn't fit data, or NULL */
+	unsigned char     data[M2MD_PUB_INLINE]; /* payload, when it fits */
+};
+
+/* Queue is bounded ring of cells, each with its own sequence number,
+ * that tells whose turn it is on the cell. Cell at position 'pos' is
+ * free for producer when seq == pos, and holds sample for consumer
+ * when seq == pos + 1. Producers and consumers claim positions with
+ * single compare and swap on head and tail, and never wait for each
+ * other. Queue takes any number of both, which is what lets server
+ * thread drop oldest sample on its own */
+struct m2md_pub_cell
+{
+	size_t               seq;  /* sequence of cell */
+	struct m2md_pub_rec  rec;  /* sample in the cell */
+};
+
+/* counters for stats, all updated with atomics, as producers
+ * and consumers update them without any lock */
+struct m2md_pub_stats
+{
+	unsigned long     published;       /* samples sent to broker */
+	unsigned long     failed;          /* samples broker didn't take */
+	unsigned long     dropped_oldest;  /* samples dropped to make room */
+	unsigned long     dropped_newest;  /* samples dropped for no room */
+	unsigned long     blocked;         /* server waits for room */
+	unsigned long     drains;          /* times queue was drained */
+	int64_t           depth_max;       /* max samples seen in queue */
+	int64_t           wait_max;        /* max time sample was queued, ns */
+};
+
+static struct m2md_pub_cell  *g_pub_cells;
+static size_t                 g_pub_mask;
+
+/* head is hammered by producers, tail by consumers,
+ * keep them on separate cache lines */
+static size_t g_pub_head __attribute__((aligned(64)));
+static size_t g_pub_tail __attribute__((aligned(64)));
+
+static pthread_t  *g_pub_threads;
+static int         g_pub_nthreads;
+static int         g_pub_run;
+
+/* lock and conditions are only used to sleep when there is nothing
+ * to do, queue itself never takes lock. Waiters are counted, so
+ * other side doesn't touch lock when nobody sleeps */
+static pthread_mutex_t  g_pub_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   g_pub_more;   /* publishers wait for samples */
+static pthread_cond_t   g_pub_room;   /* server threads wait for room */
+static int              g_pub_sleeping;
+static int              g_pub_blocked;
+
+static struct m2md_pub_stats  g_pub_stats;
+
+/* Interned topics. Topic of poll lives in poll list, which moves it
+ * around and frees it, while its samples may still be queued, so queue
+ * carries id of topic's own copy instead. Table is made of chunks that
+ * never move, so publishers can read it without lock, ids are handed
+ * out only after topic is stored. Topics are never freed, polls are
+ * hardly ever deleted */
+#define M2MD_PUB_TOPICS_CHUNK   1024
+#define M2MD_PUB_TOPICS_CHUNKS  1024
+
+static char            **g_pub_topics[M2MD_PUB_TOPICS_CHUNKS];
+static uint32_t          g_pub_ntopics;
+static pthread_mutex_t   g_pub_topics_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ==========================================================================
+    Stores in 'ts' monotonic time that is 'ms' milliseconds from now.
+   ========================================================================== */
+static void m2md_pub_deadline
+(
+	struct timespec  *ts,  /* deadline goes here */
+	int               ms   /* how far from now deadline is */
+)
+{
+	clock_gettime(CLOCK_MONOTONIC, ts);
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (long)(ms % 1000) * 1000000;
+	if (ts->tv_nsec >= 1000000000)
+	{
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+
+/* ==========================================================================
+    Raises 'max' to 'v', if 'v' is bigger. Others may be raising it at
+    the same time.
+   ========================================================================== */
+static void m2md_pub_max
+(
+	int64_t  *max,  /* max to raise */
+	int64_t   v     /* new value */
+)
+{
+	int64_t   cur;  /* current max */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	cur = __atomic_load_n(max, __ATOMIC_RELAXED);
+	while (v > cur && !__atomic_compare_exchange_n(max, &cur, v, 1,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+
+/* ==========================================================================
+    Returns number of samples in queue. It's only a hint, queue may
+    change right after it's been checked.
+   ========================================================================== */
+static size_t m2md_pub_depth
+(
+	void
+)
+{
+	size_t  tail;  /* position of oldest sample */
+	size_t  depth; /* samples between tail and head */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	/* tail is read first, head can only be further by then,
+	 * so this never goes below 0. It may go above size of
+	 * queue, when both move in between */
+	tail = __atomic_load_n(&g_pub_tail, __ATOMIC_SEQ_CST);
+	depth = __atomic_load_n(&g_pub_head, __ATOMIC_SEQ_CST) - tail;
+	return depth > g_pub_mask ? g_pub_mask + 1 : depth;
+}
+
+
+/* ==========================================================================
+    Wakes threads that wait on 'cond', if 'waiters' says there are any.
+    One thread is woken, or all of them when 'all' is set.
+
+    Caller must have changed queue before calling this, waiter checks
+    queue after it counts itself in 'waiters', so either it sees change,
+    or we see it waiting.
+   ========================================================================== */
+static void m2md_pub_wake
+(
+	int             *waiters,  /* number of threads waiting */
+	pthread_cond_t  *cond,     /* condition they wait on */
+	int              all       /* wake all of them */
+)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(waiters, __ATOMIC_RELAXED) == 0)
+		return;
+
+	pthread_mutex_lock(&g_pub_lock);
+	if (all)
+		pthread_cond_broadcast(cond);
+	else
+		pthread_cond_signal(cond);
+	pthread_mutex_unlock(&g_pub_lock);
+}
+
+
+/* ==========================================================================
+    Puts sample 'rec' into queue. Payload that fits the cell is taken
+    from 'payload', bigger one has already been copied to rec->ext.
+
+    Returns 0 when sample is queued, -1 when queue is full.
+   ========================================================================== */
+static int m2md_pub_enqueue
+(
+	const struct m2md_pub_rec  *rec,      /* sample to queue */
+	const void                 *payload   /* payload of sample */
+)
+{
+	struct m2md_pub_cell       *cell;     /* cell we take */
+	size_t                      pos;      /* position of cell */
+	size_t                      seq;      /* sequence of cell */
+	intptr_t                    dif;      /* how far seq is from pos */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	pos = __atomic_load_n(&g_pub_head, __ATOMIC_RELAXED);
+	for (;;)
+	{
+		cell = &g_pub_cells[pos & g_pub_mask];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		dif = (intptr_t)seq - (intptr_t)pos;
+
+		if (dif < 0)
+			/* cell still holds sample from previous
+			 * lap, queue is full */
+			return -1;
+
+		if (dif > 0)
+		{
+			/* other producer took this cell
+			 * already, try with fresh head */
+			pos = __atomic_load_n(&g_pub_head, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		/* on failure pos gets current head */
+		if (__atomic_compare_exchange_n(&g_pub_head, &pos, pos + 1, 1,
+					__ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+			break;
+	}
+
+	cell->rec.tid = rec->tid;
+	cell->rec.len = rec->len;
+	cell->rec.at = rec->at;
+	cell->rec.ext = rec->ext;
+	if (rec->ext == NULL)
+		memcpy(cell->rec.data, payload, rec->len);
+
+	/* cell is now consumer's */
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+
+/* ==========================================================================
+    Takes oldest sample from queue into 'rec'. Caller owns rec->ext then.
+
+    Returns 0 when sample was taken, -1 when queue is empty.
+   ========================================================================== */
+static int m2md_pub_dequeue
+(
+	struct m2md_pub_rec   *rec    /* taken sample goes here */
+)
+{
+	struct m2md_pub_cell  *cell;  /* cell we take */
+	size_t                 pos;   /* position of cell */
+	size_t                 seq;   /* sequence of cell */
+	intptr_t               dif;   /* how far seq is from pos */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	pos = __atomic_load_n(&g_pub_tail, __ATOMIC_RELAXED);
+	for (;;)
+	{
+		cell = &g_pub_cells[pos & g_pub_mask];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		dif = (intptr_t)seq - (intptr_t)(pos + 1);
+
+		if (dif < 0)
+			/* nothing has been put in this cell
+			 * yet, queue is empty */
+			return -1;
+
+		if (dif > 0)
+		{
+			pos = __atomic_load_n(&g_pub_tail, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		if (__atomic_compare_exchange_n(&g_pub_tail, &pos, pos + 1, 1,
+					__ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+			break;
+	}
+
+	*rec = cell->rec;
+
+	/* cell is free for producer on next lap */
+	__atomic_store_n(&cell->seq, pos + g_pub_mask + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+
+/* ==========================================================================
+    Puts server thread to sleep until publisher makes room in queue,
+    but not for long, so thread gets to check whether it should stop.
+   ========================================================================== */
+static void m2md_pub_wait_room
+(
+	void
+)
+{
+	struct timespec  until;  /* when we stop waiting */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	m2md_pub_deadline(&until, 10);
+	__atomic_add_fetch(&g_pub_stats.blocked, 1, __ATOMIC_RELAXED);
+
+	pthread_mutex_lock(&g_pub_lock);
+	__atomic_add_fetch(&g_pub_blocked, 1, __ATOMIC_SEQ_CST);
+	if (m2md_pub_depth() > g_pub_mask &&
+			__atomic_load_n(&g_pub_run, __ATOMIC_ACQUIRE))
+		pthread_cond_timedwait(&g_pub_room, &g_pub_lock, &until);
+	__atomic_sub_fetch(&g_pub_blocked, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&g_pub_lock);
+}
+
+
+/* ==========================================================================
+    Puts publisher thread to sleep until there is something in queue.
+   ========================================================================== */
+static void m2md_pub_sleep
+(
+	void
+)
+{
+	struct timespec  until;  /* when we stop waiting */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	m2md_pub_deadline(&until, 100);
+
+	pthread_mutex_lock(&g_pub_lock);
+	__atomic_add_fetch(&g_pub_sleeping, 1, __ATOMIC_SEQ_CST);
+	if (m2md_pub_depth() == 0 &&
+			__atomic_load_n(&g_pub_run, __ATOMIC_ACQUIRE))
+		pthread_cond_timedwait(&g_pub_more, &g_pub_lock, &until);
+	__atomic_sub_fetch(&g_pub_sleeping, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&g_pub_lock);
+}
+
+
+/* ==========================================================================
+    Takes up to M2MD_PUB_DRAIN samples from queue in one go, and
+    publishes them on mqtt.
+
+    Returns number of samples taken from queue.
+   ========================================================================== */
+static int m2md_pub_drain
+(
+	void
+)
+{
+	struct m2md_pub_rec  recs[M2MD_PUB_DRAIN]; /* samples taken */
+	struct timespec      now;      /* current time */
+	const char          *topic;    /* topic of sample */
+	const void          *payload;  /* payload of sample */
+	int64_t              wait;     /* time sample was queued */
+	int64_t              wait_max; /* max of that in this drain */
+	int64_t              depth;    /* samples in queue before drain */
+	int                  failed;   /* samples broker didn't take */
+	int                  n;        /* number of samples taken */
+	int                  i;        /* teh iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	depth = m2md_pub_depth();
+	for (n = 0; n != M2MD_PUB_DRAIN; ++n)
+		if (m2md_pub_dequeue(&recs[n]) != 0)
+			break;
+
+	if (n == 0)
+		return 0;
+
+	/* there is room now, for anyone waiting for it */
+	m2md_pub_wake(&g_pub_blocked, &g_pub_room, 1);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	wait_max = 0;
+	failed = 0;
+	for (i = 0; i != n; ++i)
+	{
+		wait = (int64_t)(now.tv_sec - recs[i].at.tv_sec) * 1000000000 +
+			(now.tv_nsec - recs[i].at.tv_nsec);
+		if (wait > wait_max)
+			wait_max = wait;
+
+		topic = g_pub_topics[recs[i].tid / M2MD_PUB_TOPICS_CHUNK]
+			[recs[i].tid % M2MD_PUB_TOPICS_CHUNK];
+		payload = recs[i].ext ? recs[i].ext : recs[i].data;
+
+		el_print(ELD, "publisher: %s: %d bytes", topic, recs[i].len);
+		if (m2md_mqtt_publish_full(topic, payload, recs[i].len, 0) != 0)
+		{
+			el_perror(ELE, "publisher: mqtt_publish(%s, %d) failed",
+					topic, recs[i].len);
+			++failed;
+		}
+
+		free(recs[i].ext);
+	}
+
+	__atomic_add_fetch(&g_pub_stats.published, n - failed, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&g_pub_stats.failed, failed, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&g_pub_stats.drains, 1, __ATOMIC_RELAXED);
+	m2md_pub_max(&g_pub_stats.depth_max, depth);
+	m2md_pub_max(&g_pub_stats.wait_max, wait_max);
+	return n;
+}
+
+
+/* ==========================================================================
+    Publisher thread, drains queue for as long as we run, and sleeps
+    when there is nothing in it.
+   ========================================================================== */
+static void *m2md_pub_thread
+(
+	void    *arg  /* not used */
+)
+{
+	size_t   i;   /* samples published after stop */
+	int      n;   /* samples published in one drain */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	(void)arg;
+
+	while (__atomic_load_n(&g_pub_run, __ATOMIC_ACQUIRE))
+		if (m2md_pub_drain() == 0)
+			m2md_pub_sleep();
+
+	/* publish what was queued before we were stopped. Server
+	 * threads may still be queueing, so don't wait for queue
+	 * to be empty, one queue worth is all we take */
+	for (i = 0; i <= g_pub_mask && (n = m2md_pub_drain()) != 0; i += n)
+		;
+
+	return NULL;
+}
+
+
+/* ==========================================================================
+                       __     __ _          ____
+        ____   __  __ / /_   / /(_)_____   / __/__  __ ____   _____ _____
+       / __ \ / / / // __ \ / // // ___/  / /_ / / / // __ \ / ___// ___/
+      / /_/ // /_/ // /_/ // // // /__   / __// /_/ // / / // /__ (__  )
+     / .___/ \__,_//_.___//_//_/ \___/  /_/   \__,_//_/ /_/ \___//____/
+    /_/
+   ==========================================================================
+    Creates queue for samples, when publisher threads are enabled. Server
+    threads can queue samples right after, they are published once
+    m2md_pub_start() is called, that is after mqtt is up.
+   ========================================================================== */
+int m2md_pub_init
+(
+	void
+)
+{
+	pthread_condattr_t  cattr;  /* attributes of conditions */
+	size_t              size;   /* number of cells in queue */
+	size_t              i;      /* teh iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (m2md_cfg->mqtt_publishers == 0)
+		return 0;
+
+	/* cell is picked by masking position,
+	 * so queue must be power of 2 */
+	for (size = 1; size < (size_t)m2md_cfg->mqtt_queue; size <<= 1)
+		;
+
+	if ((g_pub_cells = malloc(size * sizeof(*g_pub_cells))) == NULL)
+		return_perror(ELF, "publisher: malloc(queue, %zu)", size);
+
+	for (i = 0; i != size; ++i)
+		g_pub_cells[i].seq = i;
+
+	g_pub_mask = size - 1;
+	g_pub_head = 0;
+	g_pub_tail = 0;
+	memset(&g_pub_stats, 0x00, sizeof(g_pub_stats));
+
+	/* timeouts are in monotonic clock, so they are
+	 * not confused by someone changing the time */
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&g_pub_more, &cattr);
+	pthread_cond_init(&g_pub_room, &cattr);
+	pthread_condattr_destroy(&cattr);
+
+	g_pub_run = 1;
+	el_print(ELI, "publisher: queue of %zu samples", size);
+	return 0;
+}
+
+
+/* ==========================================================================
+    Starts publisher threads, mqtt must be initialized by now.
+   ========================================================================== */
+int m2md_pub_start
+(
+	void
+)
+{
+	int  ret;  /* return code from function */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (g_pub_cells == NULL)
+		return 0;
+
+	g_pub_threads = calloc(m2md_cfg->mqtt_publishers, sizeof(*g_pub_threads));
+	if (g_pub_threads == NULL)
+		return_perror(ELF, "publisher: calloc(threads)");
+
+	for (g_pub_nthreads = 0; g_pub_nthreads != m2md_cfg->mqtt_publishers;
+			++g_pub_nthreads)
+	{
+		ret = pthread_create(&g_pub_threads[g_pub_nthreads], NULL,
+				m2md_pub_thread, NULL);
+		if (ret)
+		{
+			errno = ret;
+			el_perror(ELF, "publisher: pthread_create()");
+			m2md_pub_stop();
+			return -1;
+		}
+	}
+
+	el_print(ELI, "publisher: started %d threads", g_pub_nthreads);
+	return 0;
+}
+
+
+/* ==========================================================================
+    Stops publisher threads, after they publish what's been queued. Server
+    threads may keep queueing, but nothing will be published anymore, and
+    those that block for room, drop their samples instead.
+   ========================================================================== */
+void m2md_pub_stop
+(
+	void
+)
+{
+	int  i;  /* teh iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (g_pub_cells == NULL)
+		return;
+
+	/* threads check run flag with lock held before they
+	 * sleep, so they either see it, or get woken up */
+	__atomic_store_n(&g_pub_run, 0, __ATOMIC_RELEASE);
+	pthread_mutex_lock(&g_pub_lock);
+	pthread_cond_broadcast(&g_pub_more);
+	pthread_cond_broadcast(&g_pub_room);
+	pthread_mutex_unlock(&g_pub_lock);
+
+	for (i = 0; i != g_pub_nthreads; ++i)
+		pthread_join(g_pub_threads[i], NULL);
+
+	free(g_pub_threads);
+	g_pub_threads = NULL;
+	g_pub_nthreads = 0;
+}
+
+
+/* ==========================================================================
+    Frees queue, with samples that are left in it, and interned topics.
+    Nothing can be queued anymore, server threads must be stopped by now.
+   ========================================================================== */
+void m2md_pub_cleanup
+(
+	void
+)
+{
+	struct m2md_pub_rec  rec;  /* sample left in queue */
+	uint32_t             i;    /* teh iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (g_pub_cells != NULL)
+	{
+		m2md_pub_stop();
+		while (m2md_pub_dequeue(&rec) == 0)
+			free(rec.ext);
+
+		free(g_pub_cells);
+		g_pub_cells = NULL;
+		pthread_cond_destroy(&g_pub_more);
+		pthread_cond_destroy(&g_pub_room);
+	}
+
+	for (i = 0; i != g_pub_ntopics; ++i)
+		free(g_pub_topics[i / M2MD_PUB_TOPICS_CHUNK]
+				[i % M2MD_PUB_TOPICS_CHUNK]);
+
+	for (i = 0; i != M2MD_PUB_TOPICS_CHUNKS; ++i)
+	{
+		free(g_pub_topics[i]);
+		g_pub_topics[i] = NULL;
+	}
+
+	g_pub_ntopics = 0;
+}
+
+
+/* ==========================================================================
+    Interns full 'topic', so samples can be queued with its id instead
+    of topic itself. Each call gives new id, even for topic that has
+    been interned before.
+
+    Returns id of topic, or M2MD_PUB_NO_TOPIC on error.
+
+    errno:
+            ENOSPC      no more topics can be interned
+            ENOMEM      not enough memory for topic
+   ========================================================================== */
+uint32_t m2md_pub_topic
+(
+	const char  *topic  /* full topic to intern */
+)
+{
+	char       **chunk; /* chunk topic goes to */
+	char        *copy;  /* our copy of topic */
+	uint32_t     id;    /* id of topic */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	pthread_mutex_lock(&g_pub_topics_lock);
+	id = g_pub_ntopics;
+	if (id == M2MD_PUB_TOPICS_CHUNK * M2MD_PUB_TOPICS_CHUNKS)
+	{
+		pthread_mutex_unlock(&g_pub_topics_lock);
+		errno = ENOSPC;
+		return M2MD_PUB_NO_TOPIC;
+	}
+
+	chunk = g_pub_topics[id / M2MD_PUB_TOPICS_CHUNK];
+	if (chunk == NULL)
+		chunk = calloc(M2MD_PUB_TOPICS_CHUNK, sizeof(*chunk));
+
+	if (chunk == NULL || (copy = strdup(topic)) == NULL)
+	{
+		/* chunk, if it's new, is stored anyway,
+		 * it will be used by next topic */
+		g_pub_topics[id / M2MD_PUB_TOPICS_CHUNK] = chunk;
+		pthread_mutex_unlock(&g_pub_topics_lock);
+		errno = ENOMEM;
+		return M2MD_PUB_NO_TOPIC;
+	}
+
+	g_pub_topics[id / M2MD_PUB_TOPICS_CHUNK] = chunk;
+	chunk[id % M2MD_PUB_TOPICS_CHUNK] = copy;
+	g_pub_ntopics = id + 1;
+	pthread_mutex_unlock(&g_pub_topics_lock);
+	return id;
+}
+
+
+/* ==========================================================================
+    Queues 'payload' of 'len' bytes to be published on topic 'tid', by
+    one of publisher threads. Payload is copied, caller can reuse it as
+    soon as this returns. When queue is full, mqtt_backpressure decides
+    what happens. Dropped samples are only counted, it's not an error of
+    caller.
+
+    errno:
+            EINVAL      invalid argument passed
+            ENODEV      publisher threads are not enabled
+            ENOMEM      not enough memory for big payload
+   ========================================================================== */
+int m2md_pub_push
+(
+	uint32_t             tid,      /* interned topic of sample */
+	const void          *payload,  /* payload to publish */
+	int                  len       /* length of payload */
+)
+{
+	struct m2md_pub_rec  rec;      /* sample to queue */
+	struct m2md_pub_rec  old;      /* oldest sample, dropped for rec */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	VALID(EINVAL, payload);
+	VALID(EINVAL, len >= 0);
+	VALID(EINVAL, tid != M2MD_PUB_NO_TOPIC);
+	VALID(ENODEV, g_pub_cells);
+
+	rec.tid = tid;
+	rec.len = len;
+	rec.ext = NULL;
+	clock_gettime(CLOCK_MONOTONIC, &rec.at);
+
+	if (len > M2MD_PUB_INLINE)
+	{
+		if ((rec.ext = malloc(len)) == NULL)
+			return -1;
+
+		memcpy(rec.ext, payload, len);
+	}
+
+	while (m2md_pub_enqueue(&rec, payload) != 0)
+	{
+		if (m2md_cfg->mqtt_backpressure == M2MD_PUB_DROP_OLDEST)
+		{
+			/* we take oldest sample just like publisher would.
+			 * Someone else may take it first, then we simply
+			 * find room on next try */
+			if (m2md_pub_dequeue(&old) == 0)
+			{
+				free(old.ext);
+				__atomic_add_fetch(&g_pub_stats.dropped_oldest, 1,
+						__ATOMIC_RELAXED);
+			}
+
+			continue;
+		}
+
+		if (m2md_cfg->mqtt_backpressure == M2MD_PUB_BLOCK &&
+				__atomic_load_n(&g_pub_run, __ATOMIC_ACQUIRE))
+		{
+			m2md_pub_wait_room();
+			continue;
+		}
+
+		/* drop newest, or publishers are stopped
+		 * and nobody is ever going to make room */
+		free(rec.ext);
+		__atomic_add_fetch(&g_pub_stats.dropped_newest, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	m2md_pub_wake(&g_pub_sleeping, &g_pub_more, 0);
+	return 0;
+}
+
+
+/* ==========================================================================
+    Prints stats of publisher, gathered since previous call, that is how
+    deep queue gets, how long samples wait in it, and how many of them
+    had to be dropped.
+   ========================================================================== */
+void m2md_pub_print_stats
+(
+	void
+)
+{
+	struct m2md_pub_stats  stats;  /* copy of stats */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (g_pub_cells == NULL)
+		return;
+
+#define M2MD_PUB_TAKE(f) \
+	stats.f = __atomic_exchange_n(&g_pub_stats.f, 0, __ATOMIC_RELAXED)
+
+	M2MD_PUB_TAKE(published);
+	M2MD_PUB_TAKE(failed);
+	M2MD_PUB_TAKE(dropped_oldest);
+	M2MD_PUB_TAKE(dropped_newest);
+	M2MD_PUB_TAKE(blocked);
+	M2MD_PUB_TAKE(drains);
+	M2MD_PUB_TAKE(depth_max);
+	M2MD_PUB_TAKE(wait_max);
+
+#undef M2MD_PUB_TAKE
+
+	el_print(ELI, "stats publisher: queue depth: %zu/%zu, depth max: %lld, "
+			"published: %lu, samples per drain: %.1f, wait max: %.3fms",
+			m2md_pub_depth(), g_pub_mask + 1, (long long)stats.depth_max,
+			stats.published, stats.drains ?
+			(double)(stats.published + stats.failed) / stats.drains : 0.0,
+			stats.wait_max / 1000000.0);
+
+	if (stats.dropped_oldest || stats.dropped_newest ||
+			stats.blocked || stats.failed)
+		el_print(ELI, "stats publisher: dropped oldest: %lu, "
+				"dropped newest: %lu, blocked: %lu, failed: %lu",
+				stats.dropped_oldest, stats.dropped_newest,
+				stats.blocked, stats.failed);
+}
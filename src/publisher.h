@@ -0,0 +1,39 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ========================================================================== */
+
+#ifndef M2MD_PUBLISHER_H
+#define M2MD_PUBLISHER_H 1
+
+#include <stdint.h>
+
+/* what server thread does when publisher queue is full, order must
+ * match order of names in mqtt_backpressure config option */
+enum m2md_pub_backpressure
+{
+	M2MD_PUB_DROP_OLDEST,  /* oldest queued sample makes room for new one */
+	M2MD_PUB_DROP_NEWEST,  /* new sample is dropped */
+	M2MD_PUB_BLOCK         /* server thread waits until there is room */
+};
+
+/* topic id that was never given, sample with it is
+ * published directly, without the queue */
+#define M2MD_PUB_NO_TOPIC  UINT32_MAX
+
+/* payload that fits into queue cell as it is, bigger one is copied
+ * into allocated buffer. With it cell is 128 bytes on 64bit */
+#define M2MD_PUB_INLINE    88
+
+/* max samples publisher thread takes from queue in one go */
+#define M2MD_PUB_DRAIN     64
+
+int m2md_pub_init(void);
+int m2md_pub_start(void);
+void m2md_pub_stop(void);
+void m2md_pub_cleanup(void);
+uint32_t m2md_pub_topic(const char *topic);
+int m2md_pub_push(uint32_t tid, const void *payload, int len);
+void m2md_pub_print_stats(void);
+
+#endif
@@ -0,0 +1,544 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+         ------------------------------------------------------------
+        / rp - read plan, groups polls that share uid, function and  \
+        | poll time into blocks of registers that can be read with   |
+        \ single modbus request                                       /
+         ------------------------------------------------------------
+   ==========================================================================
+          _               __            __         ____ _  __
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+
+   ========================================================================== */
+
+
+#include "read-plan.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "valid.h"
+
+
+/* ==========================================================================
+          __             __                     __   _
+     ____/ /___   _____ / /____ _ _____ ____ _ / /_ (_)____   ____   _____
+    / __  // _ \ / ___// // __ `// ___// __ `// __// // __ \ / __ \ / ___/
+   / /_/ //  __// /__ / // /_/ // /   / /_/ // /_ / // /_/ // / / /(__  )
+   \__,_/ \___/ \___//_/ \__,_//_/    \__,_/ \__//_/ \____//_/ /_//____/
+
+   ========================================================================== */
+
+
+/* poll as it is sorted when plan is built. Split is kept in list next
+ * to timers, and qsort() cannot pass list to comparator, so split is
+ * carried along with descriptor */
+struct m2md_rp_sorted
+{
+	const struct m2md_pl_data  *poll;   /* descriptor of poll */
+	unsigned                    split;  /* split of poll */
+};
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ==========================================================================
+    qsort() comparator, orders polls so that polls that can be read in
+    one request are next to each other, sorted by register.
+   ========================================================================== */
+static int m2md_rp_cmp
+(
+	const void                 *a,   /* first poll to compare */
+	const void                 *b    /* second poll to compare */
+)
+{
+	const struct m2md_rp_sorted  *sa;  /* first poll to compare */
+	const struct m2md_rp_sorted  *sb;  /* second poll to compare */
+	const struct m2md_pl_data    *pa;  /* first poll descriptor */
+	const struct m2md_pl_data    *pb;  /* second poll descriptor */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	sa = a;
+	sb = b;
+	pa = sa->poll;
+	pb = sb->poll;
+
+#define M2MD_RP_CMP(f) if (pa->f != pb->f) return pa->f < pb->f ? -1 : 1
+
+	M2MD_RP_CMP(uid);
+	M2MD_RP_CMP(func);
+	M2MD_RP_CMP(poll_time.tv_sec);
+	M2MD_RP_CMP(poll_time.tv_nsec);
+
+	if (sa->split != sb->split)
+		return sa->split < sb->split ? -1 : 1;
+
+	M2MD_RP_CMP(reg);
+	return 0;
+
+#undef M2MD_RP_CMP
+}
+
+
+/* ==========================================================================
+    Returns 1 when time 'a' is earlier than time 'b'
+   ========================================================================== */
+static int m2md_rp_earlier
+(
+	const struct timespec  *a,  /* first time to compare */
+	const struct timespec  *b   /* second time to compare */
+)
+{
+	if (a->tv_sec != b->tv_sec)
+		return a->tv_sec < b->tv_sec;
+
+	return a->tv_nsec < b->tv_nsec;
+}
+
+
+/* ==========================================================================
+    Adds poll at position 'i' of 'pl' to 'block', first poll in block
+    defines function, uid and poll time of the block.
+   ========================================================================== */
+static void m2md_rp_block_add
+(
+	struct m2md_rp_block       *block,  /* block to add poll to */
+	struct m2md_pl_list        *pl,     /* list poll belongs to */
+	size_t                      i       /* position of poll in list */
+)
+{
+	const struct m2md_pl_data  *poll;   /* poll to add */
+	const struct timespec      *next;   /* next read of poll */
+	int                         end;    /* end register of poll */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	poll = &pl->data[i];
+	end = poll->reg + m2md_rp_poll_width(poll);
+
+	if (block->npolls == 0)
+	{
+		/* new block, initialize it with first poll */
+		block->func = poll->func;
+		block->uid = poll->uid;
+		block->reg = poll->reg;
+		block->count = end - block->reg;
+		block->poll_time = poll->poll_time;
+		block->split = pl->exc[i].split;
+		block->sched.idx = M2MD_SCHED_NOT_QUEUED;
+		block->sched.deadline = pl->next_read[i];
+	}
+
+	/* polls are sorted by register, so only end
+	 * of the block can be moved further */
+	if (end - block->reg > block->count)
+		block->count = end - block->reg;
+
+	/* block shall be read as soon as any of its polls is due,
+	 * but poll that has not yet been scheduled (zero time) has
+	 * no say in it, otherwise new poll would drag whole block
+	 * back to unscheduled state and its polls would lose their
+	 * place in time. Block is unscheduled only when none of its
+	 * polls is scheduled */
+	next = &pl->next_read[i];
+	if (next->tv_sec == 0 && next->tv_nsec == 0)
+		;
+	else if (block->sched.deadline.tv_sec == 0 &&
+			block->sched.deadline.tv_nsec == 0)
+		block->sched.deadline = *next;
+	else if (m2md_rp_earlier(next, &block->sched.deadline))
+		block->sched.deadline = *next;
+
+	block->polls[block->npolls] = i;
+	pl->rp_slot[i] = &block->polls[block->npolls] - pl->rp_polls;
+	block->npolls++;
+}
+
+
+/* ==========================================================================
+    Checks if 'poll' can be appended to 'block' without breaking any of
+    the rules. Polls must be sorted for this to work.
+   ========================================================================== */
+static int m2md_rp_block_fits
+(
+	const struct m2md_rp_block    *block,      /* block to check */
+	const struct m2md_rp_sorted   *sorted,     /* poll to check */
+	int                            max_gap,    /* max unused regs to bridge */
+	int                            max_block   /* max regs in single read */
+)
+{
+	const struct m2md_pl_data     *poll;       /* descriptor of poll */
+	int                            end;        /* end register of poll */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	poll = sorted->poll;
+	if (block->func != poll->func || block->uid != poll->uid ||
+			block->poll_time.tv_sec != poll->poll_time.tv_sec ||
+			block->poll_time.tv_nsec != poll->poll_time.tv_nsec ||
+			block->split != sorted->split)
+		return 0; /* different group, cannot be read together */
+
+	if (block->func != 3 && block->func != 4 &&
+			block->func != 1 && block->func != 2)
+		/* only registers and bits can be coalesced, anything
+		 * else is always read in its own request */
+		return 0;
+
+	if (block->func == 1 || block->func == 2)
+	{
+		/* same number of bytes carries 16 times more bits than
+		 * registers, so gap is scaled, and single request can
+		 * carry up to 2000 bits no matter what max_block is */
+		max_gap *= 16;
+		max_block = M2MD_RP_MAX_BITS;
+	}
+
+	if (poll->reg - (block->reg + block->count) > max_gap)
+		/* there are too many unused registers between end
+		 * of the block and the poll, it's cheaper to make
+		 * another request than to read all of them */
+		return 0;
+
+	end = poll->reg + m2md_rp_poll_width(poll);
+	if (end - block->reg > max_block)
+		return 0; /* block would be too big for single read */
+
+	return 1;
+}
+
+
+/* ==========================================================================
+    Allocates batch decoders for register blocks in 'blocks' and fills
+    them with parameters of 16bit polls of 'pl'. All decoders share one
+    allocation, which is returned, so it can be freed together with the
+    plan. Blocks of bits have no decoder.
+
+    Returns storage of decoders, or NULL when there is no memory.
+   ========================================================================== */
+static void *m2md_rp_decode_build
+(
+	struct m2md_rp_block       *blocks,   /* blocks to build decoders for */
+	size_t                      nblocks,  /* number of blocks */
+	struct m2md_pl_list        *pl        /* polls blocks were built from */
+)
+{
+	struct m2md_rp_block       *block;    /* current block */
+	const struct m2md_pl_data  *poll;     /* current poll */
+	unsigned char              *storage;  /* storage of all decoders */
+	float                      *scale;    /* scales of all decoders */
+	uint16_t                   *mask;     /* masks of all decoders */
+	size_t                      nregs;    /* registers in all blocks */
+	size_t                      i;        /* iterator */
+	int                         j;        /* iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	nregs = 0;
+	for (i = 0; i != nblocks; ++i)
+		if (blocks[i].func == 3 || blocks[i].func == 4)
+			nregs += blocks[i].count;
+
+	/* scales go first, so they are aligned just like
+	 * malloc() aligns, masks of sign and swap follow */
+	storage = malloc((nregs ? nregs : 1) *
+			(sizeof(*scale) + 2 * sizeof(*mask)));
+	if (storage == NULL)
+		return NULL;
+
+	memset(storage, 0x00, nregs * (sizeof(*scale) + 2 * sizeof(*mask)));
+	scale = (float *)storage;
+	mask = (uint16_t *)(scale + nregs);
+
+	for (i = 0; i != nblocks; ++i)
+	{
+		block = &blocks[i];
+		memset(&block->decode, 0x00, sizeof(block->decode));
+
+		if (block->func != 3 && block->func != 4)
+			continue;
+
+		block->decode.scale = scale;
+		block->decode.sign = mask;
+		block->decode.swap = mask + nregs;
+		scale += block->count;
+		mask += block->count;
+
+		for (j = 0; j != block->npolls; ++j)
+		{
+			poll = &pl->data[block->polls[j]];
+			if (m2md_decode_is16(poll))
+				m2md_decode_set16(&block->decode,
+						poll->reg - block->reg, poll);
+		}
+	}
+
+	return storage;
+}
+
+
+/* ==========================================================================
+                       __     __ _          ____
+        ____   __  __ / /_   / /(_)_____   / __/__  __ ____   _____ _____
+       / __ \ / / / // __ \ / // // ___/  / /_ / / / // __ \ / ___// ___/
+      / /_/ // /_/ // /_/ // // // /__   / __// /_/ // / / // /__ (__  )
+     / .___/ \__,_//_.___//_//_/ \___/  /_/   \__,_//_/ /_/ \___//____/
+    /_/
+   ==========================================================================
+    Initializes empty read plan.
+   ========================================================================== */
+int m2md_rp_init
+(
+	struct m2md_rp  *rp  /* read plan to initialize */
+)
+{
+	VALID(EINVAL, rp);
+
+	memset(rp, 0x00, sizeof(*rp));
+	return 0;
+}
+
+
+/* ==========================================================================
+    Builds new read plan for 'polls' list. Polls with same uid, function
+    and poll time are grouped into blocks of at most 'max_block' registers.
+    Polls can be put into same block even when there are unused registers
+    between them, as long as there are no more than 'max_gap' of them.
+    Polls that have been split apart, because their block got modbus
+    exception, are put together only with polls of the same split.
+
+    Each block is scheduled for the time of its earliest poll. Timers of
+    blocks in old plan are copied back to polls before old plan is
+    destroyed, so that rebuilding plan does not reset polls' schedule.
+    Blocks must not be in any scheduler when this function is called.
+
+    When function fails, old plan is left intact.
+
+    errno:
+            EINVAL      rp or polls is NULL, or max_block is less than 1
+            ENOMEM      not enough memory for new plan
+   ========================================================================== */
+int m2md_rp_build
+(
+	struct m2md_rp              *rp,        /* read plan to rebuild */
+	struct m2md_pl_list         *polls,     /* polls to build plan for */
+	int                          max_gap,   /* max unused regs to bridge */
+	int                          max_block  /* max regs in single read */
+)
+{
+	struct m2md_rp_block        *blocks;    /* blocks of new plan */
+	struct m2md_rp_block        *block;     /* currently built block */
+	struct m2md_rp_sorted       *sorted;    /* sorted polls */
+	size_t                      *storage;   /* storage for blocks' polls */
+	void                        *decode;    /* storage for blocks' decoders */
+	size_t                       npolls;    /* number of polls */
+	size_t                       nblocks;   /* number of built blocks */
+	size_t                       poll;      /* current poll */
+	size_t                       i;         /* iterator */
+	int                          j;         /* iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	VALID(EINVAL, rp);
+	VALID(EINVAL, polls);
+	VALID(EINVAL, max_block > 0);
+
+	npolls = polls->nnodes;
+
+	/* in the worst case, every poll gets its own block, we will
+	 * shrink array once we know how many blocks there really are */
+	blocks = malloc((npolls ? npolls : 1) * sizeof(*blocks));
+	sorted = malloc((npolls ? npolls : 1) * sizeof(*sorted));
+	storage = malloc((npolls ? npolls : 1) * sizeof(*storage));
+
+	if (blocks == NULL || sorted == NULL || storage == NULL)
+	{
+		free(blocks);
+		free(sorted);
+		free(storage);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	/* copy timers of current blocks back to polls, so new plan
+	 * continues schedule of the old one. Polls that were deleted
+	 * have their slot cleared, so we won't touch them */
+	for (i = 0; i != rp->nblocks; ++i)
+		for (j = 0; j != rp->blocks[i].npolls; ++j)
+			if ((poll = rp->blocks[i].polls[j]) != M2MD_PL_NONE)
+				polls->next_read[poll] = rp->blocks[i].sched.deadline;
+
+	/* sort pointers to descriptors, not positions, as qsort()
+	 * cannot pass list to comparator, position is recovered
+	 * from the pointer afterwards */
+	for (i = 0; i != npolls; ++i)
+	{
+		sorted[i].poll = &polls->data[i];
+		sorted[i].split = polls->exc[i].split;
+	}
+
+	qsort(sorted, npolls, sizeof(*sorted), m2md_rp_cmp);
+
+	/* now polls that could be read together are next to each
+	 * other, so just walk the array and cut it into blocks */
+	polls->rp_polls = storage;
+	nblocks = 0;
+	block = NULL;
+	for (i = 0; i != npolls; ++i)
+	{
+		if (block == NULL ||
+				!m2md_rp_block_fits(block, &sorted[i], max_gap, max_block))
+		{
+			/* start new block, its polls will be stored just
+			 * after polls of the previous block */
+			block = &blocks[nblocks++];
+			block->npolls = 0;
+			block->polls = storage + i;
+		}
+
+		m2md_rp_block_add(block, polls, sorted[i].poll - polls->data);
+	}
+
+	free(sorted);
+
+	if (nblocks && nblocks != npolls)
+	{
+		/* shrink blocks array, it's never bigger than
+		 * before, so there is no way this could fail in
+		 * any sane implementation, but if it does, we
+		 * just waste some memory, nothing more */
+		block = realloc(blocks, nblocks * sizeof(*blocks));
+		blocks = block ? block : blocks;
+	}
+
+	/* polls are in their blocks, now we know which
+	 * register of block is decoded how */
+	if ((decode = m2md_rp_decode_build(blocks, nblocks, polls)) == NULL)
+	{
+		/* polls already point to slots in new blocks,
+		 * point them back to where they are in old plan */
+		polls->rp_polls = rp->polls;
+		for (i = 0; i != npolls; ++i)
+			polls->rp_slot[i] = M2MD_PL_NO_SLOT;
+
+		for (i = 0; i != rp->nblocks; ++i)
+			for (j = 0; j != rp->blocks[i].npolls; ++j)
+				if ((poll = rp->blocks[i].polls[j]) != M2MD_PL_NONE)
+					polls->rp_slot[poll] =
+						&rp->blocks[i].polls[j] - rp->polls;
+
+		free(blocks);
+		free(storage);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	/* new plan is ready, swap it with the old one */
+	free(rp->blocks);
+	free(rp->polls);
+	free(rp->decode);
+	rp->blocks = blocks;
+	rp->nblocks = nblocks;
+	rp->polls = storage;
+	rp->decode = decode;
+	rp->gen++;
+
+	return 0;
+}
+
+
+/* ==========================================================================
+    Splits 'block', that got modbus exception, in halves. Polls of each
+    half get their own split, taken from 'splits' counter, that is never
+    given to any other poll, so halves are not put back together when
+    plan is rebuilt, 0 is for polls that are not split. Block with only
+    one poll left is not touched, as there is nothing to split.
+
+    Plan must be rebuilt by the caller for split to take effect.
+
+    Returns number of polls that are still in the 'block'.
+   ========================================================================== */
+int m2md_rp_split
+(
+	const struct m2md_rp_block  *block,   /* block to split */
+	struct m2md_pl_list         *pl,      /* list with polls of block */
+	unsigned                    *splits   /* last split given to polls */
+)
+{
+	size_t                       pi;      /* position of poll in list */
+	int                          npolls;  /* polls still in block */
+	int                          n;       /* polls split so far */
+	int                          i;       /* iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	npolls = 0;
+	for (i = 0; i != block->npolls; ++i)
+		npolls += block->polls[i] != M2MD_PL_NONE;
+
+	if (npolls < 2)
+		return npolls;
+
+	for (i = 0, n = 0; i != block->npolls; ++i)
+	{
+		if ((pi = block->polls[i]) == M2MD_PL_NONE)
+			continue;
+
+		if (n++ == 0 || n == (npolls + 1) / 2 + 1)
+			if (++*splits == 0)
+				++*splits;
+
+		pl->exc[pi].split = *splits;
+	}
+
+	return npolls;
+}
+
+
+/* ==========================================================================
+    Releases memory allocated by the plan.
+   ========================================================================== */
+int m2md_rp_destroy
+(
+	struct m2md_rp  *rp  /* read plan to destroy */
+)
+{
+	VALID(EINVAL, rp);
+
+	free(rp->blocks);
+	free(rp->polls);
+	free(rp->decode);
+	rp->blocks = NULL;
+	rp->polls = NULL;
+	rp->decode = NULL;
+	rp->nblocks = 0;
+	rp->gen++;
+	return 0;
+}
+
+
+/* ==========================================================================
+    Returns number of registers that 'poll' occupies, or number of bits
+    for coil and discrete input polls.
+   ========================================================================== */
+int m2md_rp_poll_width
+(
+	const struct m2md_pl_data  *poll  /* poll to check */
+)
+{
+	/* field width of 0 is accepted by poll list parser, but we
+	 * still need to read at least one register to get anything */
+	return poll->field_width ? poll->field_width : 1;
+}
@@ -0,0 +1,52 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ========================================================================== */
+
+#ifndef M2MD_READ_PLAN_H
+#define M2MD_READ_PLAN_H 1
+
+#include <time.h>
+
+#include "decode.h"
+#include "poll-list.h"
+#include "scheduler.h"
+
+
+/* max number of bits that can be read with single request */
+#define M2MD_RP_MAX_BITS 2000
+
+/* single modbus read request, that covers one or more polls */
+struct m2md_rp_block
+{
+	struct m2md_sched_node   sched;      /* next read timer */
+	int                      func;       /* modbus function to read with */
+	int                      uid;        /* unit id */
+	int                      reg;        /* first register to read */
+	int                      count;      /* number of registers/bits to read */
+	struct timespec          poll_time;  /* read block every this time */
+	unsigned                 split;      /* split of all polls in block */
+	size_t                  *polls;      /* polls covered by this block */
+	int                      npolls;     /* number of polls in block */
+	struct m2md_decode16     decode;     /* batch decoder, registers only */
+};
+
+/* read plan for single server, list of reads to perform */
+struct m2md_rp
+{
+	struct m2md_rp_block    *blocks;     /* array with all blocks */
+	size_t                   nblocks;    /* number of blocks in plan */
+	size_t                  *polls;      /* storage for blocks' polls */
+	void                    *decode;     /* storage for blocks' decoders */
+	unsigned                 gen;        /* bumped each time plan changes */
+};
+
+int m2md_rp_init(struct m2md_rp *rp);
+int m2md_rp_build(struct m2md_rp *rp, struct m2md_pl_list *polls,
+		int max_gap, int max_block);
+int m2md_rp_split(const struct m2md_rp_block *block,
+		struct m2md_pl_list *pl, unsigned *splits);
+int m2md_rp_destroy(struct m2md_rp *rp);
+int m2md_rp_poll_width(const struct m2md_pl_data *poll);
+
+#endif
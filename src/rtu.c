@@ -0,0 +1,94 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+         ------------------------------------------------------------
+        / rtu - settings of modbus rtu serial line, as they are      \
+        \ given in poll list, and timing that line requires          /
+         ------------------------------------------------------------
+   ==========================================================================
+          _               __            __         ____ _  __
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+
+   ========================================================================== */
+
+
+#include "rtu.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include "macros.h"
+
+
+/* ==========================================================================
+                       __     __ _          ____
+        ____   __  __ / /_   / /(_)_____   / __/__  __ ____   _____ _____
+       / __ \ / / / // __ \ / // // ___/  / /_ / / / // __ \ / ___// ___/
+      / /_/ // /_/ // /_/ // // // /__   / __// /_/ // / / // /__ (__  )
+     / .___/ \__,_//_.___//_//_/ \___/  /_/   \__,_//_/ /_/ \___//____/
+    /_/
+   ==========================================================================
+    Parses rtu address 'addr', which is serial device, optionally followed
+    by line settings, like "/dev/ttyUSB0:8E1". Device is stored in 'dev',
+    which must be at least as big as 'addr'. Settings default to 8N1.
+
+    errno:
+            EINVAL      line settings are invalid
+   ========================================================================== */
+int m2md_rtu_parse
+(
+	const char  *addr,      /* rtu address to parse */
+	char        *dev,       /* serial device will be stored here */
+	char        *parity,    /* parity, N, E or O */
+	int         *data_bit,  /* number of data bits */
+	int         *stop_bit   /* number of stop bits */
+)
+{
+	const char  *settings;  /* line settings part of addr */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	*parity = 'N';
+	*data_bit = 8;
+	*stop_bit = 1;
+	strcpy(dev, addr);
+
+	if ((settings = strchr(addr, ':')) == NULL)
+		return 0;
+
+	dev[settings - addr] = '\0';
+	settings++;
+
+	if (strlen(settings) != 3 ||
+			settings[0] < '5' || settings[0] > '8' ||
+			strchr("NEO", settings[1]) == NULL ||
+			(settings[2] != '1' && settings[2] != '2'))
+		return_errno(EINVAL);
+
+	*data_bit = settings[0] - '0';
+	*parity = settings[1];
+	*stop_bit = settings[2] - '0';
+	return 0;
+}
+
+
+/* ==========================================================================
+    Returns silence, in microseconds, that is required between frames on
+    rtu line with 'baud' rate. Modbus requires 3.5 character times, and
+    character is 11 bits long. Above 19200 fixed 1750us is used, as timer
+    precision would not keep up anyway.
+   ========================================================================== */
+int m2md_rtu_gap_us
+(
+	int  baud  /* baud rate of the line */
+)
+{
+	if (baud > M2MD_RTU_GAP_BAUD)
+		return 1750;
+
+	return (int)(3.5 * 11 * 1000000 / baud + 1);
+}
@@ -0,0 +1,17 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ========================================================================== */
+
+#ifndef M2MD_RTU_H
+#define M2MD_RTU_H 1
+
+/* baud rate above which modbus rtu gap is fixed, and not
+ * counted in character times */
+#define M2MD_RTU_GAP_BAUD 19200
+
+int m2md_rtu_parse(const char *addr, char *dev, char *parity,
+		int *data_bit, int *stop_bit);
+int m2md_rtu_gap_us(int baud);
+
+#endif
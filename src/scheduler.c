@@ -0,0 +1,366 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+         ------------------------------------------------------------
+        / scheduler - indexed binary min-heap of timers. Earliest    \
+        | timer is always on top, so checking what expired costs     |
+        \ O(1) and removing or rescheduling single timer O(log n)    /
+         ------------------------------------------------------------
+   ==========================================================================
+          _               __            __         ____ _  __
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+
+   ========================================================================== */
+
+
+#include "scheduler.h"
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include "valid.h"
+
+
+/* ==========================================================================
+          __             __                     __   _
+     ____/ /___   _____ / /____ _ _____ ____ _ / /_ (_)____   ____   _____
+    / __  // _ \ / ___// // __ `// ___// __ `// __// // __ \ / __ \ / ___/
+   / /_/ //  __// /__ / // /_/ // /   / /_/ // /_ / // /_/ // / / /(__  )
+   \__,_/ \___/ \___//_/ \__,_//_/    \__,_/ \__//_/ \____//_/ /_//____/
+
+   ========================================================================== */
+
+
+/* initial number of nodes heap can hold, heap grows twice
+ * each time it runs out of space */
+#define M2MD_SCHED_INITIAL_SIZE 16
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ==========================================================================
+    Returns 1 when node 'a' expires before node 'b', 0 otherwise.
+   ========================================================================== */
+static int m2md_sched_less
+(
+	const struct m2md_sched_node  *a,  /* first node to compare */
+	const struct m2md_sched_node  *b   /* second node to compare */
+)
+{
+	if (a->deadline.tv_sec != b->deadline.tv_sec)
+		return a->deadline.tv_sec < b->deadline.tv_sec;
+
+	return a->deadline.tv_nsec < b->deadline.tv_nsec;
+}
+
+
+/* ==========================================================================
+    Puts 'node' at position 'idx' in the heap and updates node's index, so
+    it always knows where it is.
+   ========================================================================== */
+static void m2md_sched_set
+(
+	struct m2md_sched       *sched,  /* scheduler to modify */
+	size_t                   idx,    /* position where to put node */
+	struct m2md_sched_node  *node    /* node to put */
+)
+{
+	sched->heap[idx] = node;
+	node->idx = idx;
+}
+
+
+/* ==========================================================================
+    Moves node at 'idx' up the heap until its parent expires earlier than
+    node itself.
+   ========================================================================== */
+static void m2md_sched_sift_up
+(
+	struct m2md_sched       *sched,   /* scheduler to modify */
+	size_t                   idx      /* index of node to move */
+)
+{
+	struct m2md_sched_node  *node;    /* node being moved */
+	size_t                   parent;  /* index of node's parent */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	node = sched->heap[idx];
+	while (idx > 0)
+	{
+		parent = (idx - 1) / 2;
+		if (m2md_sched_less(node, sched->heap[parent]) == 0)
+			break; /* parent is earlier, node is where it belongs */
+
+		/* move parent down, and try one level higher */
+		m2md_sched_set(sched, idx, sched->heap[parent]);
+		idx = parent;
+	}
+
+	m2md_sched_set(sched, idx, node);
+}
+
+
+/* ==========================================================================
+    Moves node at 'idx' down the heap until both of its children expire
+    later than node itself.
+   ========================================================================== */
+static void m2md_sched_sift_down
+(
+	struct m2md_sched       *sched,  /* scheduler to modify */
+	size_t                   idx     /* index of node to move */
+)
+{
+	struct m2md_sched_node  *node;   /* node being moved */
+	size_t                   child;  /* index of earlier child */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	node = sched->heap[idx];
+	for (;;)
+	{
+		child = 2 * idx + 1;
+		if (child >= sched->n)
+			break; /* we've hit the bottom */
+
+		/* pick child that expires first */
+		if (child + 1 < sched->n &&
+				m2md_sched_less(sched->heap[child + 1], sched->heap[child]))
+			child += 1;
+
+		if (m2md_sched_less(sched->heap[child], node) == 0)
+			break; /* node is earlier than its children */
+
+		/* move child up, and try one level lower */
+		m2md_sched_set(sched, idx, sched->heap[child]);
+		idx = child;
+	}
+
+	m2md_sched_set(sched, idx, node);
+}
+
+
+/* ==========================================================================
+                       __     __ _          ____
+        ____   __  __ / /_   / /(_)_____   / __/__  __ ____   _____ _____
+       / __ \ / / / // __ \ / // // ___/  / /_ / / / // __ \ / ___// ___/
+      / /_/ // /_/ // /_/ // // // /__   / __// /_/ // / / // /__ (__  )
+     / .___/ \__,_//_.___//_//_/ \___/  /_/   \__,_//_/ /_/ \___//____/
+    /_/
+   ==========================================================================
+    Initializes empty scheduler.
+
+    errno:
+            EINVAL      sched is NULL
+            ENOMEM      not enough memory for heap
+   ========================================================================== */
+int m2md_sched_init
+(
+	struct m2md_sched  *sched  /* scheduler to initialize */
+)
+{
+	VALID(EINVAL, sched);
+
+	sched->heap = malloc(M2MD_SCHED_INITIAL_SIZE * sizeof(*sched->heap));
+	if (sched->heap == NULL)
+		return -1;
+
+	sched->n = 0;
+	sched->size = M2MD_SCHED_INITIAL_SIZE;
+	return 0;
+}
+
+
+/* ==========================================================================
+    Releases memory allocated by scheduler. Nodes are not touched, as they
+    are owned by whoever embeds them.
+   ========================================================================== */
+int m2md_sched_destroy
+(
+	struct m2md_sched  *sched  /* scheduler to destroy */
+)
+{
+	VALID(EINVAL, sched);
+
+	free(sched->heap);
+	sched->heap = NULL;
+	sched->n = 0;
+	sched->size = 0;
+	return 0;
+}
+
+
+/* ==========================================================================
+    Adds 'node' to the scheduler. Node's deadline must be set before
+    calling this function. Node must not be in any scheduler already.
+
+    errno:
+            EINVAL      sched or node is NULL
+            EEXIST      node is already queued
+            ENOMEM      not enough memory to grow the heap
+   ========================================================================== */
+int m2md_sched_add
+(
+	struct m2md_sched        *sched,  /* scheduler to add node to */
+	struct m2md_sched_node   *node    /* node to add */
+)
+{
+	struct m2md_sched_node  **heap;   /* reallocated heap */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	VALID(EINVAL, sched);
+	VALID(EINVAL, node);
+	VALID(EEXIST, node->idx == M2MD_SCHED_NOT_QUEUED);
+
+	if (sched->n == sched->size)
+	{
+		/* no more space in heap, make it twice as big */
+		heap = realloc(sched->heap, 2 * sched->size * sizeof(*heap));
+		if (heap == NULL)
+			return -1;
+
+		sched->heap = heap;
+		sched->size *= 2;
+	}
+
+	/* put node at the very bottom and let it float
+	 * to the position where it belongs */
+	m2md_sched_set(sched, sched->n, node);
+	sched->n++;
+	m2md_sched_sift_up(sched, node->idx);
+	return 0;
+}
+
+
+/* ==========================================================================
+    Removes 'node' from the scheduler.
+
+    errno:
+            EINVAL      sched or node is NULL
+            ENOENT      node is not queued
+   ========================================================================== */
+int m2md_sched_delete
+(
+	struct m2md_sched       *sched,  /* scheduler to remove node from */
+	struct m2md_sched_node  *node    /* node to remove */
+)
+{
+	struct m2md_sched_node  *last;   /* last node in the heap */
+	size_t                   idx;    /* position of removed node */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	VALID(EINVAL, sched);
+	VALID(EINVAL, node);
+	VALID(ENOENT, node->idx < sched->n && sched->heap[node->idx] == node);
+
+	idx = node->idx;
+	node->idx = M2MD_SCHED_NOT_QUEUED;
+	sched->n--;
+
+	if (idx == sched->n)
+		/* that was the last node in the heap, heap
+		 * is still consistent, nothing more to do */
+		return 0;
+
+	/* put last node in place of the removed one, it could be
+	 * both earlier or later than its new neighbours, so try
+	 * moving it in both directions, only one will do anything */
+	last = sched->heap[sched->n];
+	m2md_sched_set(sched, idx, last);
+	m2md_sched_sift_up(sched, idx);
+	m2md_sched_sift_down(sched, last->idx);
+	return 0;
+}
+
+
+/* ==========================================================================
+    Removes all nodes from the scheduler at once, it's much cheaper than
+    removing nodes one by one.
+   ========================================================================== */
+int m2md_sched_clear
+(
+	struct m2md_sched  *sched  /* scheduler to clear */
+)
+{
+	size_t              i;     /* iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	VALID(EINVAL, sched);
+
+	for (i = 0; i != sched->n; ++i)
+		sched->heap[i]->idx = M2MD_SCHED_NOT_QUEUED;
+
+	sched->n = 0;
+	return 0;
+}
+
+
+/* ==========================================================================
+    Restores heap order after 'node' deadline has been changed. It's much
+    cheaper than removing and adding node again.
+
+    errno:
+            EINVAL      sched or node is NULL
+            ENOENT      node is not queued
+   ========================================================================== */
+int m2md_sched_update
+(
+	struct m2md_sched       *sched,  /* scheduler node is in */
+	struct m2md_sched_node  *node    /* node with modified deadline */
+)
+{
+	VALID(EINVAL, sched);
+	VALID(EINVAL, node);
+	VALID(ENOENT, node->idx < sched->n && sched->heap[node->idx] == node);
+
+	m2md_sched_sift_up(sched, node->idx);
+	m2md_sched_sift_down(sched, node->idx);
+	return 0;
+}
+
+
+/* ==========================================================================
+    Returns node with the earliest deadline, or NULL if scheduler is empty.
+    Node is not removed from the scheduler.
+   ========================================================================== */
+struct m2md_sched_node *m2md_sched_peek
+(
+	struct m2md_sched  *sched  /* scheduler to peek into */
+)
+{
+	if (sched->n == 0)
+		return NULL;
+
+	return sched->heap[0];
+}
+
+
+/* ==========================================================================
+    Returns 1 when 'now' is past node's deadline, 0 otherwise. Node that
+    expires exactly at 'now' is not expired yet, thanks to that, node with
+    deadline set to 'now' while processing expired nodes won't be picked
+    up again in the same pass.
+   ========================================================================== */
+int m2md_sched_expired
+(
+	const struct m2md_sched_node  *node,  /* node to check */
+	const struct timespec         *now    /* current time */
+)
+{
+	if (now->tv_sec != node->deadline.tv_sec)
+		return now->tv_sec > node->deadline.tv_sec;
+
+	return now->tv_nsec > node->deadline.tv_nsec;
+}
@@ -0,0 +1,47 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ========================================================================== */
+
+#ifndef M2MD_SCHEDULER_H
+#define M2MD_SCHEDULER_H 1
+
+#include <stddef.h>
+#include <time.h>
+
+
+/* value of 'idx' field of node that is not currently in any heap */
+#define M2MD_SCHED_NOT_QUEUED ((size_t)-1)
+
+/* returns pointer to object of 'type' that 'node' is embedded in,
+ * 'member' is name of struct m2md_sched_node field in 'type' */
+#define m2md_sched_entry(node, type, member) \
+	((type *)((char *)(node) - offsetof(type, member)))
+
+/* single timer that can be put in scheduler, it's meant to be
+ * embedded in object that needs to be scheduled */
+struct m2md_sched_node
+{
+	struct timespec  deadline;  /* absolute time when node expires */
+	size_t           idx;       /* position in heap, managed by sched */
+};
+
+/* indexed binary min-heap of nodes, ordered by deadline */
+struct m2md_sched
+{
+	struct m2md_sched_node  **heap;  /* array representing heap */
+	size_t                    n;     /* number of nodes in the heap */
+	size_t                    size;  /* allocated size of heap array */
+};
+
+int m2md_sched_init(struct m2md_sched *sched);
+int m2md_sched_destroy(struct m2md_sched *sched);
+int m2md_sched_add(struct m2md_sched *sched, struct m2md_sched_node *node);
+int m2md_sched_delete(struct m2md_sched *sched, struct m2md_sched_node *node);
+int m2md_sched_clear(struct m2md_sched *sched);
+int m2md_sched_update(struct m2md_sched *sched, struct m2md_sched_node *node);
+struct m2md_sched_node *m2md_sched_peek(struct m2md_sched *sched);
+int m2md_sched_expired(const struct m2md_sched_node *node,
+		const struct timespec *now);
+
+#endif
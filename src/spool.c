@@ -0,0 +1,1007 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+         ------------------------------------------------------------
+        / spool - keeps messages on disk while broker is gone, and   \
+        | replays them once it's back, slowly, so live data still    |
+        \ gets through                                               /
+         ------------------------------------------------------------
+   ==========================================================================
+          _               __            __         ____ _  __
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+
+   ========================================================================== */
+
+
+#include "spool.h"
+
+#include <embedlog.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "cfg.h"
+#include "poll-list.h"
+#include "mqtt.h"
+#include "valid.h"
+#include "macros.h"
+
+
+/* ==========================================================================
+          __             __                     __   _
+     ____/ /___   _____ / /____ _ _____ ____ _ / /_ (_)____   ____   _____
+    / __  // _ \ / ___// // __ `// ___// __ `// __// // __ \ / __ \ / ___/
+   / /_/ //  __// /__ / // /_/ // /   / /_/ // /_ / // /_/ // / / /(__  )
+   \__,_/ \___/ \___//_/ \__,_//_/    \__,_/ \__//_/ \____//_/ /_//____/
+
+   ========================================================================== */
+
+
+/* superblock, as it is in file */
+struct m2md_spool_sb
+{
+	uint32_t  magic;    /* M2MD_SPOOL_MAGIC */
+	uint32_t  version;  /* M2MD_SPOOL_VERSION */
+	uint64_t  size;     /* size of ring */
+	uint64_t  head;     /* where next segment goes */
+	uint64_t  tail;     /* oldest segment not yet replayed */
+	uint32_t  next_id;  /* topic ids ever given */
+	uint32_t  pad;      /* 0 */
+};
+
+/* header of segment, as it is in file */
+struct m2md_spool_seg
+{
+	uint32_t  magic;    /* M2MD_SPOOL_SEG_MAGIC or M2MD_SPOOL_WRAP_MAGIC */
+	uint32_t  len;      /* length of message after header */
+	uint64_t  pos;      /* position of segment */
+	uint32_t  crc;      /* crc32 of message */
+	uint32_t  pad;      /* 0 */
+};
+
+/* topic that has been spooled */
+struct m2md_spool_topic
+{
+	struct m2md_spool_topic  *next;     /* next topic in bucket */
+	uint32_t                  id;       /* spool id of topic */
+	uint64_t                  seg;      /* segment it's been defined in */
+	char                      topic[];  /* full topic */
+};
+
+/* counters for stats, updated with atomics, as writers and replay
+ * thread update them from different threads */
+struct m2md_spool_stats
+{
+	unsigned long  spooled;   /* messages put into spool */
+	unsigned long  replayed;  /* messages replayed from spool */
+	unsigned long  dropped;   /* records overwritten before replay */
+	unsigned long  lost;      /* records with unknown topic */
+	unsigned long  segments;  /* segments written */
+};
+
+#define M2MD_SPOOL_ALIGN(n)  (((n) + 7) & ~(uint64_t)7)
+#define M2MD_SPOOL_BUCKETS   4096
+
+static int                    g_spool_fd = -1;
+static unsigned char         *g_spool_map;   /* whole file */
+static struct m2md_spool_sb  *g_spool_sb;    /* superblock in map */
+static unsigned char         *g_spool_ring;  /* ring in map */
+static uint64_t               g_spool_size;  /* size of ring */
+static long                   g_spool_page;  /* size of memory page */
+
+/* segment that is being filled, it goes to ring once it's full, or
+ * it's been waiting for too long. Everything in spool, but replay
+ * state, is protected with lock */
+static struct m2md_batch        g_spool_batch;
+static uint64_t                 g_spool_seg;  /* number of g_spool_batch */
+static struct m2md_spool_topic *g_spool_topics[M2MD_SPOOL_BUCKETS];
+static pthread_mutex_t          g_spool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* replay state, only replay thread touches it. Segment is copied out
+ * of ring, so writers can go on while it's published */
+static pthread_t       g_spool_thread;
+static int             g_spool_run;
+static int             g_spool_started;
+static unsigned char  *g_spool_rbuf;    /* copy of replayed segment */
+static size_t          g_spool_rlen;    /* length of message in rbuf */
+static size_t          g_spool_roff;    /* next record to replay */
+static int             g_spool_rloaded; /* rbuf holds segment */
+static uint64_t        g_spool_rtail;   /* tail when segment was copied */
+static uint64_t        g_spool_rend;    /* where copied segment ends */
+static char          **g_spool_names;   /* topics by id, as replayed */
+static uint32_t        g_spool_nnames;  /* size of names table */
+
+static struct m2md_spool_stats  g_spool_stats;
+static uint32_t                 g_spool_crc_table[256];
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ==========================================================================
+    Fills table for crc32, the same one zlib and ethernet use.
+   ========================================================================== */
+static void m2md_spool_crc_init
+(
+	void
+)
+{
+	uint32_t  c;  /* crc of single byte */
+	int       i;  /* teh iterator */
+	int       j;  /* another iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	for (i = 0; i != 256; ++i)
+	{
+		c = i;
+		for (j = 0; j != 8; ++j)
+			c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+
+		g_spool_crc_table[i] = c;
+	}
+}
+
+
+/* ==========================================================================
+    Returns crc32 of 'len' bytes of 'buf'.
+   ========================================================================== */
+static uint32_t m2md_spool_crc
+(
+	const void           *buf,  /* data to calculate crc of */
+	size_t                len   /* length of buf */
+)
+{
+	const unsigned char  *p;    /* current byte of buf */
+	uint32_t              c;    /* crc */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	c = 0xffffffff;
+	for (p = buf; len; --len, ++p)
+		c = g_spool_crc_table[(c ^ *p) & 0xff] ^ (c >> 8);
+
+	return c ^ 0xffffffff;
+}
+
+
+/* ==========================================================================
+    Tells kernel to write 'len' bytes at 'off' of file to disk. It doesn't
+    wait for it, data already is in page cache, and it survives crash of
+    the process as it is, this is for power loss.
+   ========================================================================== */
+static void m2md_spool_sync
+(
+	uint64_t  off,   /* offset in file */
+	uint64_t  len    /* length to sync */
+)
+{
+	uint64_t  start; /* off aligned to page */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	start = off & ~(uint64_t)(g_spool_page - 1);
+	msync(g_spool_map + start, off + len - start, MS_ASYNC);
+}
+
+
+/* ==========================================================================
+    Returns segment at position 'pos' of ring, or NULL when there is no
+    valid segment there. When segment could not fit at the end of ring,
+    it's at start of next lap, 'pos' is moved there then. Message of
+    segment is checked against its crc, when 'check' is set.
+   ========================================================================== */
+static const struct m2md_spool_seg *m2md_spool_seg
+(
+	uint64_t                     *pos,    /* position of segment */
+	int                           check   /* check crc of message */
+)
+{
+	const struct m2md_spool_seg  *seg;    /* segment at pos */
+	uint64_t                      off;    /* pos in ring */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	off = *pos % g_spool_size;
+	seg = (const struct m2md_spool_seg *)(g_spool_ring + off);
+
+	if (g_spool_size - off < M2MD_SPOOL_SEG_HDR ||
+			(seg->magic == M2MD_SPOOL_WRAP_MAGIC && seg->pos == *pos))
+	{
+		/* no room for header, or wrap marker,
+		 * segment is at start of next lap */
+		*pos += g_spool_size - off;
+		off = 0;
+		seg = (const struct m2md_spool_seg *)g_spool_ring;
+	}
+
+	/* stale segment from previous lap has
+	 * other position, so it's not taken */
+	if (seg->magic != M2MD_SPOOL_SEG_MAGIC || seg->pos != *pos ||
+			seg->len < M2MD_BATCH_HDR_SIZE || seg->len > M2MD_SPOOL_SEG_MAX ||
+			off + M2MD_SPOOL_SEG_HDR + seg->len > g_spool_size)
+		return NULL;
+
+	if (check && m2md_spool_crc(seg + 1, seg->len) != seg->crc)
+		return NULL;
+
+	return seg;
+}
+
+
+/* ==========================================================================
+    Reads record at 'off' of batch message 'msg' of 'len' bytes. Topic
+    id of record goes to 'id', its value to 'value' and size of value to
+    'size'.
+
+    Returns offset of next record, or 0 when record does not fit in msg.
+   ========================================================================== */
+static size_t m2md_spool_rec
+(
+	const unsigned char   *msg,    /* batch message */
+	size_t                 len,    /* length of msg */
+	size_t                 off,    /* offset of record */
+	uint32_t              *id,     /* topic id goes here */
+	const unsigned char  **value,  /* value goes here */
+	uint16_t              *size    /* size of value goes here */
+)
+{
+	if (off + M2MD_BATCH_REC_SIZE > len)
+		return 0;
+
+	memcpy(id, msg + off, sizeof(*id));
+	memcpy(size, msg + off + 8, sizeof(*size));
+	*value = msg + off + M2MD_BATCH_REC_SIZE;
+
+	if (off + M2MD_BATCH_REC_SIZE + *size > len)
+		return 0;
+
+	return off + M2MD_BATCH_REC_SIZE + *size;
+}
+
+
+/* ==========================================================================
+    Finds spooled messages after tail that have survived crash, so they
+    are replayed, and sets head right after them. Superblock may be older
+    than ring, so head in it is not trusted, only segments that are whole
+    are. Topic ids in them may be newer than superblock too, next id is
+    moved past them, so new topics never take id of old ones.
+   ========================================================================== */
+static void m2md_spool_recover
+(
+	void
+)
+{
+	const struct m2md_spool_seg  *seg;    /* recovered segment */
+	const unsigned char          *msg;    /* message of segment */
+	const unsigned char          *value;  /* value of record */
+	uint64_t                      pos;    /* position of segment */
+	uint64_t                      next;   /* pos moved past wrap */
+	unsigned long                 nsegs;  /* segments recovered */
+	size_t                        off;    /* offset of record in msg */
+	uint32_t                      id;     /* topic id of record */
+	uint16_t                      size;   /* size of value */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	nsegs = 0;
+	pos = g_spool_sb->tail;
+	for (;;)
+	{
+		next = pos;
+		if (next - g_spool_sb->tail >= g_spool_size ||
+				(seg = m2md_spool_seg(&next, 1)) == NULL)
+			break;
+
+		msg = (const unsigned char *)(seg + 1);
+		off = M2MD_BATCH_HDR_SIZE;
+		while ((off = m2md_spool_rec(msg, seg->len, off, &id, &value, &size)))
+			if (id & M2MD_SPOOL_DEF && (id & ~M2MD_SPOOL_DEF) >= g_spool_sb->next_id)
+				g_spool_sb->next_id = (id & ~M2MD_SPOOL_DEF) + 1;
+
+		pos = next + M2MD_SPOOL_ALIGN(M2MD_SPOOL_SEG_HDR + seg->len);
+		++nsegs;
+	}
+
+	if (pos != g_spool_sb->head)
+		el_print(ELW, "spool: head was %llu, found segments up to %llu",
+				(unsigned long long)g_spool_sb->head, (unsigned long long)pos);
+
+	g_spool_sb->head = pos;
+	el_print(ELN, "spool: recovered %lu segments, %llu bytes to replay",
+			nsegs, (unsigned long long)(pos - g_spool_sb->tail));
+}
+
+
+/* ==========================================================================
+    Drops oldest segment in ring, to make room for new one.
+
+    g_spool_lock must be held.
+   ========================================================================== */
+static void m2md_spool_drop
+(
+	void
+)
+{
+	const struct m2md_spool_seg  *seg;    /* dropped segment */
+	uint64_t                      pos;    /* position of segment */
+	uint16_t                      count;  /* records in segment */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	pos = g_spool_sb->tail;
+	if ((seg = m2md_spool_seg(&pos, 0)) == NULL)
+	{
+		/* there is no telling where next segment
+		 * starts, nothing till head can be used */
+		el_print(ELE, "spool: broken segment at %llu, dropping %llu bytes",
+				(unsigned long long)g_spool_sb->tail,
+				(unsigned long long)(g_spool_sb->head - g_spool_sb->tail));
+		g_spool_sb->tail = g_spool_sb->head;
+		return;
+	}
+
+	memcpy(&count, (const unsigned char *)(seg + 1) + 4, sizeof(count));
+	__atomic_add_fetch(&g_spool_stats.dropped, count, __ATOMIC_RELAXED);
+	g_spool_sb->tail = pos + M2MD_SPOOL_ALIGN(M2MD_SPOOL_SEG_HDR + seg->len);
+}
+
+
+/* ==========================================================================
+    Writes segment that is being filled into ring, at head, and starts new
+    one. Oldest segments are dropped when there is no room for it. Tail
+    moves before anything is overwritten, and head only after segment is
+    whole, so crash at any point leaves spool that can be recovered.
+
+    g_spool_lock must be held.
+   ========================================================================== */
+static void m2md_spool_write
+(
+	void
+)
+{
+	struct m2md_spool_seg  *seg;    /* segment being written */
+	uint64_t                pos;    /* position of segment */
+	uint64_t                off;    /* head in ring */
+	uint64_t                total;  /* size of segment in ring */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (g_spool_batch.count == 0)
+		return;
+
+	/* segment never wraps, if it doesn't fit
+	 * at the end, it goes to start of ring */
+	total = M2MD_SPOOL_ALIGN(M2MD_SPOOL_SEG_HDR + g_spool_batch.len);
+	pos = g_spool_sb->head;
+	off = pos % g_spool_size;
+	if (g_spool_size - off < total)
+		pos += g_spool_size - off;
+
+	while (pos + total - g_spool_sb->tail > g_spool_size)
+		m2md_spool_drop();
+
+	if (pos != g_spool_sb->head && g_spool_size - off >= M2MD_SPOOL_SEG_HDR)
+	{
+		seg = (struct m2md_spool_seg *)(g_spool_ring + off);
+		memset(seg, 0x00, sizeof(*seg));
+		seg->magic = M2MD_SPOOL_WRAP_MAGIC;
+		seg->pos = g_spool_sb->head;
+		m2md_spool_sync(M2MD_SPOOL_SB_SIZE + off, sizeof(*seg));
+	}
+
+	seg = (struct m2md_spool_seg *)(g_spool_ring + pos % g_spool_size);
+	memcpy(seg + 1, g_spool_batch.buf, g_spool_batch.len);
+	seg->len = g_spool_batch.len;
+	seg->pos = pos;
+	seg->crc = m2md_spool_crc(g_spool_batch.buf, g_spool_batch.len);
+	seg->pad = 0;
+	seg->magic = M2MD_SPOOL_SEG_MAGIC;
+
+	g_spool_sb->head = pos + total;
+	m2md_spool_sync(M2MD_SPOOL_SB_SIZE + pos % g_spool_size, total);
+	m2md_spool_sync(0, sizeof(*g_spool_sb));
+
+	__atomic_add_fetch(&g_spool_stats.segments, 1, __ATOMIC_RELAXED);
+	m2md_batch_reset(&g_spool_batch);
+
+	/* new segment, topics must be defined again */
+	++g_spool_seg;
+}
+
+
+/* ==========================================================================
+    Returns spooled 'topic', new one is given next free id.
+
+    g_spool_lock must be held.
+
+    errno:
+            ENOSPC      all topic ids have been used
+            ENOMEM      not enough memory for topic
+   ========================================================================== */
+static struct m2md_spool_topic *m2md_spool_topic
+(
+	const char               *topic  /* full topic to find */
+)
+{
+	struct m2md_spool_topic  *t;     /* topic in table */
+	const char               *p;     /* current char of topic */
+	uint32_t                  hash;  /* fnv-1a hash of topic */
+	size_t                    len;   /* length of topic */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	hash = 2166136261u;
+	for (p = topic; *p; ++p)
+		hash = (hash ^ (unsigned char)*p) * 16777619u;
+
+	hash %= M2MD_SPOOL_BUCKETS;
+	for (t = g_spool_topics[hash]; t != NULL; t = t->next)
+		if (strcmp(t->topic, topic) == 0)
+			return t;
+
+	if (g_spool_sb->next_id & M2MD_SPOOL_DEF)
+	{
+		errno = ENOSPC;
+		return NULL;
+	}
+
+	len = p - topic;
+	if ((t = malloc(sizeof(*t) + len + 1)) == NULL)
+		return NULL;
+
+	memcpy(t->topic, topic, len + 1);
+	t->id = g_spool_sb->next_id++;
+	t->seg = g_spool_seg - 1;
+	t->next = g_spool_topics[hash];
+	g_spool_topics[hash] = t;
+	return t;
+}
+
+
+/* ==========================================================================
+    Remembers that spool topic 'id' is 'topic' of 'size' bytes, as it's
+    been read from definition record.
+   ========================================================================== */
+static void m2md_spool_name
+(
+	uint32_t     id,     /* spool topic id */
+	const void  *topic,  /* topic, without nul */
+	int          size    /* length of topic */
+)
+{
+	char       **names;  /* resized names table */
+	char        *name;   /* copy of topic */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (id >= g_spool_nnames)
+	{
+		if ((names = realloc(g_spool_names, (id + 1) * sizeof(*names))) == NULL)
+		{
+			el_perror(ELE, "spool: realloc(names, %lu)", (unsigned long)id + 1);
+			return;
+		}
+
+		memset(names + g_spool_nnames, 0x00,
+				(id + 1 - g_spool_nnames) * sizeof(*names));
+		g_spool_names = names;
+		g_spool_nnames = id + 1;
+	}
+
+	if ((name = malloc(size + 1)) == NULL)
+	{
+		el_perror(ELE, "spool: malloc(name, %d)", size + 1);
+		return;
+	}
+
+	memcpy(name, topic, size);
+	name[size] = '\0';
+	free(g_spool_names[id]);
+	g_spool_names[id] = name;
+}
+
+
+/* ==========================================================================
+    Copies oldest segment in ring, so it can be replayed.
+
+    Returns 0 when segment has been copied, -1 when there is nothing to
+    replay.
+   ========================================================================== */
+static int m2md_spool_load
+(
+	void
+)
+{
+	const struct m2md_spool_seg  *seg;  /* oldest segment */
+	uint64_t                      pos;  /* position of segment */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	pthread_mutex_lock(&g_spool_lock);
+	if (g_spool_sb->tail == g_spool_sb->head)
+	{
+		pthread_mutex_unlock(&g_spool_lock);
+		return -1;
+	}
+
+	pos = g_spool_sb->tail;
+	if ((seg = m2md_spool_seg(&pos, 1)) == NULL)
+	{
+		el_print(ELE, "spool: broken segment at %llu, dropping %llu bytes",
+				(unsigned long long)g_spool_sb->tail,
+				(unsigned long long)(g_spool_sb->head - g_spool_sb->tail));
+		g_spool_sb->tail = g_spool_sb->head;
+		pthread_mutex_unlock(&g_spool_lock);
+		return -1;
+	}
+
+	memcpy(g_spool_rbuf, seg + 1, seg->len);
+	g_spool_rlen = seg->len;
+	g_spool_roff = M2MD_BATCH_HDR_SIZE;
+	g_spool_rtail = g_spool_sb->tail;
+	g_spool_rend = pos + M2MD_SPOOL_ALIGN(M2MD_SPOOL_SEG_HDR + seg->len);
+	g_spool_rloaded = 1;
+	pthread_mutex_unlock(&g_spool_lock);
+	return 0;
+}
+
+
+/* ==========================================================================
+    Replays up to 'budget' messages from spool, oldest first. Segment is
+    freed only once all of its messages are out. When broker goes away
+    in the middle, replay stops and carries on from the same message
+    next time.
+   ========================================================================== */
+static void m2md_spool_replay
+(
+	int                   budget   /* max messages to replay */
+)
+{
+	const unsigned char  *value;   /* value of record */
+	const char           *topic;   /* topic of record */
+	size_t                next;    /* offset of next record */
+	uint32_t              id;      /* topic id of record */
+	uint16_t              size;    /* size of value */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	while (budget > 0)
+	{
+		if (!g_spool_rloaded && m2md_spool_load() != 0)
+			return;
+
+		while (budget > 0 && (next = m2md_spool_rec(g_spool_rbuf,
+						g_spool_rlen, g_spool_roff, &id, &value, &size)))
+		{
+			if (id & M2MD_SPOOL_DEF)
+				m2md_spool_name(id & ~M2MD_SPOOL_DEF, value, size);
+			else if (id >= g_spool_nnames || g_spool_names[id] == NULL)
+				/* definition of topic has been dropped
+				 * before it could be replayed */
+				__atomic_add_fetch(&g_spool_stats.lost, 1, __ATOMIC_RELAXED);
+			else
+			{
+				topic = g_spool_names[id];
+				if (m2md_mqtt_publish_spooled(topic, value, size) != 0)
+					return;
+
+				__atomic_add_fetch(&g_spool_stats.replayed, 1,
+						__ATOMIC_RELAXED);
+				--budget;
+			}
+
+			g_spool_roff = next;
+		}
+
+		if (next)
+			return; /* out of budget */
+
+		/* whole segment is out, unless writer dropped
+		 * it in the meantime, it's free now */
+		pthread_mutex_lock(&g_spool_lock);
+		if (g_spool_sb->tail == g_spool_rtail)
+		{
+			g_spool_sb->tail = g_spool_rend;
+			m2md_spool_sync(0, sizeof(*g_spool_sb));
+		}
+		pthread_mutex_unlock(&g_spool_lock);
+		g_spool_rloaded = 0;
+	}
+}
+
+
+/* ==========================================================================
+    Spool thread. Writes segment that's been filled for too long to ring,
+    and replays spool, at configured rate, while we are connected to
+    broker. Live messages don't wait for it, they are published by their
+    own threads in the meantime.
+   ========================================================================== */
+static void *m2md_spool_thread
+(
+	void             *arg        /* not used */
+)
+{
+	struct timespec   tick;      /* how often thread wakes up */
+	struct timespec   now;       /* current time */
+	int64_t           waiting;   /* how long segment waits, ms */
+	int               connected; /* broker is there */
+	int               budget;    /* messages to replay in tick */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	(void)arg;
+	tick.tv_sec = 0;
+	tick.tv_nsec = 100000000;
+
+	/* rate is per second, thread wakes up 10 times a second */
+	budget = m2md_cfg->mqtt_spool_rate / 10;
+	if (budget == 0)
+		budget = 1;
+
+	while (__atomic_load_n(&g_spool_run, __ATOMIC_ACQUIRE))
+	{
+		nanosleep(&tick, NULL);
+		connected = m2md_mqtt_connected();
+
+		/* once broker is back, what waits in memory goes
+		 * to ring right away, to be replayed with the rest */
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		pthread_mutex_lock(&g_spool_lock);
+		waiting = (int64_t)(now.tv_sec - g_spool_batch.base.tv_sec) * 1000 +
+			(now.tv_nsec - g_spool_batch.base.tv_nsec) / 1000000;
+		if (g_spool_batch.count &&
+				(connected || waiting >= M2MD_SPOOL_SEG_MS))
+			m2md_spool_write();
+		pthread_mutex_unlock(&g_spool_lock);
+
+		if (connected)
+			m2md_spool_replay(budget);
+	}
+
+	return NULL;
+}
+
+
+/* ==========================================================================
+                       __     __ _          ____
+        ____   __  __ / /_   / /(_)_____   / __/__  __ ____   _____ _____
+       / __ \ / / / // __ \ / // // ___/  / /_ / / / // __ \ / ___// ___/
+      / /_/ // /_/ // /_/ // // // /__   / __// /_/ // / / // /__ (__  )
+     / .___/ \__,_//_.___//_//_/ \___/  /_/   \__,_//_/ /_/ \___//____/
+    /_/
+   ==========================================================================
+    Opens spool file, when spool is enabled, and maps it into memory.
+    Spool that is already there is picked up, and what's left in it is
+    replayed once broker is up. File that is not a spool, or is spool of
+    other size, is started anew. Messages can be spooled right after,
+    they are replayed once m2md_spool_start() is called.
+   ========================================================================== */
+int m2md_spool_init
+(
+	void
+)
+{
+	struct stat  st;     /* stat of spool file */
+	uint64_t     size;   /* size of file */
+	int          valid;  /* file holds valid spool */
+	int          ret;    /* return code from function */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (m2md_cfg->mqtt_spool[0] == '\0')
+		return 0;
+
+	m2md_spool_crc_init();
+	g_spool_page = sysconf(_SC_PAGESIZE);
+	g_spool_size = (uint64_t)m2md_cfg->mqtt_spool_size * 1024 * 1024;
+	size = M2MD_SPOOL_SB_SIZE + g_spool_size;
+
+	g_spool_fd = open(m2md_cfg->mqtt_spool, O_RDWR | O_CREAT | O_CLOEXEC, 0640);
+	if (g_spool_fd < 0)
+		return_perror(ELF, "spool: open(%s)", m2md_cfg->mqtt_spool);
+
+	if (fstat(g_spool_fd, &st) != 0)
+		goto_perror(fstat_error, ELF, "spool: fstat(%s)", m2md_cfg->mqtt_spool);
+
+	/* disk space is taken up front, writing to mapped
+	 * hole on full disk would kill us with SIGBUS */
+	valid = (uint64_t)st.st_size == size;
+	if (!valid && ftruncate(g_spool_fd, 0) != 0)
+		goto_perror(fstat_error, ELF, "spool: ftruncate(%s)", m2md_cfg->mqtt_spool);
+
+	if ((ret = posix_fallocate(g_spool_fd, 0, size)) != 0)
+	{
+		errno = ret;
+		goto_perror(fstat_error, ELF, "spool: posix_fallocate(%s, %llu)",
+				m2md_cfg->mqtt_spool, (unsigned long long)size);
+	}
+
+	g_spool_map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			g_spool_fd, 0);
+	if (g_spool_map == MAP_FAILED)
+		goto_perror(mmap_error, ELF, "spool: mmap(%s)", m2md_cfg->mqtt_spool);
+
+	g_spool_sb = (struct m2md_spool_sb *)g_spool_map;
+	g_spool_ring = g_spool_map + M2MD_SPOOL_SB_SIZE;
+
+	valid = valid && g_spool_sb->magic == M2MD_SPOOL_MAGIC &&
+		g_spool_sb->version == M2MD_SPOOL_VERSION &&
+		g_spool_sb->size == g_spool_size &&
+		g_spool_sb->head - g_spool_sb->tail <= g_spool_size;
+
+	if (valid)
+		m2md_spool_recover();
+	else
+	{
+		if (st.st_size)
+			el_print(ELW, "spool: %s is not a spool of %d MiB, starting new one",
+					m2md_cfg->mqtt_spool, m2md_cfg->mqtt_spool_size);
+
+		/* old segments would look valid to
+		 * recovery, they must be gone */
+		memset(g_spool_map, 0x00, size);
+		g_spool_sb->magic = M2MD_SPOOL_MAGIC;
+		g_spool_sb->version = M2MD_SPOOL_VERSION;
+		g_spool_sb->size = g_spool_size;
+		msync(g_spool_map, size, MS_SYNC);
+	}
+
+	if (m2md_batch_init(&g_spool_batch, M2MD_SPOOL_SEG_MAX) != 0)
+		goto_perror(batch_error, ELF, "spool: m2md_batch_init()");
+
+	if ((g_spool_rbuf = malloc(M2MD_SPOOL_SEG_MAX)) == NULL)
+		goto_perror(rbuf_error, ELF, "spool: malloc(rbuf)");
+
+	memset(&g_spool_stats, 0x00, sizeof(g_spool_stats));
+	g_spool_rloaded = 0;
+	return 0;
+
+rbuf_error:
+	m2md_batch_destroy(&g_spool_batch);
+
+batch_error:
+	munmap(g_spool_map, size);
+
+mmap_error:
+	g_spool_map = NULL;
+
+fstat_error:
+	close(g_spool_fd);
+	g_spool_fd = -1;
+	return -1;
+}
+
+
+/* ==========================================================================
+    Starts spool thread, mqtt must be initialized by now.
+   ========================================================================== */
+int m2md_spool_start
+(
+	void
+)
+{
+	int  ret;  /* return code from function */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (g_spool_map == NULL)
+		return 0;
+
+	g_spool_run = 1;
+	ret = pthread_create(&g_spool_thread, NULL, m2md_spool_thread, NULL);
+	if (ret)
+	{
+		errno = ret;
+		return_perror(ELF, "spool: pthread_create()");
+	}
+
+	g_spool_started = 1;
+	return 0;
+}
+
+
+/* ==========================================================================
+    Stops spool thread. Messages can still be spooled, they are simply
+    not replayed anymore.
+   ========================================================================== */
+void m2md_spool_stop
+(
+	void
+)
+{
+	if (!g_spool_started)
+		return;
+
+	__atomic_store_n(&g_spool_run, 0, __ATOMIC_RELEASE);
+	pthread_join(g_spool_thread, NULL);
+	g_spool_started = 0;
+}
+
+
+/* ==========================================================================
+    Writes what's left in memory to spool, and closes it. Nothing can be
+    spooled anymore, everything that publishes must be stopped by now.
+   ========================================================================== */
+void m2md_spool_cleanup
+(
+	void
+)
+{
+	struct m2md_spool_topic  *t;     /* topic to free */
+	size_t                    i;     /* teh iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (g_spool_map == NULL)
+		return;
+
+	m2md_spool_stop();
+
+	pthread_mutex_lock(&g_spool_lock);
+	m2md_spool_write();
+	msync(g_spool_map, M2MD_SPOOL_SB_SIZE + g_spool_size, MS_SYNC);
+	munmap(g_spool_map, M2MD_SPOOL_SB_SIZE + g_spool_size);
+	g_spool_map = NULL;
+	g_spool_sb = NULL;
+	g_spool_ring = NULL;
+	pthread_mutex_unlock(&g_spool_lock);
+
+	close(g_spool_fd);
+	g_spool_fd = -1;
+	m2md_batch_destroy(&g_spool_batch);
+
+	for (i = 0; i != M2MD_SPOOL_BUCKETS; ++i)
+		while ((t = g_spool_topics[i]) != NULL)
+		{
+			g_spool_topics[i] = t->next;
+			free(t);
+		}
+
+	for (i = 0; i != g_spool_nnames; ++i)
+		free(g_spool_names[i]);
+
+	free(g_spool_names);
+	g_spool_names = NULL;
+	g_spool_nnames = 0;
+	free(g_spool_rbuf);
+	g_spool_rbuf = NULL;
+}
+
+
+/* ==========================================================================
+    Spools message 'payload' of 'len' bytes, that could not be published
+    on full 'topic'. Topic is defined first, unless segment that is being
+    filled already defines it.
+
+    errno:
+            EINVAL      invalid argument passed
+            ENODEV      spool is not enabled
+            ENOSPC      all topic ids have been used
+            ENOMEM      not enough memory for topic
+   ========================================================================== */
+int m2md_spool_add
+(
+	const char               *topic,    /* full topic of message */
+	const void               *payload,  /* message to spool */
+	int                       len       /* length of payload */
+)
+{
+	struct m2md_spool_topic  *t;        /* spooled topic */
+	struct timespec           now;      /* current time */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	VALID(EINVAL, topic);
+	VALID(EINVAL, payload);
+	VALID(EINVAL, len >= 0 && len <= M2MD_SPOOL_SEG_MAX -
+			M2MD_BATCH_HDR_SIZE - M2MD_BATCH_REC_SIZE);
+
+	pthread_mutex_lock(&g_spool_lock);
+	if (g_spool_map == NULL)
+	{
+		pthread_mutex_unlock(&g_spool_lock);
+		errno = ENODEV;
+		return -1;
+	}
+
+	/* time is taken under lock, so records
+	 * in segment never go back in time */
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if ((t = m2md_spool_topic(topic)) == NULL)
+		goto error;
+
+	/* segment that is full, or has been filled for too long,
+	 * goes to ring, and both definition and message go to
+	 * new one, so it never uses topic it doesn't define */
+	for (;;)
+	{
+		if (t->seg != g_spool_seg &&
+				m2md_batch_add(&g_spool_batch, t->id | M2MD_SPOOL_DEF,
+					&now, t->topic, strlen(t->topic)) != 0)
+		{
+			if (g_spool_batch.count == 0)
+				goto error;
+
+			m2md_spool_write();
+			continue;
+		}
+
+		t->seg = g_spool_seg;
+		if (m2md_batch_add(&g_spool_batch, t->id, &now, payload, len) == 0)
+			break;
+
+		if (g_spool_batch.count == 1)
+			/* it's only definition in there, and
+			 * message doesn't fit with it */
+			goto error;
+
+		m2md_spool_write();
+	}
+
+	pthread_mutex_unlock(&g_spool_lock);
+	__atomic_add_fetch(&g_spool_stats.spooled, 1, __ATOMIC_RELAXED);
+	return 0;
+
+error:
+	pthread_mutex_unlock(&g_spool_lock);
+	return -1;
+}
+
+
+/* ==========================================================================
+    Prints stats of spool, gathered since previous call, if anything has
+    happened to it.
+   ========================================================================== */
+void m2md_spool_print_stats
+(
+	void
+)
+{
+	struct m2md_spool_stats  stats;  /* copy of stats */
+	uint64_t                 used;   /* bytes waiting to be replayed */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (g_spool_map == NULL)
+		return;
+
+	pthread_mutex_lock(&g_spool_lock);
+	used = g_spool_sb->head - g_spool_sb->tail;
+	pthread_mutex_unlock(&g_spool_lock);
+
+#define M2MD_SPOOL_TAKE(f) \
+	stats.f = __atomic_exchange_n(&g_spool_stats.f, 0, __ATOMIC_RELAXED)
+
+	M2MD_SPOOL_TAKE(spooled);
+	M2MD_SPOOL_TAKE(replayed);
+	M2MD_SPOOL_TAKE(dropped);
+	M2MD_SPOOL_TAKE(lost);
+	M2MD_SPOOL_TAKE(segments);
+
+#undef M2MD_SPOOL_TAKE
+
+	if (used == 0 && stats.spooled == 0 && stats.replayed == 0 &&
+			stats.dropped == 0 && stats.lost == 0)
+		return;
+
+	el_print(ELI, "stats spool: used: %.1f%%, spooled: %lu, segments: %lu, "
+			"replayed: %lu, dropped: %lu, lost: %lu",
+			100.0 * used / g_spool_size, stats.spooled, stats.segments,
+			stats.replayed, stats.dropped, stats.lost);
+}
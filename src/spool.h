@@ -0,0 +1,62 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ========================================================================== */
+
+#ifndef M2MD_SPOOL_H
+#define M2MD_SPOOL_H 1
+
+#include <stdint.h>
+
+/* Spool is a file, mapped into memory, where messages go when broker
+ * cannot be reached. It starts with superblock, ring of segments
+ * follows it. All fields are in host byte order.
+ *
+ * superblock, M2MD_SPOOL_SB_SIZE bytes:
+ *      uint32_t  magic    M2MD_SPOOL_MAGIC
+ *      uint32_t  version  M2MD_SPOOL_VERSION
+ *      uint64_t  size     size of ring
+ *      uint64_t  head     where next segment goes
+ *      uint64_t  tail     oldest segment not yet replayed
+ *      uint32_t  next_id  topic ids ever given in this spool
+ *
+ * Head and tail grow forever, position in ring is what's left of them
+ * after dividing by size. Segment never wraps, when it does not fit
+ * at the end of ring, M2MD_SPOOL_WRAP_MAGIC header is left there
+ * (when there is room for it) and segment goes to start of ring.
+ *
+ * segment, aligned to 8 bytes:
+ *      uint32_t  magic    M2MD_SPOOL_SEG_MAGIC
+ *      uint32_t  len      length of message
+ *      uint64_t  pos      position of segment, stale one has other
+ *      uint32_t  crc      crc32 of message
+ *      uint32_t  pad      0
+ *      uint8_t   msg[len] batch message, as in batch.h
+ *
+ * Record of message carries spool's own topic id, not the one from
+ * batch index. Record with M2MD_SPOOL_DEF bit set in id defines topic
+ * of that id instead, and its value is the topic, without nul. Each
+ * segment defines every topic it uses, before it uses it, so segment
+ * can be replayed even when all segments before it are gone.
+ */
+#define M2MD_SPOOL_MAGIC       0x5053324d  /* "M2SP" */
+#define M2MD_SPOOL_VERSION     1
+#define M2MD_SPOOL_SEG_MAGIC   0x47455353  /* "SSEG" */
+#define M2MD_SPOOL_WRAP_MAGIC  0x50525753  /* "SWRP" */
+#define M2MD_SPOOL_SB_SIZE     4096
+#define M2MD_SPOOL_SEG_HDR     24
+#define M2MD_SPOOL_DEF         0x80000000u
+
+/* max length of message in segment, segment is written once it's
+ * full, or has been waiting for M2MD_SPOOL_SEG_MS */
+#define M2MD_SPOOL_SEG_MAX     65536
+#define M2MD_SPOOL_SEG_MS      1000
+
+int m2md_spool_init(void);
+int m2md_spool_start(void);
+void m2md_spool_stop(void);
+void m2md_spool_cleanup(void);
+int m2md_spool_add(const char *topic, const void *payload, int len);
+void m2md_spool_print_stats(void);
+
+#endif
@@ -0,0 +1,315 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+         ------------------------------------------------------------
+        / timing - time arithmetic, math that moves deadlines of     \
+        | reads according to configured timing and catch up policy,  |
+        \ and response timeout estimated from round trip time        /
+         ------------------------------------------------------------
+   ==========================================================================
+          _               __            __         ____ _  __
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+
+   ========================================================================== */
+
+
+#include "timing.h"
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ==========================================================================
+    Clamps 'rto' between floor and ceiling of 'rtt'.
+   ========================================================================== */
+static int64_t m2md_timing_rto_clamp
+(
+	const struct m2md_timing_rtt  *rtt,  /* estimate with limits */
+	int64_t                        rto   /* response timeout to clamp, ns */
+)
+{
+	if (rto > rtt->rto_max)
+		rto = rtt->rto_max;
+
+	if (rto < rtt->rto_min)
+		rto = rtt->rto_min;
+
+	return rto;
+}
+
+
+/* ==========================================================================
+                       __     __ _          ____
+        ____   __  __ / /_   / /(_)_____   / __/__  __ ____   _____ _____
+       / __ \ / / / // __ \ / // // ___/  / /_ / / / // __ \ / ___// ___/
+      / /_/ // /_/ // /_/ // // // /__   / __// /_/ // / / // /__ (__  )
+     / .___/ \__,_//_.___//_//_/ \___/  /_/   \__,_//_/ /_/ \___//____/
+    /_/
+   ==========================================================================
+    Calculates diff between t1 - t2
+   ========================================================================== */
+struct timespec m2md_timing_sub
+(
+	struct timespec   t1,   /* time to subtract from */
+	struct timespec   t2    /* time to subtract */
+)
+{
+	struct timespec   res;  /* subtract result */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	res.tv_sec = t1.tv_sec - t2.tv_sec;
+	res.tv_nsec = t1.tv_nsec - t2.tv_nsec;
+
+	if (res.tv_nsec < 0)
+	{
+		res.tv_sec -= 1;
+		res.tv_nsec += 1000000000l;
+	}
+
+	return res;
+}
+
+
+/* ==========================================================================
+    Calculates sum of t1 + t2
+   ========================================================================== */
+struct timespec m2md_timing_add
+(
+	struct timespec   t1,   /* time to add to */
+	struct timespec   t2    /* time to add */
+)
+{
+	struct timespec   res;  /* add result */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	res.tv_sec = t1.tv_sec + t2.tv_sec;
+	res.tv_nsec = t1.tv_nsec + t2.tv_nsec;
+
+	if (res.tv_nsec >= 1000000000l)
+	{
+		res.tv_sec += 1;
+		res.tv_nsec -= 1000000000l;
+	}
+
+	return res;
+}
+
+
+/* ==========================================================================
+    Converts 'ns' nanoseconds into timespec
+   ========================================================================== */
+struct timespec m2md_timing_ts
+(
+	int64_t           ns   /* nanoseconds to convert */
+)
+{
+	struct timespec   res; /* converted time */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	res.tv_sec = ns / 1000000000l;
+	res.tv_nsec = ns % 1000000000l;
+	return res;
+}
+
+
+/* ==========================================================================
+    Converts 't' into nanoseconds
+   ========================================================================== */
+int64_t m2md_timing_ns
+(
+	struct timespec  t  /* time to convert */
+)
+{
+	return (int64_t)t.tv_sec * 1000000000l + t.tv_nsec;
+}
+
+
+/* ==========================================================================
+    Moves 'deadline' of read that has just expired to the time of its
+    next read, read is made every 'period' with 'mode' timing, and
+    missed reads are handled according to 'catch_up'. How late 'now'
+    the read is, compared to its deadline, is recorded in 'stats'.
+
+    Zero deadline means read has never been made, so it's not late, it
+    is its first read and it anchors the schedule.
+   ========================================================================== */
+void m2md_timing_next
+(
+	struct timespec           *deadline,  /* deadline of the read */
+	struct timespec            period,    /* time between reads */
+	struct timespec            now,       /* current absolute time */
+	int                        mode,      /* enum m2md_timing_mode */
+	int                        catch_up,  /* enum m2md_timing_catch_up */
+	struct m2md_timing_stats  *stats      /* lateness is recorded here */
+)
+{
+	int64_t                    late;      /* how late read is */
+	int64_t                    ns;        /* period in ns */
+	int64_t                    missed;    /* number of missed periods */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (deadline->tv_sec == 0 && deadline->tv_nsec == 0)
+	{
+		*deadline = m2md_timing_add(now, period);
+		return;
+	}
+
+	ns = m2md_timing_ns(period);
+	late = m2md_timing_ns(m2md_timing_sub(now, *deadline));
+	stats->reads++;
+	stats->late_sum += late;
+	if (late > stats->late_max)
+		stats->late_max = late;
+
+	if (mode == M2MD_TIMING_RELATIVE || ns == 0)
+	{
+		/* next read is poll time after now, whatever was
+		 * the delay, it will carry over to next reads */
+		*deadline = m2md_timing_add(now, period);
+		return;
+	}
+
+	/* next read is poll time after previous deadline, so
+	 * delay of this read does not affect next reads */
+	*deadline = m2md_timing_add(*deadline, period);
+
+	if (catch_up == M2MD_TIMING_CATCH_UP_BURST)
+		/* if we are more than one period late, read will
+		 * be expired right away and made again, until it
+		 * catches up with the schedule */
+		return;
+
+	late -= ns;
+	if (late < 0)
+		return; /* next deadline is in the future, all good */
+
+	/* we were so late, that we missed at least one whole read,
+	 * drop missed reads and jump straight to first deadline in
+	 * the future. It's calculated in one go, so even very long
+	 * stall does not cost more than single read */
+	missed = late / ns + 1;
+	stats->skipped += missed;
+	*deadline = m2md_timing_add(*deadline, m2md_timing_ts(missed * ns));
+}
+
+
+/* ==========================================================================
+    Moves 'deadline' of read, that could not be made for a while because
+    server was down, to its latest deadline that is not in the future.
+    There simply was no one to read from, so missed reads are not made
+    up for, read is made once right away, and schedule continues from
+    there. Reads that are dropped are counted in 'stats' as skipped.
+
+    Returns 1 when deadline has been moved, 0 otherwise.
+   ========================================================================== */
+int m2md_timing_resume
+(
+	struct timespec           *deadline,  /* deadline of the read */
+	struct timespec            period,    /* time between reads */
+	struct timespec            now,       /* current absolute time */
+	struct m2md_timing_stats  *stats      /* skipped reads go here */
+)
+{
+	int64_t                    late;      /* how late read is */
+	int64_t                    ns;        /* period in ns */
+	int64_t                    missed;    /* number of missed periods */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	ns = m2md_timing_ns(period);
+	if (ns == 0 || (deadline->tv_sec == 0 && deadline->tv_nsec == 0))
+		return 0;
+
+	late = m2md_timing_ns(m2md_timing_sub(now, *deadline));
+	if ((missed = late / ns) <= 0)
+		return 0;
+
+	stats->skipped += missed;
+	*deadline = m2md_timing_add(*deadline, m2md_timing_ts(missed * ns));
+	return 1;
+}
+
+
+/* ==========================================================================
+    Resets rtt estimate 'rtt', response timeout is kept between 'rto_min'
+    and 'rto_max' ns from now on. Until first response arrives, we know
+    nothing about the server, so we start with 1 second, just like tcp
+    does.
+   ========================================================================== */
+void m2md_timing_rtt_init
+(
+	struct m2md_timing_rtt  *rtt,      /* estimate to reset */
+	int64_t                  rto_min,  /* shortest response timeout */
+	int64_t                  rto_max   /* longest response timeout */
+)
+{
+	rtt->srtt = 0;
+	rtt->rttvar = 0;
+	rtt->rto_min = rto_min;
+	rtt->rto_max = rto_max;
+	rtt->rto = m2md_timing_rto_clamp(rtt, 1000000000ll);
+}
+
+
+/* ==========================================================================
+    Updates rtt estimate 'rtt' with new 'sample', and calculates response
+    timeout from it, the same way tcp calculates its rto (rfc 6298).
+    Smoothed rtt follows average, and variation makes sure that server
+    with jittery responses gets enough slack.
+   ========================================================================== */
+void m2md_timing_rtt_sample
+(
+	struct m2md_timing_rtt  *rtt,     /* estimate to update */
+	int64_t                  sample   /* measured rtt, ns */
+)
+{
+	int64_t                  dev;     /* deviation of sample from srtt */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (rtt->srtt == 0)
+	{
+		/* first sample, it's all we know */
+		rtt->srtt = sample > 0 ? sample : 1;
+		rtt->rttvar = rtt->srtt / 2;
+	}
+	else
+	{
+		dev = rtt->srtt - sample;
+		rtt->rttvar += ((dev < 0 ? -dev : dev) - rtt->rttvar) / 4;
+		rtt->srtt += (sample - rtt->srtt) / 8;
+		if (rtt->srtt <= 0)
+			rtt->srtt = 1;
+	}
+
+	/* variation is never taken as less than 1ms, so very
+	 * stable server does not get rto equal to its rtt */
+	rtt->rto = m2md_timing_rto_clamp(rtt, rtt->srtt +
+			(4 * rtt->rttvar > 1000000 ? 4 * rtt->rttvar : 1000000));
+}
+
+
+/* ==========================================================================
+    Doubles response timeout of 'rtt' after server failed to respond in
+    time. Response may have been just late and not lost, so until server
+    responds again, we wait longer for it.
+   ========================================================================== */
+void m2md_timing_rtt_backoff
+(
+	struct m2md_timing_rtt  *rtt  /* estimate of server that timed out */
+)
+{
+	rtt->rto = m2md_timing_rto_clamp(rtt, rtt->rto * 2);
+}
@@ -0,0 +1,69 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ========================================================================== */
+
+#ifndef M2MD_TIMING_H
+#define M2MD_TIMING_H 1
+
+#include <stdint.h>
+#include <time.h>
+
+/* how next read time of the block is calculated */
+enum m2md_timing_mode
+{
+	/* next read is period after block was actually read, every
+	 * delay in reading moves all following reads further */
+	M2MD_TIMING_RELATIVE,
+
+	/* next read is period after previous deadline, so reads are
+	 * kept at fixed rate no matter how late each of them was */
+	M2MD_TIMING_ABSOLUTE
+};
+
+/* what to do with reads that have been missed with absolute timing */
+enum m2md_timing_catch_up
+{
+	/* missed reads are dropped, next read is the first
+	 * deadline in the future */
+	M2MD_TIMING_CATCH_UP_SKIP,
+
+	/* missed reads are made one after another, until
+	 * schedule is caught up */
+	M2MD_TIMING_CATCH_UP_BURST
+};
+
+/* how late reads are, compared to their deadlines */
+struct m2md_timing_stats
+{
+	unsigned long    reads;     /* reads dispatched */
+	unsigned long    skipped;   /* reads skipped to catch up */
+	int64_t          late_sum;  /* sum of lateness of reads, ns */
+	int64_t          late_max;  /* biggest lateness of read, ns */
+};
+
+/* round trip time estimate of the server, all in ns */
+struct m2md_timing_rtt
+{
+	int64_t          srtt;      /* smoothed rtt, 0 - no sample yet */
+	int64_t          rttvar;    /* rtt variation */
+	int64_t          rto;       /* current response timeout */
+	int64_t          rto_min;   /* rto is never shorter than that */
+	int64_t          rto_max;   /* rto is never longer than that */
+};
+
+struct timespec m2md_timing_add(struct timespec t1, struct timespec t2);
+struct timespec m2md_timing_sub(struct timespec t1, struct timespec t2);
+struct timespec m2md_timing_ts(int64_t ns);
+int64_t m2md_timing_ns(struct timespec t);
+void m2md_timing_next(struct timespec *deadline, struct timespec period,
+		struct timespec now, int mode, int catch_up,
+		struct m2md_timing_stats *stats);
+int m2md_timing_resume(struct timespec *deadline, struct timespec period,
+		struct timespec now, struct m2md_timing_stats *stats);
+void m2md_timing_rtt_init(struct m2md_timing_rtt *rtt, int64_t rto_min,
+		int64_t rto_max);
+void m2md_timing_rtt_sample(struct m2md_timing_rtt *rtt, int64_t sample);
+void m2md_timing_rtt_backoff(struct m2md_timing_rtt *rtt);
+
+#endif
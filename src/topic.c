@@ -0,0 +1,74 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+         ------------------------------------------------------------
+        / topic - builds full mqtt topics, exactly as they are seen  \
+        \ on broker, out of base topic and topic of poll             /
+         ------------------------------------------------------------
+   ==========================================================================
+          _               __            __         ____ _  __
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+
+   ========================================================================== */
+
+
+#include "topic.h"
+
+#include <errno.h>
+#include <stdio.h>
+
+#include "valid.h"
+#include "macros.h"
+
+
+/* ==========================================================================
+                       __     __ _          ____
+        ____   __  __ / /_   / /(_)_____   / __/__  __ ____   _____ _____
+       / __ \ / / / // __ \ / // // ___/  / /_ / / / // __ \ / ___// ___/
+      / /_/ // /_/ // /_/ // // // /__   / __// /_/ // / / // /__ (__  )
+     / .___/ \__,_//_.___//_//_/ \___/  /_/   \__,_//_/ /_/ \___//____/
+    /_/
+   ==========================================================================
+    Builds full topic, exactly as it is published on broker, out of
+    'topic' into 'dst' of 'size' bytes. 'base' topic is put in front of
+    it, and first slash of 'topic' is stripped, so "/poll" with base
+    "m2md" is "m2md/poll".
+
+    Returns length of full topic. When it doesn't fit, 'dst' holds as
+    much of it as it could take.
+
+    errno:
+            EINVAL      any of pointers is NULL
+            ENOBUFS     full topic does not fit in dst
+   ========================================================================== */
+int m2md_topic_build
+(
+	char        *dst,      /* full topic goes here */
+	size_t       size,     /* size of dst buffer */
+	const char  *base,     /* base topic, put in front of topic */
+	const char  *topic     /* topic to build full topic of */
+)
+{
+	int          toplen;   /* length of full topic */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	VALID(EINVAL, dst);
+	VALID(EINVAL, base);
+	VALID(EINVAL, topic);
+
+	/* strip first slash */
+	if (topic[0] == '/')
+		topic += 1;
+
+	toplen = snprintf(dst, size, "%s/%s", base, topic);
+
+	if (toplen < 0 || (size_t)toplen >= size)
+		return_errno(ENOBUFS);
+
+	return toplen;
+}
@@ -0,0 +1,14 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ========================================================================== */
+
+#ifndef M2MD_TOPIC_H
+#define M2MD_TOPIC_H 1
+
+#include <stddef.h>
+
+int m2md_topic_build(char *dst, size_t size, const char *base,
+		const char *topic);
+
+#endif
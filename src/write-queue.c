@@ -0,0 +1,270 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+         ------------------------------------------------------------
+        / write-queue - registers and coils that wait to be written  \
+        | to server, newer value replaces older one, and neighbours  |
+        \ are written with single request                            /
+         ------------------------------------------------------------
+   ==========================================================================
+          _               __            __         ____ _  __
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+
+   ========================================================================== */
+
+
+#include "write-queue.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "macros.h"
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ==========================================================================
+    Returns key by which write queue is sorted, writes to the same unit and
+    of the same type are next to each other, ordered by register.
+   ========================================================================== */
+static long m2md_wq_key
+(
+	int  uid,   /* unit id */
+	int  bits,  /* write of coil, not register */
+	int  reg    /* register or coil */
+)
+{
+	return (long)uid << 17 | (long)(bits != 0) << 16 | reg;
+}
+
+
+/* ==========================================================================
+    Returns position in 'wq' at which write with 'key' is, or should be
+    put when it's not in queue yet.
+   ========================================================================== */
+static int m2md_wq_search
+(
+	const struct m2md_wq        *wq,   /* queue to search */
+	long                         key   /* key of write to find */
+)
+{
+	const struct m2md_wq_write  *w;    /* current write */
+	int                          lo;   /* lower bound of search */
+	int                          hi;   /* upper bound of search */
+	int                          mid;  /* middle of search */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	lo = 0;
+	hi = wq->nwrites;
+	while (lo < hi)
+	{
+		mid = (lo + hi) / 2;
+		w = &wq->writes[mid];
+		if (m2md_wq_key(w->uid, w->bits, w->reg) < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+
+/* ==========================================================================
+                       __     __ _          ____
+        ____   __  __ / /_   / /(_)_____   / __/__  __ ____   _____ _____
+       / __ \ / / / // __ \ / // // ___/  / /_ / / / // __ \ / ___// ___/
+      / /_/ // /_/ // /_/ // // // /__   / __// /_/ // / / // /__ (__  )
+     / .___/ \__,_//_.___//_//_/ \___/  /_/   \__,_//_/ /_/ \___//____/
+    /_/
+   ==========================================================================
+    Initializes empty write queue 'wq'. Memory is allocated on first add.
+   ========================================================================== */
+void m2md_wq_init
+(
+	struct m2md_wq  *wq  /* queue to initialize */
+)
+{
+	memset(wq, 0x00, sizeof(*wq));
+}
+
+
+/* ==========================================================================
+    Puts write of 'value' to register 'reg' (or coil, when 'bits' is set)
+    of unit 'uid' in write queue 'wq'. Queue is kept sorted, so registers
+    that are next to each other end up next to each other in queue, and
+    can be written with single request. When register already waits to
+    be written, its value is simply replaced, there is no point in
+    writing old value, when new one is already known.
+
+    Returns 0 when write has been queued, 1 when it replaced write that
+    was already in queue, or -1 on error.
+
+    errno:
+            ENOBUFS     write queue is full
+            ENOMEM      not enough memory to grow write queue
+   ========================================================================== */
+int m2md_wq_add
+(
+	struct m2md_wq        *wq,      /* queue to put write in */
+	int                    uid,     /* unit id */
+	int                    bits,    /* write coil, not register */
+	int                    reg,     /* register to write */
+	uint16_t               value    /* value to write */
+)
+{
+	struct m2md_wq_write  *writes;  /* reallocated write queue */
+	struct m2md_wq_write  *w;       /* current write */
+	long                   key;     /* key of new write */
+	int                    i;       /* position of write in queue */
+	int                    size;    /* new size of write queue */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	key = m2md_wq_key(uid, bits, reg);
+	i = m2md_wq_search(wq, key);
+	w = wq->writes + i;
+	if (i != wq->nwrites && m2md_wq_key(w->uid, w->bits, w->reg) == key)
+	{
+		/* newer value supersedes one that still waits */
+		w->value = value;
+		return 1;
+	}
+
+	if (wq->nwrites == M2MD_WQ_MAX)
+		return_errno(ENOBUFS);
+
+	if (wq->nwrites == wq->size)
+	{
+		size = wq->size ? wq->size * 2 : 16;
+		if ((writes = realloc(wq->writes, size * sizeof(*writes))) == NULL)
+			return -1;
+
+		wq->writes = writes;
+		wq->size = size;
+	}
+
+	w = &wq->writes[i];
+	memmove(w + 1, w, (wq->nwrites - i) * sizeof(*w));
+	w->uid = uid;
+	w->bits = bits != 0;
+	w->reg = reg;
+	w->value = value;
+	wq->nwrites++;
+	return 0;
+}
+
+
+/* ==========================================================================
+    Returns how many of 'n' registers (or coils) from 'reg' of unit 'uid'
+    are not in 'wq' yet, that is, how much room in queue write of them
+    would take. Registers that are already queued only get new value.
+   ========================================================================== */
+int m2md_wq_missing
+(
+	const struct m2md_wq        *wq,       /* queue to check */
+	int                          uid,      /* unit id */
+	int                          bits,     /* write coil, not register */
+	int                          reg,      /* first register to write */
+	int                          n         /* number of registers */
+)
+{
+	const struct m2md_wq_write  *w;        /* current write */
+	int                          missing;  /* registers not in queue */
+	int                          i;        /* position in queue */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	/* registers are sorted, so queued ones of
+	 * our range are all right after first one */
+	missing = n;
+	i = m2md_wq_search(wq, m2md_wq_key(uid, bits, reg));
+	for (; i != wq->nwrites; ++i)
+	{
+		w = &wq->writes[i];
+		if (w->uid != uid || w->bits != (bits != 0) || w->reg >= reg + n)
+			break;
+
+		--missing;
+	}
+
+	return missing;
+}
+
+
+/* ==========================================================================
+    Takes writes from the front of write queue 'wq', that can be done
+    with single request, stores first of them in 'first', and values of
+    all of them in 'values'. These are writes to the same unit, of the
+    same type, to registers that are next to each other, no more than
+    single request can take. Coils are packed in 'values', 16 in each
+    word, just like read bits are.
+
+    Returns number of registers (or coils) taken, or 0 when queue is
+    empty.
+   ========================================================================== */
+int m2md_wq_take
+(
+	struct m2md_wq        *wq,      /* queue to take writes of */
+	struct m2md_wq_write  *first,   /* first write taken goes here */
+	uint16_t              *values   /* values to write go here */
+)
+{
+	struct m2md_wq_write  *w;       /* writes in queue */
+	int                    max;     /* max items in single write */
+	int                    n;       /* number of writes taken */
+	int                    i;       /* iterator */
+	/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+	if (wq->nwrites == 0)
+		return 0;
+
+	w = wq->writes;
+	max = w->bits ? M2MD_WQ_MAX_BITS : M2MD_WQ_MAX_REGS;
+	for (n = 1; n != wq->nwrites && n != max; ++n)
+		if (w[n].uid != w->uid || w[n].bits != w->bits ||
+				w[n].reg != w->reg + n)
+			break;
+
+	*first = *w;
+
+	if (w->bits)
+	{
+		memset(values, 0x00, (n + 15) / 16 * sizeof(*values));
+		for (i = 0; i != n; ++i)
+			values[i >> 4] |= (uint16_t)(w[i].value & 1) << (i & 15);
+	}
+	else
+		for (i = 0; i != n; ++i)
+			values[i] = w[i].value;
+
+	wq->nwrites -= n;
+	memmove(w, w + n, wq->nwrites * sizeof(*w));
+	return n;
+}
+
+
+/* ==========================================================================
+    Drops all writes of 'wq' and releases its memory. Queue is empty and
+    can be used again after that.
+   ========================================================================== */
+void m2md_wq_destroy
+(
+	struct m2md_wq  *wq  /* queue to destroy */
+)
+{
+	free(wq->writes);
+	m2md_wq_init(wq);
+}
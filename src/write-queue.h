@@ -0,0 +1,48 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ========================================================================== */
+
+#ifndef M2MD_WRITE_QUEUE_H
+#define M2MD_WRITE_QUEUE_H 1
+
+#include <stdint.h>
+
+/* max number of registers and coils waiting to be written to single
+ * server, it's enough to hold the biggest bitmap write */
+#define M2MD_WQ_MAX 2048
+
+/* max number of coils and registers written with single request,
+ * same as libmodbus' MODBUS_MAX_WRITE_BITS and REGISTERS */
+#define M2MD_WQ_MAX_BITS 1968
+#define M2MD_WQ_MAX_REGS 123
+
+/* single register or coil waiting to be written */
+struct m2md_wq_write
+{
+	int                    uid;     /* unit id */
+	int                    bits;    /* it's coil, not register */
+	int                    reg;     /* register or coil to write */
+	uint16_t               value;   /* value to write, 0 or 1 for coil */
+};
+
+/* writes waiting to be sent to single server, sorted by unit id,
+ * type and register, so writes that can be done with single
+ * request are next to each other */
+struct m2md_wq
+{
+	struct m2md_wq_write  *writes;  /* writes in queue */
+	int                    nwrites; /* writes waiting in queue */
+	int                    size;    /* writes queue can hold */
+};
+
+void m2md_wq_init(struct m2md_wq *wq);
+int m2md_wq_add(struct m2md_wq *wq, int uid, int bits, int reg,
+		uint16_t value);
+int m2md_wq_missing(const struct m2md_wq *wq, int uid, int bits, int reg,
+		int n);
+int m2md_wq_take(struct m2md_wq *wq, struct m2md_wq_write *first,
+		uint16_t *values);
+void m2md_wq_destroy(struct m2md_wq *wq);
+
+#endif
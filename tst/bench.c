@@ -0,0 +1,1053 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+         ------------------------------------------------------------
+        / bench - benchmarks of hot paths of m2md. Not run by make   \
+        | check, as numbers mean nothing on loaded build machine.    |
+        | Run ./m2md_bench for all of them, or ./m2md_bench <name>   |
+        \ for just one.                                              /
+         ------------------------------------------------------------
+   ==========================================================================
+          _               __            __         ____ _  __
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+
+   ========================================================================== */
+
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "decode.h"
+#include "encode.h"
+#include "mbtcp.h"
+#include "poll-list.h"
+#include "scheduler.h"
+
+
+/* ==========================================================================
+          __             __                     __   _
+     ____/ /___   _____ / /____ _ _____ ____ _ / /_ (_)____   ____   _____
+    / __  // _ \ / ___// // __ `// ___// __ `// __// // __ \ / __ \ / ___/
+   / /_/ //  __// /__ / // /_/ // /   / /_/ // /_ / // /_/ // / / /(__  )
+   \__,_/ \___/ \___//_/ \__,_//_/    \__,_/ \__//_/ \____//_/ /_//____/
+
+   ========================================================================== */
+
+
+struct bench
+{
+    const char  *name;
+    void       (*run)(void);
+};
+
+/* simulated modbus tcp servers, all of them are connections accepted
+ * on single listening socket, and served by single thread */
+struct bench_sim
+{
+    int            lfd;    /* listening socket */
+    int            port;   /* port servers listen on */
+    int            efd;    /* epoll of all connections */
+    volatile int   stop;   /* set to stop the thread */
+    pthread_t      t;      /* thread serving connections */
+};
+
+/* requests received, but not yet answered, by simulated server */
+struct bench_sim_conn
+{
+    unsigned char  buf[2 * M2MD_MBTCP_REQ_SIZE];
+    size_t         len;
+};
+
+/* node of poll list as it was before polls were moved to arrays, with
+ * poll in it, each node and its topic were allocated on their own. Kept
+ * to compare memory of both */
+struct bench_pl_node
+{
+    int                    func;
+    int                    reg;
+    int                    uid;
+    char                  *topic;
+    float                  scale;
+    unsigned char          is_signed;
+    unsigned char          field_width;
+    struct timespec        poll_time;
+    struct timespec        next_read;
+    struct bench_pl_node  *next;
+};
+
+/* registers read by single request in engines bench */
+#define BENCH_REGS 10
+
+/* result is written here, so compiler does not throw away
+ * work which results would otherwise not be used at all */
+static volatile uint64_t  g_sink;
+
+/* requests each client of engines bench sends */
+static int                g_rounds;
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ========================================================================== */
+
+
+/* ==========================================================================
+    Returns monotonic time in nanoseconds.
+   ========================================================================== */
+static int64_t bench_now(void)
+{
+    struct timespec  ts;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/* ==========================================================================
+    Adds 'ns' nanoseconds to 'ts'.
+   ========================================================================== */
+static void bench_ts_add
+(
+    struct timespec  *ts,
+    long              ns
+)
+{
+    ts->tv_nsec += ns;
+    while (ts->tv_nsec >= 1000000000)
+    {
+        ts->tv_nsec -= 1000000000;
+        ts->tv_sec++;
+    }
+}
+
+
+/* ==========================================================================
+    Cost of single wakeup of poll loop, against number of polls. Every
+    poll is read every 100ms, and first reads are spread evenly over
+    that time, so each wakeup finds only one or few polls expired.
+
+    Heap takes expired nodes from the top and pushes them down by their
+    period, scan is what loop did before, it walks all polls to find
+    expired ones and the next deadline.
+   ========================================================================== */
+static void bench_sched(void)
+{
+    static const int         counts[] = { 1000, 10000, 100000, 1000000 };
+    struct m2md_sched        sched;
+    struct m2md_sched_node  *nodes;
+    struct m2md_sched_node  *node;
+    struct timespec          now;
+    struct timespec          next;
+    int64_t                  start;
+    int64_t                  heap_ns;
+    int64_t                  scan_ns;
+    int                      wakeups;
+    int                      n;
+    int                      i;
+    int                      w;
+    int                      c;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    printf("sched: wakeup cost, polls read every 100ms\n");
+    printf("%10s %14s %14s\n", "polls", "heap ns/wake", "scan ns/wake");
+
+    for (c = 0; c != sizeof(counts) / sizeof(*counts); ++c)
+    {
+        n = counts[c];
+        nodes = malloc(n * sizeof(*nodes));
+        m2md_sched_init(&sched);
+
+        for (i = 0; i != n; ++i)
+        {
+            nodes[i].idx = M2MD_SCHED_NOT_QUEUED;
+            nodes[i].deadline.tv_sec = 0;
+            nodes[i].deadline.tv_nsec = (long)(100000000ll * i / n);
+            m2md_sched_add(&sched, &nodes[i]);
+        }
+
+        /* scan is way slower, so give it fewer wakeups,
+         * or the biggest list would take all day */
+        wakeups = 100000;
+        memset(&now, 0x00, sizeof(now));
+        start = bench_now();
+        for (w = 0; w != wakeups; ++w)
+        {
+            bench_ts_add(&now, 100000000 / wakeups + 1);
+            while ((node = m2md_sched_peek(&sched)) != NULL &&
+                    m2md_sched_expired(node, &now))
+            {
+                bench_ts_add(&node->deadline, 100000000);
+                m2md_sched_update(&sched, node);
+            }
+
+            g_sink += node->deadline.tv_nsec;
+        }
+        heap_ns = (bench_now() - start) / wakeups;
+
+        wakeups = 100000000 / n < 1000 ? 100000000 / n : 1000;
+        start = bench_now();
+        for (w = 0; w != wakeups; ++w)
+        {
+            bench_ts_add(&now, 100000000 / wakeups + 1);
+            next.tv_sec = now.tv_sec + 1;
+            next.tv_nsec = now.tv_nsec;
+            for (i = 0; i != n; ++i)
+            {
+                if (m2md_sched_expired(&nodes[i], &now))
+                    bench_ts_add(&nodes[i].deadline, 100000000);
+
+                if (nodes[i].deadline.tv_sec < next.tv_sec ||
+                        (nodes[i].deadline.tv_sec == next.tv_sec &&
+                         nodes[i].deadline.tv_nsec < next.tv_nsec))
+                    next = nodes[i].deadline;
+            }
+
+            g_sink += next.tv_nsec;
+        }
+        scan_ns = (bench_now() - start) / wakeups;
+
+        printf("%10d %14lld %14lld\n", n, (long long)heap_ns,
+                (long long)scan_ns);
+
+        m2md_sched_destroy(&sched);
+        free(nodes);
+    }
+}
+
+
+/* ==========================================================================
+    Fills 'data' with poll number 'n', all polls of one server, many
+    units, functions and registers, like big poll file would have them.
+   ========================================================================== */
+static void bench_pl_data
+(
+    struct m2md_pl_data  *data,
+    char                 *topic,
+    int                   n
+)
+{
+    memset(data, 0x00, sizeof(*data));
+    data->func = 3 + n % 2;
+    data->uid = n / 2 % 247 + 1;
+    data->reg = n / 494;
+    data->poll_time.tv_sec = 1;
+    data->scale = 1;
+    data->field_width = 1;
+
+    sprintf(topic, "/plant/inverter-%d/func-%d/reg-%d", data->uid,
+            data->func, data->reg);
+    data->topic = topic;
+}
+
+
+/* ==========================================================================
+    Cost of loading poll list, and of finding and deleting polls in it,
+    against number of polls. Loading poll file adds polls one by one,
+    and each add looks for duplicate first, so that's what startup time
+    of big poll file depends on. Polls are found and deleted in order
+    other than they were added in, 7919 is prime, so i * 7919 % n visits
+    every poll once.
+   ========================================================================== */
+static void bench_pl(void)
+{
+    static const int      counts[] = { 10000, 50000, 100000, 1000000 };
+    struct m2md_pl_list   pl;
+    struct m2md_pl_data   data;
+    char                  topic[64];
+    int64_t               add_ns;
+    int64_t               find_ns;
+    int64_t               del_ns;
+    int64_t               start;
+    int                   n;
+    int                   i;
+    int                   c;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    printf("pl: poll list operations\n");
+    printf("%10s %12s %12s %12s %12s\n", "polls", "load ms",
+            "add ns/op", "find ns/op", "del ns/op");
+
+    for (c = 0; c != sizeof(counts) / sizeof(*counts); ++c)
+    {
+        n = counts[c];
+        m2md_pl_init(&pl);
+
+        start = bench_now();
+        for (i = 0; i != n; ++i)
+        {
+            bench_pl_data(&data, topic, i);
+            m2md_pl_add(&pl, &data);
+        }
+        add_ns = bench_now() - start;
+
+        start = bench_now();
+        for (i = 0; i != n; ++i)
+        {
+            bench_pl_data(&data, topic, (int)((uint64_t)i * 7919 % n));
+            g_sink += m2md_pl_find(&pl, &data);
+        }
+        find_ns = bench_now() - start;
+
+        start = bench_now();
+        for (i = 0; i != n; ++i)
+        {
+            bench_pl_data(&data, topic, (int)((uint64_t)i * 7919 % n));
+            m2md_pl_delete(&pl, &data);
+        }
+        del_ns = bench_now() - start;
+
+        printf("%10d %12lld %12lld %12lld %12lld\n", n,
+                (long long)(add_ns / 1000000), (long long)(add_ns / n),
+                (long long)(find_ns / n), (long long)(del_ns / n));
+
+        m2md_pl_destroy(&pl);
+    }
+}
+
+
+/* ==========================================================================
+    Returns how much heap malloc() takes for 'size' bytes. That's glibc
+    on 64bit machine, where each chunk has 8 bytes of header, is aligned
+    to 16 bytes, and is never smaller than 32 bytes.
+   ========================================================================== */
+static size_t bench_malloc_size
+(
+    size_t  size
+)
+{
+    size = (size + 8 + 15) & ~(size_t)15;
+    return size < 32 ? 32 : size;
+}
+
+
+/* ==========================================================================
+    Memory taken by poll list, per poll, at 100k and 1M polls. Arrays
+    and index are counted by their allocated size, not by what's used,
+    arena by size of its chunks. Polls are the same as in bench_pl(), so
+    topics are about 40 bytes long.
+
+    Next to it, the same polls are put in the old list, where every poll
+    was a node allocated on its own, with topic copied with strdup(), and
+    that's counted by what malloc() really takes for each of them.
+   ========================================================================== */
+static void bench_pl_mem(void)
+{
+    static const int       counts[] = { 100000, 1000000 };
+    struct m2md_pl_list    pl;
+    struct m2md_pl_data    data;
+    struct m2md_pl_chunk  *chunk;
+    struct bench_pl_node  *head;
+    struct bench_pl_node  *node;
+    char                   topic[64];
+    size_t                 arrays;
+    size_t                 index;
+    size_t                 arena;
+    size_t                 hot;
+    size_t                 old;
+    int                    n;
+    int                    i;
+    int                    c;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    printf("pl_mem: memory of poll list, bytes per poll\n");
+    printf("%10s %8s %8s %8s %8s %8s %8s\n", "polls", "total", "arrays",
+            "index", "topics", "timers", "old");
+
+    for (c = 0; c != sizeof(counts) / sizeof(*counts); ++c)
+    {
+        n = counts[c];
+        m2md_pl_init(&pl);
+
+        for (i = 0; i != n; ++i)
+        {
+            bench_pl_data(&data, topic, i);
+            m2md_pl_add(&pl, &data);
+        }
+
+        /* last values are there only when some poll has
+         * deadband, none of these has */
+        arrays = pl.size * (sizeof(*pl.data) + sizeof(*pl.next_read) +
+                sizeof(*pl.exc) + sizeof(*pl.rp_slot) +
+                (pl.last ? sizeof(*pl.last) : 0));
+        index = ((size_t)1 << pl.bits) * sizeof(*pl.index);
+        hot = pl.size * sizeof(*pl.next_read);
+
+        arena = 0;
+        for (chunk = pl.chunks; chunk != NULL; chunk = chunk->next)
+            arena += sizeof(*chunk) + chunk->size;
+
+        m2md_pl_destroy(&pl);
+
+        /* now the same with old list, new nodes were put
+         * in front of it, as that's the cheapest */
+        head = NULL;
+        old = 0;
+        for (i = 0; i != n; ++i)
+        {
+            bench_pl_data(&data, topic, i);
+            if ((node = malloc(sizeof(*node))) == NULL ||
+                    (node->topic = strdup(topic)) == NULL)
+            {
+                free(node);
+                break;
+            }
+
+            node->func = data.func;
+            node->reg = data.reg;
+            node->uid = data.uid;
+            node->poll_time = data.poll_time;
+            node->next = head;
+            head = node;
+            old += bench_malloc_size(sizeof(*node)) +
+                bench_malloc_size(strlen(topic) + 1);
+        }
+
+        for (; head != NULL; head = node)
+        {
+            node = head->next;
+            free(head->topic);
+            free(head);
+        }
+
+        /* timers is what scan of due polls walks through,
+         * it's part of arrays, not on top of them */
+        printf("%10d %8zu %8zu %8zu %8zu %8zu %8zu\n", n,
+                (arrays + index + arena) / n, arrays / n, index / n,
+                arena / n, hot / n, old / n);
+    }
+}
+
+
+/* ==========================================================================
+    Compares batch decoder, with whatever kernel it was built with,
+    against decoding one register at a time, the way each poll would be
+    decoded on its own. Block is the largest single read can return,
+    and every register in it is a 16bit poll.
+   ========================================================================== */
+static void bench_decode(void)
+{
+    struct m2md_decode16   d;
+    struct m2md_pl_data    polls[125];
+    float                  scale[125];
+    uint16_t               sign[125];
+    uint16_t               swap[125];
+    uint16_t               regs[125];
+    float                  out[125];
+    uint16_t               r;
+    int64_t                start;
+    int64_t                batch_ns;
+    int64_t                scalar_ns;
+    int                    rounds;
+    int                    k;
+    int                    i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    d.scale = scale;
+    d.sign = sign;
+    d.swap = swap;
+
+    srand(1);
+    memset(polls, 0x00, sizeof(polls));
+    for (i = 0; i != 125; ++i)
+    {
+        polls[i].type = M2MD_PL_TYPE_I16;
+        polls[i].scale = (float)(rand() % 100 + 1) / 10;
+        polls[i].is_signed = rand() & 1;
+        polls[i].order = rand() & 1 ? M2MD_PL_ORDER_BADC : 0;
+        m2md_decode_set16(&d, i, &polls[i]);
+        regs[i] = rand() & 0xffff;
+    }
+
+    rounds = 1000000;
+
+    start = bench_now();
+    for (k = 0; k != rounds; ++k)
+    {
+        regs[0] = k;
+        m2md_decode_block16(&d, regs, 125, out);
+        g_sink += out[k % 125];
+    }
+    batch_ns = bench_now() - start;
+
+    start = bench_now();
+    for (k = 0; k != rounds; ++k)
+    {
+        regs[0] = k;
+        for (i = 0; i != 125; ++i)
+        {
+            r = regs[i];
+            if (polls[i].order & M2MD_PL_ORDER_BADC)
+                r = (uint16_t)(r >> 8 | r << 8);
+
+            if (polls[i].is_signed)
+                out[i] = (int16_t)r * polls[i].scale;
+            else
+                out[i] = r * polls[i].scale;
+        }
+        g_sink += out[k % 125];
+    }
+    scalar_ns = bench_now() - start;
+
+    printf("decode: %d blocks of 125 registers, kernel %s\n", rounds,
+            m2md_decode_kernel());
+    printf("%10s %12s %12s\n", "decoder", "ns/block", "ns/reg");
+    printf("%10s %12.1f %12.3f\n", "batch", (double)batch_ns / rounds,
+            (double)batch_ns / rounds / 125);
+    printf("%10s %12.1f %12.3f\n", "per-reg", (double)scalar_ns / rounds,
+            (double)scalar_ns / rounds / 125);
+}
+
+
+/* ==========================================================================
+    Measures how long encoding single value takes, for every encoding,
+    with values that registers usually hold, whole numbers and scaled
+    floats.
+   ========================================================================== */
+static void bench_encode(void)
+{
+    static const char     *names[] = { "raw", "text", "json", "cbor",
+        "binary" };
+    static const char     *kinds[] = { "f32", "f64", "i64" };
+    struct timespec        ts;
+    const void            *out;
+    float                  f[1024];
+    double                 d[1024];
+    int64_t                v[1024];
+    const void            *value;
+    int64_t                start;
+    int64_t                took;
+    int                    rounds;
+    int                    size;
+    int                    enc;
+    int                    kind;
+    int                    i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    srand(1);
+    for (i = 0; i != 1024; ++i)
+    {
+        v[i] = rand() % 65536 - 32768;
+        f[i] = i % 2 ? v[i] : v[i] * 0.1f;
+        d[i] = i % 2 ? v[i] : v[i] * 0.01;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    rounds = 1000000;
+
+    printf("encode: %d values of each kind\n", rounds);
+    printf("%10s %8s %10s\n", "encoding", "kind", "ns/value");
+
+    for (enc = M2MD_ENC_RAW; enc <= M2MD_ENC_BINARY; ++enc)
+        for (kind = 0; kind != 3; ++kind)
+        {
+            start = bench_now();
+            for (i = 0; i != rounds; ++i)
+            {
+                if (kind == 0)
+                {
+                    value = &f[i & 1023];
+                    size = sizeof(*f);
+                }
+                else if (kind == 1)
+                {
+                    value = &d[i & 1023];
+                    size = sizeof(*d);
+                }
+                else
+                {
+                    value = &v[i & 1023];
+                    size = sizeof(*v);
+                }
+
+                g_sink += m2md_enc_encode(enc, kind == 0 ? M2MD_ENC_KIND_F32
+                        : kind == 1 ? M2MD_ENC_KIND_F64 : M2MD_ENC_KIND_I64,
+                        value, size, &ts, &out);
+            }
+            took = bench_now() - start;
+
+            printf("%10s %8s %10.1f\n", names[enc], kinds[kind],
+                    (double)took / rounds);
+        }
+}
+
+
+/* ==========================================================================
+    Serves read requests of all simulated servers, each request gets
+    response with BENCH_REGS registers of zeros.
+   ========================================================================== */
+static void *bench_sim_thread
+(
+    void                   *arg
+)
+{
+    struct bench_sim       *sim = arg;
+    struct bench_sim_conn  *conns;
+    struct bench_sim_conn  *c;
+    struct epoll_event      events[256];
+    struct epoll_event      ev;
+    struct rlimit           lim;
+    unsigned char           rsp[9 + 2 * BENCH_REGS];
+    ssize_t                 r;
+    int                     n;
+    int                     fd;
+    int                     i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    getrlimit(RLIMIT_NOFILE, &lim);
+    conns = calloc(lim.rlim_cur, sizeof(*conns));
+    memset(rsp, 0x00, sizeof(rsp));
+
+    while (!sim->stop)
+    {
+        n = epoll_wait(sim->efd, events, 256, 100);
+        for (i = 0; i < n; ++i)
+        {
+            fd = events[i].data.fd;
+            if (fd == sim->lfd)
+            {
+                while ((fd = accept(sim->lfd, NULL, NULL)) >= 0)
+                {
+                    conns[fd].len = 0;
+                    ev.events = EPOLLIN;
+                    ev.data.fd = fd;
+                    epoll_ctl(sim->efd, EPOLL_CTL_ADD, fd, &ev);
+                }
+
+                continue;
+            }
+
+            c = &conns[fd];
+            r = recv(fd, c->buf + c->len, sizeof(c->buf) - c->len, 0);
+            if (r <= 0)
+            {
+                epoll_ctl(sim->efd, EPOLL_CTL_DEL, fd, NULL);
+                close(fd);
+                continue;
+            }
+
+            /* answer every complete request, echoing its
+             * transaction id, unit id and function */
+            for (c->len += r; c->len >= M2MD_MBTCP_REQ_SIZE;)
+            {
+                memcpy(rsp, c->buf, 2);
+                rsp[5] = 3 + 2 * BENCH_REGS;
+                rsp[6] = c->buf[6];
+                rsp[7] = c->buf[7];
+                rsp[8] = 2 * BENCH_REGS;
+                send(fd, rsp, sizeof(rsp), MSG_NOSIGNAL);
+
+                c->len -= M2MD_MBTCP_REQ_SIZE;
+                memmove(c->buf, c->buf + M2MD_MBTCP_REQ_SIZE, c->len);
+            }
+        }
+    }
+
+    free(conns);
+    return NULL;
+}
+
+
+/* ==========================================================================
+    Starts simulated servers on loopback.
+   ========================================================================== */
+static int bench_sim_start
+(
+    struct bench_sim    *sim
+)
+{
+    struct sockaddr_in   addr;
+    struct epoll_event   ev;
+    socklen_t            len;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    memset(&addr, 0x00, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    len = sizeof(addr);
+
+    sim->stop = 0;
+    sim->lfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (sim->lfd < 0 ||
+            bind(sim->lfd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+            listen(sim->lfd, 4096) != 0 ||
+            getsockname(sim->lfd, (struct sockaddr *)&addr, &len) != 0)
+        return -1;
+
+    sim->port = ntohs(addr.sin_port);
+    sim->efd = epoll_create1(0);
+    ev.events = EPOLLIN;
+    ev.data.fd = sim->lfd;
+    epoll_ctl(sim->efd, EPOLL_CTL_ADD, sim->lfd, &ev);
+
+    return pthread_create(&sim->t, NULL, bench_sim_thread, sim) ? -1 : 0;
+}
+
+
+/* ==========================================================================
+    Stops simulated servers, connections clients left open are closed.
+   ========================================================================== */
+static void bench_sim_stop
+(
+    struct bench_sim  *sim
+)
+{
+    sim->stop = 1;
+    pthread_join(sim->t, NULL);
+    close(sim->efd);
+    close(sim->lfd);
+}
+
+
+/* ==========================================================================
+    Client of thread engine, it's what each server thread does, blocks
+    on request until response comes back.
+   ========================================================================== */
+static void *bench_thread_client
+(
+    void                *arg
+)
+{
+    struct sockaddr_in   addr;
+    unsigned char        req[M2MD_MBTCP_REQ_SIZE];
+    unsigned char        rsp[9 + 2 * BENCH_REGS];
+    size_t               got;
+    ssize_t              r;
+    int                  fd;
+    int                  i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    memset(&addr, 0x00, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(*(int *)arg);
+
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        return NULL;
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    /* read BENCH_REGS holding registers from unit 1 */
+    memset(req, 0x00, sizeof(req));
+    req[5] = 6;
+    req[6] = 1;
+    req[7] = 3;
+    req[11] = BENCH_REGS;
+
+    for (i = 0; i != g_rounds; ++i)
+    {
+        req[1] = i & 0xff;
+        if (send(fd, req, sizeof(req), MSG_NOSIGNAL) != sizeof(req))
+            break;
+
+        for (got = 0; got != sizeof(rsp); got += r)
+            if ((r = recv(fd, rsp + got, sizeof(rsp) - got, 0)) <= 0)
+                break;
+
+        if (got != sizeof(rsp))
+            break;
+
+        g_sink += rsp[1];
+    }
+
+    close(fd);
+    return NULL;
+}
+
+
+/* ==========================================================================
+    Thread engine, 'n' servers, each with its own thread.
+   ========================================================================== */
+static int bench_engine_thread
+(
+    struct bench_sim  *sim,
+    int                n
+)
+{
+    pthread_attr_t     attr;
+    pthread_t         *threads;
+    int                i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    if ((threads = malloc(n * sizeof(*threads))) == NULL)
+        return -1;
+
+    /* small stacks, or thousands of threads would not fit */
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, 64 * 1024);
+
+    for (i = 0; i != n; ++i)
+        if (pthread_create(&threads[i], &attr, bench_thread_client,
+                    &sim->port) != 0)
+            break;
+
+    n = i;
+    for (i = 0; i != n; ++i)
+        pthread_join(threads[i], NULL);
+
+    pthread_attr_destroy(&attr);
+    free(threads);
+    return n;
+}
+
+
+/* ==========================================================================
+    Epoll engine, 'n' servers, all driven by single thread over non
+    blocking connections, with m2md's own framing.
+   ========================================================================== */
+static int bench_engine_epoll
+(
+    struct bench_sim    *sim,
+    int                  n
+)
+{
+    struct m2md_mbtcp   *conns;
+    struct m2md_mbtcp   *c;
+    struct epoll_event   events[256];
+    struct epoll_event   ev;
+    uint16_t             regs[BENCH_REGS];
+    int                 *sent;
+    int                  active;
+    int                  efd;
+    int                  slot;
+    int                  ret;
+    int                  nev;
+    int                  i;
+    int                  j;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    conns = malloc(n * sizeof(*conns));
+    sent = calloc(n, sizeof(*sent));
+    if (conns == NULL || sent == NULL || (efd = epoll_create1(0)) < 0)
+    {
+        free(conns);
+        free(sent);
+        return -1;
+    }
+
+    active = 0;
+    for (i = 0; i != n; ++i)
+    {
+        m2md_mbtcp_init(&conns[i]);
+        if (m2md_mbtcp_connect(&conns[i], "127.0.0.1", sim->port) < 0)
+            continue;
+
+        ev.events = EPOLLOUT;
+        ev.data.u32 = i;
+        epoll_ctl(efd, EPOLL_CTL_ADD, conns[i].fd, &ev);
+        ++active;
+    }
+
+    while (active)
+    {
+        nev = epoll_wait(efd, events, 256, 1000);
+        for (j = 0; j < nev; ++j)
+        {
+            i = events[j].data.u32;
+            c = &conns[i];
+
+            if (c->state == M2MD_MBTCP_CONNECTING)
+            {
+                if (m2md_mbtcp_finish_connect(c) != 0)
+                    goto drop;
+
+                ev.events = EPOLLIN;
+                ev.data.u32 = i;
+                epoll_ctl(efd, EPOLL_CTL_MOD, c->fd, &ev);
+            }
+            else if ((ret = m2md_mbtcp_recv(c, regs, &slot)) == 1)
+                continue;
+            else if (ret != 0)
+                goto drop;
+            else
+                g_sink += regs[0];
+
+            if (sent[i] == g_rounds)
+                goto drop;
+
+            /* window of 1, just like server thread
+             * does, it's the engine that's measured */
+            m2md_mbtcp_send_read(c, 1, 3, 0, BENCH_REGS);
+            if (m2md_mbtcp_flush(c) < 0)
+                goto drop;
+
+            sent[i]++;
+            continue;
+
+        drop:
+            m2md_mbtcp_close(c);
+            --active;
+        }
+    }
+
+    close(efd);
+    free(conns);
+    free(sent);
+    return n;
+}
+
+
+/* ==========================================================================
+    Compares thread engine with epoll engine, against number of servers.
+    Both read the same number of requests in total, from simulated
+    servers on loopback, which are served by single thread, so that's
+    the same in both cases. Context switches are of whole process.
+   ========================================================================== */
+static void bench_engines(void)
+{
+    static const int   counts[] = { 10, 100, 1000, 5000 };
+    static const char *names[] = { "thread", "epoll" };
+    struct bench_sim   sim;
+    struct rlimit      lim;
+    struct rusage      ru0;
+    struct rusage      ru1;
+    int64_t            start;
+    int64_t            took;
+    long               csw;
+    int                threads;
+    int                total;
+    int                n;
+    int                c;
+    int                e;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    /* every server takes two descriptors, ours and simulator's */
+    getrlimit(RLIMIT_NOFILE, &lim);
+    lim.rlim_cur = lim.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &lim);
+
+    total = 100000;
+    printf("engines: %d reads of %d registers in total\n", total,
+            BENCH_REGS);
+    printf("%10s %8s %8s %10s %12s %10s\n", "servers", "engine",
+            "threads", "ms", "reads/s", "csw/read");
+
+    for (c = 0; c != sizeof(counts) / sizeof(*counts); ++c)
+    {
+        n = counts[c];
+        g_rounds = total / n;
+
+        if ((rlim_t)n * 2 + 16 > lim.rlim_cur)
+        {
+            printf("%10d skipped, open files limit is %lu\n", n,
+                    (unsigned long)lim.rlim_cur);
+            continue;
+        }
+
+        for (e = 0; e != 2; ++e)
+        {
+            if (bench_sim_start(&sim) != 0)
+            {
+                perror("simulated servers");
+                return;
+            }
+
+            getrusage(RUSAGE_SELF, &ru0);
+            start = bench_now();
+            if (e == 0)
+                bench_engine_thread(&sim, n);
+            else
+                bench_engine_epoll(&sim, n);
+            took = bench_now() - start;
+            getrusage(RUSAGE_SELF, &ru1);
+            bench_sim_stop(&sim);
+
+            csw = (ru1.ru_nvcsw - ru0.ru_nvcsw) +
+                (ru1.ru_nivcsw - ru0.ru_nivcsw);
+            threads = e == 0 ? n : 1;
+
+            printf("%10d %8s %8d %10lld %12lld %10.2f\n", n, names[e],
+                    threads, (long long)(took / 1000000),
+                    (long long)((int64_t)n * g_rounds * 1000000000 / took),
+                    (double)csw / ((double)n * g_rounds));
+        }
+    }
+}
+
+
+/* ==========================================================================
+                       __     __ _          ____
+        ____   __  __ / /_   / /(_)_____   / __/__  __ ____   _____ _____
+       / __ \ / / / // __ \ / // // ___/  / /_ / / / // __ \ / ___// ___/
+      / /_/ // /_/ // /_/ // // // /__   / __// /_/ // / / // /__ (__  )
+     / .___/ \__,_//_.___//_//_/ \___/  /_/   \__,_//_/ /_/ \___//____/
+    /_/
+   ========================================================================== */
+
+
+int main
+(
+    int    argc,
+    char  *argv[]
+)
+{
+    static const struct bench  benches[] =
+    {
+        { "sched",  bench_sched },
+        { "pl",     bench_pl },
+        { "pl_mem", bench_pl_mem },
+        { "decode", bench_decode },
+        { "encode", bench_encode },
+        { "engines", bench_engines }
+    };
+
+    size_t                     i;
+    int                        ran;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    ran = 0;
+    for (i = 0; i != sizeof(benches) / sizeof(*benches); ++i)
+    {
+        if (argc > 1 && strcmp(argv[1], benches[i].name) != 0)
+            continue;
+
+        benches[i].run();
+        printf("\n");
+        ran = 1;
+    }
+
+    if (ran == 0)
+    {
+        fprintf(stderr, "unknown benchmark %s\n", argv[1]);
+        return 1;
+    }
+
+    return 0;
+}
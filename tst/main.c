@@ -4,6 +4,7 @@
    ========================================================================== */
 
 #include "mtest.h"
+#include "test-group-list.h"
 
 #include <embedlog.h>
 
@@ -16,6 +17,21 @@ int main(void)
     el_option(EL_COLORS, 1);
     el_option(EL_FINFO, 1);
 
+    m2md_sched_test_group();
+    m2md_pl_test_group();
+    m2md_rp_test_group();
+    m2md_decode_test_group();
+    m2md_enc_test_group();
+    m2md_pub_test_group();
+    m2md_rtu_test_group();
+    m2md_timing_test_group();
+    m2md_mbtcp_test_group();
+    m2md_wq_test_group();
+    m2md_breaker_test_group();
+    m2md_batch_test_group();
+    m2md_topic_test_group();
+    m2md_spool_test_group();
+
     el_cleanup();
     mt_return();
 }
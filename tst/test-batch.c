@@ -0,0 +1,370 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+          _               __            __         ____ _  __
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+
+   ========================================================================== */
+
+
+#include "mtest.h"
+#include "batch.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+
+/* ==========================================================================
+          __             __                     __   _
+     ____/ /___   _____ / /____ _ _____ ____ _ / /_ (_)____   ____   _____
+    / __  // _ \ / ___// // __ `// ___// __ `// __// // __ \ / __ \ / ___/
+   / /_/ //  __// /__ / // /_/ // /   / /_/ // /_ / // /_/ // / / /(__  )
+   \__,_/ \___/ \___//_/ \__,_//_/    \__,_/ \__//_/ \____//_/ /_//____/
+
+   ========================================================================== */
+
+
+mt_defs_ext();
+static struct m2md_batch  batch;
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ========================================================================== */
+
+
+/* ==========================================================================
+    Returns timespec of 'sec' seconds and 'us' microseconds.
+   ========================================================================== */
+static struct timespec ts
+(
+    long             sec,  /* seconds */
+    long             us    /* microseconds */
+)
+{
+    struct timespec  t;    /* built time */
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    t.tv_sec = sec + us / 1000000;
+    t.tv_nsec = us % 1000000 * 1000;
+    return t;
+}
+
+
+/* ==========================================================================
+    Returns 'size' bytes long field at 'off' of batch buffer.
+   ========================================================================== */
+static uint64_t field
+(
+    size_t    off,  /* offset of field */
+    size_t    size  /* size of field */
+)
+{
+    uint64_t  v8;
+    uint32_t  v4;
+    uint16_t  v2;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    if (size == 8)
+        return memcpy(&v8, batch.buf + off, size), v8;
+    if (size == 4)
+        return memcpy(&v4, batch.buf + off, size), v4;
+    if (size == 2)
+        return memcpy(&v2, batch.buf + off, size), v2;
+
+    return batch.buf[off];
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void test_prepare(void)
+{
+    m2md_batch_init(&batch, 128);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void test_cleanup(void)
+{
+    m2md_batch_destroy(&batch);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void batch_init_einval(void)
+{
+    struct m2md_batch  b;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    /* batch must take at least one record */
+    mt_ferr(m2md_batch_init(&b, M2MD_BATCH_HDR_SIZE), EINVAL);
+    mt_ferr(m2md_batch_init(&b,
+                M2MD_BATCH_HDR_SIZE + M2MD_BATCH_REC_SIZE), EINVAL);
+    mt_ferr(m2md_batch_init(NULL, 128), EINVAL);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void batch_header(void)
+{
+    struct timespec  now;
+    struct timespec  real;
+    uint16_t         value;
+    int64_t          base;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    mt_fail(batch.count == 0 && batch.len == 0);
+
+    /* record taken a second ago sets base a second back */
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    now.tv_sec -= 1;
+    value = 0x1234;
+    mt_fok(m2md_batch_add(&batch, 7, &now, &value, sizeof(value)));
+    clock_gettime(CLOCK_REALTIME, &real);
+
+    mt_fail(field(0, 2) == M2MD_BATCH_MAGIC);
+    mt_fail(field(2, 1) == M2MD_BATCH_VERSION);
+    mt_fail(field(3, 1) == 0);
+    mt_fail(field(4, 2) == 1);
+    mt_fail(field(6, 2) == 0);
+
+    base = field(8, 8);
+    base -= (int64_t)real.tv_sec * 1000000 + real.tv_nsec / 1000;
+    mt_fail(base <= -1000000 && base > -1100000);
+
+    /* first record is where base is */
+    mt_fail(field(16, 4) == 7);
+    mt_fail(field(20, 4) == 0);
+    mt_fail(field(24, 2) == sizeof(value));
+    mt_fail(field(26, 2) == 0x1234);
+    mt_fail(batch.len == M2MD_BATCH_HDR_SIZE + M2MD_BATCH_REC_SIZE + 2);
+    mt_fail(batch.count == 1);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void batch_records(void)
+{
+    unsigned char  value[5] = { 1, 2, 3, 4, 5 };
+    uint32_t       v32;
+    size_t         off;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    mt_fok(m2md_batch_add(&batch, 1, &(struct timespec){ 100, 0 },
+                value, 1));
+    v32 = 0xdeadbeef;
+    mt_fok(m2md_batch_add(&batch, 2, &(struct timespec){ 100, 1500000 },
+                &v32, sizeof(v32)));
+    mt_fok(m2md_batch_add(&batch, 3, &(struct timespec){ 102, 999 },
+                value, 0));
+    mt_fok(m2md_batch_add(&batch, 4, &(struct timespec){ 102, 1000 },
+                value, sizeof(value)));
+
+    /* records follow one another, each with its own size */
+    mt_fail(field(4, 2) == 4);
+    off = M2MD_BATCH_HDR_SIZE;
+    mt_fail(field(off, 4) == 1 && field(off + 4, 4) == 0);
+    mt_fail(field(off + 8, 2) == 1 && field(off + 10, 1) == 1);
+
+    off += M2MD_BATCH_REC_SIZE + 1;
+    mt_fail(field(off, 4) == 2 && field(off + 4, 4) == 1500);
+    mt_fail(field(off + 8, 2) == 4 && field(off + 10, 4) == 0xdeadbeef);
+
+    /* offset is in whole microseconds */
+    off += M2MD_BATCH_REC_SIZE + 4;
+    mt_fail(field(off, 4) == 3 && field(off + 4, 4) == 2000000);
+    mt_fail(field(off + 8, 2) == 0);
+
+    off += M2MD_BATCH_REC_SIZE;
+    mt_fail(field(off, 4) == 4 && field(off + 4, 4) == 2000001);
+    mt_fail(field(off + 8, 2) == 5);
+    mt_fail(memcmp(batch.buf + off + 10, value, sizeof(value)) == 0);
+    mt_fail(batch.len == off + M2MD_BATCH_REC_SIZE + sizeof(value));
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void batch_full(void)
+{
+    unsigned char    v[7];
+    int              n;
+    size_t           len;
+    struct timespec  at;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    at = ts(10, 0);
+    memset(v, 0x00, sizeof(v));
+    for (n = 0; m2md_batch_add(&batch, n, &at, v, sizeof(v)) == 0; ++n)
+        mt_assert(batch.len <= batch.size);
+
+    /* (128 - 16) / 17 */
+    mt_fail(n == 6);
+    mt_fail(errno == ENOSPC);
+    mt_fail(batch.count == 6);
+    mt_fail(field(4, 2) == 6);
+
+    /* record that didn't fit left batch as it was */
+    len = batch.len;
+    mt_ferr(m2md_batch_add(&batch, 99, &at, v, sizeof(v)), ENOSPC);
+    mt_fail(batch.len == len);
+
+    /* but record without value still fits */
+    mt_fok(m2md_batch_add(&batch, 99, &at, v, 0));
+    mt_fail(batch.len == batch.size);
+
+    /* and after batch is sent, it takes records again,
+     * with fresh header */
+    m2md_batch_reset(&batch);
+    mt_fok(m2md_batch_add(&batch, 5, &at, v, sizeof(v)));
+    mt_fail(field(4, 2) == 1);
+    mt_fail(batch.len == M2MD_BATCH_HDR_SIZE + M2MD_BATCH_REC_SIZE + 7);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void batch_range(void)
+{
+    char  v;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    v = 0;
+    mt_fok(m2md_batch_add(&batch, 1, &(struct timespec){ 100, 0 }, &v, 1));
+
+    /* record cannot go before first one */
+    mt_ferr(m2md_batch_add(&batch, 2, &(struct timespec){ 99, 999999000 },
+                &v, 1), ERANGE);
+
+    /* nor further than dt can hold */
+    mt_fok(m2md_batch_add(&batch, 3, &(struct timespec){ 4394, 967295000 },
+                &v, 1));
+    mt_ferr(m2md_batch_add(&batch, 4, &(struct timespec){ 4394, 967296000 },
+                &v, 1), ERANGE);
+
+    mt_fail(batch.count == 2);
+    mt_fail(field(4, 2) == 2);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void batch_invalid(void)
+{
+    char  v;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    v = 0;
+    mt_ferr(m2md_batch_add(&batch, 1, &(struct timespec){ 0, 0 }, NULL, 1),
+            EINVAL);
+    mt_ferr(m2md_batch_add(&batch, 1, &(struct timespec){ 0, 0 }, &v, -1),
+            EINVAL);
+    mt_ferr(m2md_batch_add(&batch, 1, &(struct timespec){ 0, 0 }, &v,
+                UINT16_MAX + 1), EINVAL);
+
+    /* destroyed batch takes nothing, and can be destroyed again */
+    m2md_batch_destroy(&batch);
+    mt_ferr(m2md_batch_add(&batch, 1, &(struct timespec){ 0, 0 }, &v, 1),
+            ENOSPC);
+    m2md_batch_destroy(&batch);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void batch_due_no_window(void)
+{
+    struct timespec  end;
+    char             v;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    /* empty batch has nothing to publish */
+    mt_fail(m2md_batch_due(&batch, 0, ts(10, 0), &end) == -1);
+
+    /* without window, batch goes out right away */
+    v = 0;
+    mt_fok(m2md_batch_add(&batch, 1, &(struct timespec){ 10, 0 }, &v, 1));
+    mt_fail(m2md_batch_due(&batch, 0, ts(10, 0), &end) == 1);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void batch_due_window(void)
+{
+    struct timespec  end;
+    char             v;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    mt_fail(m2md_batch_due(&batch, 250, ts(10, 0), &end) == -1);
+
+    /* window is counted from first record of batch */
+    v = 0;
+    mt_fok(m2md_batch_add(&batch, 1, &(struct timespec){ 10, 900000000 },
+                &v, 1));
+    mt_fok(m2md_batch_add(&batch, 2, &(struct timespec){ 11, 0 }, &v, 1));
+
+    mt_fail(m2md_batch_due(&batch, 250, ts(11, 0), &end) == 0);
+    mt_fail(end.tv_sec == 11 && end.tv_nsec == 150000000);
+    mt_fail(m2md_batch_due(&batch, 250, ts(11, 149999), &end) == 0);
+    mt_fail(m2md_batch_due(&batch, 250, ts(11, 150000), &end) == 1);
+    mt_fail(m2md_batch_due(&batch, 250, ts(20, 0), &end) == 1);
+
+    /* fresh batch gets fresh window */
+    m2md_batch_reset(&batch);
+    mt_fok(m2md_batch_add(&batch, 1, &(struct timespec){ 20, 0 }, &v, 1));
+    mt_fail(m2md_batch_due(&batch, 250, ts(20, 0), &end) == 0);
+    mt_fail(end.tv_sec == 20 && end.tv_nsec == 250000000);
+}
+
+
+/* ==========================================================================
+                       __     __ _          ____
+        ____   __  __ / /_   / /(_)_____   / __/__  __ ____   _____ _____
+       / __ \ / / / // __ \ / // // ___/  / /_ / / / // __ \ / ___// ___/
+      / /_/ // /_/ // /_/ // // // /__   / __// /_/ // / / // /__ (__  )
+     / .___/ \__,_//_.___//_//_/ \___/  /_/   \__,_//_/ /_/ \___//____/
+    /_/
+   ========================================================================== */
+
+
+void m2md_batch_test_group(void)
+{
+    mt_prepare_test = &test_prepare;
+    mt_cleanup_test = &test_cleanup;
+
+    mt_run(batch_init_einval);
+    mt_run(batch_header);
+    mt_run(batch_records);
+    mt_run(batch_full);
+    mt_run(batch_range);
+    mt_run(batch_invalid);
+    mt_run(batch_due_no_window);
+    mt_run(batch_due_window);
+}
@@ -0,0 +1,327 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+          _               __            __         ____ _  __
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+
+   ========================================================================== */
+
+
+#include "mtest.h"
+#include "breaker.h"
+
+#include <string.h>
+#include <time.h>
+
+
+/* ==========================================================================
+          __             __                     __   _
+     ____/ /___   _____ / /____ _ _____ ____ _ / /_ (_)____   ____   _____
+    / __  // _ \ / ___// // __ `// ___// __ `// __// // __ \ / __ \ / ___/
+   / /_/ //  __// /__ / // /_/ // /   / /_/ // /_ / // /_/ // / / /(__  )
+   \__,_/ \___/ \___//_/ \__,_//_/    \__,_/ \__//_/ \____//_/ /_//____/
+
+   ========================================================================== */
+
+
+mt_defs_ext();
+static struct m2md_breaker       breaker;
+static struct m2md_breaker_conn  pool[3];
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ========================================================================== */
+
+
+/* ==========================================================================
+    Returns timespec of 'sec' seconds and 'ms' milliseconds.
+   ========================================================================== */
+static struct timespec ts
+(
+    int              sec,  /* seconds */
+    int              ms    /* milliseconds */
+)
+{
+    struct timespec  t;    /* built time */
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    t.tv_sec = sec;
+    t.tv_nsec = ms * 1000000l;
+    return t;
+}
+
+
+/* ==========================================================================
+    Probes fresh breaker over first connection, and connects the rest of
+    the pool, so server works with all connections healthy.
+   ========================================================================== */
+static void breaker_closed(void)
+{
+    mt_assert(m2md_breaker_probe(&breaker, ts(0, 0)) == 1);
+    mt_assert(m2md_breaker_result(&breaker, &pool[0], 1) ==
+            M2MD_BREAKER_RESET);
+    m2md_breaker_close(&breaker);
+    m2md_breaker_conn_up(&breaker, &pool[1]);
+    m2md_breaker_conn_up(&breaker, &pool[2]);
+    mt_assert(breaker.nhealthy == 3);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void test_prepare(void)
+{
+    m2md_breaker_init(&breaker, 8, 3);
+    memset(pool, 0x00, sizeof(pool));
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void breaker_init_expired(void)
+{
+    /* fresh server is probed right away, but only once */
+    mt_fail(breaker.state == M2MD_BREAKER_OPEN);
+    mt_fail(breaker.nhealthy == 0);
+    mt_fail(m2md_breaker_expired(&breaker, ts(0, 0)));
+    mt_fail(m2md_breaker_probe(&breaker, ts(0, 0)) == 1);
+    mt_fail(breaker.state == M2MD_BREAKER_HALF_OPEN);
+    mt_fail(m2md_breaker_probe(&breaker, ts(0, 0)) == 0);
+    mt_fail(m2md_breaker_probe(&breaker, ts(1000, 0)) == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void breaker_probe_closes(void)
+{
+    mt_assert(m2md_breaker_probe(&breaker, ts(0, 0)) == 1);
+
+    /* connection probe went over is healthy now */
+    mt_fail(m2md_breaker_result(&breaker, &pool[0], 1) ==
+            M2MD_BREAKER_RESET);
+    mt_fail(pool[0].healthy == 1);
+    mt_fail(breaker.nhealthy == 1);
+
+    m2md_breaker_close(&breaker);
+    mt_fail(breaker.state == M2MD_BREAKER_CLOSED);
+    mt_fail(m2md_breaker_probe(&breaker, ts(1000, 0)) == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void breaker_probe_reopens(void)
+{
+    mt_assert(m2md_breaker_probe(&breaker, ts(10, 0)) == 1);
+
+    /* single failed probe is enough to open breaker
+     * again, no need to wait for more fails */
+    mt_fail(m2md_breaker_result(&breaker, &pool[0], 0) ==
+            M2MD_BREAKER_TRIP);
+    mt_fail(pool[0].healthy == 0);
+    mt_fail(breaker.nhealthy == 0);
+
+    m2md_breaker_open(&breaker, ts(10, 0));
+    mt_fail(breaker.state == M2MD_BREAKER_OPEN);
+    mt_fail(breaker.until.tv_sec == 11 && breaker.until.tv_nsec == 0);
+
+    /* server is left alone until timeout is over */
+    mt_fail(m2md_breaker_probe(&breaker, ts(10, 999)) == 0);
+    mt_fail(breaker.state == M2MD_BREAKER_OPEN);
+    mt_fail(m2md_breaker_probe(&breaker, ts(11, 0)) == 1);
+    mt_fail(breaker.state == M2MD_BREAKER_HALF_OPEN);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void breaker_backoff(void)
+{
+    int  expect[] = { 1, 2, 4, 8, 8, 8 };
+    int  i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    /* each failed probe doubles the wait, up to limit */
+    for (i = 0; i != sizeof(expect) / sizeof(*expect); ++i)
+    {
+        m2md_breaker_open(&breaker, ts(100, 0));
+        mt_fail(breaker.until.tv_sec == 100 + expect[i]);
+    }
+
+    /* server that came back is probed quickly
+     * again, when it goes down next time */
+    m2md_breaker_close(&breaker);
+    m2md_breaker_open(&breaker, ts(100, 0));
+    mt_fail(breaker.until.tv_sec == 101);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void breaker_fails_in_row(void)
+{
+    breaker_closed();
+
+    /* only fails in a row break connection */
+    mt_fail(m2md_breaker_result(&breaker, &pool[0], 0) == M2MD_BREAKER_KEEP);
+    mt_fail(m2md_breaker_result(&breaker, &pool[0], 0) == M2MD_BREAKER_KEEP);
+    mt_fail(m2md_breaker_result(&breaker, &pool[0], 1) == M2MD_BREAKER_KEEP);
+    mt_fail(pool[0].fails == 0);
+    mt_fail(m2md_breaker_result(&breaker, &pool[0], 0) == M2MD_BREAKER_KEEP);
+    mt_fail(m2md_breaker_result(&breaker, &pool[0], 0) == M2MD_BREAKER_KEEP);
+    mt_fail(pool[0].healthy == 1);
+
+    /* other connections still work, breaker stays closed */
+    mt_fail(m2md_breaker_result(&breaker, &pool[0], 0) ==
+            M2MD_BREAKER_BROKEN);
+    mt_fail(pool[0].healthy == 0);
+    mt_fail(pool[0].fails == 0);
+    mt_fail(breaker.nhealthy == 2);
+    mt_fail(breaker.state == M2MD_BREAKER_CLOSED);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void breaker_last_conn_trips(void)
+{
+    int  i;
+    int  c;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    breaker_closed();
+
+    for (c = 0; c != 2; ++c)
+    {
+        for (i = 0; i != 2; ++i)
+            m2md_breaker_result(&breaker, &pool[c], 0);
+
+        mt_fail(m2md_breaker_result(&breaker, &pool[c], 0) ==
+                M2MD_BREAKER_BROKEN);
+        mt_fail(breaker.nhealthy == 2 - c);
+    }
+
+    /* last working connection takes whole server down */
+    for (i = 0; i != 2; ++i)
+        m2md_breaker_result(&breaker, &pool[2], 0);
+
+    mt_fail(m2md_breaker_result(&breaker, &pool[2], 0) ==
+            M2MD_BREAKER_TRIP);
+    mt_fail(breaker.nhealthy == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void breaker_open_ignores_reads(void)
+{
+    breaker_closed();
+    m2md_breaker_open(&breaker, ts(5, 0));
+
+    /* reads queued before breaker opened don't
+     * decide anything, probe does */
+    mt_fail(m2md_breaker_result(&breaker, &pool[1], 1) == M2MD_BREAKER_KEEP);
+    mt_fail(m2md_breaker_result(&breaker, &pool[1], 0) == M2MD_BREAKER_KEEP);
+    mt_fail(m2md_breaker_result(&breaker, &pool[1], 0) == M2MD_BREAKER_KEEP);
+    mt_fail(m2md_breaker_result(&breaker, &pool[1], 0) == M2MD_BREAKER_KEEP);
+    mt_fail(pool[1].fails == 0);
+    mt_fail(breaker.state == M2MD_BREAKER_OPEN);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void breaker_probe_not_queued(void)
+{
+    breaker_closed();
+    m2md_breaker_open(&breaker, ts(20, 0));
+    mt_assert(m2md_breaker_probe(&breaker, ts(21, 0)) == 1);
+
+    /* probe could not be sent, breaker is opened again,
+     * so server is probed later instead of waiting for
+     * result of probe that never went out */
+    m2md_breaker_open(&breaker, ts(21, 0));
+    mt_fail(breaker.state == M2MD_BREAKER_OPEN);
+    mt_fail(breaker.until.tv_sec == 23);
+    mt_fail(m2md_breaker_probe(&breaker, ts(22, 0)) == 0);
+    mt_fail(m2md_breaker_probe(&breaker, ts(23, 0)) == 1);
+
+    /* and that probe closes it as usual */
+    mt_fail(m2md_breaker_result(&breaker, &pool[1], 1) ==
+            M2MD_BREAKER_RESET);
+    m2md_breaker_close(&breaker);
+    mt_fail(breaker.state == M2MD_BREAKER_CLOSED);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void breaker_pool_counting(void)
+{
+    /* connection is counted once, no matter
+     * how many times it's reported */
+    m2md_breaker_conn_up(&breaker, &pool[0]);
+    m2md_breaker_conn_up(&breaker, &pool[0]);
+    mt_fail(breaker.nhealthy == 1);
+
+    m2md_breaker_conn_up(&breaker, &pool[1]);
+    m2md_breaker_conn_up(&breaker, &pool[2]);
+    mt_fail(breaker.nhealthy == 3);
+
+    m2md_breaker_conn_down(&breaker, &pool[1]);
+    m2md_breaker_conn_down(&breaker, &pool[1]);
+    mt_fail(breaker.nhealthy == 2);
+    mt_fail(pool[1].healthy == 0);
+
+    /* reconnected connection starts with clean record */
+    pool[1].fails = 2;
+    m2md_breaker_conn_up(&breaker, &pool[1]);
+    mt_fail(pool[1].fails == 0);
+    mt_fail(breaker.nhealthy == 3);
+
+    m2md_breaker_conn_down(&breaker, &pool[0]);
+    m2md_breaker_conn_down(&breaker, &pool[1]);
+    m2md_breaker_conn_down(&breaker, &pool[2]);
+    mt_fail(breaker.nhealthy == 0);
+}
+
+
+/* ==========================================================================
+                       __     __ _          ____
+        ____   __  __ / /_   / /(_)_____   / __/__  __ ____   _____ _____
+       / __ \ / / / // __ \ / // // ___/  / /_ / / / // __ \ / ___// ___/
+      / /_/ // /_/ // /_/ // // // /__   / __// /_/ // / / // /__ (__  )
+     / .___/ \__,_//_.___//_//_/ \___/  /_/   \__,_//_/ /_/ \___//____/
+    /_/
+   ========================================================================== */
+
+
+void m2md_breaker_test_group(void)
+{
+    mt_prepare_test = &test_prepare;
+    mt_cleanup_test = NULL;
+
+    mt_run(breaker_init_expired);
+    mt_run(breaker_probe_closes);
+    mt_run(breaker_probe_reopens);
+    mt_run(breaker_backoff);
+    mt_run(breaker_fails_in_row);
+    mt_run(breaker_last_conn_trips);
+    mt_run(breaker_open_ignores_reads);
+    mt_run(breaker_probe_not_queued);
+    mt_run(breaker_pool_counting);
+}
@@ -0,0 +1,499 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+          _               __            __         ____ _  __
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+
+   ========================================================================== */
+
+
+
+#include "mtest.h"
+#include "decode.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/* ==========================================================================
+          __             __                     __   _
+     ____/ /___   _____ / /____ _ _____ ____ _ / /_ (_)____   ____   _____
+    / __  // _ \ / ___// // __ `// ___// __ `// __// // __ \ / __ \ / ___/
+   / /_/ //  __// /__ / // /_/ // /   / /_/ // /_ / // /_/ // / / /(__  )
+   \__,_/ \___/ \___//_/ \__,_//_/    \__,_/ \__//_/ \____//_/ /_//____/
+
+   ========================================================================== */
+
+
+/* largest number of registers single read can return */
+#define NREGS 125
+
+mt_defs_ext();
+static float     scale[NREGS];
+static uint16_t  sign[NREGS];
+static uint16_t  swap[NREGS];
+static struct m2md_decode16  dec = { scale, sign, swap };
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ========================================================================== */
+
+
+/* ==========================================================================
+    Decodes single register 'i' the long way, one thing at a time, this
+    is what batch decoder must agree with.
+   ========================================================================== */
+static float decode_ref
+(
+    const uint16_t  *regs,
+    int              i
+)
+{
+    uint16_t         r;
+    int32_t          v;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    r = regs[i];
+    if (swap[i])
+        r = (uint16_t)(r >> 8 | r << 8);
+
+    v = sign[i] ? (int16_t)r : r;
+    return v * scale[i];
+}
+
+
+/* ==========================================================================
+    Fills registers and decoder parameters with random data.
+   ========================================================================== */
+static void fill_random
+(
+    uint16_t  *regs,
+    int        n
+)
+{
+    int        i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    for (i = 0; i != n; ++i)
+    {
+        regs[i] = rand() & 0xffff;
+        sign[i] = rand() & 1 ? 0x8000 : 0;
+        swap[i] = rand() & 1 ? 0xffff : 0;
+
+        /* some registers are not 16bit polls and must decode to 0 */
+        scale[i] = rand() % 4 ? (float)(rand() % 2001 - 1000) / 100 : 0;
+    }
+}
+
+
+/* ==========================================================================
+    Decodes 'n' registers with batch decoder and checks them against
+    reference, 'out' is guarded so write past 'n' is also caught.
+   ========================================================================== */
+static void check_block
+(
+    const uint16_t  *regs,
+    int              n
+)
+{
+    float            out[NREGS + 1];
+    int              i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    for (i = 0; i != NREGS + 1; ++i)
+        out[i] = 1234.5f;
+
+    m2md_decode_block16(&dec, regs, n, out);
+
+    for (i = 0; i != n; ++i)
+        if (out[i] != decode_ref(regs, i))
+            break;
+
+    mt_fail(i == n);
+    mt_fail(out[n] == 1234.5f);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void test_prepare(void)
+{
+    memset(scale, 0x00, sizeof(scale));
+    memset(sign, 0x00, sizeof(sign));
+    memset(swap, 0x00, sizeof(swap));
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void decode_is16(void)
+{
+    struct m2md_pl_data  poll;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    memset(&poll, 0x00, sizeof(poll));
+
+    poll.type = M2MD_PL_TYPE_RAW;
+    poll.field_width = 0;
+    mt_fail(m2md_decode_is16(&poll) == 1);
+    poll.field_width = 1;
+    mt_fail(m2md_decode_is16(&poll) == 1);
+    poll.field_width = 2;
+    mt_fail(m2md_decode_is16(&poll) == 0);
+
+    poll.type = M2MD_PL_TYPE_I16;
+    mt_fail(m2md_decode_is16(&poll) == 1);
+    poll.type = M2MD_PL_TYPE_U16;
+    mt_fail(m2md_decode_is16(&poll) == 1);
+    poll.type = M2MD_PL_TYPE_I32;
+    mt_fail(m2md_decode_is16(&poll) == 0);
+    poll.type = M2MD_PL_TYPE_F32;
+    mt_fail(m2md_decode_is16(&poll) == 0);
+    poll.type = M2MD_PL_TYPE_F64;
+    mt_fail(m2md_decode_is16(&poll) == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void decode_set16(void)
+{
+    struct m2md_pl_data  poll;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    memset(&poll, 0x00, sizeof(poll));
+    poll.type = M2MD_PL_TYPE_I16;
+    poll.scale = 0.25f;
+    poll.is_signed = 1;
+    poll.order = M2MD_PL_ORDER_ABCD;
+    m2md_decode_set16(&dec, 3, &poll);
+    mt_fail(scale[3] == 0.25f);
+    mt_fail(sign[3] == 0x8000);
+    mt_fail(swap[3] == 0);
+
+    /* only byte swap matters, there is one word only */
+    poll.order = M2MD_PL_ORDER_CDAB;
+    m2md_decode_set16(&dec, 4, &poll);
+    mt_fail(swap[4] == 0);
+
+    poll.order = M2MD_PL_ORDER_BADC;
+    poll.is_signed = 0;
+    poll.scale = 7;
+    m2md_decode_set16(&dec, 5, &poll);
+    mt_fail(scale[5] == 7);
+    mt_fail(sign[5] == 0);
+    mt_fail(swap[5] == 0xffff);
+
+    poll.order = M2MD_PL_ORDER_DCBA;
+    m2md_decode_set16(&dec, 6, &poll);
+    mt_fail(swap[6] == 0xffff);
+
+    /* neighbours are left alone */
+    mt_fail(scale[2] == 0);
+    mt_fail(scale[7] == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void decode_limits(void)
+{
+    uint16_t  regs[4] = { 0x8000, 0xffff, 0x7fff, 0x0080 };
+    float     out[4];
+    int       i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    for (i = 0; i != 4; ++i)
+        scale[i] = 1;
+
+    m2md_decode_block16(&dec, regs, 4, out);
+    mt_fail(out[0] == 32768);
+    mt_fail(out[1] == 65535);
+    mt_fail(out[2] == 32767);
+    mt_fail(out[3] == 128);
+
+    for (i = 0; i != 4; ++i)
+        sign[i] = 0x8000;
+
+    m2md_decode_block16(&dec, regs, 4, out);
+    mt_fail(out[0] == -32768);
+    mt_fail(out[1] == -1);
+    mt_fail(out[2] == 32767);
+    mt_fail(out[3] == 128);
+
+    /* 0x0080 swapped is 0x8000 */
+    swap[3] = 0xffff;
+    m2md_decode_block16(&dec, regs, 4, out);
+    mt_fail(out[3] == -32768);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void decode_unused_zero(void)
+{
+    uint16_t  regs[NREGS];
+    float     out[NREGS];
+    int       i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    for (i = 0; i != NREGS; ++i)
+        regs[i] = 0xa5a5;
+
+    m2md_decode_block16(&dec, regs, NREGS, out);
+
+    for (i = 0; i != NREGS; ++i)
+        if (out[i] != 0)
+            break;
+
+    mt_fail(i == NREGS);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void decode_all_sizes(void)
+{
+    uint16_t  regs[NREGS];
+    int       round;
+    int       n;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    /* every size so that simd body, tail and both are covered */
+    srand(1);
+    for (round = 0; round != 20; ++round)
+        for (n = 0; n <= NREGS; ++n)
+        {
+            fill_random(regs, n);
+            check_block(regs, n);
+        }
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void decode_unaligned(void)
+{
+    uint16_t  regs[NREGS + 1];
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    /* registers come straight from network buffer, so they
+     * may not be aligned the way vector loads like them */
+    srand(2);
+    fill_random(regs + 1, NREGS);
+    check_block(regs + 1, NREGS);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void decode_kernel(void)
+{
+    const char  *k;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    k = m2md_decode_kernel();
+    mt_assert(k != NULL);
+    mt_fail(strcmp(k, "avx2") == 0 || strcmp(k, "sse2") == 0 ||
+            strcmp(k, "neon") == 0 || strcmp(k, "scalar") == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void decode_pack_bits_order(void)
+{
+    uint8_t   bits[20];
+    uint16_t  words[3];
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    /* first bit goes to lowest bit of first word, 17th
+     * to lowest of second, anything not 0 is set bit */
+    memset(bits, 0x00, sizeof(bits));
+    bits[0] = 1;
+    bits[3] = 0xff;
+    bits[15] = 1;
+    bits[16] = 1;
+    bits[19] = 1;
+    memset(words, 0xa5, sizeof(words));
+
+    m2md_decode_pack_bits(bits, 20, words);
+    mt_fail(words[0] == 0x8009);
+    mt_fail(words[1] == 0x0009);
+
+    /* only words that hold bits are touched */
+    mt_fail(words[2] == 0xa5a5);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void decode_pack_bits_roundtrip(void)
+{
+    uint8_t   bits[2000];
+    uint8_t   out[2000];
+    uint16_t  words[125];
+    int       n;
+    int       i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    srand(3);
+    for (n = 1; n <= 2000; n += n < 40 ? 1 : 97)
+    {
+        for (i = 0; i != n; ++i)
+            bits[i] = rand() & 1;
+
+        m2md_decode_pack_bits(bits, n, words);
+        m2md_decode_unpack_bits(words, n, out);
+        mt_fail(memcmp(bits, out, n) == 0);
+    }
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void decode_pack_bytes_odd(void)
+{
+    uint8_t   bytes[] = { 0x01, 0x80, 0x5a, 0xc3, 0x7f };
+    uint16_t  words[4];
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    /* first byte goes to lower half of word */
+    memset(words, 0xa5, sizeof(words));
+    m2md_decode_pack_bytes(bytes, 5, words);
+    mt_fail(words[0] == 0x8001);
+    mt_fail(words[1] == 0xc35a);
+
+    /* and last odd byte gets its word alone */
+    mt_fail(words[2] == 0x007f);
+    mt_fail(words[3] == 0xa5a5);
+
+    memset(words, 0xa5, sizeof(words));
+    m2md_decode_pack_bytes(bytes, 1, words);
+    mt_fail(words[0] == 0x0001);
+    mt_fail(words[1] == 0xa5a5);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void decode_pack_bytes_same_as_bits(void)
+{
+    uint8_t   bits[2000];
+    uint8_t   bytes[250];
+    uint16_t  wbits[125];
+    uint16_t  wbytes[125];
+    int       n;
+    int       i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    /* bits read with libmodbus and over raw modbus tcp
+     * must end up in registers buffer the same way */
+    srand(4);
+    for (n = 1; n <= 2000; n += n < 40 ? 1 : 89)
+    {
+        memset(bytes, 0x00, sizeof(bytes));
+        for (i = 0; i != n; ++i)
+        {
+            bits[i] = rand() & 1;
+            bytes[i / 8] |= bits[i] << (i & 7);
+        }
+
+        m2md_decode_pack_bits(bits, n, wbits);
+        m2md_decode_pack_bytes(bytes, (n + 7) / 8, wbytes);
+        mt_fail(memcmp(wbits, wbytes, (n + 15) / 16 * 2) == 0);
+    }
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void decode_bitmap(void)
+{
+    uint8_t        bits[40];
+    uint16_t       words[3];
+    unsigned char  map[5];
+    int            i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    /* every third bit is set */
+    for (i = 0; i != 40; ++i)
+        bits[i] = i % 3 == 0;
+
+    m2md_decode_pack_bits(bits, 40, words);
+
+    /* poll that starts at first bit is published
+     * just like modbus sent it, lowest bit first */
+    mt_fail(m2md_decode_bitmap(words, 3, 0, 16, map) == 2);
+    mt_fail(map[0] == 0x49);
+    mt_fail(map[1] == 0x92);
+
+    /* poll in the middle of word, that crosses to next one,
+     * bits past its end belong to other polls, and are 0 */
+    memset(map, 0xff, sizeof(map));
+    mt_fail(m2md_decode_bitmap(words, 3, 13, 11, map) == 2);
+    for (i = 0; i != 11; ++i)
+        mt_fail((map[i / 8] >> (i & 7) & 1) == ((13 + i) % 3 == 0));
+    mt_fail((map[1] & 0xf8) == 0);
+    mt_fail(map[2] == 0xff);
+
+    /* poll at the end of last word, nothing is read past it */
+    mt_fail(m2md_decode_bitmap(words, 3, 35, 5, map) == 1);
+    mt_fail(map[0] == 0x12);
+}
+
+
+/* ==========================================================================
+                       __     __ _          ____
+        ____   __  __ / /_   / /(_)_____   / __/__  __ ____   _____ _____
+       / __ \ / / / // __ \ / // // ___/  / /_ / / / // __ \ / ___// ___/
+      / /_/ // /_/ // /_/ // // // /__   / __// /_/ // / / // /__ (__  )
+     / .___/ \__,_//_.___//_//_/ \___/  /_/   \__,_//_/ /_/ \___//____/
+    /_/
+   ========================================================================== */
+
+
+void m2md_decode_test_group(void)
+{
+    mt_prepare_test = &test_prepare;
+    mt_cleanup_test = NULL;
+
+    mt_run(decode_is16);
+    mt_run(decode_set16);
+    mt_run(decode_limits);
+    mt_run(decode_unused_zero);
+    mt_run(decode_all_sizes);
+    mt_run(decode_unaligned);
+    mt_run(decode_kernel);
+    mt_run(decode_pack_bits_order);
+    mt_run(decode_pack_bits_roundtrip);
+    mt_run(decode_pack_bytes_odd);
+    mt_run(decode_pack_bytes_same_as_bits);
+    mt_run(decode_bitmap);
+}
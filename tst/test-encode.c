@@ -0,0 +1,592 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+          _               __            __         ____ _  __
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+
+   ========================================================================== */
+
+
+
+#include "mtest.h"
+#include "encode.h"
+
+#include <errno.h>
+#include <float.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/* ==========================================================================
+          __             __                     __   _
+     ____/ /___   _____ / /____ _ _____ ____ _ / /_ (_)____   ____   _____
+    / __  // _ \ / ___// // __ `// ___// __ `// __// // __ \ / __ \ / ___/
+   / /_/ //  __// /__ / // /_/ // /   / /_/ // /_ / // /_/ // / / /(__  )
+   \__,_/ \___/ \___//_/ \__,_//_/    \__,_/ \__//_/ \____//_/ /_//____/
+
+   ========================================================================== */
+
+
+mt_defs_ext();
+static struct timespec  ts = { 1, 500000000 };
+static char             text[M2MD_ENC_BUF_SIZE + 1];
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ========================================================================== */
+
+
+/* ==========================================================================
+    Encodes 'value' with text or json 'enc' and returns it as nul
+    terminated string, or NULL when encoder failed.
+   ========================================================================== */
+static const char *enc_text
+(
+    int          enc,
+    int          kind,
+    const void  *value,
+    int          size
+)
+{
+    const void  *out;
+    int          n;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    if ((n = m2md_enc_encode(enc, kind, value, size, &ts, &out)) < 0)
+        return NULL;
+
+    memcpy(text, out, n);
+    text[n] = '\0';
+    return text;
+}
+
+
+/* ==========================================================================
+    Checks that 'value' encoded with binary 'enc' is exactly 'expect'
+    of 'n' bytes.
+   ========================================================================== */
+static int enc_bytes
+(
+    int                   enc,
+    int                   kind,
+    const void           *value,
+    int                   size,
+    const unsigned char  *expect,
+    int                   n
+)
+{
+    const void           *out;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    if (m2md_enc_encode(enc, kind, value, size, &ts, &out) != n)
+        return -1;
+
+    return memcmp(out, expect, n) == 0 ? 0 : -1;
+}
+
+
+/* ==========================================================================
+    Returns number of significant digits in decimal 'text', leading and
+    trailing zeros are not significant.
+   ========================================================================== */
+static int digits
+(
+    const char  *text
+)
+{
+    int          n;
+    int          zeros;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    n = 0;
+    zeros = 0;
+    for (; *text && *text != 'e'; ++text)
+    {
+        if (*text < '0' || *text > '9')
+            continue;
+
+        if (*text == '0')
+        {
+            /* zeros count only when followed by other digit */
+            zeros += n != 0;
+            continue;
+        }
+
+        n += zeros + 1;
+        zeros = 0;
+    }
+
+    return n;
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void enc_parse(void)
+{
+    mt_fail(m2md_enc_parse("raw") == M2MD_ENC_RAW);
+    mt_fail(m2md_enc_parse("text") == M2MD_ENC_TEXT);
+    mt_fail(m2md_enc_parse("json") == M2MD_ENC_JSON);
+    mt_fail(m2md_enc_parse("cbor") == M2MD_ENC_CBOR);
+    mt_fail(m2md_enc_parse("binary") == M2MD_ENC_BINARY);
+    mt_fail(m2md_enc_parse("RAW") == -1);
+    mt_fail(m2md_enc_parse("") == -1);
+    mt_fail(m2md_enc_parse("default") == -1);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void enc_einval(void)
+{
+    const void  *out;
+    int64_t      v;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    v = 1;
+    mt_ferr(m2md_enc_encode(M2MD_ENC_TEXT, M2MD_ENC_KIND_I64, NULL, 8,
+                &ts, &out), EINVAL);
+    mt_ferr(m2md_enc_encode(M2MD_ENC_TEXT, M2MD_ENC_KIND_I64, &v, 8,
+                &ts, NULL), EINVAL);
+    mt_ferr(m2md_enc_encode(M2MD_ENC_TEXT, M2MD_ENC_KIND_BITS + 1, &v, 8,
+                &ts, &out), EINVAL);
+    mt_ferr(m2md_enc_encode(M2MD_ENC_TEXT, -1, &v, 8, &ts, &out), EINVAL);
+    mt_ferr(m2md_enc_encode(M2MD_ENC_DEFAULT, M2MD_ENC_KIND_I64, &v, 8,
+                &ts, &out), EINVAL);
+    mt_ferr(m2md_enc_encode(-1, M2MD_ENC_KIND_I64, &v, 8, &ts, &out),
+            EINVAL);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void enc_enobufs(void)
+{
+    static unsigned char  bits[M2MD_ENC_BUF_SIZE];
+    const void           *out;
+    int                   max;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    max = (M2MD_ENC_BUF_SIZE - 64) / 2;
+    memset(bits, 0xff, sizeof(bits));
+
+    mt_ferr(m2md_enc_encode(M2MD_ENC_JSON, M2MD_ENC_KIND_BITS, bits,
+                max + 1, &ts, &out), ENOBUFS);
+    mt_ferr(m2md_enc_encode(M2MD_ENC_JSON, M2MD_ENC_KIND_BITS, bits,
+                -1, &ts, &out), ENOBUFS);
+
+    /* the biggest bitmap that fits, fits in every encoding */
+    mt_fail(m2md_enc_encode(M2MD_ENC_JSON, M2MD_ENC_KIND_BITS, bits,
+                max, &ts, &out) == max * 2 + 2 + 16);
+    mt_fail(m2md_enc_encode(M2MD_ENC_TEXT, M2MD_ENC_KIND_BITS, bits,
+                max, &ts, &out) == max * 2);
+    mt_fail(m2md_enc_encode(M2MD_ENC_CBOR, M2MD_ENC_KIND_BITS, bits,
+                max, &ts, &out) > max);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void enc_raw(void)
+{
+    const void  *out;
+    float        f;
+    int64_t      i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    /* raw is value itself, nothing is copied */
+    f = 1.5f;
+    mt_fail(m2md_enc_encode(M2MD_ENC_RAW, M2MD_ENC_KIND_F32, &f,
+                sizeof(f), &ts, &out) == sizeof(f));
+    mt_fail(out == &f);
+
+    i = -7;
+    mt_fail(m2md_enc_encode(M2MD_ENC_RAW, M2MD_ENC_KIND_I64, &i,
+                sizeof(i), &ts, &out) == sizeof(i));
+    mt_fail(out == &i);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void enc_text_int(void)
+{
+    int64_t      i;
+    uint64_t     u;
+    const char  *t;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    i = 0;
+    t = enc_text(M2MD_ENC_TEXT, M2MD_ENC_KIND_I64, &i, sizeof(i));
+    mt_fail(t && strcmp(t, "0") == 0);
+
+    i = -123;
+    t = enc_text(M2MD_ENC_TEXT, M2MD_ENC_KIND_I64, &i, sizeof(i));
+    mt_fail(t && strcmp(t, "-123") == 0);
+
+    i = INT64_MIN;
+    t = enc_text(M2MD_ENC_TEXT, M2MD_ENC_KIND_I64, &i, sizeof(i));
+    mt_fail(t && strcmp(t, "-9223372036854775808") == 0);
+
+    i = INT64_MAX;
+    t = enc_text(M2MD_ENC_TEXT, M2MD_ENC_KIND_I64, &i, sizeof(i));
+    mt_fail(t && strcmp(t, "9223372036854775807") == 0);
+
+    u = UINT64_MAX;
+    t = enc_text(M2MD_ENC_TEXT, M2MD_ENC_KIND_U64, &u, sizeof(u));
+    mt_fail(t && strcmp(t, "18446744073709551615") == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void enc_text_real(void)
+{
+    float        f;
+    double       d;
+    const char  *t;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    f = 1;
+    t = enc_text(M2MD_ENC_TEXT, M2MD_ENC_KIND_F32, &f, sizeof(f));
+    mt_fail(t && strcmp(t, "1") == 0);
+
+    f = -250;
+    t = enc_text(M2MD_ENC_TEXT, M2MD_ENC_KIND_F32, &f, sizeof(f));
+    mt_fail(t && strcmp(t, "-250") == 0);
+
+    /* not 0.100000001, which is what float really holds */
+    f = 0.1f;
+    t = enc_text(M2MD_ENC_TEXT, M2MD_ENC_KIND_F32, &f, sizeof(f));
+    mt_fail(t && strcmp(t, "0.1") == 0);
+
+    f = 16777217.0f / 3;
+    t = enc_text(M2MD_ENC_TEXT, M2MD_ENC_KIND_F32, &f, sizeof(f));
+    mt_fail(t && strtof(t, NULL) == f);
+
+    /* every digit of whole float is needed only up to 2^24 */
+    f = 16777215;
+    t = enc_text(M2MD_ENC_TEXT, M2MD_ENC_KIND_F32, &f, sizeof(f));
+    mt_fail(t && strcmp(t, "16777215") == 0);
+
+    f = 1e10f;
+    t = enc_text(M2MD_ENC_TEXT, M2MD_ENC_KIND_F32, &f, sizeof(f));
+    mt_fail(t && strcmp(t, "1e+10") == 0);
+
+    f = -0.0f;
+    t = enc_text(M2MD_ENC_TEXT, M2MD_ENC_KIND_F32, &f, sizeof(f));
+    mt_fail(t && strcmp(t, "-0") == 0);
+
+    d = 0.1;
+    t = enc_text(M2MD_ENC_TEXT, M2MD_ENC_KIND_F64, &d, sizeof(d));
+    mt_fail(t && strcmp(t, "0.1") == 0);
+
+    d = 1e20;
+    t = enc_text(M2MD_ENC_TEXT, M2MD_ENC_KIND_F64, &d, sizeof(d));
+    mt_fail(t && strcmp(t, "1e+20") == 0);
+
+    d = 1.0 / 3;
+    t = enc_text(M2MD_ENC_TEXT, M2MD_ENC_KIND_F64, &d, sizeof(d));
+    mt_fail(t && strcmp(t, "0.3333333333333333") == 0);
+
+    d = NAN;
+    t = enc_text(M2MD_ENC_TEXT, M2MD_ENC_KIND_F64, &d, sizeof(d));
+    mt_fail(t && strcmp(t, "nan") == 0);
+
+    d = -INFINITY;
+    t = enc_text(M2MD_ENC_TEXT, M2MD_ENC_KIND_F64, &d, sizeof(d));
+    mt_fail(t && strcmp(t, "-inf") == 0);
+
+    f = INFINITY;
+    t = enc_text(M2MD_ENC_TEXT, M2MD_ENC_KIND_F32, &f, sizeof(f));
+    mt_fail(t && strcmp(t, "inf") == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void enc_text_shortest(void)
+{
+    char         shorter[320];
+    const char  *t;
+    uint32_t     u32;
+    uint64_t     u;
+    float        f;
+    double       d;
+    int          bad;
+    int          n;
+    int          i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    /* every value must read back exactly, and with one digit less
+     * it must not, otherwise it wasn't the shortest one */
+    srand(1);
+    bad = 0;
+    for (i = 0; i != 100000; ++i)
+    {
+        u32 = (uint32_t)rand() << 16 ^ rand();
+        memcpy(&f, &u32, sizeof(f));
+        if (f != f || f - f != 0)
+            continue;
+
+        t = enc_text(M2MD_ENC_TEXT, M2MD_ENC_KIND_F32, &f, sizeof(f));
+        if (t == NULL || strtof(t, NULL) != f)
+        {
+            ++bad;
+            continue;
+        }
+
+        if ((n = digits(t)) > 1)
+        {
+            snprintf(shorter, sizeof(shorter), "%.*g", n - 1, f);
+            bad += strtof(shorter, NULL) == f;
+        }
+    }
+
+    mt_fail(bad == 0);
+
+    bad = 0;
+    for (i = 0; i != 100000; ++i)
+    {
+        u = (uint64_t)rand() << 42 ^ (uint64_t)rand() << 21 ^ rand();
+        memcpy(&d, &u, sizeof(d));
+        if (d != d || d - d != 0)
+            continue;
+
+        t = enc_text(M2MD_ENC_TEXT, M2MD_ENC_KIND_F64, &d, sizeof(d));
+        if (t == NULL || strtod(t, NULL) != d)
+        {
+            ++bad;
+            continue;
+        }
+
+        if ((n = digits(t)) > 1)
+        {
+            snprintf(shorter, sizeof(shorter), "%.*g", n - 1, d);
+            bad += strtod(shorter, NULL) == d;
+        }
+    }
+
+    mt_fail(bad == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void enc_text_bits(void)
+{
+    unsigned char  bits[3] = { 0x01, 0xab, 0xf0 };
+    const char    *t;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    t = enc_text(M2MD_ENC_TEXT, M2MD_ENC_KIND_BITS, bits, sizeof(bits));
+    mt_fail(t && strcmp(t, "01abf0") == 0);
+
+    t = enc_text(M2MD_ENC_TEXT, M2MD_ENC_KIND_BITS, bits, 0);
+    mt_fail(t && strcmp(t, "") == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void enc_json(void)
+{
+    unsigned char  bits[2] = { 0x01, 0xab };
+    const char    *t;
+    int64_t        i;
+    float          f;
+    double         d;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    i = 42;
+    t = enc_text(M2MD_ENC_JSON, M2MD_ENC_KIND_I64, &i, sizeof(i));
+    mt_fail(t && strcmp(t, "{\"v\":42,\"ts\":1500}") == 0);
+
+    f = -0.5f;
+    t = enc_text(M2MD_ENC_JSON, M2MD_ENC_KIND_F32, &f, sizeof(f));
+    mt_fail(t && strcmp(t, "{\"v\":-0.5,\"ts\":1500}") == 0);
+
+    /* json has no nan nor infinity */
+    d = NAN;
+    t = enc_text(M2MD_ENC_JSON, M2MD_ENC_KIND_F64, &d, sizeof(d));
+    mt_fail(t && strcmp(t, "{\"v\":null,\"ts\":1500}") == 0);
+
+    f = -INFINITY;
+    t = enc_text(M2MD_ENC_JSON, M2MD_ENC_KIND_F32, &f, sizeof(f));
+    mt_fail(t && strcmp(t, "{\"v\":null,\"ts\":1500}") == 0);
+
+    t = enc_text(M2MD_ENC_JSON, M2MD_ENC_KIND_BITS, bits, sizeof(bits));
+    mt_fail(t && strcmp(t, "{\"v\":\"01ab\",\"ts\":1500}") == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void enc_cbor(void)
+{
+    unsigned char  bits[2] = { 0x01, 0xab };
+    int64_t        i;
+    uint64_t       u;
+    float          f;
+    double         d;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    /* {"v": 42, "ts": 1500} */
+    {
+        static const unsigned char e[] = { 0xa2, 0x61, 'v', 0x18, 0x2a,
+            0x62, 't', 's', 0x19, 0x05, 0xdc };
+        i = 42;
+        mt_fok(enc_bytes(M2MD_ENC_CBOR, M2MD_ENC_KIND_I64, &i, sizeof(i),
+                    e, sizeof(e)));
+    }
+
+    {
+        static const unsigned char e[] = { 0xa2, 0x61, 'v', 0x20,
+            0x62, 't', 's', 0x19, 0x05, 0xdc };
+        i = -1;
+        mt_fok(enc_bytes(M2MD_ENC_CBOR, M2MD_ENC_KIND_I64, &i, sizeof(i),
+                    e, sizeof(e)));
+    }
+
+    {
+        static const unsigned char e[] = { 0xa2, 0x61, 'v', 0x39, 0x01, 0xf3,
+            0x62, 't', 's', 0x19, 0x05, 0xdc };
+        i = -500;
+        mt_fok(enc_bytes(M2MD_ENC_CBOR, M2MD_ENC_KIND_I64, &i, sizeof(i),
+                    e, sizeof(e)));
+    }
+
+    {
+        static const unsigned char e[] = { 0xa2, 0x61, 'v', 0x1b, 0xff,
+            0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+            0x62, 't', 's', 0x19, 0x05, 0xdc };
+        u = UINT64_MAX;
+        mt_fok(enc_bytes(M2MD_ENC_CBOR, M2MD_ENC_KIND_U64, &u, sizeof(u),
+                    e, sizeof(e)));
+    }
+
+    {
+        static const unsigned char e[] = { 0xa2, 0x61, 'v', 0xfa, 0x3f,
+            0xc0, 0x00, 0x00, 0x62, 't', 's', 0x19, 0x05, 0xdc };
+        f = 1.5f;
+        mt_fok(enc_bytes(M2MD_ENC_CBOR, M2MD_ENC_KIND_F32, &f, sizeof(f),
+                    e, sizeof(e)));
+
+        /* double that fits in float is written as float */
+        d = 1.5;
+        mt_fok(enc_bytes(M2MD_ENC_CBOR, M2MD_ENC_KIND_F64, &d, sizeof(d),
+                    e, sizeof(e)));
+    }
+
+    {
+        static const unsigned char e[] = { 0xa2, 0x61, 'v', 0xfb, 0x3f,
+            0xb9, 0x99, 0x99, 0x99, 0x99, 0x99, 0x9a,
+            0x62, 't', 's', 0x19, 0x05, 0xdc };
+        d = 0.1;
+        mt_fok(enc_bytes(M2MD_ENC_CBOR, M2MD_ENC_KIND_F64, &d, sizeof(d),
+                    e, sizeof(e)));
+    }
+
+    {
+        static const unsigned char e[] = { 0xa2, 0x61, 'v', 0x42, 0x01,
+            0xab, 0x62, 't', 's', 0x19, 0x05, 0xdc };
+        mt_fok(enc_bytes(M2MD_ENC_CBOR, M2MD_ENC_KIND_BITS, bits,
+                    sizeof(bits), e, sizeof(e)));
+    }
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void enc_binary(void)
+{
+    unsigned char  bits[2] = { 0x01, 0xab };
+    const void    *out;
+    int64_t        i;
+    float          f;
+    double         d;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    {
+        static const unsigned char e[] = { 0x3f, 0xc0, 0x00, 0x00 };
+        f = 1.5f;
+        mt_fok(enc_bytes(M2MD_ENC_BINARY, M2MD_ENC_KIND_F32, &f, sizeof(f),
+                    e, sizeof(e)));
+    }
+
+    {
+        static const unsigned char e[] = { 0x3f, 0xb9, 0x99, 0x99, 0x99,
+            0x99, 0x99, 0x9a };
+        d = 0.1;
+        mt_fok(enc_bytes(M2MD_ENC_BINARY, M2MD_ENC_KIND_F64, &d, sizeof(d),
+                    e, sizeof(e)));
+    }
+
+    {
+        static const unsigned char e[] = { 0xff, 0xff, 0xff, 0xff, 0xff,
+            0xff, 0xfe, 0x0c };
+        i = -500;
+        mt_fok(enc_bytes(M2MD_ENC_BINARY, M2MD_ENC_KIND_I64, &i, sizeof(i),
+                    e, sizeof(e)));
+    }
+
+    /* bitmap has no byte order, it's sent as it is */
+    mt_fail(m2md_enc_encode(M2MD_ENC_BINARY, M2MD_ENC_KIND_BITS, bits,
+                sizeof(bits), &ts, &out) == sizeof(bits));
+    mt_fail(out == bits);
+}
+
+
+/* ==========================================================================
+                       __     __ _          ____
+        ____   __  __ / /_   / /(_)_____   / __/__  __ ____   _____ _____
+       / __ \ / / / // __ \ / // // ___/  / /_ / / / // __ \ / ___// ___/
+      / /_/ // /_/ // /_/ // // // /__   / __// /_/ // / / // /__ (__  )
+     / .___/ \__,_//_.___//_//_/ \___/  /_/   \__,_//_/ /_/ \___//____/
+    /_/
+   ========================================================================== */
+
+
+void m2md_enc_test_group(void)
+{
+    mt_prepare_test = NULL;
+    mt_cleanup_test = NULL;
+
+    mt_run(enc_parse);
+    mt_run(enc_einval);
+    mt_run(enc_enobufs);
+    mt_run(enc_raw);
+    mt_run(enc_text_int);
+    mt_run(enc_text_real);
+    mt_run(enc_text_shortest);
+    mt_run(enc_text_bits);
+    mt_run(enc_json);
+    mt_run(enc_cbor);
+    mt_run(enc_binary);
+}
@@ -0,0 +1,24 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ========================================================================== */
+
+#ifndef M2MD_TEST_GROUP_LIST_H
+#define M2MD_TEST_GROUP_LIST_H 1
+
+void m2md_sched_test_group(void);
+void m2md_pl_test_group(void);
+void m2md_rp_test_group(void);
+void m2md_decode_test_group(void);
+void m2md_enc_test_group(void);
+void m2md_pub_test_group(void);
+void m2md_rtu_test_group(void);
+void m2md_timing_test_group(void);
+void m2md_mbtcp_test_group(void);
+void m2md_wq_test_group(void);
+void m2md_breaker_test_group(void);
+void m2md_batch_test_group(void);
+void m2md_topic_test_group(void);
+void m2md_spool_test_group(void);
+
+#endif
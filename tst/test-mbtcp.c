@@ -0,0 +1,612 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+          _               __            __         ____ _  __
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+
+   ========================================================================== */
+
+
+#include "mtest.h"
+#include "mbtcp.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <modbus/modbus.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+
+/* ==========================================================================
+          __             __                     __   _
+     ____/ /___   _____ / /____ _ _____ ____ _ / /_ (_)____   ____   _____
+    / __  // _ \ / ___// // __ `// ___// __ `// __// // __ \ / __ \ / ___/
+   / /_/ //  __// /__ / // /_/ // /   / /_/ // /_ / // /_/ // / / /(__  )
+   \__,_/ \___/ \___//_/ \__,_//_/    \__,_/ \__//_/ \____//_/ /_//____/
+
+   ========================================================================== */
+
+
+mt_defs_ext();
+static struct m2md_mbtcp  conn;
+static int                peer;
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ========================================================================== */
+
+
+/* ==========================================================================
+    Reads exactly 'len' bytes, that connection sent, into 'buf'.
+   ========================================================================== */
+static int peer_read
+(
+    unsigned char  *buf,
+    size_t          len
+)
+{
+    ssize_t         r;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    while (len)
+    {
+        if ((r = read(peer, buf, len)) <= 0)
+            return -1;
+
+        buf += r;
+        len -= r;
+    }
+
+    return 0;
+}
+
+
+/* ==========================================================================
+    Stores frame with transaction id 'tid', to unit 'uid' with 'pdulen'
+    bytes of 'pdu' in 'frame'. Returns size of the frame.
+   ========================================================================== */
+static size_t frame_make
+(
+    unsigned char        *frame,
+    int                   tid,
+    int                   uid,
+    const unsigned char  *pdu,
+    size_t                pdulen
+)
+{
+    frame[0] = tid >> 8;
+    frame[1] = tid & 0xff;
+    frame[2] = 0;
+    frame[3] = 0;
+    frame[4] = (1 + pdulen) >> 8;
+    frame[5] = (1 + pdulen) & 0xff;
+    frame[6] = uid;
+    memcpy(frame + 7, pdu, pdulen);
+    return 7 + pdulen;
+}
+
+
+/* ==========================================================================
+    Stores response with 'count' registers to request 'tid' in 'frame',
+    register n has value of 'base' + n. Returns size of the frame.
+   ========================================================================== */
+static size_t frame_regs
+(
+    unsigned char  *frame,
+    int             tid,
+    int             uid,
+    int             func,
+    int             count,
+    int             base
+)
+{
+    unsigned char   pdu[2 + 250];
+    int             i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    pdu[0] = func;
+    pdu[1] = count * 2;
+    for (i = 0; i != count; ++i)
+    {
+        pdu[2 + i * 2] = (base + i) >> 8;
+        pdu[3 + i * 2] = (base + i) & 0xff;
+    }
+
+    return frame_make(frame, tid, uid, pdu, 2 + count * 2);
+}
+
+
+/* ==========================================================================
+    Receives response on connection, retries while it says more data
+    is needed, peer has already sent everything, so that won't be long.
+   ========================================================================== */
+static int conn_recv
+(
+    uint16_t  *regs,
+    int       *slot
+)
+{
+    int        ret;
+    int        i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    for (i = 0; i != 10; ++i)
+        if ((ret = m2md_mbtcp_recv(&conn, regs, slot)) != 1)
+            return ret;
+
+    return 1;
+}
+
+
+/* ==========================================================================
+    Sends read request and takes it from the other side, so that test
+    can respond to it. Returns slot of request.
+   ========================================================================== */
+static int conn_read
+(
+    int            uid,
+    int            func,
+    int            reg,
+    int            count
+)
+{
+    unsigned char  req[M2MD_MBTCP_REQ_SIZE];
+    int            slot;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    if ((slot = m2md_mbtcp_send_read(&conn, uid, func, reg, count)) < 0)
+        return -1;
+
+    if (m2md_mbtcp_flush(&conn) != 0 || peer_read(req, sizeof(req)) != 0)
+        return -1;
+
+    return slot;
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void test_prepare(void)
+{
+    int  sv[2];
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    /* other end of the pair plays modbus server */
+    m2md_mbtcp_init(&conn);
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL, 0) | O_NONBLOCK);
+    conn.fd = sv[0];
+    conn.state = M2MD_MBTCP_CONNECTED;
+    peer = sv[1];
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void test_cleanup(void)
+{
+    m2md_mbtcp_close(&conn);
+    if (peer >= 0)
+        close(peer);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void mbtcp_read_frame(void)
+{
+    unsigned char  req[M2MD_MBTCP_REQ_SIZE];
+    int            slot;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    slot = m2md_mbtcp_send_read(&conn, 7, 3, 0x1234, 10);
+    mt_assert(slot >= 0);
+    mt_fail(conn.nreqs == 1);
+    mt_fok(m2md_mbtcp_flush(&conn));
+    mt_fail(conn.txlen == 0);
+    mt_assert(peer_read(req, sizeof(req)) == 0);
+
+    /* tid, protocol, length of unit and pdu, unit, pdu */
+    mt_fail(req[0] == 0x00 && req[1] == 0x01);
+    mt_fail(req[2] == 0x00 && req[3] == 0x00);
+    mt_fail(req[4] == 0x00 && req[5] == 0x06);
+    mt_fail(req[6] == 7);
+    mt_fail(req[7] == 3);
+    mt_fail(req[8] == 0x12 && req[9] == 0x34);
+    mt_fail(req[10] == 0x00 && req[11] == 10);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void mbtcp_out_of_order(void)
+{
+    unsigned char  frames[3 * M2MD_MBTCP_ADU_MAX];
+    size_t         len;
+    uint16_t       regs[125];
+    int            slot[3];
+    int            s;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    mt_assert((slot[0] = conn_read(1, 3, 0, 2)) >= 0);
+    mt_assert((slot[1] = conn_read(1, 4, 100, 3)) >= 0);
+    mt_assert((slot[2] = conn_read(2, 3, 200, 1)) >= 0);
+    mt_fail(conn.nreqs == 3);
+
+    /* server answers in its own order, all at once */
+    len = frame_regs(frames, 3, 2, 3, 1, 300);
+    len += frame_regs(frames + len, 1, 1, 3, 2, 10);
+    len += frame_regs(frames + len, 2, 1, 4, 3, 20);
+    mt_assert(write(peer, frames, len) == (ssize_t)len);
+
+    mt_fok(conn_recv(regs, &s));
+    mt_fail(s == slot[2]);
+    mt_fail(regs[0] == 300);
+
+    mt_fok(conn_recv(regs, &s));
+    mt_fail(s == slot[0]);
+    mt_fail(regs[0] == 10 && regs[1] == 11);
+
+    mt_fok(conn_recv(regs, &s));
+    mt_fail(s == slot[1]);
+    mt_fail(regs[0] == 20 && regs[1] == 21 && regs[2] == 22);
+
+    mt_fail(conn.nreqs == 0);
+    mt_fail(conn_recv(regs, &s) == 1);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void mbtcp_partial_frame(void)
+{
+    unsigned char  frame[M2MD_MBTCP_ADU_MAX];
+    size_t         len;
+    uint16_t       regs[125];
+    int            slot;
+    int            s;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    mt_assert((slot = conn_read(1, 3, 0, 4)) >= 0);
+    len = frame_regs(frame, 1, 1, 3, 4, 1000);
+
+    /* not even whole header yet */
+    mt_assert(write(peer, frame, 5) == 5);
+    mt_fail(conn_recv(regs, &s) == 1);
+
+    /* header is there, but not the rest */
+    mt_assert(write(peer, frame + 5, 6) == 6);
+    mt_fail(conn_recv(regs, &s) == 1);
+    mt_fail(conn.nreqs == 1);
+
+    mt_assert(write(peer, frame + 11, len - 11) == (ssize_t)len - 11);
+    mt_fok(conn_recv(regs, &s));
+    mt_fail(s == slot);
+    mt_fail(regs[0] == 1000 && regs[3] == 1003);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void mbtcp_unknown_tid(void)
+{
+    unsigned char  frame[M2MD_MBTCP_ADU_MAX];
+    size_t         len;
+    uint16_t       regs[125];
+    int            s;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    mt_assert(conn_read(1, 3, 0, 1) >= 0);
+
+    /* response to something we never asked for, there
+     * is no telling what else is wrong with stream */
+    len = frame_regs(frame, 9, 1, 3, 1, 5);
+    mt_assert(write(peer, frame, len) == (ssize_t)len);
+    mt_ferr(conn_recv(regs, &s), EPROTO);
+
+    /* request still waits for its response */
+    mt_fail(conn.nreqs == 1);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void mbtcp_wrong_uid(void)
+{
+    unsigned char  frame[M2MD_MBTCP_ADU_MAX];
+    size_t         len;
+    uint16_t       regs[125];
+    int            s;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    mt_assert(conn_read(5, 3, 0, 1) >= 0);
+    len = frame_regs(frame, 1, 6, 3, 1, 5);
+    mt_assert(write(peer, frame, len) == (ssize_t)len);
+    mt_ferr(conn_recv(regs, &s), EPROTO);
+    mt_fail(conn.nreqs == 1);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void mbtcp_wrong_count(void)
+{
+    unsigned char  frame[M2MD_MBTCP_ADU_MAX];
+    size_t         len;
+    uint16_t       regs[125];
+    int            s;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    mt_assert(conn_read(1, 3, 0, 4) >= 0);
+    len = frame_regs(frame, 1, 1, 3, 3, 5);
+    mt_assert(write(peer, frame, len) == (ssize_t)len);
+    mt_ferr(conn_recv(regs, &s), EPROTO);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void mbtcp_exception(void)
+{
+    unsigned char  frame[M2MD_MBTCP_ADU_MAX];
+    unsigned char  pdu[2];
+    size_t         len;
+    uint16_t       regs[125];
+    int            slot;
+    int            s;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    mt_assert((slot = conn_read(1, 4, 0, 1)) >= 0);
+    pdu[0] = 4 | 0x80;
+    pdu[1] = 2;
+    len = frame_make(frame, 1, 1, pdu, sizeof(pdu));
+    mt_assert(write(peer, frame, len) == (ssize_t)len);
+
+    /* exception is reported like libmodbus does */
+    s = -1;
+    mt_ferr(conn_recv(regs, &s), MODBUS_ENOBASE + 2);
+    mt_fail(s == slot);
+    mt_fail(conn.nreqs == 0);
+
+    /* and connection works just fine afterwards */
+    mt_assert((slot = conn_read(1, 3, 0, 1)) >= 0);
+    len = frame_regs(frame, 2, 1, 3, 1, 42);
+    mt_assert(write(peer, frame, len) == (ssize_t)len);
+    mt_fok(conn_recv(regs, &s));
+    mt_fail(s == slot);
+    mt_fail(regs[0] == 42);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void mbtcp_bits_odd_bytes(void)
+{
+    unsigned char  frame[M2MD_MBTCP_ADU_MAX];
+    unsigned char  pdu[2 + 3];
+    size_t         len;
+    uint16_t       regs[4];
+    int            s;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    /* 20 coils come in 3 bytes, lowest bit first */
+    mt_assert(conn_read(1, 1, 0, 20) >= 0);
+    pdu[0] = 1;
+    pdu[1] = 3;
+    pdu[2] = 0x01;
+    pdu[3] = 0x80;
+    pdu[4] = 0x0f;
+    len = frame_make(frame, 1, 1, pdu, sizeof(pdu));
+    mt_assert(write(peer, frame, len) == (ssize_t)len);
+
+    memset(regs, 0xa5, sizeof(regs));
+    mt_fok(conn_recv(regs, &s));
+    mt_fail(regs[0] == 0x8001);
+    mt_fail(regs[1] == 0x000f);
+    mt_fail(regs[2] == 0xa5a5);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void mbtcp_write_frame(void)
+{
+    unsigned char  req[M2MD_MBTCP_ADU_MAX];
+    uint16_t       values[2];
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    values[0] = 0x1234;
+    values[1] = 0xabcd;
+    mt_assert(m2md_mbtcp_send_write(&conn, 3, 16, 0x100, 2, values) >= 0);
+    mt_fok(m2md_mbtcp_flush(&conn));
+    mt_assert(peer_read(req, 7 + 6 + 4) == 0);
+    mt_fail(req[4] == 0 && req[5] == 1 + 6 + 4);
+    mt_fail(req[6] == 3 && req[7] == 16);
+    mt_fail(req[8] == 0x01 && req[9] == 0x00);
+    mt_fail(req[10] == 0 && req[11] == 2 && req[12] == 4);
+    mt_fail(req[13] == 0x12 && req[14] == 0x34);
+    mt_fail(req[15] == 0xab && req[16] == 0xcd);
+
+    /* 10 coils take 2 bytes, lowest bit first */
+    values[0] = 0x0301;
+    mt_assert(m2md_mbtcp_send_write(&conn, 3, 15, 0, 10, values) >= 0);
+    mt_fok(m2md_mbtcp_flush(&conn));
+    mt_assert(peer_read(req, 7 + 6 + 2) == 0);
+    mt_fail(req[7] == 15 && req[12] == 2);
+    mt_fail(req[13] == 0x01 && req[14] == 0x03);
+
+    /* single coil is switched on with 0xff00 */
+    values[0] = 1;
+    mt_assert(m2md_mbtcp_send_write(&conn, 3, 5, 7, 1, values) >= 0);
+    mt_fok(m2md_mbtcp_flush(&conn));
+    mt_assert(peer_read(req, M2MD_MBTCP_REQ_SIZE) == 0);
+    mt_fail(req[7] == 5 && req[9] == 7);
+    mt_fail(req[10] == 0xff && req[11] == 0x00);
+
+    mt_ferr(m2md_mbtcp_send_write(&conn, 3, 3, 7, 1, values), EINVAL);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void mbtcp_write_ahead_of_reads(void)
+{
+    unsigned char  frame[M2MD_MBTCP_ADU_MAX];
+    unsigned char  req[7 + 6 + 2];
+    unsigned char  pdu[5];
+    uint16_t       regs[125];
+    uint16_t       values[1];
+    size_t         len;
+    int            reads[2];
+    int            wslot;
+    int            s;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    /* reads are still waiting for responses, and
+     * write does not wait for them to be answered */
+    mt_assert((reads[0] = conn_read(1, 3, 0, 1)) >= 0);
+    mt_assert((reads[1] = conn_read(1, 3, 10, 1)) >= 0);
+    values[0] = 77;
+    wslot = m2md_mbtcp_send_write(&conn, 1, 6, 20, 1, values);
+    mt_assert(wslot >= 0);
+    mt_fok(m2md_mbtcp_flush(&conn));
+    mt_assert(peer_read(req, M2MD_MBTCP_REQ_SIZE) == 0);
+    mt_fail(conn.nreqs == 3);
+
+    /* server confirms write first, with echo */
+    memcpy(pdu, req + 7, sizeof(pdu));
+    len = frame_make(frame, 3, 1, pdu, sizeof(pdu));
+    len += frame_regs(frame + len, 2, 1, 3, 1, 11);
+    len += frame_regs(frame + len, 1, 1, 3, 1, 10);
+    mt_assert(write(peer, frame, len) == (ssize_t)len);
+
+    mt_fok(conn_recv(regs, &s));
+    mt_fail(s == wslot);
+    mt_fok(conn_recv(regs, &s));
+    mt_fail(s == reads[1] && regs[0] == 11);
+    mt_fok(conn_recv(regs, &s));
+    mt_fail(s == reads[0] && regs[0] == 10);
+    mt_fail(conn.nreqs == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void mbtcp_write_room(void)
+{
+    uint16_t  values[125];
+    int       i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    /* transmit buffer is full of reads, biggest
+     * write still fits, but only one of them */
+    memset(values, 0x00, sizeof(values));
+    for (i = 0; i != M2MD_MBTCP_WINDOW_MAX - 2; ++i)
+        mt_assert(m2md_mbtcp_send_read(&conn, 1, 3, i, 1) >= 0);
+
+    mt_assert(m2md_mbtcp_send_write(&conn, 1, 16, 0, 123, values) >= 0);
+    mt_ferr(m2md_mbtcp_send_write(&conn, 1, 16, 0, 123, values), ENOBUFS);
+
+    /* small one is just fine */
+    mt_assert(m2md_mbtcp_send_write(&conn, 1, 6, 0, 1, values) >= 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void mbtcp_window_full(void)
+{
+    int  i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    for (i = 0; i != M2MD_MBTCP_WINDOW_MAX; ++i)
+        mt_fail(m2md_mbtcp_send_read(&conn, 1, 3, i, 1) == i);
+
+    mt_ferr(m2md_mbtcp_send_read(&conn, 1, 3, 0, 1), EBUSY);
+    mt_fail(conn.nreqs == M2MD_MBTCP_WINDOW_MAX);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void mbtcp_not_connected(void)
+{
+    m2md_mbtcp_close(&conn);
+    mt_ferr(m2md_mbtcp_send_read(&conn, 1, 3, 0, 1), ENOTCONN);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void mbtcp_peer_closed(void)
+{
+    uint16_t  regs[125];
+    int       s;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    mt_assert(conn_read(1, 3, 0, 1) >= 0);
+    close(peer);
+    peer = -1;
+    mt_ferr(conn_recv(regs, &s), ECONNRESET);
+}
+
+
+/* ==========================================================================
+                       __     __ _          ____
+        ____   __  __ / /_   / /(_)_____   / __/__  __ ____   _____ _____
+       / __ \ / / / // __ \ / // // ___/  / /_ / / / // __ \ / ___// ___/
+      / /_/ // /_/ // /_/ // // // /__   / __// /_/ // / / // /__ (__  )
+     / .___/ \__,_//_.___//_//_/ \___/  /_/   \__,_//_/ /_/ \___//____/
+    /_/
+   ========================================================================== */
+
+
+void m2md_mbtcp_test_group(void)
+{
+    mt_prepare_test = &test_prepare;
+    mt_cleanup_test = &test_cleanup;
+
+    mt_run(mbtcp_read_frame);
+    mt_run(mbtcp_out_of_order);
+    mt_run(mbtcp_partial_frame);
+    mt_run(mbtcp_unknown_tid);
+    mt_run(mbtcp_wrong_uid);
+    mt_run(mbtcp_wrong_count);
+    mt_run(mbtcp_exception);
+    mt_run(mbtcp_bits_odd_bytes);
+    mt_run(mbtcp_write_frame);
+    mt_run(mbtcp_write_ahead_of_reads);
+    mt_run(mbtcp_write_room);
+    mt_run(mbtcp_window_full);
+    mt_run(mbtcp_not_connected);
+    mt_run(mbtcp_peer_closed);
+}
@@ -0,0 +1,982 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+          _               __            __         ____ _  __
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+
+   ========================================================================== */
+
+
+#include "mtest.h"
+#include "poll-list.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/* ==========================================================================
+          __             __                     __   _
+     ____/ /___   _____ / /____ _ _____ ____ _ / /_ (_)____   ____   _____
+    / __  // _ \ / ___// // __ `// ___// __ `// __// // __ \ / __ \ / ___/
+   / /_/ //  __// /__ / // /_/ // /   / /_/ // /_ / // /_/ // / / /(__  )
+   \__,_/ \___/ \___//_/ \__,_//_/    \__,_/ \__//_/ \____//_/ /_//____/
+
+   ========================================================================== */
+
+
+#define NPOLLS 5000
+
+mt_defs_ext();
+static struct m2md_pl_list  polls;
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ========================================================================== */
+
+
+/* ==========================================================================
+    Fills 'data' with poll number 'n'. Polls are spread over functions,
+    units and registers so that plenty of them share some of the fields
+    and end up in same or neighbouring slots of index.
+   ========================================================================== */
+static void poll_data
+(
+    struct m2md_pl_data  *data,
+    char                 *topic,
+    int                   n
+)
+{
+    memset(data, 0x00, sizeof(*data));
+    data->func = 1 + n % 4;
+    data->uid = n / 4 % 7;
+    data->reg = n / 28 * 3;
+    data->poll_time.tv_sec = 1 + n % 3;
+    data->scale = 1;
+    data->field_width = 1;
+
+    sprintf(topic, "/poll/%d", n);
+    data->topic = topic;
+}
+
+
+/* ==========================================================================
+    Adds polls from 'first' up to, but without, 'last'.
+   ========================================================================== */
+static int polls_add
+(
+    int                   first,
+    int                   last
+)
+{
+    struct m2md_pl_data   data;
+    char                  topic[32];
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    for (; first != last; ++first)
+    {
+        poll_data(&data, topic, first);
+        if (m2md_pl_add(&polls, &data) != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+
+/* ==========================================================================
+    Returns position of poll number 'n', or M2MD_PL_NONE.
+   ========================================================================== */
+static size_t poll_find
+(
+    int                   n
+)
+{
+    struct m2md_pl_data   data;
+    char                  topic[32];
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    poll_data(&data, topic, n);
+    return m2md_pl_find(&polls, &data);
+}
+
+
+/* ==========================================================================
+    Deletes poll number 'n'.
+   ========================================================================== */
+static int poll_delete
+(
+    int                   n
+)
+{
+    struct m2md_pl_data   data;
+    char                  topic[32];
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    poll_data(&data, topic, n);
+    return m2md_pl_delete(&polls, &data);
+}
+
+
+/* ==========================================================================
+    Checks that poll number 'n' can be found, and that it is the right
+    one.
+   ========================================================================== */
+static int poll_valid
+(
+    int                   n
+)
+{
+    struct m2md_pl_data   data;
+    char                  topic[32];
+    size_t                i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    poll_data(&data, topic, n);
+    if ((i = m2md_pl_find(&polls, &data)) == M2MD_PL_NONE)
+        return -1;
+
+    if (i >= polls.nnodes)
+        return -1;
+
+    if (polls.data[i].func != data.func || polls.data[i].uid != data.uid ||
+            polls.data[i].reg != data.reg)
+        return -1;
+
+    return strcmp(polls.data[i].topic, topic) == 0 ? 0 : -1;
+}
+
+
+/* ==========================================================================
+    Returns number of chunks in arena.
+   ========================================================================== */
+static int arena_chunks(void)
+{
+    struct m2md_pl_chunk  *chunk;
+    int                    n;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    n = 0;
+    for (chunk = polls.chunks; chunk != NULL; chunk = chunk->next)
+        ++n;
+
+    return n;
+}
+
+
+/* ==========================================================================
+    Returns 1 when 'topic' lies in one of chunks of arena.
+   ========================================================================== */
+static int arena_owns
+(
+    const char            *topic
+)
+{
+    struct m2md_pl_chunk  *chunk;
+    const char            *start;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    for (chunk = polls.chunks; chunk != NULL; chunk = chunk->next)
+    {
+        start = (const char *)(chunk + 1);
+        if (topic >= start && topic + strlen(topic) < start + chunk->used)
+            return 1;
+    }
+
+    return 0;
+}
+
+
+/* ==========================================================================
+    Adds poll with deadband 'mode' of 'band' and 'heartbeat', and returns
+    its position in list.
+   ========================================================================== */
+static size_t poll_deadband
+(
+    int                   mode,
+    double                band,
+    int                   heartbeat
+)
+{
+    struct m2md_pl_data   data;
+    char                  topic[32];
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    poll_data(&data, topic, 0);
+    data.deadband_mode = mode;
+    data.deadband = band;
+    data.heartbeat = heartbeat;
+    if (m2md_pl_add(&polls, &data) != 0)
+        return M2MD_PL_NONE;
+
+    return poll_find(0);
+}
+
+
+/* ==========================================================================
+    Reports value 'v' of poll at 'i', taken at 'sec' second. Value is its
+    own payload.
+   ========================================================================== */
+static int poll_report
+(
+    size_t           i,
+    double           v,
+    int              sec
+)
+{
+    struct timespec  now;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    now.tv_sec = sec;
+    now.tv_nsec = 0;
+    return m2md_pl_report(&polls, i, &v, sizeof(v), v, &now);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void test_prepare(void)
+{
+    m2md_pl_init(&polls);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void test_cleanup(void)
+{
+    m2md_pl_destroy(&polls);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void pl_find_empty(void)
+{
+    mt_fail(poll_find(0) == M2MD_PL_NONE);
+    mt_fail(m2md_pl_find(NULL, NULL) == M2MD_PL_NONE);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void pl_add_find(void)
+{
+    int  i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    mt_assert(polls_add(0, NPOLLS) == 0);
+    mt_fail(polls.nnodes == NPOLLS);
+
+    for (i = 0; i != NPOLLS; ++i)
+        mt_assert(poll_valid(i) == 0);
+
+    mt_fail(poll_find(NPOLLS) == M2MD_PL_NONE);
+    mt_fail(poll_find(NPOLLS + 1) == M2MD_PL_NONE);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void pl_index_half_full(void)
+{
+    size_t  used;
+    size_t  i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    mt_assert(polls_add(0, NPOLLS) == 0);
+    mt_fail(polls.nnodes * 2 <= (size_t)1 << polls.bits);
+
+    used = 0;
+    for (i = 0; i != (size_t)1 << polls.bits; ++i)
+        if (polls.index[i] != 0)
+            ++used;
+
+    mt_fail(used == polls.nnodes);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void pl_add_einval(void)
+{
+    struct m2md_pl_data  data;
+    char                 topic[32];
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    poll_data(&data, topic, 0);
+    mt_ferr(m2md_pl_add(NULL, &data), EINVAL);
+    mt_ferr(m2md_pl_add(&polls, NULL), EINVAL);
+
+    data.topic = NULL;
+    mt_ferr(m2md_pl_add(&polls, &data), EINVAL);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void pl_add_duplicate(void)
+{
+    struct m2md_pl_data  data;
+    char                 topic[32];
+    size_t               i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    mt_assert(polls_add(0, 100) == 0);
+    poll_data(&data, topic, 50);
+    i = poll_find(50);
+    polls.next_read[i].tv_sec = 99;
+
+    /* longer poll time, nothing changes */
+    data.poll_time.tv_sec = 10;
+    mt_fok(m2md_pl_add(&polls, &data));
+    mt_fail(polls.nnodes == 100);
+    mt_fail(polls.data[i].poll_time.tv_sec != 10);
+    mt_fail(polls.next_read[i].tv_sec == 99);
+
+    /* shorter one is taken, and poll is due at once */
+    data.poll_time.tv_sec = 0;
+    data.poll_time.tv_nsec = 100;
+    mt_fok(m2md_pl_add(&polls, &data));
+    mt_fail(polls.nnodes == 100);
+    mt_fail(poll_find(50) == i);
+    mt_fail(polls.data[i].poll_time.tv_sec == 0);
+    mt_fail(polls.data[i].poll_time.tv_nsec == 100);
+    mt_fail(polls.next_read[i].tv_sec == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void pl_delete_all(void)
+{
+    int  i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    mt_assert(polls_add(0, NPOLLS) == 0);
+
+    for (i = 0; i != NPOLLS; ++i)
+    {
+        mt_assert(poll_delete(i) == 0);
+        mt_assert(poll_find(i) == M2MD_PL_NONE);
+    }
+
+    mt_fail(polls.nnodes == 0);
+    for (i = 0; i != 1 << polls.bits; ++i)
+        mt_assert(polls.index[i] == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void pl_delete_random(void)
+{
+    char  *deleted;
+    int    i;
+    int    n;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    mt_assert(polls_add(0, NPOLLS) == 0);
+    mt_assert((deleted = calloc(NPOLLS, 1)) != NULL);
+    srand(NPOLLS);
+
+    /* deleting from the middle of probing sequences shifts
+     * polls back, all that are left must still be found */
+    for (n = 0; n != NPOLLS / 2; ++n)
+    {
+        while (deleted[i = rand() % NPOLLS])
+            ;
+
+        deleted[i] = 1;
+        mt_fail(poll_delete(i) == 0);
+    }
+
+    mt_fail(polls.nnodes == NPOLLS - NPOLLS / 2);
+    for (i = 0; i != NPOLLS; ++i)
+    {
+        if (deleted[i])
+            mt_fail(poll_find(i) == M2MD_PL_NONE);
+        else
+            mt_fail(poll_valid(i) == 0);
+    }
+
+    free(deleted);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void pl_delete_readd(void)
+{
+    int  i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    mt_assert(polls_add(0, NPOLLS) == 0);
+
+    for (i = 0; i < NPOLLS; i += 3)
+        mt_assert(poll_delete(i) == 0);
+
+    for (i = 0; i < NPOLLS; i += 3)
+        mt_assert(polls_add(i, i + 1) == 0);
+
+    mt_fail(polls.nnodes == NPOLLS);
+    for (i = 0; i != NPOLLS; ++i)
+        mt_assert(poll_valid(i) == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void pl_delete_moves_last(void)
+{
+    size_t  i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    mt_assert(polls_add(0, 10) == 0);
+    i = poll_find(3);
+    polls.next_read[9].tv_sec = 9;
+
+    /* last poll fills the hole, with its timer */
+    mt_fok(poll_delete(3));
+    mt_fail(poll_find(9) == i);
+    mt_fail(polls.next_read[i].tv_sec == 9);
+    mt_fail(poll_valid(9) == 0);
+
+    /* deleting the last one leaves others alone */
+    mt_fok(poll_delete(8));
+    mt_fail(poll_find(9) == i);
+    mt_fail(polls.nnodes == 8);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void pl_delete_enoent(void)
+{
+    mt_ferr(poll_delete(0), ENOENT);
+
+    mt_assert(polls_add(0, 10) == 0);
+    mt_ferr(poll_delete(10), ENOENT);
+    mt_fok(poll_delete(5));
+    mt_ferr(poll_delete(5), ENOENT);
+    mt_fail(polls.nnodes == 9);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void pl_delete_clears_rp_slot(void)
+{
+    size_t  slot[2];
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    /* that's what read plan does with its blocks */
+    mt_assert(polls_add(0, 2) == 0);
+    slot[0] = 0;
+    slot[1] = 1;
+    polls.rp_polls = slot;
+    polls.rp_slot[0] = 0;
+    polls.rp_slot[1] = 1;
+
+    mt_fok(poll_delete(0));
+    mt_fail(slot[0] == M2MD_PL_NONE);
+    mt_fail(slot[1] == 0);
+    mt_fail(polls.rp_slot[0] == 1);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void pl_last_only_with_deadband(void)
+{
+    struct m2md_pl_data  data;
+    char                 topic[32];
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    /* no poll needs last published values */
+    mt_assert(polls_add(0, 100) == 0);
+    mt_fail(polls.last == NULL);
+
+    /* first one that does, gets them for everyone */
+    poll_data(&data, topic, 100);
+    data.deadband_mode = M2MD_PL_DEADBAND_ANY;
+    mt_fok(m2md_pl_add(&polls, &data));
+    mt_assert(polls.last != NULL);
+    polls.last[100].valid = 1;
+    polls.last[100].value = 7;
+
+    /* and array follows the rest, as list grows */
+    mt_assert(polls_add(101, 1000) == 0);
+    mt_fail(polls.last[100].valid == 1);
+    mt_fail(polls.last[999].valid == 0);
+
+    /* poll moved in place of deleted one takes its value along */
+    polls.last[999].valid = 1;
+    polls.last[999].value = 9;
+    mt_fok(poll_delete(100));
+    mt_fail(polls.last[100].valid == 1);
+    mt_fail(polls.last[100].value == 9);
+    mt_fail(poll_find(999) == 100);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void pl_strike_counts(void)
+{
+    size_t  i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    mt_assert(polls_add(0, 10) == 0);
+    i = poll_find(3);
+    mt_fail(polls.exc[i].strikes == 0);
+    mt_fail(polls.exc[i].split == 0);
+
+    m2md_pl_strike(&polls, i, 5, 100);
+    m2md_pl_strike(&polls, i, 5, 100);
+    mt_fail(polls.exc[i].strikes == 2);
+
+    /* other polls don't get strikes of their neighbour */
+    mt_fail(polls.exc[poll_find(2)].strikes == 0);
+    mt_fail(polls.exc[poll_find(4)].strikes == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void pl_strike_backoff(void)
+{
+    size_t  i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    mt_assert(polls_add(0, 1) == 0);
+    i = poll_find(0);
+
+    /* doubles from min with each strike, until it hits max */
+    mt_fail(m2md_pl_strike(&polls, i, 5, 60) == 5);
+    mt_fail(m2md_pl_strike(&polls, i, 5, 60) == 10);
+    mt_fail(m2md_pl_strike(&polls, i, 5, 60) == 20);
+    mt_fail(m2md_pl_strike(&polls, i, 5, 60) == 40);
+    mt_fail(m2md_pl_strike(&polls, i, 5, 60) == 60);
+    mt_fail(m2md_pl_strike(&polls, i, 5, 60) == 60);
+    mt_fail(polls.exc[i].strikes == 6);
+
+    /* and stays there no matter how many strikes there are */
+    polls.exc[i].strikes = 1000;
+    mt_fail(m2md_pl_strike(&polls, i, 5, 60) == 60);
+    polls.exc[i].strikes = 0;
+    mt_fail(m2md_pl_strike(&polls, i, 86400, 86400) == 86400);
+    mt_fail(m2md_pl_strike(&polls, i, 86400, 86400) == 86400);
+
+    /* min bigger than max, max still wins */
+    polls.exc[i].strikes = 0;
+    mt_fail(m2md_pl_strike(&polls, i, 100, 60) == 60);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void pl_exc_follows_poll(void)
+{
+    struct m2md_pl_data  data;
+    char                 topic[32];
+    size_t               i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    mt_assert(polls_add(0, 100) == 0);
+    polls.exc[poll_find(99)].split = 7;
+    m2md_pl_strike(&polls, poll_find(99), 1, 10);
+
+    /* poll moved in place of deleted one takes its state along */
+    mt_fok(poll_delete(10));
+    i = poll_find(99);
+    mt_fail(i == 10);
+    mt_fail(polls.exc[i].split == 7);
+    mt_fail(polls.exc[i].strikes == 1);
+
+    /* shorter poll time of existing poll keeps what poll did */
+    poll_data(&data, topic, 99);
+    data.poll_time.tv_sec = 0;
+    mt_fok(m2md_pl_add(&polls, &data));
+    mt_fail(polls.exc[i].split == 7);
+    mt_fail(polls.exc[i].strikes == 1);
+
+    /* while readded poll starts clean */
+    mt_fok(poll_delete(99));
+    poll_data(&data, topic, 99);
+    mt_fok(m2md_pl_add(&polls, &data));
+    i = poll_find(99);
+    mt_fail(polls.exc[i].split == 0);
+    mt_fail(polls.exc[i].strikes == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void pl_report_no_deadband(void)
+{
+    size_t  i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    /* every sample goes out, even the same ones */
+    mt_assert((i = poll_deadband(M2MD_PL_DEADBAND_NONE, 0, 0)) == 0);
+    mt_fail(poll_report(i, 5, 0) == 1);
+    mt_fail(poll_report(i, 5, 0) == 1);
+    mt_fail(poll_report(i, 5.1, 1) == 1);
+    mt_fail(polls.last == NULL);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void pl_report_any(void)
+{
+    size_t  i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    mt_assert((i = poll_deadband(M2MD_PL_DEADBAND_ANY, 0, 0)) == 0);
+    mt_fail(poll_report(i, 5, 0) == 1);
+    mt_fail(poll_report(i, 5, 1) == 0);
+    mt_fail(poll_report(i, 5.001, 2) == 1);
+    mt_fail(poll_report(i, 5.001, 3) == 0);
+    mt_fail(poll_report(i, 5, 4) == 1);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void pl_report_abs(void)
+{
+    size_t  i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    mt_assert((i = poll_deadband(M2MD_PL_DEADBAND_ABS, 1, 0)) == 0);
+
+    /* first sample always goes out */
+    mt_fail(poll_report(i, 10, 0) == 1);
+    mt_fail(poll_report(i, 10.5, 1) == 0);
+    mt_fail(poll_report(i, 9.5, 2) == 0);
+    mt_fail(poll_report(i, 11, 3) == 1);
+
+    /* band is measured from last published, not last read */
+    mt_fail(poll_report(i, 10.2, 4) == 0);
+    mt_fail(poll_report(i, 11.9, 5) == 0);
+    mt_fail(poll_report(i, 9.9, 6) == 1);
+    mt_fail(polls.last[i].value == 9.9);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void pl_report_percent(void)
+{
+    size_t  i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    mt_assert((i = poll_deadband(M2MD_PL_DEADBAND_PERCENT, 10, 0)) == 0);
+    mt_fail(poll_report(i, 100, 0) == 1);
+    mt_fail(poll_report(i, 109, 1) == 0);
+    mt_fail(poll_report(i, 91, 2) == 0);
+    mt_fail(poll_report(i, 110, 3) == 1);
+
+    /* band grows with published value */
+    mt_fail(poll_report(i, 120, 4) == 0);
+    mt_fail(poll_report(i, 121, 5) == 1);
+
+    /* and so does it with negative ones */
+    mt_fail(poll_report(i, -100, 6) == 1);
+    mt_fail(poll_report(i, -95, 7) == 0);
+    mt_fail(poll_report(i, -110, 8) == 1);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void pl_report_heartbeat(void)
+{
+    size_t  i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    mt_assert((i = poll_deadband(M2MD_PL_DEADBAND_ABS, 100, 10)) == 0);
+    mt_fail(poll_report(i, 1, 0) == 1);
+    mt_fail(poll_report(i, 1, 5) == 0);
+    mt_fail(poll_report(i, 2, 9) == 0);
+
+    /* silent poll goes out, even when nothing changed */
+    mt_fail(poll_report(i, 1, 10) == 1);
+    mt_fail(poll_report(i, 1, 15) == 0);
+
+    /* and heartbeat is counted from last published sample */
+    mt_fail(poll_report(i, 150, 17) == 1);
+    mt_fail(poll_report(i, 150, 26) == 0);
+    mt_fail(poll_report(i, 150, 27) == 1);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void pl_report_bitmap(void)
+{
+    struct timespec  now;
+    unsigned char    map[16];
+    size_t           i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    /* bitmap has no value, so any change goes out,
+     * no matter what band is */
+    mt_assert((i = poll_deadband(M2MD_PL_DEADBAND_ABS, 5, 0)) == 0);
+    memset(map, 0x00, sizeof(map));
+    now.tv_sec = 0;
+    now.tv_nsec = 0;
+    mt_fail(m2md_pl_report(&polls, i, map, sizeof(map), NAN, &now) == 1);
+    mt_fail(m2md_pl_report(&polls, i, map, sizeof(map), NAN, &now) == 0);
+
+    /* bitmap bigger than 8 bytes is compared by hash */
+    map[15] = 0x80;
+    mt_fail(m2md_pl_report(&polls, i, map, sizeof(map), NAN, &now) == 1);
+    mt_fail(m2md_pl_report(&polls, i, map, sizeof(map), NAN, &now) == 0);
+
+    /* and of course size matters too */
+    mt_fail(m2md_pl_report(&polls, i, map, 15, NAN, &now) == 1);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void pl_arena_topic_copied(void)
+{
+    struct m2md_pl_data  data;
+    char                 topic[32];
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    poll_data(&data, topic, 7);
+    mt_fok(m2md_pl_add(&polls, &data));
+
+    /* caller's topic is not needed after add */
+    strcpy(topic, "/changed");
+    mt_fail(polls.data[0].topic != topic);
+    mt_fail(strcmp(polls.data[0].topic, "/poll/7") == 0);
+    mt_fail(arena_owns(polls.data[0].topic));
+    mt_fail(polls.live == strlen("/poll/7") + 1);
+    mt_fail(polls.dead == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void pl_arena_packed(void)
+{
+    size_t  live;
+    size_t  i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    mt_assert(polls_add(0, NPOLLS) == 0);
+
+    live = 0;
+    for (i = 0; i != polls.nnodes; ++i)
+    {
+        live += strlen(polls.data[i].topic) + 1;
+        mt_assert(arena_owns(polls.data[i].topic));
+    }
+
+    /* topics are packed into few big chunks, not one
+     * allocation per topic, and nothing is lost */
+    mt_fail(polls.live == live);
+    mt_fail(arena_chunks() <= (int)(live / 4096) + 1);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void pl_arena_big_topic(void)
+{
+    struct m2md_pl_data  data;
+    char                 small[32];
+    char                *big;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    mt_assert((big = malloc(10000)) != NULL);
+    memset(big, 'a', 9999);
+    big[9999] = '\0';
+
+    poll_data(&data, small, 0);
+    mt_fok(m2md_pl_add(&polls, &data));
+
+    /* topic bigger than chunk gets chunk of its own size */
+    poll_data(&data, small, 1);
+    data.topic = big;
+    mt_fok(m2md_pl_add(&polls, &data));
+    mt_fail(arena_chunks() == 2);
+    mt_fail(polls.chunks->size == 10000);
+    mt_fail(strcmp(polls.data[1].topic, big) == 0);
+
+    /* and next topic does not fit after it */
+    mt_assert(polls_add(2, 3) == 0);
+    mt_fail(arena_chunks() == 3);
+    mt_fail(poll_valid(0) == 0);
+    mt_fail(poll_valid(2) == 0);
+    free(big);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void pl_arena_compact(void)
+{
+    int  chunks;
+    int  i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    mt_assert(polls_add(0, NPOLLS) == 0);
+    chunks = arena_chunks();
+
+    /* delete most of polls, arena must be compacted on the way */
+    for (i = 0; i != NPOLLS; ++i)
+        if (i % 10)
+            mt_assert(poll_delete(i) == 0);
+
+    mt_fail(polls.dead < polls.live || polls.dead < 4096);
+    mt_fail(arena_chunks() < chunks);
+
+    for (i = 0; i < NPOLLS; i += 10)
+    {
+        mt_assert(poll_valid(i) == 0);
+        mt_assert(arena_owns(polls.data[poll_find(i)].topic));
+    }
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void pl_arena_delete_all(void)
+{
+    int  i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    mt_assert(polls_add(0, NPOLLS) == 0);
+
+    for (i = 0; i != NPOLLS; ++i)
+        mt_assert(poll_delete(i) == 0);
+
+    mt_fail(polls.live == 0);
+
+    /* list is as good as new */
+    mt_assert(polls_add(0, 100) == 0);
+    for (i = 0; i != 100; ++i)
+        mt_assert(poll_valid(i) == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void pl_arrays_dense(void)
+{
+    int  i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    for (i = 0; i != NPOLLS; ++i)
+    {
+        mt_assert(polls_add(i, i + 1) == 0);
+
+        /* arrays grow by eighth at a time, so no more than
+         * eighth of them is unused, new poll goes at the end */
+        mt_assert(polls.nnodes <= polls.size);
+        mt_assert(polls.size - polls.nnodes <= polls.size / 8 ||
+                polls.size == 16);
+        mt_assert(poll_find(i) == (size_t)i);
+        mt_assert(polls.next_read[i].tv_sec == 0);
+        mt_assert(polls.rp_slot[i] == M2MD_PL_NO_SLOT);
+    }
+
+    mt_fail(polls.last == NULL);
+}
+
+
+/* ==========================================================================
+                       __     __ _          ____
+        ____   __  __ / /_   / /(_)_____   / __/__  __ ____   _____ _____
+       / __ \ / / / // __ \ / // // ___/  / /_ / / / // __ \ / ___// ___/
+      / /_/ // /_/ // /_/ // // // /__   / __// /_/ // / / // /__ (__  )
+     / .___/ \__,_//_.___//_//_/ \___/  /_/   \__,_//_/ /_/ \___//____/
+    /_/
+   ========================================================================== */
+
+
+void m2md_pl_test_group(void)
+{
+    mt_prepare_test = &test_prepare;
+    mt_cleanup_test = &test_cleanup;
+
+    mt_run(pl_find_empty);
+    mt_run(pl_add_find);
+    mt_run(pl_index_half_full);
+    mt_run(pl_add_einval);
+    mt_run(pl_add_duplicate);
+    mt_run(pl_delete_all);
+    mt_run(pl_delete_random);
+    mt_run(pl_delete_readd);
+    mt_run(pl_delete_moves_last);
+    mt_run(pl_delete_enoent);
+    mt_run(pl_delete_clears_rp_slot);
+    mt_run(pl_last_only_with_deadband);
+    mt_run(pl_strike_counts);
+    mt_run(pl_strike_backoff);
+    mt_run(pl_exc_follows_poll);
+    mt_run(pl_report_no_deadband);
+    mt_run(pl_report_any);
+    mt_run(pl_report_abs);
+    mt_run(pl_report_percent);
+    mt_run(pl_report_heartbeat);
+    mt_run(pl_report_bitmap);
+    mt_run(pl_arena_topic_copied);
+    mt_run(pl_arena_packed);
+    mt_run(pl_arena_big_topic);
+    mt_run(pl_arena_compact);
+    mt_run(pl_arena_delete_all);
+    mt_run(pl_arrays_dense);
+}
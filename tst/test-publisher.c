@@ -0,0 +1,576 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+          _               __            __         ____ _  __
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+
+   ========================================================================== */
+
+
+
+#include "mtest.h"
+#include "cfg.h"
+#include "publisher.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+/* ==========================================================================
+          __             __                     __   _
+     ____/ /___   _____ / /____ _ _____ ____ _ / /_ (_)____   ____   _____
+    / __  // _ \ / ___// // __ `// ___// __ `// __// // __ \ / __ \ / ___/
+   / /_/ //  __// /__ / // /_/ // /   / /_/ // /_ / // /_/ // / / /(__  )
+   \__,_/ \___/ \___//_/ \__,_//_/    \__,_/ \__//_/ \____//_/ /_//____/
+
+   ========================================================================== */
+
+
+/* producers in multi producer tests, and samples each of them pushes */
+#define NPRODUCERS  4
+#define NSAMPLES    10000
+
+/* sample, as captured from mqtt */
+struct sample
+{
+    char  topic[32];
+    int   producer;
+    int   seq;
+    int   len;
+};
+
+mt_defs_ext();
+static struct m2md_cfg   cfg;
+static pthread_mutex_t   lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sample    *samples;
+static int               nsamples;
+static int               slow;
+static unsigned char     big[M2MD_PUB_INLINE * 3];
+static uint32_t          tid;
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ========================================================================== */
+
+
+/* ==========================================================================
+    Takes place of mqtt, instead of sending samples to broker, it keeps
+    them, so tests can see what publisher did.
+   ========================================================================== */
+int m2md_mqtt_publish_full
+(
+    const char      *topic,
+    const void      *payload,
+    int              paylen,
+    int              retain
+)
+{
+    struct sample   *s;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    (void)retain;
+
+    if (slow)
+        usleep(10);
+
+    pthread_mutex_lock(&lock);
+    if (nsamples == NPRODUCERS * NSAMPLES)
+    {
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+
+    s = &samples[nsamples++];
+    strncpy(s->topic, topic, sizeof(s->topic) - 1);
+    s->len = paylen;
+    s->producer = -1;
+    s->seq = -1;
+
+    if (paylen == 2 * sizeof(int))
+    {
+        memcpy(&s->producer, payload, sizeof(int));
+        memcpy(&s->seq, (const int *)payload + 1, sizeof(int));
+    }
+    else if (paylen == sizeof(big) && memcmp(payload, big, paylen) == 0)
+        s->seq = 0;
+
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+
+/* ==========================================================================
+    Pushes sample 'seq' of 'producer' to queue.
+   ========================================================================== */
+static int push
+(
+    int  producer,
+    int  seq
+)
+{
+    int  payload[2];
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    payload[0] = producer;
+    payload[1] = seq;
+    return m2md_pub_push(tid, payload, sizeof(payload));
+}
+
+
+/* ==========================================================================
+    Producer thread, pushes NSAMPLES samples in order.
+   ========================================================================== */
+static void *producer_thread
+(
+    void  *arg
+)
+{
+    int    i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    for (i = 0; i != NSAMPLES; ++i)
+        if (push(*(int *)arg, i) != 0)
+            break;
+
+    return NULL;
+}
+
+
+/* ==========================================================================
+    Runs NPRODUCERS producers at once, with publishers running, and
+    stops publishers once all producers are done.
+   ========================================================================== */
+static int run_producers
+(
+    void
+)
+{
+    pthread_t  t[NPRODUCERS];
+    int        id[NPRODUCERS];
+    int        i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    if (m2md_pub_start() != 0)
+        return -1;
+
+    for (i = 0; i != NPRODUCERS; ++i)
+    {
+        id[i] = i;
+        pthread_create(&t[i], NULL, producer_thread, &id[i]);
+    }
+
+    for (i = 0; i != NPRODUCERS; ++i)
+        pthread_join(t[i], NULL);
+
+    /* what's left in queue is published after stop */
+    m2md_pub_stop();
+    return 0;
+}
+
+
+/* ==========================================================================
+    Checks that samples of one producer are published in order they
+    were pushed in, and that each of them is published exactly once.
+   ========================================================================== */
+static int samples_valid
+(
+    int   in_order
+)
+{
+    int   next[NPRODUCERS];
+    int   count[NPRODUCERS];
+    int   i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    memset(next, 0x00, sizeof(next));
+    memset(count, 0x00, sizeof(count));
+
+    for (i = 0; i != nsamples; ++i)
+    {
+        if (samples[i].producer < 0 || samples[i].producer >= NPRODUCERS)
+            return -1;
+
+        if (in_order && samples[i].seq != next[samples[i].producer]++)
+            return -1;
+
+        count[samples[i].producer]++;
+    }
+
+    for (i = 0; i != NPRODUCERS; ++i)
+        if (count[i] != NSAMPLES)
+            return -1;
+
+    return 0;
+}
+
+
+/* ==========================================================================
+    Pushes 'n' samples of producer 0, then publishes them, all at once.
+   ========================================================================== */
+static int push_then_publish
+(
+    int  n
+)
+{
+    int  i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    for (i = 0; i != n; ++i)
+        if (push(0, i) != 0)
+            return -1;
+
+    if (m2md_pub_start() != 0)
+        return -1;
+
+    m2md_pub_stop();
+    return 0;
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void test_prepare(void)
+{
+    memset(&cfg, 0x00, sizeof(cfg));
+    cfg.mqtt_publishers = 1;
+    cfg.mqtt_queue = 16;
+    cfg.mqtt_backpressure = M2MD_PUB_DROP_OLDEST;
+    m2md_cfg = &cfg;
+
+    samples = calloc(NPRODUCERS * NSAMPLES, sizeof(*samples));
+    nsamples = 0;
+    slow = 0;
+    tid = m2md_pub_topic("/m2md/test");
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void test_cleanup(void)
+{
+    m2md_pub_cleanup();
+    free(samples);
+    m2md_cfg = NULL;
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void pub_disabled(void)
+{
+    cfg.mqtt_publishers = 0;
+    mt_fok(m2md_pub_init());
+    mt_fok(m2md_pub_start());
+    mt_ferr(push(0, 0), ENODEV);
+    m2md_pub_stop();
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void pub_push_einval(void)
+{
+    mt_fok(m2md_pub_init());
+    mt_ferr(m2md_pub_push(tid, NULL, 1), EINVAL);
+    mt_ferr(m2md_pub_push(tid, big, -1), EINVAL);
+
+    /* sample without topic must go around the queue */
+    mt_ferr(m2md_pub_push(M2MD_PUB_NO_TOPIC, big, 1), EINVAL);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void pub_topic(void)
+{
+    uint32_t  a;
+    uint32_t  b;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    /* every call gives new id, even for the same topic */
+    a = m2md_pub_topic("/m2md/a");
+    b = m2md_pub_topic("/m2md/a");
+    mt_fail(a != M2MD_PUB_NO_TOPIC);
+    mt_fail(b != M2MD_PUB_NO_TOPIC);
+    mt_fail(a == tid + 1);
+    mt_fail(b == tid + 2);
+
+    mt_fok(m2md_pub_init());
+    mt_fok(m2md_pub_push(a, big, 1));
+    mt_fok(m2md_pub_push(tid, big, 1));
+    mt_fok(m2md_pub_start());
+    m2md_pub_stop();
+
+    mt_assert(nsamples == 2);
+    mt_fail(strcmp(samples[0].topic, "/m2md/a") == 0);
+    mt_fail(strcmp(samples[1].topic, "/m2md/test") == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void pub_payload(void)
+{
+    size_t  i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    for (i = 0; i != sizeof(big); ++i)
+        big[i] = i;
+
+    mt_fok(m2md_pub_init());
+
+    /* payload that does not fit in cell, and empty one */
+    mt_fok(m2md_pub_push(tid, big, sizeof(big)));
+    mt_fok(m2md_pub_push(tid, big, 0));
+    mt_fok(m2md_pub_start());
+    m2md_pub_stop();
+
+    mt_assert(nsamples == 2);
+    mt_fail(samples[0].len == sizeof(big));
+    mt_fail(samples[0].seq == 0);
+    mt_fail(samples[1].len == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void pub_queue_pow2(void)
+{
+    int  i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    /* 10 is rounded up to 16 */
+    cfg.mqtt_queue = 10;
+    cfg.mqtt_backpressure = M2MD_PUB_DROP_NEWEST;
+    mt_fok(m2md_pub_init());
+    mt_fok(push_then_publish(20));
+
+    mt_assert(nsamples == 16);
+    for (i = 0; i != 16; ++i)
+        if (samples[i].seq != i)
+            break;
+
+    mt_fail(i == 16);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void pub_drop_oldest(void)
+{
+    int  i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    cfg.mqtt_backpressure = M2MD_PUB_DROP_OLDEST;
+    mt_fok(m2md_pub_init());
+    mt_fok(push_then_publish(40));
+
+    /* newest 16 samples survive */
+    mt_assert(nsamples == 16);
+    for (i = 0; i != 16; ++i)
+        if (samples[i].seq != 24 + i)
+            break;
+
+    mt_fail(i == 16);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void pub_drop_newest(void)
+{
+    int  i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    cfg.mqtt_backpressure = M2MD_PUB_DROP_NEWEST;
+    mt_fok(m2md_pub_init());
+    mt_fok(push_then_publish(40));
+
+    /* oldest 16 samples survive */
+    mt_assert(nsamples == 16);
+    for (i = 0; i != 16; ++i)
+        if (samples[i].seq != i)
+            break;
+
+    mt_fail(i == 16);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void pub_block(void)
+{
+    int  i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    /* publisher is slower than producer, so
+     * producer must wait, and lose nothing */
+    cfg.mqtt_backpressure = M2MD_PUB_BLOCK;
+    slow = 1;
+    mt_fok(m2md_pub_init());
+    mt_fok(m2md_pub_start());
+
+    for (i = 0; i != 1000; ++i)
+        if (push(0, i) != 0)
+            break;
+
+    m2md_pub_stop();
+
+    mt_assert(nsamples == 1000);
+    for (i = 0; i != 1000; ++i)
+        if (samples[i].seq != i)
+            break;
+
+    mt_fail(i == 1000);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void pub_block_stopped(void)
+{
+    int  i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    /* nobody is going to make room, so producer must not
+     * wait for it forever, but drop newest instead */
+    cfg.mqtt_backpressure = M2MD_PUB_BLOCK;
+    mt_fok(m2md_pub_init());
+    m2md_pub_stop();
+
+    for (i = 0; i != 40; ++i)
+        if (push(0, i) != 0)
+            break;
+
+    mt_fail(i == 40);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void pub_mpsc_order(void)
+{
+    /* with single consumer, samples of each
+     * producer come out in order they went in */
+    cfg.mqtt_queue = 64;
+    cfg.mqtt_backpressure = M2MD_PUB_BLOCK;
+    mt_fok(m2md_pub_init());
+    mt_fok(run_producers());
+
+    mt_fail(nsamples == NPRODUCERS * NSAMPLES);
+    mt_fok(samples_valid(1));
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void pub_mpmc_once(void)
+{
+    /* many consumers publish in parallel, so order is lost,
+     * but still, each sample must be published once */
+    cfg.mqtt_publishers = 3;
+    cfg.mqtt_queue = 64;
+    cfg.mqtt_backpressure = M2MD_PUB_BLOCK;
+    mt_fok(m2md_pub_init());
+    mt_fok(run_producers());
+
+    mt_fail(nsamples == NPRODUCERS * NSAMPLES);
+    mt_fok(samples_valid(0));
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void pub_mpsc_drop_oldest(void)
+{
+    int  last[NPRODUCERS];
+    int  i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    /* producers drop samples on their own, while publisher
+     * takes them too, what's left must still be in order */
+    cfg.mqtt_backpressure = M2MD_PUB_DROP_OLDEST;
+    slow = 1;
+    mt_fok(m2md_pub_init());
+    mt_fok(m2md_pub_start());
+
+    for (i = 0; i != NPRODUCERS; ++i)
+        last[i] = -1;
+
+    for (i = 0; i != NSAMPLES; ++i)
+        push(i % NPRODUCERS, i);
+
+    m2md_pub_stop();
+
+    mt_assert(nsamples > 0 && nsamples <= NSAMPLES);
+    for (i = 0; i != nsamples; ++i)
+    {
+        if (samples[i].seq <= last[samples[i].producer])
+            break;
+
+        last[samples[i].producer] = samples[i].seq;
+    }
+
+    mt_fail(i == nsamples);
+
+    /* newest sample is never the one that's dropped */
+    mt_fail(samples[nsamples - 1].seq == NSAMPLES - 1);
+}
+
+
+/* ==========================================================================
+                       __     __ _          ____
+        ____   __  __ / /_   / /(_)_____   / __/__  __ ____   _____ _____
+       / __ \ / / / // __ \ / // // ___/  / /_ / / / // __ \ / ___// ___/
+      / /_/ // /_/ // /_/ // // // /__   / __// /_/ // / / // /__ (__  )
+     / .___/ \__,_//_.___//_//_/ \___/  /_/   \__,_//_/ /_/ \___//____/
+    /_/
+   ========================================================================== */
+
+
+void m2md_pub_test_group(void)
+{
+    mt_prepare_test = &test_prepare;
+    mt_cleanup_test = &test_cleanup;
+
+    mt_run(pub_disabled);
+    mt_run(pub_push_einval);
+    mt_run(pub_topic);
+    mt_run(pub_payload);
+    mt_run(pub_queue_pow2);
+    mt_run(pub_drop_oldest);
+    mt_run(pub_drop_newest);
+    mt_run(pub_block);
+    mt_run(pub_block_stopped);
+    mt_run(pub_mpsc_order);
+    mt_run(pub_mpmc_once);
+    mt_run(pub_mpsc_drop_oldest);
+}
@@ -0,0 +1,754 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+          _               __            __         ____ _  __
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+
+   ========================================================================== */
+
+
+#include "mtest.h"
+#include "read-plan.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+
+/* ==========================================================================
+          __             __                     __   _
+     ____/ /___   _____ / /____ _ _____ ____ _ / /_ (_)____   ____   _____
+    / __  // _ \ / ___// // __ `// ___// __ `// __// // __ \ / __ \ / ___/
+   / /_/ //  __// /__ / // /_/ // /   / /_/ // /_ / // /_/ // / / /(__  )
+   \__,_/ \___/ \___//_/ \__,_//_/    \__,_/ \__//_/ \____//_/ /_//____/
+
+   ========================================================================== */
+
+
+mt_defs_ext();
+static struct m2md_pl_list  polls;
+static struct m2md_rp       plan;
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ========================================================================== */
+
+
+/* ==========================================================================
+    Adds poll of 'width' registers at 'reg' of unit 'uid' to the list,
+    polls are read every second, unless changed later.
+   ========================================================================== */
+static int poll_add_uid
+(
+    int                   func,
+    int                   reg,
+    int                   width,
+    int                   uid
+)
+{
+    struct m2md_pl_data   data;
+    char                  topic[32];
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    memset(&data, 0x00, sizeof(data));
+    sprintf(topic, "/%d/%d/%d", uid, func, reg);
+    data.func = func;
+    data.reg = reg;
+    data.uid = uid;
+    data.topic = topic;
+    data.scale = 1;
+    data.field_width = width;
+    data.type = M2MD_PL_TYPE_RAW;
+    data.poll_time.tv_sec = 1;
+
+    return m2md_pl_add(&polls, &data);
+}
+
+
+/* ==========================================================================
+    Adds poll of unit 1, that's the unit of all polls in most tests.
+   ========================================================================== */
+static int poll_add
+(
+    int  func,
+    int  reg,
+    int  width
+)
+{
+    return poll_add_uid(func, reg, width, 1);
+}
+
+
+/* ==========================================================================
+    Returns position of poll at 'reg' read with 'func'.
+   ========================================================================== */
+static size_t poll_find
+(
+    int                   func,
+    int                   reg
+)
+{
+    struct m2md_pl_data   data;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    memset(&data, 0x00, sizeof(data));
+    data.func = func;
+    data.reg = reg;
+    data.uid = 1;
+
+    return m2md_pl_find(&polls, &data);
+}
+
+
+/* ==========================================================================
+    Returns block in plan that reads poll at 'reg' with 'func', or NULL
+    when poll is in no block.
+   ========================================================================== */
+static struct m2md_rp_block *block_of
+(
+    int      func,
+    int      reg
+)
+{
+    size_t   poll;
+    size_t   i;
+    int      j;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    poll = poll_find(func, reg);
+    for (i = 0; i != plan.nblocks; ++i)
+        for (j = 0; j != plan.blocks[i].npolls; ++j)
+            if (plan.blocks[i].polls[j] == poll)
+                return &plan.blocks[i];
+
+    return NULL;
+}
+
+
+/* ==========================================================================
+    Checks that every poll of the list is in exactly one block, its
+    registers are covered by that block, and its read plan slot points
+    back to it.
+   ========================================================================== */
+static int plan_consistent(void)
+{
+    const struct m2md_rp_block  *block;
+    const struct m2md_pl_data   *poll;
+    size_t                       found;
+    size_t                       i;
+    size_t                       p;
+    int                          j;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    for (p = 0; p != polls.nnodes; ++p)
+    {
+        found = 0;
+        poll = &polls.data[p];
+
+        for (i = 0; i != plan.nblocks; ++i)
+        {
+            block = &plan.blocks[i];
+            for (j = 0; j != block->npolls; ++j)
+            {
+                if (block->polls[j] != p)
+                    continue;
+
+                if (polls.rp_polls + polls.rp_slot[p] != &block->polls[j])
+                    return -1;
+
+                if (poll->reg < block->reg || poll->reg +
+                        m2md_rp_poll_width(poll) > block->reg + block->count)
+                    return -1;
+
+                if (poll->func != block->func || poll->uid != block->uid)
+                    return -1;
+
+                ++found;
+            }
+        }
+
+        if (found != 1)
+            return -1;
+    }
+
+    return 0;
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void test_prepare(void)
+{
+    m2md_pl_init(&polls);
+    m2md_rp_init(&plan);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void test_cleanup(void)
+{
+    m2md_rp_destroy(&plan);
+    m2md_pl_destroy(&polls);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void rp_build_empty(void)
+{
+    mt_fok(m2md_rp_build(&plan, &polls, 0, 125));
+    mt_fail(plan.nblocks == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void rp_build_einval(void)
+{
+    mt_ferr(m2md_rp_build(NULL, &polls, 0, 125), EINVAL);
+    mt_ferr(m2md_rp_build(&plan, NULL, 0, 125), EINVAL);
+    mt_ferr(m2md_rp_build(&plan, &polls, 0, 0), EINVAL);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void rp_adjacent_one_block(void)
+{
+    int  i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    /* added out of order on purpose, plan sorts them */
+    for (i = 59; i >= 0; --i)
+        mt_assert(poll_add(3, 100 + i, 1) == 0);
+
+    mt_fok(m2md_rp_build(&plan, &polls, 0, 125));
+    mt_fail(plan.nblocks == 1);
+    mt_fail(plan.blocks[0].reg == 100);
+    mt_fail(plan.blocks[0].count == 60);
+    mt_fail(plan.blocks[0].npolls == 60);
+    mt_fail(plan_consistent() == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void rp_gap_not_bridged(void)
+{
+    mt_assert(poll_add(3, 0, 2) == 0);
+    mt_assert(poll_add(3, 3, 1) == 0);
+
+    /* one unused register between polls, 0 allowed */
+    mt_fok(m2md_rp_build(&plan, &polls, 0, 125));
+    mt_fail(plan.nblocks == 2);
+    mt_fail(block_of(3, 0) != block_of(3, 3));
+    mt_fail(plan_consistent() == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void rp_gap_bridged(void)
+{
+    mt_assert(poll_add(3, 0, 2) == 0);
+    mt_assert(poll_add(3, 5, 1) == 0);
+
+    /* three unused registers, exactly what is allowed */
+    mt_fok(m2md_rp_build(&plan, &polls, 3, 125));
+    mt_fail(plan.nblocks == 1);
+    mt_fail(plan.blocks[0].reg == 0);
+    mt_fail(plan.blocks[0].count == 6);
+
+    /* and one too many */
+    mt_fok(m2md_rp_build(&plan, &polls, 2, 125));
+    mt_fail(plan.nblocks == 2);
+    mt_fail(plan_consistent() == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void rp_max_block(void)
+{
+    struct m2md_rp_block  *block;
+    int                    i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    for (i = 0; i != 300; ++i)
+        mt_assert(poll_add(4, i, 1) == 0);
+
+    mt_fok(m2md_rp_build(&plan, &polls, 0, 125));
+    mt_fail(plan.nblocks == 3);
+
+    for (i = 0; i != (int)plan.nblocks; ++i)
+        mt_fail(plan.blocks[i].count <= 125);
+
+    block = block_of(4, 0);
+    mt_assert(block != NULL);
+    mt_fail(block->count == 125);
+    mt_fail(block_of(4, 124) == block);
+    mt_fail(block_of(4, 125) != block);
+    mt_fail(plan_consistent() == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void rp_max_block_wide_poll(void)
+{
+    /* second poll starts within the limit, but ends past it */
+    mt_assert(poll_add(3, 0, 123) == 0);
+    mt_assert(poll_add(3, 123, 4) == 0);
+
+    mt_fok(m2md_rp_build(&plan, &polls, 0, 125));
+    mt_fail(plan.nblocks == 2);
+    mt_fail(block_of(3, 0)->count == 123);
+    mt_fail(block_of(3, 123)->count == 4);
+    mt_fail(plan_consistent() == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void rp_max_block_custom(void)
+{
+    int  i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    for (i = 0; i != 40; ++i)
+        mt_assert(poll_add(3, i, 1) == 0);
+
+    mt_fok(m2md_rp_build(&plan, &polls, 0, 10));
+    mt_fail(plan.nblocks == 4);
+
+    mt_fok(m2md_rp_build(&plan, &polls, 0, 1));
+    mt_fail(plan.nblocks == 40);
+    mt_fail(plan_consistent() == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void rp_bits_limit(void)
+{
+    struct m2md_rp_block  *block;
+    int                    i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    for (i = 0; i != M2MD_RP_MAX_BITS + 100; ++i)
+        mt_assert(poll_add(1, i, 1) == 0);
+
+    /* max_block is for registers, bits have limit of their own */
+    mt_fok(m2md_rp_build(&plan, &polls, 0, 125));
+    mt_fail(plan.nblocks == 2);
+
+    block = block_of(1, 0);
+    mt_assert(block != NULL);
+    mt_fail(block->count == M2MD_RP_MAX_BITS);
+    mt_fail(block->npolls == M2MD_RP_MAX_BITS);
+    mt_fail(block_of(1, M2MD_RP_MAX_BITS) != block);
+    mt_fail(block_of(1, M2MD_RP_MAX_BITS)->count == 100);
+
+    /* bits have no batch decoder */
+    mt_fail(block->decode.scale == NULL);
+    mt_fail(plan_consistent() == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void rp_bits_gap(void)
+{
+    /* bit gap is 16 times register gap, 16 bits fit in gap of 1 */
+    mt_assert(poll_add(2, 0, 8) == 0);
+    mt_assert(poll_add(2, 24, 1) == 0);
+
+    mt_fok(m2md_rp_build(&plan, &polls, 1, 125));
+    mt_fail(plan.nblocks == 1);
+    mt_fail(plan.blocks[0].count == 25);
+
+    mt_assert(poll_add(2, 42, 1) == 0);
+    mt_fok(m2md_rp_build(&plan, &polls, 1, 125));
+    mt_fail(plan.nblocks == 2);
+    mt_fail(block_of(2, 42) != block_of(2, 0));
+    mt_fail(plan_consistent() == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void rp_groups_apart(void)
+{
+    size_t  i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    /* neighbours in registers, but each
+     * differs in something that matters */
+    mt_assert(poll_add(3, 0, 1) == 0);
+    mt_assert(poll_add(4, 1, 1) == 0);
+    mt_assert(poll_add_uid(3, 2, 1, 2) == 0);
+    mt_assert(poll_add(3, 3, 1) == 0);
+    mt_assert(poll_add(3, 4, 1) == 0);
+    mt_assert(poll_add(3, 5, 1) == 0);
+
+    polls.data[poll_find(3, 3)].poll_time.tv_nsec = 1;
+    polls.exc[poll_find(3, 4)].split = 1;
+
+    mt_fok(m2md_rp_build(&plan, &polls, 10, 125));
+
+    /* poll 3:5 is the only one that goes with 3:0 */
+    mt_fail(plan.nblocks == 5);
+    mt_fail(block_of(3, 5) == block_of(3, 0));
+
+    for (i = 0; i != plan.nblocks; ++i)
+        mt_fail(plan.blocks[i].count <= 6);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void rp_deadline_earliest(void)
+{
+    mt_assert(poll_add(3, 0, 1) == 0);
+    mt_assert(poll_add(3, 1, 1) == 0);
+    mt_assert(poll_add(3, 2, 1) == 0);
+
+    polls.next_read[poll_find(3, 0)].tv_sec = 30;
+    polls.next_read[poll_find(3, 1)].tv_sec = 10;
+    polls.next_read[poll_find(3, 2)].tv_sec = 20;
+
+    mt_fok(m2md_rp_build(&plan, &polls, 0, 125));
+    mt_fail(plan.nblocks == 1);
+    mt_fail(plan.blocks[0].sched.deadline.tv_sec == 10);
+    mt_fail(plan.blocks[0].sched.idx == M2MD_SCHED_NOT_QUEUED);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void rp_rebuild_keeps_schedule(void)
+{
+    unsigned  gen;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    mt_assert(poll_add(3, 0, 1) == 0);
+    mt_assert(poll_add(3, 1, 1) == 0);
+    mt_fok(m2md_rp_build(&plan, &polls, 0, 125));
+    gen = plan.gen;
+
+    /* block has been read, and its timer moved */
+    plan.blocks[0].sched.deadline.tv_sec = 77;
+
+    mt_assert(poll_add(3, 2, 1) == 0);
+    mt_fok(m2md_rp_build(&plan, &polls, 0, 125));
+    mt_fail(plan.gen != gen);
+    mt_fail(plan.nblocks == 1);
+
+    /* new poll has not been scheduled yet, so it does not
+     * move block, and old polls continue from where old block
+     * was, with no read skipped or doubled */
+    mt_fail(plan.blocks[0].sched.deadline.tv_sec == 77);
+    mt_fail(polls.next_read[poll_find(3, 0)].tv_sec == 77);
+    mt_fail(polls.next_read[poll_find(3, 1)].tv_sec == 77);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void rp_deadline_ignores_unscheduled(void)
+{
+    mt_assert(poll_add(3, 0, 1) == 0);
+    mt_assert(poll_add(3, 1, 1) == 0);
+    mt_assert(poll_add(3, 2, 1) == 0);
+
+    /* none scheduled, block is not either */
+    mt_fok(m2md_rp_build(&plan, &polls, 0, 125));
+    mt_fail(plan.nblocks == 1);
+    mt_fail(plan.blocks[0].sched.deadline.tv_sec == 0);
+    mt_fail(plan.blocks[0].sched.deadline.tv_nsec == 0);
+
+    /* poll that is not first in block is the only one with
+     * schedule, block takes it, even though it is later
+     * than zero time of the rest, fresh plan, so old block
+     * does not hand its own schedule back to polls */
+    m2md_rp_destroy(&plan);
+    m2md_rp_init(&plan);
+    polls.next_read[poll_find(3, 1)].tv_sec = 40;
+    polls.next_read[poll_find(3, 1)].tv_nsec = 5;
+
+    mt_fok(m2md_rp_build(&plan, &polls, 0, 125));
+    mt_fail(plan.nblocks == 1);
+    mt_fail(plan.blocks[0].sched.deadline.tv_sec == 40);
+    mt_fail(plan.blocks[0].sched.deadline.tv_nsec == 5);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void rp_shorter_poll_time_keeps_schedule(void)
+{
+    struct m2md_pl_data  data;
+    char                 topic[] = "/1/3/1";
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    /* two polls read every second, and one every 500ms */
+    mt_assert(poll_add(3, 0, 1) == 0);
+    mt_assert(poll_add(3, 1, 1) == 0);
+    mt_assert(poll_add(3, 2, 1) == 0);
+    polls.data[poll_find(3, 2)].poll_time.tv_sec = 0;
+    polls.data[poll_find(3, 2)].poll_time.tv_nsec = 500000000;
+
+    mt_fok(m2md_rp_build(&plan, &polls, 0, 125));
+    mt_fail(plan.nblocks == 2);
+    block_of(3, 0)->sched.deadline.tv_sec = 77;
+    block_of(3, 2)->sched.deadline.tv_sec = 50;
+
+    /* second poll is now read every 500ms too */
+    memset(&data, 0x00, sizeof(data));
+    data.func = 3;
+    data.reg = 1;
+    data.uid = 1;
+    data.topic = topic;
+    data.poll_time.tv_nsec = 500000000;
+    mt_fok(m2md_pl_add(&polls, &data));
+
+    /* it moves over to faster block, which keeps its schedule,
+     * and so does the block it left */
+    mt_fok(m2md_rp_build(&plan, &polls, 0, 125));
+    mt_fail(plan.nblocks == 2);
+    mt_fail(block_of(3, 1) == block_of(3, 2));
+    mt_fail(block_of(3, 0) != block_of(3, 1));
+    mt_fail(block_of(3, 0)->sched.deadline.tv_sec == 77);
+    mt_fail(block_of(3, 2)->sched.deadline.tv_sec == 50);
+    mt_fail(polls.next_read[poll_find(3, 0)].tv_sec == 77);
+    mt_fail(polls.next_read[poll_find(3, 2)].tv_sec == 50);
+    mt_fail(plan_consistent() == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void rp_delete_clears_slot(void)
+{
+    struct m2md_pl_data   data;
+    struct m2md_rp_block  *block;
+    size_t                 moved;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    mt_assert(poll_add(3, 0, 1) == 0);
+    mt_assert(poll_add(3, 1, 1) == 0);
+    mt_assert(poll_add(3, 2, 1) == 0);
+    mt_fok(m2md_rp_build(&plan, &polls, 0, 125));
+    block = &plan.blocks[0];
+
+    memset(&data, 0x00, sizeof(data));
+    data.func = 3;
+    data.reg = 0;
+    data.uid = 1;
+    mt_fok(m2md_pl_delete(&polls, &data));
+
+    /* deleted poll is gone from block, last poll was moved in its
+     * place in list, and block follows it to its new position */
+    moved = poll_find(3, 2);
+    mt_fail(moved == 0);
+    mt_fail(block->polls[0] == M2MD_PL_NONE);
+    mt_fail(block->polls[2] == moved);
+
+    mt_fok(m2md_rp_build(&plan, &polls, 0, 125));
+    mt_fail(plan.nblocks == 1);
+    mt_fail(plan.blocks[0].reg == 1);
+    mt_fail(plan.blocks[0].npolls == 2);
+    mt_fail(plan_consistent() == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void rp_split_halves(void)
+{
+    unsigned  splits;
+    int       i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    for (i = 0; i != 5; ++i)
+        mt_assert(poll_add(3, i, 1) == 0);
+
+    mt_fok(m2md_rp_build(&plan, &polls, 0, 125));
+    mt_assert(plan.nblocks == 1);
+
+    /* block got exception, first half is bigger one */
+    splits = 0;
+    mt_fail(m2md_rp_split(&plan.blocks[0], &polls, &splits) == 5);
+    mt_fail(splits == 2);
+    mt_fail(polls.exc[poll_find(3, 0)].split == 1);
+    mt_fail(polls.exc[poll_find(3, 2)].split == 1);
+    mt_fail(polls.exc[poll_find(3, 3)].split == 2);
+    mt_fail(polls.exc[poll_find(3, 4)].split == 2);
+
+    /* and halves are not put back together */
+    mt_fok(m2md_rp_build(&plan, &polls, 0, 125));
+    mt_fail(plan.nblocks == 2);
+    mt_fail(block_of(3, 0) == block_of(3, 2));
+    mt_fail(block_of(3, 3) == block_of(3, 4));
+    mt_fail(block_of(3, 2) != block_of(3, 3));
+    mt_fail(block_of(3, 0)->count == 3);
+    mt_fail(block_of(3, 3)->count == 2);
+    mt_fail(plan_consistent() == 0);
+
+    /* each half is split further, until bad poll is alone */
+    mt_fail(m2md_rp_split(block_of(3, 3), &polls, &splits) == 2);
+    mt_fok(m2md_rp_build(&plan, &polls, 0, 125));
+    mt_fail(plan.nblocks == 3);
+    mt_fail(block_of(3, 3)->count == 1);
+    mt_fail(block_of(3, 4)->count == 1);
+    mt_fail(plan_consistent() == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void rp_split_single(void)
+{
+    unsigned  splits;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    mt_assert(poll_add(3, 0, 1) == 0);
+    mt_assert(poll_add(3, 1, 1) == 0);
+    mt_fok(m2md_rp_build(&plan, &polls, 0, 125));
+
+    /* poll already read alone, there is nothing to split,
+     * deleted poll doesn't count, caller quarantines it */
+    plan.blocks[0].polls[1] = M2MD_PL_NONE;
+    splits = 9;
+    mt_fail(m2md_rp_split(&plan.blocks[0], &polls, &splits) == 1);
+    mt_fail(splits == 9);
+    mt_fail(polls.exc[0].split == 0);
+
+    plan.blocks[0].polls[0] = M2MD_PL_NONE;
+    mt_fail(m2md_rp_split(&plan.blocks[0], &polls, &splits) == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void rp_split_wraps(void)
+{
+    unsigned  splits;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    mt_assert(poll_add(3, 0, 1) == 0);
+    mt_assert(poll_add(3, 1, 1) == 0);
+    mt_fok(m2md_rp_build(&plan, &polls, 0, 125));
+
+    /* 0 means not split, so it's never given away */
+    splits = (unsigned)-1;
+    mt_fail(m2md_rp_split(&plan.blocks[0], &polls, &splits) == 2);
+    mt_fail(polls.exc[poll_find(3, 0)].split == 1);
+    mt_fail(polls.exc[poll_find(3, 1)].split == 2);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void rp_decode_params(void)
+{
+    struct m2md_rp_block  *block;
+    size_t                 p;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    mt_assert(poll_add(3, 10, 1) == 0);
+    mt_assert(poll_add(3, 11, 2) == 0);
+    mt_assert(poll_add(3, 14, 1) == 0);
+
+    p = poll_find(3, 10);
+    polls.data[p].scale = 0.5f;
+    polls.data[p].is_signed = 1;
+    polls.data[p].order = M2MD_PL_ORDER_BADC;
+
+    p = poll_find(3, 14);
+    polls.data[p].type = M2MD_PL_TYPE_U16;
+    polls.data[p].scale = 3;
+
+    mt_fok(m2md_rp_build(&plan, &polls, 1, 125));
+    mt_assert(plan.nblocks == 1);
+    block = &plan.blocks[0];
+    mt_assert(block->decode.scale != NULL);
+
+    mt_fail(block->decode.scale[0] == 0.5f);
+    mt_fail(block->decode.sign[0] == 0x8000);
+    mt_fail(block->decode.swap[0] == 0xffff);
+
+    /* 32bit poll and gap are not decoded in batch */
+    mt_fail(block->decode.scale[1] == 0);
+    mt_fail(block->decode.scale[2] == 0);
+    mt_fail(block->decode.scale[3] == 0);
+
+    mt_fail(block->decode.scale[4] == 3);
+    mt_fail(block->decode.sign[4] == 0);
+    mt_fail(block->decode.swap[4] == 0);
+}
+
+
+/* ==========================================================================
+                       __     __ _          ____
+        ____   __  __ / /_   / /(_)_____   / __/__  __ ____   _____ _____
+       / __ \ / / / // __ \ / // // ___/  / /_ / / / // __ \ / ___// ___/
+      / /_/ // /_/ // /_/ // // // /__   / __// /_/ // / / // /__ (__  )
+     / .___/ \__,_//_.___//_//_/ \___/  /_/   \__,_//_/ /_/ \___//____/
+    /_/
+   ========================================================================== */
+
+
+void m2md_rp_test_group(void)
+{
+    mt_prepare_test = &test_prepare;
+    mt_cleanup_test = &test_cleanup;
+
+    mt_run(rp_build_empty);
+    mt_run(rp_build_einval);
+    mt_run(rp_adjacent_one_block);
+    mt_run(rp_gap_not_bridged);
+    mt_run(rp_gap_bridged);
+    mt_run(rp_max_block);
+    mt_run(rp_max_block_wide_poll);
+    mt_run(rp_max_block_custom);
+    mt_run(rp_bits_limit);
+    mt_run(rp_bits_gap);
+    mt_run(rp_groups_apart);
+    mt_run(rp_deadline_earliest);
+    mt_run(rp_rebuild_keeps_schedule);
+    mt_run(rp_deadline_ignores_unscheduled);
+    mt_run(rp_shorter_poll_time_keeps_schedule);
+    mt_run(rp_delete_clears_slot);
+    mt_run(rp_split_halves);
+    mt_run(rp_split_single);
+    mt_run(rp_split_wraps);
+    mt_run(rp_decode_params);
+}
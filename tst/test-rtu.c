@@ -0,0 +1,648 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+          _               __            __         ____ _  __
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+
+   ========================================================================== */
+
+
+
+#include "mtest.h"
+#include "rtu.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+
+/* ==========================================================================
+          __             __                     __   _
+     ____/ /___   _____ / /____ _ _____ ____ _ / /_ (_)____   ____   _____
+    / __  // _ \ / ___// // __ `// ___// __ `// __// // __ \ / __ \ / ___/
+   / /_/ //  __// /__ / // /_/ // /   / /_/ // /_ / // /_/ // / / /(__  )
+   \__,_/ \___/ \___//_/ \__,_//_/    \__,_/ \__//_/ \____//_/ /_//____/
+
+   ========================================================================== */
+
+
+/* Stand-in rtu device, on master side of pty. Slave side is what m2md,
+ * or test, opens as serial device. Device answers reads of holding and
+ * input registers of units 1 to RTU_UNITS, every register holds its
+ * address plus 1000 times unit id. Frames with bad crc and frames for
+ * other units get no response, just like on real line. Device measures
+ * silence on the line before each request, and counts requests that
+ * came sooner than line with its baud allows */
+struct rtu_dev
+{
+    int            master;      /* master side of pty, device uses it */
+    int            slave;       /* slave side of pty, client uses it */
+    int            baud;        /* baud rate line is set to */
+    pthread_t      t;           /* thread answering requests */
+    int            stop;        /* set to stop the thread */
+    int            frames;      /* valid requests received */
+    int            bad_crc;     /* requests with bad crc */
+    int            too_soon;    /* requests that came before gap ended */
+    int64_t        last;        /* when line went silent, ns */
+};
+
+#define RTU_UNITS    3
+#define RTU_TIMEOUT  100  /* ms, client waits for response that long */
+
+mt_defs_ext();
+static struct rtu_dev  dev;
+static int64_t         client_last;
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ========================================================================== */
+
+
+/* ==========================================================================
+    Returns monotonic time in nanoseconds.
+   ========================================================================== */
+static int64_t now_ns(void)
+{
+    struct timespec  ts;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/* ==========================================================================
+    Calculates modbus crc of 'n' bytes of 'buf'.
+   ========================================================================== */
+static uint16_t crc16
+(
+    const unsigned char  *buf,
+    int                   n
+)
+{
+    uint16_t              crc;
+    int                   i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    crc = 0xffff;
+    while (n--)
+    {
+        crc ^= *buf++;
+        for (i = 0; i != 8; ++i)
+            crc = crc & 1 ? (crc >> 1) ^ 0xa001 : crc >> 1;
+    }
+
+    return crc;
+}
+
+
+/* ==========================================================================
+    Appends crc to frame of 'n' bytes in 'buf', crc goes low byte first.
+
+    Returns size of frame with crc.
+   ========================================================================== */
+static int crc_add
+(
+    unsigned char  *buf,
+    int             n
+)
+{
+    uint16_t        crc;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    crc = crc16(buf, n);
+    buf[n] = crc & 0xff;
+    buf[n + 1] = crc >> 8;
+    return n + 2;
+}
+
+
+/* ==========================================================================
+    Answers single request 'req' of 8 bytes, which has valid crc.
+   ========================================================================== */
+static void dev_answer
+(
+    const unsigned char  *req
+)
+{
+    unsigned char         rsp[256];
+    int                   reg;
+    int                   count;
+    int                   n;
+    int                   i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    if (req[0] < 1 || req[0] > RTU_UNITS)
+        return;
+
+    reg = req[2] << 8 | req[3];
+    count = req[4] << 8 | req[5];
+
+    rsp[0] = req[0];
+    rsp[1] = req[1];
+
+    if (req[1] != 3 && req[1] != 4)
+    {
+        /* illegal function */
+        rsp[1] |= 0x80;
+        rsp[2] = 0x01;
+        n = 3;
+    }
+    else if (count < 1 || count > 125)
+    {
+        /* illegal data value */
+        rsp[1] |= 0x80;
+        rsp[2] = 0x03;
+        n = 3;
+    }
+    else
+    {
+        rsp[2] = count * 2;
+        for (i = 0; i != count; ++i)
+        {
+            rsp[3 + i * 2] = (reg + i + req[0] * 1000) >> 8;
+            rsp[4 + i * 2] = (reg + i + req[0] * 1000) & 0xff;
+        }
+
+        n = 3 + count * 2;
+    }
+
+    n = crc_add(rsp, n);
+    if (write(dev.master, rsp, n) != n)
+        return;
+
+    dev.last = now_ns();
+}
+
+
+/* ==========================================================================
+    Device thread, reads requests from line and answers them. All
+    requests tests send are 8 bytes long, so frames are cut by length.
+   ========================================================================== */
+static void *dev_thread
+(
+    void           *arg
+)
+{
+    struct pollfd   pfd;
+    unsigned char   buf[256];
+    int64_t         start;
+    int64_t         gap;
+    int             len;
+    int             r;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    (void)arg;
+    len = 0;
+    start = 0;
+    gap = (int64_t)m2md_rtu_gap_us(dev.baud) * 1000;
+    pfd.fd = dev.master;
+    pfd.events = POLLIN;
+
+    while (!__atomic_load_n(&dev.stop, __ATOMIC_RELAXED))
+    {
+        if (poll(&pfd, 1, 10) <= 0)
+            continue;
+
+        if ((r = read(dev.master, buf + len, sizeof(buf) - len)) <= 0)
+            continue;
+
+        if (len == 0)
+        {
+            /* first byte of frame, that's where silence ends */
+            start = now_ns();
+            if (dev.last && start - dev.last < gap)
+                __atomic_add_fetch(&dev.too_soon, 1, __ATOMIC_RELAXED);
+        }
+
+        for (len += r; len >= 8; len -= 8)
+        {
+            if (crc16(buf, 8) == 0)
+            {
+                /* crc of frame with its crc is 0 */
+                __atomic_add_fetch(&dev.frames, 1, __ATOMIC_RELAXED);
+                dev.last = now_ns();
+                dev_answer(buf);
+            }
+            else
+            {
+                __atomic_add_fetch(&dev.bad_crc, 1, __ATOMIC_RELAXED);
+                dev.last = now_ns();
+            }
+
+            memmove(buf, buf + 8, len - 8);
+        }
+    }
+
+    return NULL;
+}
+
+
+/* ==========================================================================
+    Opens pty pair and starts device on it, with line of 'baud' rate.
+   ========================================================================== */
+static int dev_start
+(
+    int              baud
+)
+{
+    struct termios   tio;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    memset(&dev, 0x00, sizeof(dev));
+    dev.baud = baud;
+
+    if ((dev.master = posix_openpt(O_RDWR | O_NOCTTY)) < 0)
+        return -1;
+
+    if (grantpt(dev.master) != 0 || unlockpt(dev.master) != 0 ||
+            (dev.slave = open(ptsname(dev.master), O_RDWR | O_NOCTTY)) < 0)
+    {
+        close(dev.master);
+        return -1;
+    }
+
+    /* raw line, just like serial port
+     * opened for modbus rtu would be */
+    tcgetattr(dev.slave, &tio);
+    cfmakeraw(&tio);
+    cfsetspeed(&tio, B9600);
+    tcsetattr(dev.slave, TCSANOW, &tio);
+
+    client_last = 0;
+    return pthread_create(&dev.t, NULL, dev_thread, NULL) ? -1 : 0;
+}
+
+
+/* ==========================================================================
+    Stops device and closes pty.
+   ========================================================================== */
+static void dev_stop(void)
+{
+    __atomic_store_n(&dev.stop, 1, __ATOMIC_RELAXED);
+    pthread_join(dev.t, NULL);
+    close(dev.slave);
+    close(dev.master);
+}
+
+
+/* ==========================================================================
+    Returns counter 'c' of device, device thread updates them.
+   ========================================================================== */
+static int dev_count
+(
+    int  *c
+)
+{
+    return __atomic_load_n(c, __ATOMIC_RELAXED);
+}
+
+
+/* ==========================================================================
+    Sends 'n' bytes of 'req' over the line, as client does, after line
+    has been silent for as long as m2md_rtu_gap_us() says, unless
+    'nowait' is set. Then waits for 'rsplen' bytes of response.
+
+    Returns number of bytes received, 0 when device did not respond.
+   ========================================================================== */
+static int client_send
+(
+    const unsigned char  *req,
+    int                   n,
+    unsigned char        *rsp,
+    int                   rsplen,
+    int                   nowait
+)
+{
+    struct pollfd         pfd;
+    struct timespec       ts;
+    int64_t               wait;
+    int                   got;
+    int                   r;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    wait = client_last + (int64_t)m2md_rtu_gap_us(dev.baud) * 1000 -
+        now_ns();
+    if (!nowait && client_last && wait > 0)
+    {
+        ts.tv_sec = wait / 1000000000;
+        ts.tv_nsec = wait % 1000000000;
+        nanosleep(&ts, NULL);
+    }
+
+    if (write(dev.slave, req, n) != n)
+        return -1;
+
+    client_last = now_ns();
+    pfd.fd = dev.slave;
+    pfd.events = POLLIN;
+
+    for (got = 0; got < rsplen; got += r)
+    {
+        if (poll(&pfd, 1, RTU_TIMEOUT) <= 0)
+            break;
+
+        if ((r = read(dev.slave, rsp + got, rsplen - got)) <= 0)
+            break;
+    }
+
+    if (got)
+        client_last = now_ns();
+
+    return got;
+}
+
+
+/* ==========================================================================
+    Reads 'count' registers at 'reg' of 'uid' with function 'func', and
+    checks that device returned what it holds there.
+
+    Returns 0 when values are right, -1 otherwise.
+   ========================================================================== */
+static int client_read
+(
+    int            uid,
+    int            func,
+    int            reg,
+    int            count,
+    int            nowait
+)
+{
+    unsigned char  req[8];
+    unsigned char  rsp[256];
+    int            n;
+    int            i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    req[0] = uid;
+    req[1] = func;
+    req[2] = reg >> 8;
+    req[3] = reg & 0xff;
+    req[4] = count >> 8;
+    req[5] = count & 0xff;
+    crc_add(req, 6);
+
+    n = 5 + count * 2;
+    if (client_send(req, sizeof(req), rsp, n, nowait) != n ||
+            crc16(rsp, n) != 0)
+        return -1;
+
+    if (rsp[0] != uid || rsp[1] != func || rsp[2] != count * 2)
+        return -1;
+
+    for (i = 0; i != count; ++i)
+        if ((rsp[3 + i * 2] << 8 | rsp[4 + i * 2]) != reg + i + uid * 1000)
+            return -1;
+
+    return 0;
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void test_prepare(void)
+{
+    dev_start(9600);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void test_cleanup(void)
+{
+    dev_stop();
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void rtu_parse_default(void)
+{
+    char  d[64];
+    char  parity;
+    int   data_bit;
+    int   stop_bit;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    mt_fok(m2md_rtu_parse("/dev/ttyUSB0", d, &parity, &data_bit,
+                &stop_bit));
+    mt_fail(strcmp(d, "/dev/ttyUSB0") == 0);
+    mt_fail(parity == 'N');
+    mt_fail(data_bit == 8);
+    mt_fail(stop_bit == 1);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void rtu_parse_settings(void)
+{
+    char  d[64];
+    char  parity;
+    int   data_bit;
+    int   stop_bit;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    mt_fok(m2md_rtu_parse("/dev/ttyS1:8E1", d, &parity, &data_bit,
+                &stop_bit));
+    mt_fail(strcmp(d, "/dev/ttyS1") == 0);
+    mt_fail(parity == 'E');
+    mt_fail(data_bit == 8);
+    mt_fail(stop_bit == 1);
+
+    mt_fok(m2md_rtu_parse("/dev/ttyS1:7O2", d, &parity, &data_bit,
+                &stop_bit));
+    mt_fail(strcmp(d, "/dev/ttyS1") == 0);
+    mt_fail(parity == 'O');
+    mt_fail(data_bit == 7);
+    mt_fail(stop_bit == 2);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void rtu_parse_einval(void)
+{
+    static const char  *bad[] = { "/dev/ttyS1:", "/dev/ttyS1:8N",
+        "/dev/ttyS1:8N11", "/dev/ttyS1:9N1", "/dev/ttyS1:4N1",
+        "/dev/ttyS1:8X1", "/dev/ttyS1:8n1", "/dev/ttyS1:8N3",
+        "/dev/ttyS1:8N0" };
+    char                d[64];
+    char                parity;
+    int                 data_bit;
+    int                 stop_bit;
+    size_t              i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    for (i = 0; i != sizeof(bad) / sizeof(*bad); ++i)
+        mt_ferr(m2md_rtu_parse(bad[i], d, &parity, &data_bit, &stop_bit),
+                EINVAL);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void rtu_gap(void)
+{
+    static const int  bauds[] = { 1200, 2400, 4800, 9600, 19200 };
+    int64_t           gap;
+    size_t            i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    /* 3.5 characters of 11 bits, that's 38.5 bits,
+     * rounded up to whole microsecond */
+    for (i = 0; i != sizeof(bauds) / sizeof(*bauds); ++i)
+    {
+        gap = m2md_rtu_gap_us(bauds[i]);
+        mt_fail(gap * bauds[i] >= 38500000);
+        mt_fail((gap - 1) * bauds[i] < 38500000);
+    }
+
+    /* fixed above 19200 */
+    mt_fail(m2md_rtu_gap_us(M2MD_RTU_GAP_BAUD + 1) == 1750);
+    mt_fail(m2md_rtu_gap_us(38400) == 1750);
+    mt_fail(m2md_rtu_gap_us(115200) == 1750);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void rtu_dev_read(void)
+{
+    int  uid;
+    int  i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    /* all units on the line, one after another, back
+     * to back, with nothing but the gap between them */
+    for (i = 0; i != 10; ++i)
+        for (uid = 1; uid <= RTU_UNITS; ++uid)
+        {
+            mt_fok(client_read(uid, 3, 100 * i, 1 + i * 12, 0));
+            mt_fok(client_read(uid, 4, 100 * i, 125, 0));
+        }
+
+    mt_fail(dev_count(&dev.frames) == 10 * RTU_UNITS * 2);
+    mt_fail(dev_count(&dev.too_soon) == 0);
+    mt_fail(dev_count(&dev.bad_crc) == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void rtu_dev_too_soon(void)
+{
+    /* device notices when client does not keep the gap */
+    mt_fok(client_read(1, 3, 0, 1, 0));
+    mt_fok(client_read(1, 3, 0, 1, 1));
+    mt_fail(dev_count(&dev.too_soon) == 1);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void rtu_dev_bad_crc(void)
+{
+    unsigned char  req[8] = { 1, 3, 0, 0, 0, 1 };
+    unsigned char  rsp[8];
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    crc_add(req, 6);
+    req[7] ^= 0xff;
+    mt_fail(client_send(req, sizeof(req), rsp, 7, 0) == 0);
+    mt_fail(dev_count(&dev.bad_crc) == 1);
+
+    /* line is usable right after */
+    mt_fok(client_read(1, 3, 0, 1, 0));
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void rtu_dev_other_unit(void)
+{
+    /* nobody answers for unit that is not on the line */
+    mt_fail(client_read(RTU_UNITS + 1, 3, 0, 1, 0) == -1);
+    mt_fail(dev_count(&dev.frames) == 1);
+    mt_fok(client_read(RTU_UNITS, 3, 0, 1, 0));
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void rtu_dev_exception(void)
+{
+    unsigned char  req[8] = { 2, 6, 0, 0, 0, 1 };
+    unsigned char  rsp[5];
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    crc_add(req, 6);
+    mt_assert(client_send(req, sizeof(req), rsp, 5, 0) == 5);
+    mt_fail(crc16(rsp, 5) == 0);
+    mt_fail(rsp[0] == 2);
+    mt_fail(rsp[1] == (6 | 0x80));
+    mt_fail(rsp[2] == 0x01);
+}
+
+
+/* ==========================================================================
+                       __     __ _          ____
+        ____   __  __ / /_   / /(_)_____   / __/__  __ ____   _____ _____
+       / __ \ / / / // __ \ / // // ___/  / /_ / / / // __ \ / ___// ___/
+      / /_/ // /_/ // /_/ // // // /__   / __// /_/ // / / // /__ (__  )
+     / .___/ \__,_//_.___//_//_/ \___/  /_/   \__,_//_/ /_/ \___//____/
+    /_/
+   ========================================================================== */
+
+
+void m2md_rtu_test_group(void)
+{
+    mt_prepare_test = NULL;
+    mt_cleanup_test = NULL;
+
+    mt_run(rtu_parse_default);
+    mt_run(rtu_parse_settings);
+    mt_run(rtu_parse_einval);
+    mt_run(rtu_gap);
+
+    mt_prepare_test = &test_prepare;
+    mt_cleanup_test = &test_cleanup;
+
+    mt_run(rtu_dev_read);
+    mt_run(rtu_dev_too_soon);
+    mt_run(rtu_dev_bad_crc);
+    mt_run(rtu_dev_other_unit);
+    mt_run(rtu_dev_exception);
+}
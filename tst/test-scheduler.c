@@ -0,0 +1,449 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+          _               __            __         ____ _  __
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+
+   ========================================================================== */
+
+
+#include "mtest.h"
+#include "scheduler.h"
+
+#include <errno.h>
+#include <stdlib.h>
+
+
+/* ==========================================================================
+          __             __                     __   _
+     ____/ /___   _____ / /____ _ _____ ____ _ / /_ (_)____   ____   _____
+    / __  // _ \ / ___// // __ `// ___// __ `// __// // __ \ / __ \ / ___/
+   / /_/ //  __// /__ / // /_/ // /   / /_/ // /_ / // /_/ // / / /(__  )
+   \__,_/ \___/ \___//_/ \__,_//_/    \__,_/ \__//_/ \____//_/ /_//____/
+
+   ========================================================================== */
+
+
+#define NNODES 1000
+
+mt_defs_ext();
+static struct m2md_sched       sched;
+static struct m2md_sched_node  nodes[NNODES];
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ========================================================================== */
+
+
+/* ==========================================================================
+    Returns -1, 0 or 1 when 'a' is earlier, same or later than 'b'.
+   ========================================================================== */
+static int ts_cmp
+(
+    const struct timespec  *a,
+    const struct timespec  *b
+)
+{
+    if (a->tv_sec != b->tv_sec)
+        return a->tv_sec < b->tv_sec ? -1 : 1;
+
+    if (a->tv_nsec != b->tv_nsec)
+        return a->tv_nsec < b->tv_nsec ? -1 : 1;
+
+    return 0;
+}
+
+
+/* ==========================================================================
+    Sets random deadline for node 'i', few seconds away at most, so there
+    are plenty of nodes with the same seconds but different nanoseconds.
+   ========================================================================== */
+static void node_random
+(
+    int  i
+)
+{
+    nodes[i].deadline.tv_sec = rand() % 8;
+    nodes[i].deadline.tv_nsec = rand() % 1000000000l;
+}
+
+
+/* ==========================================================================
+    Takes all nodes out of the scheduler, checking that they come out in
+    order of their deadlines, and returns number of nodes taken.
+   ========================================================================== */
+static int sched_drain(void)
+{
+    struct m2md_sched_node  *node;
+    struct timespec          prev;
+    int                      n;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    n = 0;
+    while ((node = m2md_sched_peek(&sched)) != NULL)
+    {
+        if (n && ts_cmp(&prev, &node->deadline) > 0)
+            return -1;
+
+        prev = node->deadline;
+        if (m2md_sched_delete(&sched, node) != 0)
+            return -1;
+
+        if (node->idx != M2MD_SCHED_NOT_QUEUED)
+            return -1;
+
+        ++n;
+    }
+
+    return n;
+}
+
+
+/* ==========================================================================
+    Adds all nodes with random deadlines to the scheduler.
+   ========================================================================== */
+static int sched_fill(void)
+{
+    int  i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    for (i = 0; i != NNODES; ++i)
+    {
+        node_random(i);
+        if (m2md_sched_add(&sched, &nodes[i]) != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void test_prepare(void)
+{
+    int  i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    srand(NNODES);
+    m2md_sched_init(&sched);
+    for (i = 0; i != NNODES; ++i)
+        nodes[i].idx = M2MD_SCHED_NOT_QUEUED;
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void test_cleanup(void)
+{
+    m2md_sched_destroy(&sched);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void sched_peek_empty(void)
+{
+    mt_fail(m2md_sched_peek(&sched) == NULL);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void sched_add_one(void)
+{
+    nodes[0].deadline.tv_sec = 1;
+    nodes[0].deadline.tv_nsec = 2;
+    mt_fok(m2md_sched_add(&sched, &nodes[0]));
+    mt_fail(m2md_sched_peek(&sched) == &nodes[0]);
+    mt_fail(nodes[0].idx == 0);
+    mt_fail(sched_drain() == 1);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void sched_add_many_ordered(void)
+{
+    mt_assert(sched_fill() == 0);
+    mt_fail(sched.n == NNODES);
+    mt_fail(sched_drain() == NNODES);
+    mt_fail(sched.n == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void sched_add_same_deadline(void)
+{
+    int  i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    for (i = 0; i != NNODES; ++i)
+    {
+        nodes[i].deadline.tv_sec = 3;
+        nodes[i].deadline.tv_nsec = 3;
+        mt_assert(m2md_sched_add(&sched, &nodes[i]) == 0);
+    }
+
+    mt_fail(sched_drain() == NNODES);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void sched_add_twice(void)
+{
+    mt_fok(m2md_sched_add(&sched, &nodes[0]));
+    mt_ferr(m2md_sched_add(&sched, &nodes[0]), EEXIST);
+    mt_fail(sched.n == 1);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void sched_add_null(void)
+{
+    mt_ferr(m2md_sched_add(NULL, &nodes[0]), EINVAL);
+    mt_ferr(m2md_sched_add(&sched, NULL), EINVAL);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void sched_update_earlier(void)
+{
+    int  i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    mt_assert(sched_fill() == 0);
+
+    /* every update moves node to the very top */
+    for (i = 0; i < NNODES; i += 7)
+    {
+        nodes[i].deadline.tv_sec = -1 - i;
+        mt_fok(m2md_sched_update(&sched, &nodes[i]));
+        mt_fail(m2md_sched_peek(&sched) == &nodes[i]);
+    }
+
+    mt_fail(sched_drain() == NNODES);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void sched_update_later(void)
+{
+    struct m2md_sched_node  *node;
+    int                      i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    mt_assert(sched_fill() == 0);
+
+    /* that's what poll loop does, takes the earliest
+     * node and moves its deadline by its period */
+    for (i = 0; i != 10 * NNODES; ++i)
+    {
+        node = m2md_sched_peek(&sched);
+        node->deadline.tv_sec += 1 + i % 5;
+        mt_assert(m2md_sched_update(&sched, node) == 0);
+    }
+
+    mt_fail(sched_drain() == NNODES);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void sched_update_random(void)
+{
+    int  i;
+    int  j;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    mt_assert(sched_fill() == 0);
+
+    for (i = 0; i != 10 * NNODES; ++i)
+    {
+        j = rand() % NNODES;
+        node_random(j);
+        mt_assert(m2md_sched_update(&sched, &nodes[j]) == 0);
+    }
+
+    mt_fail(sched_drain() == NNODES);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void sched_update_not_queued(void)
+{
+    mt_ferr(m2md_sched_update(&sched, &nodes[0]), ENOENT);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void sched_delete_random(void)
+{
+    int  i;
+    int  n;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    mt_assert(sched_fill() == 0);
+
+    /* delete every third node, from the middle of heap too */
+    for (n = 0, i = 0; i < NNODES; i += 3, ++n)
+    {
+        mt_fok(m2md_sched_delete(&sched, &nodes[i]));
+        mt_fail(nodes[i].idx == M2MD_SCHED_NOT_QUEUED);
+    }
+
+    mt_fail(sched_drain() == NNODES - n);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void sched_delete_twice(void)
+{
+    mt_fok(m2md_sched_add(&sched, &nodes[0]));
+    mt_fok(m2md_sched_delete(&sched, &nodes[0]));
+    mt_ferr(m2md_sched_delete(&sched, &nodes[0]), ENOENT);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void sched_delete_readd(void)
+{
+    int  i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    mt_assert(sched_fill() == 0);
+
+    for (i = 0; i < NNODES; i += 2)
+    {
+        mt_assert(m2md_sched_delete(&sched, &nodes[i]) == 0);
+        node_random(i);
+        mt_assert(m2md_sched_add(&sched, &nodes[i]) == 0);
+    }
+
+    mt_fail(sched_drain() == NNODES);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void sched_clear(void)
+{
+    int  i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    mt_assert(sched_fill() == 0);
+    mt_fok(m2md_sched_clear(&sched));
+    mt_fail(m2md_sched_peek(&sched) == NULL);
+
+    for (i = 0; i != NNODES; ++i)
+        mt_assert(nodes[i].idx == M2MD_SCHED_NOT_QUEUED);
+
+    /* nodes can go back once they are out */
+    mt_fail(sched_fill() == 0);
+    mt_fail(sched_drain() == NNODES);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void sched_expired(void)
+{
+    struct timespec  now;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    nodes[0].deadline.tv_sec = 10;
+    nodes[0].deadline.tv_nsec = 500;
+
+    now = nodes[0].deadline;
+    mt_fail(m2md_sched_expired(&nodes[0], &now) == 0);
+    now.tv_nsec = 501;
+    mt_fail(m2md_sched_expired(&nodes[0], &now) == 1);
+    now.tv_nsec = 499;
+    mt_fail(m2md_sched_expired(&nodes[0], &now) == 0);
+    now.tv_sec = 11;
+    mt_fail(m2md_sched_expired(&nodes[0], &now) == 1);
+    now.tv_sec = 9;
+    now.tv_nsec = 999999999;
+    mt_fail(m2md_sched_expired(&nodes[0], &now) == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void sched_entry(void)
+{
+    struct obj
+    {
+        int                     a;
+        struct m2md_sched_node  sched;
+    }
+    o;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    mt_fail(m2md_sched_entry(&o.sched, struct obj, sched) == &o);
+}
+
+
+/* ==========================================================================
+                       __     __ _          ____
+        ____   __  __ / /_   / /(_)_____   / __/__  __ ____   _____ _____
+       / __ \ / / / // __ \ / // // ___/  / /_ / / / // __ \ / ___// ___/
+      / /_/ // /_/ // /_/ // // // /__   / __// /_/ // / / // /__ (__  )
+     / .___/ \__,_//_.___//_//_/ \___/  /_/   \__,_//_/ /_/ \___//____/
+    /_/
+   ========================================================================== */
+
+
+void m2md_sched_test_group(void)
+{
+    mt_prepare_test = &test_prepare;
+    mt_cleanup_test = &test_cleanup;
+
+    mt_run(sched_peek_empty);
+    mt_run(sched_add_one);
+    mt_run(sched_add_many_ordered);
+    mt_run(sched_add_same_deadline);
+    mt_run(sched_add_twice);
+    mt_run(sched_add_null);
+    mt_run(sched_update_earlier);
+    mt_run(sched_update_later);
+    mt_run(sched_update_random);
+    mt_run(sched_update_not_queued);
+    mt_run(sched_delete_random);
+    mt_run(sched_delete_twice);
+    mt_run(sched_delete_readd);
+    mt_run(sched_clear);
+    mt_run(sched_expired);
+    mt_run(sched_entry);
+}
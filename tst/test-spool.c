@@ -0,0 +1,529 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+          _               __            __         ____ _  __
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+
+   ========================================================================== */
+
+
+#include "mtest.h"
+#include "cfg.h"
+#include "spool.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+
+/* ==========================================================================
+          __             __                     __   _
+     ____/ /___   _____ / /____ _ _____ ____ _ / /_ (_)____   ____   _____
+    / __  // _ \ / ___// // __ `// ___// __ `// __// // __ \ / __ \ / ___/
+   / /_/ //  __// /__ / // /_/ // /   / /_/ // /_ / // /_/ // / / /(__  )
+   \__,_/ \___/ \___//_/ \__,_//_/    \__,_/ \__//_/ \____//_/ /_//____/
+
+   ========================================================================== */
+
+
+/* length of spooled message, around 60 of them fill single segment */
+#define MSG_LEN   1000
+
+/* max messages test can spool */
+#define MSG_MAX   4096
+
+/* superblock fields, as they are in file */
+#define SB_HEAD   16
+#define SB_TAIL   24
+
+mt_defs_ext();
+static struct m2md_cfg   cfg;
+static char              path[64];
+static pthread_mutex_t   lock = PTHREAD_MUTEX_INITIALIZER;
+static int               connected;
+static int              *replayed;
+static int               nreplayed;
+static int               bad_topic;
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ========================================================================== */
+
+
+/* ==========================================================================
+    Takes place of mqtt, keeps sequence numbers of replayed messages, so
+    tests can see what came out of spool, and checks each came with the
+    topic it's been spooled with.
+   ========================================================================== */
+int m2md_mqtt_publish_spooled
+(
+    const char  *topic,
+    const void  *payload,
+    int          paylen
+)
+{
+    char         expect[32];
+    int          seq;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    memcpy(&seq, payload, sizeof(seq));
+    sprintf(expect, "m2md/t/%d", seq % 7);
+
+    pthread_mutex_lock(&lock);
+    if (paylen != MSG_LEN || strcmp(topic, expect) != 0)
+        bad_topic++;
+
+    if (nreplayed != MSG_MAX)
+        replayed[nreplayed++] = seq;
+
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+
+/* ==========================================================================
+    Takes place of mqtt, broker is there only when test says so.
+   ========================================================================== */
+int m2md_mqtt_connected
+(
+    void
+)
+{
+    return __atomic_load_n(&connected, __ATOMIC_ACQUIRE);
+}
+
+
+/* ==========================================================================
+    Spools messages from 'first' up to, but without, 'last'. Each carries
+    its sequence number, and goes to one of few topics.
+   ========================================================================== */
+static int spool
+(
+    int            first,
+    int            last
+)
+{
+    unsigned char  msg[MSG_LEN];
+    char           topic[32];
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    memset(msg, 0xa5, sizeof(msg));
+    for (; first != last; ++first)
+    {
+        memcpy(msg, &first, sizeof(first));
+        sprintf(topic, "m2md/t/%d", first % 7);
+        if (m2md_spool_add(topic, msg, sizeof(msg)) != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+
+/* ==========================================================================
+    Lets spool replay, until it has nothing more to give.
+   ========================================================================== */
+static void replay(void)
+{
+    struct timespec  tick;
+    int              last;
+    int              idle;
+    int              i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    tick.tv_sec = 0;
+    tick.tv_nsec = 50000000;
+    __atomic_store_n(&connected, 1, __ATOMIC_RELEASE);
+    m2md_spool_start();
+
+    /* thread replays in 100ms ticks, so spool
+     * is empty when nothing came for few of them */
+    last = -1;
+    idle = 0;
+    for (i = 0; i != 200 && idle != 10; ++i)
+    {
+        nanosleep(&tick, NULL);
+        pthread_mutex_lock(&lock);
+        idle = nreplayed == last ? idle + 1 : 0;
+        last = nreplayed;
+        pthread_mutex_unlock(&lock);
+    }
+
+    m2md_spool_stop();
+    __atomic_store_n(&connected, 0, __ATOMIC_RELEASE);
+}
+
+
+/* ==========================================================================
+    Checks that replayed messages are in order, without holes, and start
+    with 'first'.
+   ========================================================================== */
+static int replayed_in_order
+(
+    int  first
+)
+{
+    int  i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    if (bad_topic)
+        return 0;
+
+    for (i = 0; i != nreplayed; ++i)
+        if (replayed[i] != first + i)
+            return 0;
+
+    return 1;
+}
+
+
+/* ==========================================================================
+    Simulates crash of the process. Spool file is left exactly as it is
+    in page cache right now, which is what survives process crash, and
+    whatever has not been written to ring yet is gone. Spool is closed,
+    so it can be opened again, but file is then put back as it was.
+   ========================================================================== */
+static int crash(void)
+{
+    struct stat     st;
+    unsigned char  *file;
+    int             fd;
+    int             ret;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    if ((fd = open(path, O_RDWR)) < 0)
+        return -1;
+
+    ret = -1;
+    if (fstat(fd, &st) != 0 || (file = malloc(st.st_size)) == NULL)
+        goto error;
+
+    if (pread(fd, file, st.st_size, 0) != st.st_size)
+        goto read_error;
+
+    m2md_spool_cleanup();
+
+    if (pwrite(fd, file, st.st_size, 0) != st.st_size)
+        goto read_error;
+
+    ret = 0;
+
+read_error:
+    free(file);
+
+error:
+    close(fd);
+    return ret;
+}
+
+
+/* ==========================================================================
+    Reads or writes 8 byte field of superblock at 'off'.
+   ========================================================================== */
+static uint64_t sb_field
+(
+    size_t    off,
+    int       write,
+    uint64_t  v
+)
+{
+    int       fd;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    if ((fd = open(path, O_RDWR)) < 0)
+        return (uint64_t)-1;
+
+    if (write)
+        v = pwrite(fd, &v, sizeof(v), off) == sizeof(v) ? v : (uint64_t)-1;
+    else if (pread(fd, &v, sizeof(v), off) != sizeof(v))
+        v = (uint64_t)-1;
+
+    close(fd);
+    return v;
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void test_prepare(void)
+{
+    int  fd;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    strcpy(path, "/tmp/m2md-test-spool-XXXXXX");
+    if ((fd = mkstemp(path)) >= 0)
+        close(fd);
+
+    memset(&cfg, 0x00, sizeof(cfg));
+    strcpy(cfg.mqtt_spool, path);
+
+    cfg.mqtt_spool_size = 1;
+    cfg.mqtt_spool_rate = 100000;
+    m2md_cfg = &cfg;
+
+    replayed = calloc(MSG_MAX, sizeof(*replayed));
+    nreplayed = 0;
+    bad_topic = 0;
+    connected = 0;
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void test_cleanup(void)
+{
+    m2md_spool_cleanup();
+    unlink(path);
+    free(replayed);
+    m2md_cfg = NULL;
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void spool_disabled(void)
+{
+    char  msg[4];
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    cfg.mqtt_spool[0] = '\0';
+    mt_fok(m2md_spool_init());
+    mt_ferr(m2md_spool_add("m2md/t/0", msg, sizeof(msg)), ENODEV);
+    mt_fok(m2md_spool_start());
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void spool_add_einval(void)
+{
+    char  msg[4];
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    mt_assert(m2md_spool_init() == 0);
+    mt_ferr(m2md_spool_add(NULL, msg, sizeof(msg)), EINVAL);
+    mt_ferr(m2md_spool_add("m2md/t/0", NULL, sizeof(msg)), EINVAL);
+    mt_ferr(m2md_spool_add("m2md/t/0", msg, -1), EINVAL);
+    mt_ferr(m2md_spool_add("m2md/t/0", msg, M2MD_SPOOL_SEG_MAX), EINVAL);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void spool_replay(void)
+{
+    mt_assert(m2md_spool_init() == 0);
+    mt_assert(spool(0, 500) == 0);
+
+    /* everything comes out once broker is
+     * back, in order and on its topic */
+    replay();
+    mt_fail(nreplayed == 500);
+    mt_fail(replayed_in_order(0));
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void spool_reopen(void)
+{
+    mt_assert(m2md_spool_init() == 0);
+    mt_assert(spool(0, 300) == 0);
+
+    /* clean exit writes what's left in memory too,
+     * and next start replays all of it */
+    m2md_spool_cleanup();
+    mt_assert(m2md_spool_init() == 0);
+    replay();
+    mt_fail(nreplayed == 300);
+    mt_fail(replayed_in_order(0));
+
+    /* replayed messages are not replayed again */
+    m2md_spool_cleanup();
+    nreplayed = 0;
+    mt_assert(m2md_spool_init() == 0);
+    replay();
+    mt_fail(nreplayed == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void spool_crash(void)
+{
+    mt_assert(m2md_spool_init() == 0);
+    mt_assert(spool(0, 500) == 0);
+    mt_assert(crash() == 0);
+
+    /* segments that made it to ring are replayed,
+     * only segment that was still filled is lost */
+    mt_assert(m2md_spool_init() == 0);
+    replay();
+    mt_fail(nreplayed > 400 && nreplayed < 500);
+    mt_fail(replayed_in_order(0));
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void spool_crash_stale_sb(void)
+{
+    uint64_t  tail;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    mt_assert(m2md_spool_init() == 0);
+    mt_assert(spool(0, 500) == 0);
+    mt_assert(crash() == 0);
+
+    /* superblock didn't make it to disk before crash,
+     * segments did, and they are what counts */
+    tail = sb_field(SB_TAIL, 0, 0);
+    mt_assert(sb_field(SB_HEAD, 1, tail) == tail);
+
+    mt_assert(m2md_spool_init() == 0);
+    replay();
+    mt_fail(nreplayed > 400 && nreplayed < 500);
+    mt_fail(replayed_in_order(0));
+
+    /* spool goes on after recovered messages */
+    nreplayed = 0;
+    mt_assert(spool(1000, 1100) == 0);
+    replay();
+    mt_fail(nreplayed == 100);
+    mt_fail(replayed_in_order(1000));
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void spool_crash_torn_segment(void)
+{
+    uint64_t  last;
+    int       fd;
+    char      c;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    /* few whole segments, and last one, that
+     * crash caught while it was being written */
+    mt_assert(m2md_spool_init() == 0);
+    mt_assert(spool(0, 100) == 0);
+    m2md_spool_cleanup();
+    last = sb_field(SB_HEAD, 0, 0);
+    mt_assert(m2md_spool_init() == 0);
+    mt_assert(spool(100, 110) == 0);
+    m2md_spool_cleanup();
+    mt_assert(sb_field(SB_HEAD, 0, 0) > last);
+
+    /* part of its message never made it to disk */
+    fd = open(path, O_RDWR);
+    mt_assert(fd >= 0);
+    c = 0x5a;
+    mt_fail(pwrite(fd, &c, 1, M2MD_SPOOL_SB_SIZE + last +
+                M2MD_SPOOL_SEG_HDR + MSG_LEN / 2) == 1);
+    close(fd);
+
+    /* it's not replayed, but everything before it is */
+    mt_assert(m2md_spool_init() == 0);
+    mt_fail(sb_field(SB_HEAD, 0, 0) == last);
+    replay();
+    mt_fail(nreplayed == 100);
+    mt_fail(replayed_in_order(0));
+
+    /* and new segments take its place */
+    nreplayed = 0;
+    mt_assert(spool(200, 210) == 0);
+    replay();
+    mt_fail(nreplayed == 10);
+    mt_fail(replayed_in_order(200));
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void spool_wrap(void)
+{
+    /* 1MiB ring takes around a thousand messages,
+     * so this goes around it few times */
+    mt_assert(m2md_spool_init() == 0);
+    mt_assert(spool(0, 3500) == 0);
+
+    /* oldest are dropped, newest are all there */
+    replay();
+    mt_fail(nreplayed > 500 && nreplayed < 1100);
+    mt_fail(replayed_in_order(3500 - nreplayed));
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void spool_wrap_crash(void)
+{
+    mt_assert(m2md_spool_init() == 0);
+    mt_assert(spool(0, 2500) == 0);
+    mt_assert(crash() == 0);
+
+    /* ring has been gone around few times,
+     * recovery must find where it ends now */
+    mt_fail(sb_field(SB_HEAD, 0, 0) > 2 * 1024 * 1024);
+    mt_assert(m2md_spool_init() == 0);
+    replay();
+    mt_fail(nreplayed > 500 && nreplayed < 1100);
+    mt_fail(replayed_in_order(replayed[0]));
+    mt_fail(replayed[nreplayed - 1] < 2500 &&
+            replayed[nreplayed - 1] > 2400);
+}
+
+
+/* ==========================================================================
+                       __     __ _          ____
+        ____   __  __ / /_   / /(_)_____   / __/__  __ ____   _____ _____
+       / __ \ / / / // __ \ / // // ___/  / /_ / / / // __ \ / ___// ___/
+      / /_/ // /_/ // /_/ // // // /__   / __// /_/ // / / // /__ (__  )
+     / .___/ \__,_//_.___//_//_/ \___/  /_/   \__,_//_/ /_/ \___//____/
+    /_/
+   ========================================================================== */
+
+
+void m2md_spool_test_group(void)
+{
+    mt_prepare_test = &test_prepare;
+    mt_cleanup_test = &test_cleanup;
+
+    mt_run(spool_disabled);
+    mt_run(spool_add_einval);
+    mt_run(spool_replay);
+    mt_run(spool_reopen);
+    mt_run(spool_crash);
+    mt_run(spool_crash_stale_sb);
+    mt_run(spool_crash_torn_segment);
+    mt_run(spool_wrap);
+    mt_run(spool_wrap_crash);
+}
@@ -0,0 +1,472 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+          _               __            __         ____ _  __
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+
+   ========================================================================== */
+
+
+#include "mtest.h"
+#include "timing.h"
+
+#include <string.h>
+#include <time.h>
+
+
+/* ==========================================================================
+          __             __                     __   _
+     ____/ /___   _____ / /____ _ _____ ____ _ / /_ (_)____   ____   _____
+    / __  // _ \ / ___// // __ `// ___// __ `// __// // __ \ / __ \ / ___/
+   / /_/ //  __// /__ / // /_/ // /   / /_/ // /_ / // /_/ // / / /(__  )
+   \__,_/ \___/ \___//_/ \__,_//_/    \__,_/ \__//_/ \____//_/ /_//____/
+
+   ========================================================================== */
+
+
+#define MS(ms)  ((ms) * 1000000ll)
+
+mt_defs_ext();
+static struct m2md_timing_stats  stats;
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ========================================================================== */
+
+
+/* ==========================================================================
+    Returns timespec of 'sec' seconds and 'ms' milliseconds.
+   ========================================================================== */
+static struct timespec ts
+(
+    long             sec,
+    long             ms
+)
+{
+    struct timespec  t;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    t.tv_sec = sec;
+    t.tv_nsec = ms * 1000000l;
+    return t;
+}
+
+
+/* ==========================================================================
+    Checks that 't' is 'sec' seconds and 'ms' milliseconds.
+   ========================================================================== */
+static int ts_is
+(
+    struct timespec  t,
+    long             sec,
+    long             ms
+)
+{
+    return t.tv_sec == sec && t.tv_nsec == ms * 1000000l;
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void test_prepare(void)
+{
+    memset(&stats, 0x00, sizeof(stats));
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void timing_add_sub_carry(void)
+{
+    mt_fail(ts_is(m2md_timing_add(ts(1, 600), ts(2, 700)), 4, 300));
+    mt_fail(ts_is(m2md_timing_sub(ts(4, 300), ts(2, 700)), 1, 600));
+    mt_fail(m2md_timing_ns(m2md_timing_sub(ts(1, 0), ts(2, 500))) ==
+            -1500000000ll);
+    mt_fail(ts_is(m2md_timing_ts(2500000000ll), 2, 500));
+    mt_fail(m2md_timing_ns(ts(3, 250)) == 3250000000ll);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void timing_first_read_anchors(void)
+{
+    struct timespec  deadline;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    deadline = ts(0, 0);
+    m2md_timing_next(&deadline, ts(1, 0), ts(100, 300),
+            M2MD_TIMING_ABSOLUTE, M2MD_TIMING_CATCH_UP_SKIP, &stats);
+
+    /* first read is not late, it sets the schedule */
+    mt_fail(ts_is(deadline, 101, 300));
+    mt_fail(stats.reads == 0);
+    mt_fail(stats.late_sum == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void timing_relative_carries_delay(void)
+{
+    struct timespec  deadline;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    deadline = ts(10, 0);
+    m2md_timing_next(&deadline, ts(1, 0), ts(10, 200),
+            M2MD_TIMING_RELATIVE, M2MD_TIMING_CATCH_UP_SKIP, &stats);
+    mt_fail(ts_is(deadline, 11, 200));
+
+    m2md_timing_next(&deadline, ts(1, 0), ts(11, 300),
+            M2MD_TIMING_RELATIVE, M2MD_TIMING_CATCH_UP_SKIP, &stats);
+    mt_fail(ts_is(deadline, 12, 300));
+    mt_fail(stats.reads == 2);
+    mt_fail(stats.skipped == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void timing_absolute_no_drift(void)
+{
+    struct timespec  deadline;
+    long             i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    deadline = ts(10, 0);
+
+    /* every read is late by a bit, but schedule stays
+     * on whole seconds, no matter how many reads */
+    for (i = 0; i != 1000; ++i)
+    {
+        m2md_timing_next(&deadline, ts(1, 0), ts(10 + i, 1 + i % 900),
+                M2MD_TIMING_ABSOLUTE, M2MD_TIMING_CATCH_UP_SKIP, &stats);
+        mt_fail(ts_is(deadline, 11 + i, 0));
+    }
+
+    mt_fail(stats.reads == 1000);
+    mt_fail(stats.skipped == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void timing_skip_missed(void)
+{
+    struct timespec  deadline;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    /* read at 13.5s was due at 10s, reads at 11, 12 and 13
+     * have been missed and are dropped, next one is at 14 */
+    deadline = ts(10, 0);
+    m2md_timing_next(&deadline, ts(1, 0), ts(13, 500),
+            M2MD_TIMING_ABSOLUTE, M2MD_TIMING_CATCH_UP_SKIP, &stats);
+    mt_fail(ts_is(deadline, 14, 0));
+    mt_fail(stats.skipped == 3);
+    mt_fail(stats.reads == 1);
+
+    /* late exactly by one period, the next deadline would
+     * be now, and that read is missed too */
+    deadline = ts(20, 0);
+    m2md_timing_next(&deadline, ts(1, 0), ts(21, 0),
+            M2MD_TIMING_ABSOLUTE, M2MD_TIMING_CATCH_UP_SKIP, &stats);
+    mt_fail(ts_is(deadline, 22, 0));
+    mt_fail(stats.skipped == 4);
+
+    /* just below one period is not a miss */
+    deadline = ts(30, 0);
+    m2md_timing_next(&deadline, ts(1, 0), ts(30, 999),
+            M2MD_TIMING_ABSOLUTE, M2MD_TIMING_CATCH_UP_SKIP, &stats);
+    mt_fail(ts_is(deadline, 31, 0));
+    mt_fail(stats.skipped == 4);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void timing_burst_catches_up(void)
+{
+    struct timespec  deadline;
+    struct timespec  now;
+    int              n;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    /* read due at 10s is made at 13.5s, each next read is
+     * made right away, until deadline is in the future */
+    deadline = ts(10, 0);
+    now = ts(13, 500);
+    n = 0;
+
+    do
+    {
+        m2md_timing_next(&deadline, ts(1, 0), now,
+                M2MD_TIMING_ABSOLUTE, M2MD_TIMING_CATCH_UP_BURST, &stats);
+        ++n;
+    }
+    while (m2md_timing_ns(m2md_timing_sub(now, deadline)) >= 0);
+
+    /* 10, 11, 12 and 13 have all been read */
+    mt_fail(n == 4);
+    mt_fail(ts_is(deadline, 14, 0));
+    mt_fail(stats.skipped == 0);
+    mt_fail(stats.reads == 4);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void timing_lateness_stats(void)
+{
+    struct timespec  deadline;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    deadline = ts(10, 0);
+    m2md_timing_next(&deadline, ts(1, 0), ts(10, 20),
+            M2MD_TIMING_ABSOLUTE, M2MD_TIMING_CATCH_UP_SKIP, &stats);
+    m2md_timing_next(&deadline, ts(1, 0), ts(11, 50),
+            M2MD_TIMING_ABSOLUTE, M2MD_TIMING_CATCH_UP_SKIP, &stats);
+    m2md_timing_next(&deadline, ts(1, 0), ts(12, 30),
+            M2MD_TIMING_ABSOLUTE, M2MD_TIMING_CATCH_UP_SKIP, &stats);
+
+    mt_fail(stats.reads == 3);
+    mt_fail(stats.late_sum == 100 * 1000000ll);
+    mt_fail(stats.late_max == 50 * 1000000ll);
+
+    /* read made ahead of its deadline counts as negative
+     * lateness, and does not touch max */
+    m2md_timing_next(&deadline, ts(1, 0), ts(12, 990),
+            M2MD_TIMING_ABSOLUTE, M2MD_TIMING_CATCH_UP_SKIP, &stats);
+    mt_fail(stats.reads == 4);
+    mt_fail(stats.late_sum == 90 * 1000000ll);
+    mt_fail(stats.late_max == 50 * 1000000ll);
+    mt_fail(ts_is(deadline, 14, 0));
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void timing_zero_period(void)
+{
+    struct timespec  deadline;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    /* read as often as possible, there is nothing to
+     * catch up with and no division by zero */
+    deadline = ts(10, 0);
+    m2md_timing_next(&deadline, ts(0, 0), ts(15, 0),
+            M2MD_TIMING_ABSOLUTE, M2MD_TIMING_CATCH_UP_SKIP, &stats);
+    mt_fail(ts_is(deadline, 15, 0));
+    mt_fail(stats.skipped == 0);
+    mt_fail(m2md_timing_resume(&deadline, ts(0, 0), ts(20, 0), &stats) == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void timing_resume_latest_deadline(void)
+{
+    struct timespec  deadline;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    /* server was down from 10s to 13.5s, read is made once
+     * at 13s deadline, which is already expired, and 3 are
+     * dropped */
+    deadline = ts(10, 0);
+    mt_fail(m2md_timing_resume(&deadline, ts(1, 0), ts(13, 500), &stats));
+    mt_fail(ts_is(deadline, 13, 0));
+    mt_fail(stats.skipped == 3);
+    mt_fail(stats.reads == 0);
+
+    /* less than period late, nothing was missed */
+    deadline = ts(10, 0);
+    mt_fail(m2md_timing_resume(&deadline, ts(1, 0), ts(10, 900), &stats) == 0);
+    mt_fail(ts_is(deadline, 10, 0));
+
+    /* never read, nothing to resume */
+    deadline = ts(0, 0);
+    mt_fail(m2md_timing_resume(&deadline, ts(1, 0), ts(10, 900), &stats) == 0);
+    mt_fail(ts_is(deadline, 0, 0));
+    mt_fail(stats.skipped == 3);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void timing_rtt_init(void)
+{
+    struct m2md_timing_rtt  rtt;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    /* nothing known yet, so tcp's 1 second it is,
+     * as long as it's within limits */
+    m2md_timing_rtt_init(&rtt, MS(10), MS(60000));
+    mt_fail(rtt.srtt == 0 && rtt.rttvar == 0);
+    mt_fail(rtt.rto == MS(1000));
+
+    m2md_timing_rtt_init(&rtt, MS(10), MS(500));
+    mt_fail(rtt.rto == MS(500));
+
+    m2md_timing_rtt_init(&rtt, MS(2000), MS(5000));
+    mt_fail(rtt.rto == MS(2000));
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void timing_rtt_rfc6298(void)
+{
+    struct m2md_timing_rtt  rtt;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    m2md_timing_rtt_init(&rtt, MS(1), MS(60000));
+
+    /* first sample: srtt = r, rttvar = r / 2 */
+    m2md_timing_rtt_sample(&rtt, MS(100));
+    mt_fail(rtt.srtt == MS(100));
+    mt_fail(rtt.rttvar == MS(50));
+    mt_fail(rtt.rto == MS(300));
+
+    /* rttvar = 3/4 rttvar + 1/4 |srtt - r|,
+     * srtt = 7/8 srtt + 1/8 r */
+    m2md_timing_rtt_sample(&rtt, MS(100));
+    mt_fail(rtt.srtt == MS(100));
+    mt_fail(rtt.rttvar == 37500000);
+    mt_fail(rtt.rto == MS(250));
+
+    m2md_timing_rtt_sample(&rtt, MS(200));
+    mt_fail(rtt.srtt == 112500000);
+    mt_fail(rtt.rttvar == 53125000);
+    mt_fail(rtt.rto == MS(325));
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void timing_rtt_stable(void)
+{
+    struct m2md_timing_rtt  rtt;
+    int                     i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    /* variation of very stable server fades away, but
+     * it still gets 1ms of slack on top of its rtt */
+    m2md_timing_rtt_init(&rtt, MS(1), MS(60000));
+    for (i = 0; i != 200; ++i)
+        m2md_timing_rtt_sample(&rtt, MS(5));
+
+    mt_fail(rtt.srtt == MS(5));
+    mt_fail(rtt.rttvar < MS(1) / 4);
+    mt_fail(rtt.rto == MS(6));
+
+    /* zero sample is still a sample, srtt of 0 means none */
+    m2md_timing_rtt_init(&rtt, MS(1), MS(60000));
+    m2md_timing_rtt_sample(&rtt, 0);
+    mt_fail(rtt.srtt == 1);
+    mt_fail(rtt.rto == MS(1) + 1);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void timing_rtt_clamp(void)
+{
+    struct m2md_timing_rtt  rtt;
+    int                     i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    /* fast server never gets less than floor */
+    m2md_timing_rtt_init(&rtt, MS(200), MS(1000));
+    for (i = 0; i != 50; ++i)
+        m2md_timing_rtt_sample(&rtt, MS(5));
+
+    mt_fail(rtt.rto == MS(200));
+
+    /* and slow one never more than ceiling,
+     * while estimate itself is not clamped */
+    m2md_timing_rtt_sample(&rtt, MS(30000));
+    mt_fail(rtt.srtt > MS(1000));
+    mt_fail(rtt.rto == MS(1000));
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void timing_rtt_backoff(void)
+{
+    struct m2md_timing_rtt  rtt;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    m2md_timing_rtt_init(&rtt, MS(1), MS(1000));
+    m2md_timing_rtt_sample(&rtt, MS(100));
+    mt_assert(rtt.rto == MS(300));
+
+    /* each timeout doubles rto, up to ceiling */
+    m2md_timing_rtt_backoff(&rtt);
+    mt_fail(rtt.rto == MS(600));
+    m2md_timing_rtt_backoff(&rtt);
+    mt_fail(rtt.rto == MS(1000));
+    m2md_timing_rtt_backoff(&rtt);
+    mt_fail(rtt.rto == MS(1000));
+
+    /* estimate is not touched, so next response
+     * brings rto right back to what it says */
+    mt_fail(rtt.srtt == MS(100));
+    m2md_timing_rtt_sample(&rtt, MS(100));
+    mt_fail(rtt.rto == MS(250));
+}
+
+
+/* ==========================================================================
+                       __     __ _          ____
+        ____   __  __ / /_   / /(_)_____   / __/__  __ ____   _____ _____
+       / __ \ / / / // __ \ / // // ___/  / /_ / / / // __ \ / ___// ___/
+      / /_/ // /_/ // /_/ // // // /__   / __// /_/ // / / // /__ (__  )
+     / .___/ \__,_//_.___//_//_/ \___/  /_/   \__,_//_/ /_/ \___//____/
+    /_/
+   ========================================================================== */
+
+
+void m2md_timing_test_group(void)
+{
+    mt_prepare_test = &test_prepare;
+    mt_cleanup_test = NULL;
+
+    mt_run(timing_add_sub_carry);
+    mt_run(timing_first_read_anchors);
+    mt_run(timing_relative_carries_delay);
+    mt_run(timing_absolute_no_drift);
+    mt_run(timing_skip_missed);
+    mt_run(timing_burst_catches_up);
+    mt_run(timing_lateness_stats);
+    mt_run(timing_zero_period);
+    mt_run(timing_resume_latest_deadline);
+    mt_run(timing_rtt_init);
+    mt_run(timing_rtt_rfc6298);
+    mt_run(timing_rtt_stable);
+    mt_run(timing_rtt_clamp);
+    mt_run(timing_rtt_backoff);
+}
@@ -0,0 +1,154 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+          _               __            __         ____ _  __
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+
+   ========================================================================== */
+
+
+#include "mtest.h"
+#include "topic.h"
+
+#include <errno.h>
+#include <string.h>
+
+
+/* ==========================================================================
+          __             __                     __   _
+     ____/ /___   _____ / /____ _ _____ ____ _ / /_ (_)____   ____   _____
+    / __  // _ \ / ___// // __ `// ___// __ `// __// // __ \ / __ \ / ___/
+   / /_/ //  __// /__ / // /_/ // /   / /_/ // /_ / // /_/ // / / /(__  )
+   \__,_/ \___/ \___//_/ \__,_//_/    \__,_/ \__//_/ \____//_/ /_//____/
+
+   ========================================================================== */
+
+
+mt_defs_ext();
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ========================================================================== */
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void topic_strip_slash(void)
+{
+    char  dst[64];
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    mt_fail(m2md_topic_build(dst, sizeof(dst), "m2md", "/poll/1") == 11);
+    mt_fail(strcmp(dst, "m2md/poll/1") == 0);
+
+    /* only first slash is stripped */
+    mt_fail(m2md_topic_build(dst, sizeof(dst), "m2md", "//poll") == 10);
+    mt_fail(strcmp(dst, "m2md//poll") == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void topic_no_slash(void)
+{
+    char  dst[64];
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    mt_fail(m2md_topic_build(dst, sizeof(dst), "m2md", "poll/1") == 11);
+    mt_fail(strcmp(dst, "m2md/poll/1") == 0);
+
+    mt_fail(m2md_topic_build(dst, sizeof(dst), "a/b/c", "") == 6);
+    mt_fail(strcmp(dst, "a/b/c/") == 0);
+
+    mt_fail(m2md_topic_build(dst, sizeof(dst), "", "/poll") == 5);
+    mt_fail(strcmp(dst, "/poll") == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void topic_exact_fit(void)
+{
+    char  dst[12];
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    /* topic and its null just fit */
+    memset(dst, 'x', sizeof(dst));
+    mt_fail(m2md_topic_build(dst, sizeof(dst), "m2md", "/poll/1") == 11);
+    mt_fail(strcmp(dst, "m2md/poll/1") == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void topic_overflow(void)
+{
+    char  dst[12];
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    /* no room for null */
+    mt_ferr(m2md_topic_build(dst, sizeof(dst), "m2md", "/poll/10"), ENOBUFS);
+
+    /* and what didn't fit is cut, but still terminated */
+    mt_fail(strcmp(dst, "m2md/poll/1") == 0);
+
+    mt_ferr(m2md_topic_build(dst, sizeof(dst), "very/long/base", "/p"),
+            ENOBUFS);
+    mt_fail(strcmp(dst, "very/long/b") == 0);
+
+    /* buffer without room for anything is left alone */
+    dst[0] = 'x';
+    mt_ferr(m2md_topic_build(dst, 0, "m2md", "/poll"), ENOBUFS);
+    mt_fail(dst[0] == 'x');
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void topic_einval(void)
+{
+    char  dst[16];
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    mt_ferr(m2md_topic_build(NULL, sizeof(dst), "m2md", "/p"), EINVAL);
+    mt_ferr(m2md_topic_build(dst, sizeof(dst), NULL, "/p"), EINVAL);
+    mt_ferr(m2md_topic_build(dst, sizeof(dst), "m2md", NULL), EINVAL);
+}
+
+
+/* ==========================================================================
+                       __     __ _          ____
+        ____   __  __ / /_   / /(_)_____   / __/__  __ ____   _____ _____
+       / __ \ / / / // __ \ / // // ___/  / /_ / / / // __ \ / ___// ___/
+      / /_/ // /_/ // /_/ // // // /__   / __// /_/ // / / // /__ (__  )
+     / .___/ \__,_//_.___//_//_/ \___/  /_/   \__,_//_/ /_/ \___//____/
+    /_/
+   ========================================================================== */
+
+
+void m2md_topic_test_group(void)
+{
+    mt_prepare_test = NULL;
+    mt_cleanup_test = NULL;
+
+    mt_run(topic_strip_slash);
+    mt_run(topic_no_slash);
+    mt_run(topic_exact_fit);
+    mt_run(topic_overflow);
+    mt_run(topic_einval);
+}
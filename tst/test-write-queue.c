@@ -0,0 +1,289 @@
+/* ==========================================================================
+    Licensed under BSD 2clause license See LICENSE file for more information
+    Author: Michał Łyszczek <michal.lyszczek@bofc.pl>
+   ==========================================================================
+          _               __            __         ____ _  __
+         (_)____   _____ / /__  __ ____/ /___     / __/(_)/ /___   _____
+        / // __ \ / ___// // / / // __  // _ \   / /_ / // // _ \ / ___/
+       / // / / // /__ / // /_/ // /_/ //  __/  / __// // //  __/(__  )
+      /_//_/ /_/ \___//_/ \__,_/ \__,_/ \___/  /_/  /_//_/ \___//____/
+
+   ========================================================================== */
+
+
+#include "mtest.h"
+#include "write-queue.h"
+
+#include <errno.h>
+#include <string.h>
+
+
+/* ==========================================================================
+          __             __                     __   _
+     ____/ /___   _____ / /____ _ _____ ____ _ / /_ (_)____   ____   _____
+    / __  // _ \ / ___// // __ `// ___// __ `// __// // __ \ / __ \ / ___/
+   / /_/ //  __// /__ / // /_/ // /   / /_/ // /_ / // /_/ // / / /(__  )
+   \__,_/ \___/ \___//_/ \__,_//_/    \__,_/ \__//_/ \____//_/ /_//____/
+
+   ========================================================================== */
+
+
+mt_defs_ext();
+static struct m2md_wq  wq;
+
+
+/* ==========================================================================
+                  _                __           ____
+    ____   _____ (_)_   __ ____ _ / /_ ___     / __/__  __ ____   _____ _____
+   / __ \ / ___// /| | / // __ `// __// _ \   / /_ / / / // __ \ / ___// ___/
+  / /_/ // /   / / | |/ // /_/ // /_ /  __/  / __// /_/ // / / // /__ (__  )
+ / .___//_/   /_/  |___/ \__,_/ \__/ \___/  /_/   \__,_//_/ /_/ \___//____/
+/_/
+   ========================================================================== */
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void test_prepare(void)
+{
+    m2md_wq_init(&wq);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void test_cleanup(void)
+{
+    m2md_wq_destroy(&wq);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void wq_take_empty(void)
+{
+    struct m2md_wq_write  w;
+    uint16_t              values[M2MD_WQ_MAX_REGS];
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    mt_fail(m2md_wq_take(&wq, &w, values) == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void wq_merge_contiguous(void)
+{
+    struct m2md_wq_write  w;
+    uint16_t              values[M2MD_WQ_MAX_REGS];
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    /* order in which writes come does not matter,
+     * neighbours are written with single request */
+    mt_fok(m2md_wq_add(&wq, 1, 0, 12, 120));
+    mt_fok(m2md_wq_add(&wq, 1, 0, 10, 100));
+    mt_fok(m2md_wq_add(&wq, 1, 0, 11, 110));
+    mt_fok(m2md_wq_add(&wq, 1, 0, 14, 140));
+
+    mt_fail(m2md_wq_take(&wq, &w, values) == 3);
+    mt_fail(w.uid == 1 && w.bits == 0 && w.reg == 10);
+    mt_fail(values[0] == 100 && values[1] == 110 && values[2] == 120);
+
+    /* gap is not bridged, that would write register no one asked for */
+    mt_fail(m2md_wq_take(&wq, &w, values) == 1);
+    mt_fail(w.reg == 14 && values[0] == 140);
+    mt_fail(m2md_wq_take(&wq, &w, values) == 0);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void wq_no_merge_across(void)
+{
+    struct m2md_wq_write  w;
+    uint16_t              values[M2MD_WQ_MAX_REGS];
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    /* same registers, but different unit or type */
+    mt_fok(m2md_wq_add(&wq, 2, 0, 1, 21));
+    mt_fok(m2md_wq_add(&wq, 1, 1, 1, 1));
+    mt_fok(m2md_wq_add(&wq, 1, 0, 0, 10));
+    mt_fok(m2md_wq_add(&wq, 1, 0, 1, 11));
+    mt_fok(m2md_wq_add(&wq, 1, 1, 2, 1));
+
+    mt_fail(m2md_wq_take(&wq, &w, values) == 2);
+    mt_fail(w.uid == 1 && !w.bits && w.reg == 0);
+
+    mt_fail(m2md_wq_take(&wq, &w, values) == 2);
+    mt_fail(w.uid == 1 && w.bits && w.reg == 1);
+
+    mt_fail(m2md_wq_take(&wq, &w, values) == 1);
+    mt_fail(w.uid == 2 && !w.bits && w.reg == 1 && values[0] == 21);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void wq_supersede(void)
+{
+    struct m2md_wq_write  w;
+    uint16_t              values[M2MD_WQ_MAX_REGS];
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    mt_fok(m2md_wq_add(&wq, 1, 0, 5, 1));
+    mt_fok(m2md_wq_add(&wq, 1, 0, 6, 2));
+
+    /* newer value replaces one that still waits */
+    mt_fail(m2md_wq_add(&wq, 1, 0, 5, 3) == 1);
+    mt_fail(m2md_wq_add(&wq, 1, 0, 5, 4) == 1);
+    mt_fail(wq.nwrites == 2);
+
+    mt_fail(m2md_wq_take(&wq, &w, values) == 2);
+    mt_fail(values[0] == 4 && values[1] == 2);
+
+    /* once taken, same register is queued anew */
+    mt_fok(m2md_wq_add(&wq, 1, 0, 5, 5));
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void wq_coils_packed(void)
+{
+    struct m2md_wq_write  w;
+    uint16_t              values[M2MD_WQ_MAX_REGS];
+    int                   i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    for (i = 0; i != 20; ++i)
+        mt_fok(m2md_wq_add(&wq, 1, 1, 100 + i, i % 3 == 0));
+
+    /* packed just like read bits, first coil in lowest bit */
+    memset(values, 0xa5, sizeof(values));
+    mt_fail(m2md_wq_take(&wq, &w, values) == 20);
+    mt_fail(values[0] == 0x9249);
+    mt_fail(values[1] == 0x0004);
+    mt_fail(values[2] == 0xa5a5);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void wq_request_limit(void)
+{
+    struct m2md_wq_write  w;
+    uint16_t              values[M2MD_WQ_MAX_REGS];
+    int                   i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    /* long run is cut at what single request can take */
+    for (i = 0; i != M2MD_WQ_MAX_REGS + 7; ++i)
+        mt_fok(m2md_wq_add(&wq, 1, 0, i, i));
+
+    mt_fail(m2md_wq_take(&wq, &w, values) == M2MD_WQ_MAX_REGS);
+    mt_fail(values[M2MD_WQ_MAX_REGS - 1] == M2MD_WQ_MAX_REGS - 1);
+    mt_fail(m2md_wq_take(&wq, &w, values) == 7);
+    mt_fail(w.reg == M2MD_WQ_MAX_REGS);
+
+    for (i = 0; i != M2MD_WQ_MAX_BITS + 9; ++i)
+        mt_fok(m2md_wq_add(&wq, 1, 1, i, 1));
+
+    mt_fail(m2md_wq_take(&wq, &w, values) == M2MD_WQ_MAX_BITS);
+    mt_fail(values[M2MD_WQ_MAX_BITS / 16 - 1] == 0xffff);
+    mt_fail(m2md_wq_take(&wq, &w, values) == 9);
+    mt_fail(w.reg == M2MD_WQ_MAX_BITS);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void wq_full(void)
+{
+    int  i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    for (i = 0; i != M2MD_WQ_MAX; ++i)
+        mt_fok(m2md_wq_add(&wq, 1, 0, i * 2, i));
+
+    mt_ferr(m2md_wq_add(&wq, 1, 0, 1, 0), ENOBUFS);
+    mt_fail(wq.nwrites == M2MD_WQ_MAX);
+
+    /* but register that is there can still get new value */
+    mt_fail(m2md_wq_add(&wq, 1, 0, 2, 7) == 1);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void wq_missing(void)
+{
+    /* nothing is queued, all of it needs room */
+    mt_fail(m2md_wq_missing(&wq, 1, 0, 10, 4) == 4);
+
+    mt_fok(m2md_wq_add(&wq, 1, 0, 9, 0));
+    mt_fok(m2md_wq_add(&wq, 1, 0, 10, 0));
+    mt_fok(m2md_wq_add(&wq, 1, 0, 12, 0));
+    mt_fok(m2md_wq_add(&wq, 1, 0, 14, 0));
+    mt_fok(m2md_wq_add(&wq, 1, 1, 11, 0));
+    mt_fok(m2md_wq_add(&wq, 2, 0, 11, 0));
+
+    /* only 10 and 12 are ours, neighbours outside
+     * of range and other units and types don't count */
+    mt_fail(m2md_wq_missing(&wq, 1, 0, 10, 4) == 2);
+    mt_fail(m2md_wq_missing(&wq, 1, 0, 10, 1) == 0);
+    mt_fail(m2md_wq_missing(&wq, 1, 1, 10, 4) == 3);
+    mt_fail(m2md_wq_missing(&wq, 3, 0, 10, 4) == 4);
+}
+
+
+/* ==========================================================================
+   ========================================================================== */
+static void wq_full_rewrite(void)
+{
+    int  i;
+    /*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+    /* queue is full of 32bit values, rewrite of any of them
+     * fits, but new value of 2 registers does not */
+    for (i = 0; i != M2MD_WQ_MAX; ++i)
+        mt_fok(m2md_wq_add(&wq, 1, 0, i, i));
+
+    mt_fail(wq.nwrites + m2md_wq_missing(&wq, 1, 0, 100, 2) <= M2MD_WQ_MAX);
+    mt_fail(wq.nwrites + m2md_wq_missing(&wq, 1, 0, M2MD_WQ_MAX - 1, 2) >
+            M2MD_WQ_MAX);
+}
+
+
+/* ==========================================================================
+                       __     __ _          ____
+        ____   __  __ / /_   / /(_)_____   / __/__  __ ____   _____ _____
+       / __ \ / / / // __ \ / // // ___/  / /_ / / / // __ \ / ___// ___/
+      / /_/ // /_/ // /_/ // // // /__   / __// /_/ // / / // /__ (__  )
+     / .___/ \__,_//_.___//_//_/ \___/  /_/   \__,_//_/ /_/ \___//____/
+    /_/
+   ========================================================================== */
+
+
+void m2md_wq_test_group(void)
+{
+    mt_prepare_test = &test_prepare;
+    mt_cleanup_test = &test_cleanup;
+
+    mt_run(wq_take_empty);
+    mt_run(wq_merge_contiguous);
+    mt_run(wq_no_merge_across);
+    mt_run(wq_supersede);
+    mt_run(wq_coils_packed);
+    mt_run(wq_request_limit);
+    mt_run(wq_full);
+    mt_run(wq_missing);
+    mt_run(wq_full_rewrite);
+}